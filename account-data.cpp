@@ -2,8 +2,11 @@
 #include "client-utils.h"
 #include "config.h"
 #include "format.h"
+#include "purple-info.h"
 #include <purple.h>
+#include <glib/gstdio.h>
 #include <algorithm>
+#include <sstream>
 
 static bool isCanonicalPhoneNumber(const char *s)
 {
@@ -166,9 +169,9 @@ IncomingMessage &PendingMessageQueue::addPendingMessage(IncomingMessage &&messag
     ChatId     chatId  = getChatId(*message.message);
     auto       queueIt = getChatQueue(chatId);
     ChatQueue *queue;
-    purple_debug_misc(config::pluginId,"MessageQueue: chat %" G_GINT64_FORMAT ": "
-                      "adding pending message %" G_GINT64_FORMAT " (not ready)\n",
-                      chatId.value(), message.message->id_);
+    DEBUG_TRACE("MessageQueue: chat %" G_GINT64_FORMAT ": "
+                "adding pending message %" G_GINT64_FORMAT " (not ready)\n",
+                chatId.value(), message.message->id_);
 
     if (queueIt != m_queues.end())
         queue = &*queueIt;
@@ -191,9 +194,9 @@ void PendingMessageQueue::extractReadyMessages(
     std::list<Message>::iterator pReady;
     for (pReady = pQueue->messages.begin(); pReady != pQueue->messages.end(); ++pReady) {
         if (!pReady->ready) break;
-        purple_debug_misc(config::pluginId,"MessageQueue: chat %" G_GINT64_FORMAT ": "
-                            "showing message %" G_GINT64_FORMAT "\n",
-                            pQueue->chatId.value(), getId(*pReady->message.message).value());
+        DEBUG_TRACE("MessageQueue: chat %" G_GINT64_FORMAT ": "
+                    "showing message %" G_GINT64_FORMAT "\n",
+                    pQueue->chatId.value(), getId(*pReady->message.message).value());
         readyMessages.push_back(std::move(pReady->message));
     }
 
@@ -212,9 +215,9 @@ void PendingMessageQueue::setMessageReady(ChatId chatId, MessageId messageId,
     auto pQueue = getChatQueue(chatId);
     if (pQueue == m_queues.end()) return;
 
-    purple_debug_misc(config::pluginId,"MessageQueue: chat %" G_GINT64_FORMAT ": "
-                      "message %" G_GINT64_FORMAT " now ready\n",
-                      chatId.value(), messageId.value());
+    DEBUG_TRACE("MessageQueue: chat %" G_GINT64_FORMAT ": "
+                "message %" G_GINT64_FORMAT " now ready\n",
+                chatId.value(), messageId.value());
 
     auto it = std::find_if(pQueue->messages.begin(), pQueue->messages.end(), [messageId](const Message &m) {
         return (getId(*m.message.message) == messageId);
@@ -236,9 +239,9 @@ IncomingMessage PendingMessageQueue::addReadyMessage(IncomingMessage &&message,
     if (queueIt == m_queues.end())
         return std::move(message);
 
-    purple_debug_misc(config::pluginId,"MessageQueue: chat %" G_GINT64_FORMAT ": "
-                      "adding pending message %" G_GINT64_FORMAT " (ready)\n",
-                      chatId.value(), message.message->id_);
+    DEBUG_TRACE("MessageQueue: chat %" G_GINT64_FORMAT ": "
+                "adding pending message %" G_GINT64_FORMAT " (ready)\n",
+                chatId.value(), message.message->id_);
 
     Message &newEntry = addMessage(*queueIt, action);
     newEntry.ready = true;
@@ -299,6 +302,560 @@ bool PendingMessageQueue::isChatReady(ChatId chatId)
         return true;
 }
 
+static size_t getMessageInfoMemory(const TgMessageInfo &info)
+{
+    // Replied message summary is shared with recent message cache, and counted there
+    size_t size = getStringMemory(info.incomingGroupchatSender) + getStringMemory(info.forwardedFrom) +
+                  getStringMemory(info.stickerFileId);
+    if (info.repliedMessage)
+        size += getMessageMemory(*info.repliedMessage);
+    return size;
+}
+
+void PendingMessageQueue::getMemoryUsage(MemoryUsage &usage) const
+{
+    for (const ChatQueue &queue: m_queues)
+        for (const Message &message: queue.messages) {
+            const IncomingMessage &fullMessage = message.message;
+            size_t size = LIST_NODE_OVERHEAD + sizeof(message) + getMessageInfoMemory(fullMessage.messageInfo) +
+                          getStringMemory(fullMessage.inlineDownloadedFilePath);
+            if (fullMessage.message)
+                size += getMessageMemory(*fullMessage.message);
+            if (fullMessage.repliedMessage)
+                size += getMessageMemory(*fullMessage.repliedMessage);
+            if (fullMessage.thumbnail)
+                size += sizeof(td::td_api::file);
+            usage.add(size);
+        }
+}
+
+void MessageSummaryCache::add(ChatId chatId, MessageSummaryPtr summary)
+{
+    if (!summary) return;
+    std::list<MessageSummaryPtr> &messages = m_chats[chatId];
+    MessageId messageId = summary->id;
+
+    auto it = std::find_if(messages.begin(), messages.end(), [messageId](const MessageSummaryPtr &entry) {
+        return (entry->id == messageId);
+    });
+    if (it != messages.end())
+        messages.erase(it);
+    messages.push_front(std::move(summary));
+    if (messages.size() > MESSAGES_PER_CHAT)
+        messages.pop_back();
+}
+
+MessageSummaryPtr MessageSummaryCache::find(ChatId chatId, MessageId messageId) const
+{
+    auto pChat = m_chats.find(chatId);
+    if (pChat == m_chats.end())
+        return nullptr;
+
+    std::list<MessageSummaryPtr> &messages = pChat->second;
+    auto it = std::find_if(messages.begin(), messages.end(), [messageId](const MessageSummaryPtr &entry) {
+        return (entry->id == messageId);
+    });
+    if (it == messages.end())
+        return nullptr;
+
+    messages.splice(messages.begin(), messages, it);
+    return messages.front();
+}
+
+void MessageSummaryCache::remove(ChatId chatId, MessageId messageId)
+{
+    auto pChat = m_chats.find(chatId);
+    if (pChat == m_chats.end())
+        return;
+
+    pChat->second.remove_if([messageId](const MessageSummaryPtr &entry) {
+        return (entry->id == messageId);
+    });
+}
+
+void MessageSummaryCache::removeChat(ChatId chatId)
+{
+    m_chats.erase(chatId);
+}
+
+void MessageSummaryCache::getMemoryUsage(MemoryUsage &usage) const
+{
+    for (const auto &chat: m_chats)
+        for (const MessageSummaryPtr &summary: chat.second)
+            // Plus shared pointer control block
+            usage.add(LIST_NODE_OVERHEAD + sizeof(summary) + 2*sizeof(long) + sizeof(*summary) +
+                      getStringMemory(summary->text));
+}
+
+bool OutgoingMessageQueue::startWaiting(ChatId chatId)
+{
+    if (findWaiting(chatId))
+        return false;
+
+    m_chats.emplace_back();
+    m_chats.back().chatId = chatId;
+    return true;
+}
+
+auto OutgoingMessageQueue::findWaiting(ChatId chatId) -> Chat *
+{
+    auto it = std::find_if(m_chats.begin(), m_chats.end(), [chatId](const Chat &chat) {
+        return (chat.chatId == chatId);
+    });
+    return (it != m_chats.end()) ? &*it : nullptr;
+}
+
+bool OutgoingMessageQueue::extractWaiting(ChatId chatId, Chat &chat)
+{
+    auto it = std::find_if(m_chats.begin(), m_chats.end(), [chatId](const Chat &chat) {
+        return (chat.chatId == chatId);
+    });
+    if (it == m_chats.end())
+        return false;
+
+    chat = std::move(*it);
+    m_chats.erase(it);
+    return true;
+}
+
+static std::string getChatWithoutIdKey(const char *joinString, const char *groupName, int groupType)
+{
+    // Matches what findChatsByJoinString and findChatsByNewGroup used to compare
+    if (*joinString)
+        return std::string("link ") + joinString;
+    else
+        return "group " + std::to_string(groupType) + " " + groupName;
+}
+
+static std::string getChatWithoutIdKey(PurpleChat *chat)
+{
+    GHashTable *components = purple_chat_get_components(chat);
+    const char *joinString = getChatJoinString(components);
+    const char *groupName  = getChatGroupName(components);
+    return getChatWithoutIdKey(joinString ? joinString : "", groupName ? groupName : "",
+                               getChatGroupType(components));
+}
+
+template<typename Node>
+static void removeEntry(std::unordered_multimap<std::string, Node *> &index, const std::string &key, Node *node)
+{
+    auto range = index.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it)
+        if (it->second == node) {
+            index.erase(it);
+            return;
+        }
+}
+
+static void addNodes(BuddyListIndex &index, PurpleBlistNode *node)
+{
+    index.add(node);
+    for (PurpleBlistNode *child = purple_blist_node_get_first_child(node); child;
+         child = purple_blist_node_get_sibling_next(child))
+    {
+        addNodes(index, child);
+    }
+}
+
+void BuddyListIndex::build()
+{
+    m_buddies.clear();
+    m_chats.clear();
+    m_chatsWithoutId.clear();
+    m_keys.clear();
+
+    for (PurpleBlistNode *root = purple_blist_get_root(); root;
+         root = purple_blist_node_get_sibling_next(root))
+    {
+        addNodes(*this, root);
+    }
+}
+
+void BuddyListIndex::add(PurpleBlistNode *node)
+{
+    PurpleBlistNodeType nodeType = purple_blist_node_get_type(node);
+
+    if (nodeType == PURPLE_BLIST_BUDDY_NODE) {
+        PurpleBuddy *buddy = PURPLE_BUDDY(node);
+        if (purple_buddy_get_account(buddy) == m_account) {
+            std::string key = purple_buddy_get_name(buddy);
+            auto it = m_keys.find(node);
+            if ((it == m_keys.end()) || (it->second != key)) {
+                remove(node);
+                m_buddies.emplace(key, buddy);
+                m_keys.emplace(node, std::move(key));
+            }
+        }
+    } else if (nodeType == PURPLE_BLIST_CHAT_NODE) {
+        PurpleChat *chat = PURPLE_CHAT(node);
+        if (purple_chat_get_account(chat) == m_account) {
+            const char *name   = getChatName(purple_chat_get_components(chat));
+            bool        withId = name && *name;
+            std::string key    = withId ? std::string(name) : getChatWithoutIdKey(chat);
+            auto it = m_keys.find(node);
+            if ((it == m_keys.end()) || (it->second != key)) {
+                remove(node);
+                if (withId)
+                    m_chats.emplace(key, chat);
+                else
+                    m_chatsWithoutId.emplace(key, chat);
+                m_keys.emplace(node, std::move(key));
+            }
+        }
+    }
+}
+
+void BuddyListIndex::remove(PurpleBlistNode *node)
+{
+    auto it = m_keys.find(node);
+    if (it == m_keys.end())
+        return;
+
+    // Key might be different from the node's current one, if it has been renamed or its components
+    // have been edited
+    if (purple_blist_node_get_type(node) == PURPLE_BLIST_BUDDY_NODE)
+        removeEntry(m_buddies, it->second, PURPLE_BUDDY(node));
+    else {
+        removeEntry(m_chats, it->second, PURPLE_CHAT(node));
+        removeEntry(m_chatsWithoutId, it->second, PURPLE_CHAT(node));
+    }
+    m_keys.erase(it);
+}
+
+PurpleBuddy *BuddyListIndex::findBuddy(const char *name)
+{
+    if (!purple_account_is_connected(m_account))
+        return NULL;
+
+    auto range = m_buddies.equal_range(name);
+    for (auto it = range.first; it != range.second; ++it)
+        if (!strcmp(purple_buddy_get_name(it->second), name))
+            return it->second;
+
+    // Renaming a buddy emits no signal. purple_find_buddy only looks in each group's hash table,
+    // so this is still cheap.
+    PurpleBuddy *buddy = purple_find_buddy(m_account, name);
+    if (buddy)
+        add(PURPLE_BLIST_NODE(buddy));
+    return buddy;
+}
+
+PurpleChat *BuddyListIndex::findChat(const char *name) const
+{
+    if (!purple_account_is_connected(m_account))
+        return NULL;
+
+    // Chat settings can be edited by user, so check that the name is still the same
+    auto range = m_chats.equal_range(name);
+    for (auto it = range.first; it != range.second; ++it) {
+        const char *chatName = getChatName(purple_chat_get_components(it->second));
+        if (chatName && !strcmp(chatName, name))
+            return it->second;
+    }
+    return NULL;
+}
+
+void BuddyListIndex::findChatsWithoutId(const std::string &key, std::vector<PurpleChat *> &result) const
+{
+    auto range = m_chatsWithoutId.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+        const char *chatName = getChatName(purple_chat_get_components(it->second));
+        if ((!chatName || !*chatName) && (getChatWithoutIdKey(it->second) == key))
+            result.push_back(it->second);
+    }
+}
+
+void BuddyListIndex::findChatsByJoinString(const char *joinString, std::vector<PurpleChat *> &result) const
+{
+    findChatsWithoutId(getChatWithoutIdKey(joinString, "", 0), result);
+}
+
+void BuddyListIndex::findChatsByNewGroup(const char *groupName, int groupType,
+                                         std::vector<PurpleChat *> &result) const
+{
+    findChatsWithoutId(getChatWithoutIdKey("", groupName, groupType), result);
+}
+
+bool UserStatusQueue::add(UserId userId)
+{
+    bool first = m_userIds.empty();
+    m_received++;
+    if (!m_userIds.insert(userId).second)
+        m_collapsed++;
+    return first;
+}
+
+void UserStatusQueue::extract(std::vector<UserId> &userIds)
+{
+    userIds.assign(m_userIds.begin(), m_userIds.end());
+    m_userIds.clear();
+}
+
+bool InlineDownloadScheduler::add(int32_t fileId, uint64_t requestId, bool focused)
+{
+    auto it = std::find_if(m_downloads.begin(), m_downloads.end(), [fileId](const Download &download) {
+        return (download.fileId == fileId);
+    });
+
+    if (it != m_downloads.end()) {
+        it->requestIds.push_back(requestId);
+        it->focused = it->focused || focused;
+        return false;
+    }
+
+    m_downloads.emplace_back();
+    m_downloads.back().fileId  = fileId;
+    m_downloads.back().focused = focused;
+    m_downloads.back().queryId = 0;
+    m_downloads.back().requestIds.push_back(requestId);
+    return true;
+}
+
+auto InlineDownloadScheduler::getNextQueued() -> Download *
+{
+    unsigned activeCount = std::count_if(m_downloads.begin(), m_downloads.end(), [](const Download &download) {
+        return (download.queryId != 0);
+    });
+    if (activeCount >= MAX_ACTIVE_DOWNLOADS)
+        return nullptr;
+
+    auto it = std::find_if(m_downloads.begin(), m_downloads.end(), [](const Download &download) {
+        return (download.queryId == 0) && download.focused;
+    });
+    if (it == m_downloads.end())
+        it = std::find_if(m_downloads.begin(), m_downloads.end(), [](const Download &download) {
+            return (download.queryId == 0);
+        });
+
+    return (it != m_downloads.end()) ? &*it : nullptr;
+}
+
+void InlineDownloadScheduler::extractRequests(uint64_t queryId, std::vector<uint64_t> &requestIds)
+{
+    requestIds.clear();
+    auto it = std::find_if(m_downloads.begin(), m_downloads.end(), [queryId](const Download &download) {
+        return (download.queryId == queryId);
+    });
+
+    if (it != m_downloads.end()) {
+        requestIds = std::move(it->requestIds);
+        m_downloads.erase(it);
+    }
+}
+
+bool UploadCache::hashFile(const std::string &path, std::string &hash)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+
+    GChecksum           *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    std::vector<guchar>  buffer(65536);
+    size_t               bytesRead;
+    while ((bytesRead = fread(buffer.data(), 1, buffer.size(), f)) != 0)
+        g_checksum_update(checksum, buffer.data(), bytesRead);
+    bool success = !ferror(f);
+    fclose(f);
+
+    if (success)
+        hash = g_checksum_get_string(checksum);
+    g_checksum_free(checksum);
+    return success;
+}
+
+void UploadCache::load(const std::string &fileName)
+{
+    m_fileName = fileName;
+    m_entries.clear();
+
+    gchar *contents = NULL;
+    if (!g_file_get_contents(fileName.c_str(), &contents, NULL, NULL))
+        return;
+
+    std::istringstream stream(contents);
+    g_free(contents);
+    std::string line;
+    while (std::getline(stream, line)) {
+        std::istringstream lineStream(line);
+        Entry entry;
+        if (lineStream >> entry.key.hash >> entry.key.size >> entry.key.mtime >> entry.lastUsed >> entry.remoteId) {
+            if (entry.key.hash == "-")
+                entry.key.hash.clear();
+            lineStream.get();
+            std::getline(lineStream, entry.path);
+            m_useCounter = std::max(m_useCounter, entry.lastUsed);
+            m_entries.push_back(std::move(entry));
+        }
+    }
+
+    DEBUG_MISC("Loaded %zu entries from upload cache %s\n", m_entries.size(),
+               fileName.c_str());
+}
+
+void UploadCache::save()
+{
+    if (m_fileName.empty())
+        return;
+
+    std::ostringstream stream;
+    for (const Entry &entry: m_entries)
+        stream << (entry.key.hash.empty() ? "-" : entry.key.hash) << ' ' << entry.key.size << ' '
+               << entry.key.mtime << ' ' << entry.lastUsed << ' ' << entry.remoteId << ' ' << entry.path << '\n';
+
+    std::string contents = stream.str();
+    GError *error = NULL;
+    if (!g_file_set_contents(m_fileName.c_str(), contents.c_str(), contents.length(), &error)) {
+        DEBUG_MISC("Failed to save upload cache: %s\n", error->message);
+        g_error_free(error);
+    }
+}
+
+static std::string getBaseName(const std::string &path)
+{
+    gchar *baseName = g_path_get_basename(path.c_str());
+    std::string result = baseName;
+    g_free(baseName);
+    return result;
+}
+
+void UploadCache::countLookup(const std::string &path, bool found)
+{
+    if (found)
+        m_hits++;
+    else
+        m_misses++;
+    DEBUG_MISC("Upload cache %s for %s: %u hits, %u misses (%u%%)\n",
+               found ? "hit" : "miss", path.c_str(), m_hits, m_misses,
+               100 * m_hits / (m_hits + m_misses));
+}
+
+std::string UploadCache::find(const std::string &path, bool &needsHash)
+{
+    GStatBuf st;
+    needsHash = false;
+    if (g_stat(path.c_str(), &st) != 0) {
+        countLookup(path, false);
+        return std::string();
+    }
+
+    FileKey key;
+    key.size  = st.st_size;
+    key.mtime = st.st_mtime;
+
+    // Same file not modified since it was sent
+    auto it = std::find_if(m_entries.begin(), m_entries.end(), [&path, &key](const Entry &entry) {
+        return (entry.path == path) && (entry.key.size == key.size) && (entry.key.mtime == key.mtime);
+    });
+    if (it != m_entries.end()) {
+        it->lastUsed = ++m_useCounter;
+        countLookup(path, true);
+        return it->remoteId;
+    }
+
+    m_pendingKeys[path] = key;
+    if (key.size <= MAX_HASHED_SIZE)
+        needsHash = true;
+    else
+        countLookup(path, false);
+    return std::string();
+}
+
+std::string UploadCache::findByHash(const std::string &path, const std::string &hash)
+{
+    auto pKey = m_pendingKeys.find(path);
+    if (pKey == m_pendingKeys.end())
+        return std::string();
+    FileKey &key = pKey->second;
+    key.hash = hash;
+
+    // Remote document keeps the file name it was uploaded with, so content alone is not enough
+    std::string baseName = getBaseName(path);
+    auto it = m_entries.end();
+    if (!hash.empty())
+        it = std::find_if(m_entries.begin(), m_entries.end(), [&key, &baseName](const Entry &entry) {
+            return (entry.key.hash == key.hash) && (entry.key.size == key.size) &&
+                   (getBaseName(entry.path) == baseName);
+        });
+
+    countLookup(path, it != m_entries.end());
+    if (it == m_entries.end())
+        return std::string();
+
+    it->lastUsed = ++m_useCounter;
+    m_pendingKeys.erase(pKey);
+    return it->remoteId;
+}
+
+std::string UploadCache::findImage(const std::string &path, int64_t size)
+{
+    // File name already stands for the content, and file modification time means nothing as
+    // the file is written anew each time
+    auto it = std::find_if(m_entries.begin(), m_entries.end(), [&path, size](const Entry &entry) {
+        return (entry.path == path) && (entry.key.size == size) && entry.key.hash.empty();
+    });
+
+    countLookup(path, it != m_entries.end());
+    if (it != m_entries.end()) {
+        it->lastUsed = ++m_useCounter;
+        return it->remoteId;
+    }
+
+    FileKey &key = m_pendingKeys[path];
+    key.hash.clear();
+    key.size  = size;
+    key.mtime = 0;
+    return std::string();
+}
+
+void UploadCache::add(const std::string &path, const std::string &remoteId)
+{
+    auto pKey = m_pendingKeys.find(path);
+    if (pKey == m_pendingKeys.end())
+        return;
+    FileKey key = std::move(pKey->second);
+    m_pendingKeys.erase(pKey);
+
+    // Sent again after modification, or same content and name from another directory
+    std::string baseName = getBaseName(path);
+    m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [&path, &key, &baseName](const Entry &entry) {
+                                       return (entry.path == path) ||
+                                              (!key.hash.empty() && (entry.key.hash == key.hash) &&
+                                               (getBaseName(entry.path) == baseName));
+                                   }),
+                    m_entries.end());
+    if (m_entries.size() >= MAX_ENTRIES) {
+        auto oldest = std::min_element(m_entries.begin(), m_entries.end(), [](const Entry &a, const Entry &b) {
+            return (a.lastUsed < b.lastUsed);
+        });
+        m_entries.erase(oldest);
+    }
+
+    m_entries.emplace_back();
+    m_entries.back().key      = std::move(key);
+    m_entries.back().path     = path;
+    m_entries.back().remoteId = remoteId;
+    m_entries.back().lastUsed = ++m_useCounter;
+    save();
+}
+
+void UploadCache::cancel(const std::string &path)
+{
+    m_pendingKeys.erase(path);
+}
+
+void UploadCache::remove(const std::string &remoteId)
+{
+    size_t count = m_entries.size();
+    m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [&remoteId](const Entry &entry) {
+                                       return (entry.remoteId == remoteId);
+                                   }),
+                    m_entries.end());
+    if (m_entries.size() != count) {
+        DEBUG_MISC("Removed remote file id %s from upload cache\n", remoteId.c_str());
+        save();
+    }
+}
+
 void TdAccountData::updateUser(TdUserPtr userPtr)
 {
     const td::td_api::user *user = userPtr.get();
@@ -406,10 +963,135 @@ void TdAccountData::updateSupergroupInfo(SupergroupId groupId, TdSupergroupInfoP
         m_supergroups[groupId].fullInfo = std::move(groupInfo);
 }
 
-void TdAccountData::updateSupergroupMembers(SupergroupId groupId, TdChatMembersPtr members)
+static bool isGroupAdministrator(const td::td_api::chatMember &member)
 {
-    if (members)
-        m_supergroups[groupId].members = std::move(members);
+    return member.status_ && ((member.status_->get_id() == td::td_api::chatMemberStatusCreator::ID) ||
+                              (member.status_->get_id() == td::td_api::chatMemberStatusAdministrator::ID));
+}
+
+void TdAccountData::removeSupergroupMembers(SupergroupInfo &info, const std::set<UserId> &userIds,
+                                            std::vector<UserId> &removedMembers)
+{
+    if (userIds.empty())
+        return;
+
+    auto  &list       = info.members->members_;
+    size_t kept       = 0;
+    size_t recentKept = 0;
+    for (size_t i = 0; i < list.size(); i++) {
+        if (userIds.count(getUserId(*list[i])))
+            continue;
+        if (i < info.recentMemberCount)
+            recentKept++;
+        if (kept != i)
+            list[kept] = std::move(list[i]);
+        kept++;
+    }
+    list.erase(list.begin() + kept, list.end());
+    info.recentMemberCount = recentKept;
+
+    for (UserId userId: userIds) {
+        info.memberIndex.erase(userId);
+        removedMembers.push_back(userId);
+    }
+}
+
+void TdAccountData::addSupergroupMembers(SupergroupId groupId, td::td_api::chatMembers &page, bool refresh,
+                                         size_t maxCount,
+                                         std::vector<const td::td_api::chatMember *> &changedMembers,
+                                         std::vector<UserId> &removedMembers)
+{
+    SupergroupInfo &info = m_supergroups[groupId];
+    if (!info.members)
+        info.members = td::td_api::make_object<td::td_api::chatMembers>();
+    auto &list = info.members->members_;
+
+    std::vector<td::td_api::object_ptr<td::td_api::chatMember>> newMembers;
+    std::set<UserId> pageMembers;
+    std::set<UserId> leftMembers;
+    for (auto &member: page.members_) {
+        // Members that are not users are never shown, so there is no point keeping them
+        UserId userId = member ? getUserId(*member) : UserId::invalid;
+        if (!userId.valid()) continue;
+        auto known = info.memberIndex.find(userId);
+
+        if (!isGroupMember(member->status_)) {
+            if (known != info.memberIndex.end())
+                leftMembers.insert(userId);
+        } else if (known != info.memberIndex.end()) {
+            known->second->status_ = std::move(member->status_);
+            changedMembers.push_back(known->second);
+            pageMembers.insert(userId);
+        } else {
+            info.memberIndex[userId] = member.get();
+            pageMembers.insert(userId);
+            changedMembers.push_back(member.get());
+            newMembers.push_back(std::move(member));
+        }
+    }
+
+    // If the refreshed page holds all members of the group, anyone not in it has left. For bigger
+    // groups there is no telling who left from just the first page, so the rest of the list is kept.
+    if (refresh && (page.total_count_ >= 0) && ((size_t)page.total_count_ <= page.members_.size())) {
+        for (const auto &item: info.memberIndex)
+            if (!pageMembers.count(item.first))
+                leftMembers.insert(item.first);
+    }
+    removeSupergroupMembers(info, leftMembers, removedMembers);
+
+    auto insertPos = list.begin() + (refresh ? 0 : info.recentMemberCount);
+    list.insert(insertPos, std::make_move_iterator(newMembers.begin()),
+                std::make_move_iterator(newMembers.end()));
+    info.recentMemberCount += newMembers.size();
+
+    if (maxCount && (info.recentMemberCount > maxCount)) {
+        // Administrators beyond the limit are moved to the end of the list instead of being dropped
+        auto cutStart = list.begin() + maxCount;
+        auto cutEnd   = std::stable_partition(cutStart, list.begin() + info.recentMemberCount,
+                                              [](const td::td_api::object_ptr<td::td_api::chatMember> &member) {
+                                                  return !isGroupAdministrator(*member);
+                                              });
+        std::set<const td::td_api::chatMember *> cutMembers;
+        for (auto it = cutStart; it != cutEnd; ++it) {
+            cutMembers.insert(it->get());
+            info.memberIndex.erase(getUserId(**it));
+            removedMembers.push_back(getUserId(**it));
+        }
+        list.erase(cutStart, cutEnd);
+        info.recentMemberCount = maxCount;
+
+        changedMembers.erase(std::remove_if(changedMembers.begin(), changedMembers.end(),
+                                            [&cutMembers](const td::td_api::chatMember *member) {
+                                                return cutMembers.count(member) != 0;
+                                            }),
+                             changedMembers.end());
+    }
+
+    info.members->total_count_ = page.total_count_;
+}
+
+void TdAccountData::addSupergroupAdministrators(SupergroupId groupId, td::td_api::chatMembers &page,
+                                                std::vector<const td::td_api::chatMember *> &changedMembers)
+{
+    SupergroupInfo &info = m_supergroups[groupId];
+    if (!info.members)
+        info.members = td::td_api::make_object<td::td_api::chatMembers>();
+
+    for (auto &member: page.members_) {
+        UserId userId = member ? getUserId(*member) : UserId::invalid;
+        if (!userId.valid() || !isGroupMember(member->status_)) continue;
+        auto known = info.memberIndex.find(userId);
+
+        if (known != info.memberIndex.end()) {
+            known->second->status_ = std::move(member->status_);
+            changedMembers.push_back(known->second);
+        } else {
+            info.memberIndex[userId] = member.get();
+            changedMembers.push_back(member.get());
+            info.members->members_.push_back(std::move(member));
+        }
+    }
+
 }
 
 void TdAccountData::addChat(TdChatPtr chat)
@@ -422,9 +1104,7 @@ void TdAccountData::addChat(TdChatPtr chat)
         auto pContact = std::find(m_contactUserIdsNoChat.begin(), m_contactUserIdsNoChat.end(),
                                   getUserId(privType));
         if (pContact != m_contactUserIdsNoChat.end()) {
-            purpleDebug("Private chat (id {}) now known for user {}", {
-                std::to_string(chat->id_), std::to_string(privType.user_id_)
-            });
+            purpleDebug("Private chat (id {}) now known for user {}", chat->id_, privType.user_id_);
             m_contactUserIdsNoChat.erase(pContact);
         }
     }
@@ -446,7 +1126,7 @@ void TdAccountData::updateChatPosition(ChatId chatId, td::td_api::object_ptr<td:
         auto listId = position->list_->get_id();
         td::td_api::chat &chat = *it->second.chat;
         if (position->order_ == 0) {
-            purpleDebug("Removing chat {} from list {}", {std::to_string(chatId.value()), std::to_string(listId)});
+            DEBUG_TRACE("Removing chat %" G_GINT64_FORMAT " from list %d\n", chatId.value(), listId);
             chat.positions_.erase(
                 std::remove_if(chat.positions_.begin(), chat.positions_.end(),
                                [listId](const td::td_api::object_ptr<td::td_api::chatPosition> &chatPos) {
@@ -459,11 +1139,11 @@ void TdAccountData::updateChatPosition(ChatId chatId, td::td_api::object_ptr<td:
                                               return chatPos && (chatPos->list_->get_id() == listId);
                                           });
             if (pExisting != chat.positions_.end()) {
-                purpleDebug("Changing chat {}, list {} order to {}",
-                            {std::to_string(chatId.value()), std::to_string(listId), std::to_string(position->order_)});
+                DEBUG_TRACE("Changing chat %" G_GINT64_FORMAT ", list %d order to %" G_GINT64_FORMAT "\n",
+                            chatId.value(), listId, position->order_);
                 *pExisting = std::move(position);
             } else {
-                purpleDebug("Adding chat {} to list {}", {std::to_string(chatId.value()), std::to_string(listId)});
+                DEBUG_TRACE("Adding chat %" G_GINT64_FORMAT " to list %d\n", chatId.value(), listId);
                 chat.positions_.push_back(std::move(position));
             }
         }
@@ -725,6 +1405,7 @@ void TdAccountData::getChats(std::vector<const td::td_api::chat *> &chats) const
 void TdAccountData::deleteChat(ChatId id)
 {
     m_chatInfo.erase(id);
+    recentMessages.removeChat(id);
 }
 
 void TdAccountData::addExpectedChat(ChatId id)
@@ -746,6 +1427,30 @@ void TdAccountData::removeExpectedChat(ChatId id)
 
 }
 
+size_t SendMessageRequest::getMemoryUsage() const
+{
+    size_t size = sizeof(*this) + tempFiles.capacity() * sizeof(tempFiles[0]) + getStringMemory(uploadPath) +
+                  getStringMemory(remoteFileId);
+    for (const std::string &path: tempFiles)
+        size += getStringMemory(path);
+    size += remotePhotoIds.capacity() * sizeof(remotePhotoIds[0]);
+    for (const std::string &remoteId: remotePhotoIds)
+        size += getStringMemory(remoteId);
+    size += resendUploadPaths.capacity() * sizeof(resendUploadPaths[0]);
+    for (const std::string &path: resendUploadPaths)
+        size += getStringMemory(path);
+    return size;
+}
+
+size_t DownloadRequest::getMemoryUsage() const
+{
+    size_t size = sizeof(*this) + getMessageInfoMemory(message) + getStringMemory(fileDescription) +
+                  getStringMemory(tempFileName) + getStringMemory(streamPath);
+    if (thumbnail)
+        size += sizeof(td::td_api::file);
+    return size;
+}
+
 std::unique_ptr<PendingRequest> TdAccountData::getPendingRequestImpl(uint64_t requestId)
 {
     auto it = std::find_if(m_requests.begin(), m_requests.end(),
@@ -822,27 +1527,66 @@ void TdAccountData::extractFileTransferRequests(std::vector<PurpleXfer *> &trans
     }
 }
 
+std::string TdAccountData::extractSentMessage(std::vector<SendMessageInfo> &messages, int64_t messageId)
+{
+    auto it = std::find_if(messages.begin(), messages.end(),
+                           [messageId](const SendMessageInfo &item) {
+                               return (item.messageId == messageId);
+                           });
+
+    std::string result;
+    if (it != messages.end()) {
+        result = it->path;
+        messages.erase(it);
+    }
+
+    return result;
+}
+
 void TdAccountData::addTempFileUpload(int64_t messageId, const std::string &path)
 {
     m_sentMessages.emplace_back();
     m_sentMessages.back().messageId = messageId;
-    m_sentMessages.back().tempFile = path;
+    m_sentMessages.back().path = path;
 }
 
 std::string TdAccountData::extractTempFileUpload(int64_t messageId)
 {
-    auto it = std::find_if(m_sentMessages.begin(), m_sentMessages.end(),
-                           [messageId](const SendMessageInfo &item) {
-                               return (item.messageId == messageId);
-                           });
+    return extractSentMessage(m_sentMessages, messageId);
+}
 
-    std::string result;
-    if (it != m_sentMessages.end()) {
-        result = it->tempFile;
-        m_sentMessages.erase(it);
-    }
+void TdAccountData::addDocumentUpload(int64_t messageId, const std::string &path)
+{
+    m_sentDocuments.emplace_back();
+    m_sentDocuments.back().messageId = messageId;
+    m_sentDocuments.back().path = path;
+}
 
-    return result;
+std::string TdAccountData::extractDocumentUpload(int64_t messageId)
+{
+    return extractSentMessage(m_sentDocuments, messageId);
+}
+
+void TdAccountData::acquireTempFile(const std::string &path)
+{
+    m_tempFileUsers[path]++;
+}
+
+bool TdAccountData::isTempFileInUse(const std::string &path) const
+{
+    return (m_tempFileUsers.find(path) != m_tempFileUsers.end());
+}
+
+bool TdAccountData::releaseTempFile(const std::string &path)
+{
+    auto it = m_tempFileUsers.find(path);
+    if (it == m_tempFileUsers.end())
+        return true;
+    if (--it->second != 0)
+        return false;
+
+    m_tempFileUsers.erase(it);
+    return true;
 }
 
 void TdAccountData::addFileTransfer(int32_t fileId, PurpleXfer *xfer, ChatId chatId)
@@ -985,3 +1729,80 @@ void TdAccountData::extractPendingReadReceipts(ChatId chatId, std::vector<ReadRe
     } else
         receipts.clear();
 }
+
+void TdAccountData::getMemoryUsage(MemoryReport &report) const
+{
+    MemoryUsage users;
+    for (const auto &item: m_userInfo)
+        users.add(MAP_NODE_OVERHEAD + sizeof(item) + getStringMemory(item.second.displayName) +
+                  (item.second.user ? getUserMemory(*item.second.user) : 0));
+    // TRANSLATOR: Memory report item, followed by count and size of known Telegram users
+    report.push_back({_("Users"), users});
+
+    MemoryUsage chats;
+    for (const auto &item: m_chatInfo)
+        chats.add(MAP_NODE_OVERHEAD + sizeof(item) + (item.second.chat ? getChatMemory(*item.second.chat) : 0));
+    // TRANSLATOR: Memory report item, followed by count and size of known chats
+    report.push_back({_("Chats"), chats});
+
+    // Member lists are the part that can get big, so they are counted separately
+    MemoryUsage groups;
+    MemoryUsage members;
+    for (const auto &item: m_groups) {
+        const GroupInfo &info = item.second;
+        size_t size = MAP_NODE_OVERHEAD + sizeof(item);
+        if (info.group)
+            size += sizeof(*info.group);
+        if (info.fullInfo) {
+            size += sizeof(*info.fullInfo) + getStringMemory(info.fullInfo->description_);
+            members.add(getChatMembersMemory(info.fullInfo->members_), info.fullInfo->members_.size());
+        }
+        groups.add(size);
+    }
+    for (const auto &item: m_supergroups) {
+        const SupergroupInfo &info = item.second;
+        size_t size = MAP_NODE_OVERHEAD + sizeof(item);
+        if (info.group)
+            size += sizeof(*info.group);
+        if (info.fullInfo)
+            size += sizeof(*info.fullInfo) + getStringMemory(info.fullInfo->description_);
+        if (info.members)
+            members.add(sizeof(*info.members) + getChatMembersMemory(info.members->members_) +
+                        info.memberIndex.size() * (MAP_NODE_OVERHEAD + sizeof(*info.memberIndex.begin())),
+                        info.members->members_.size());
+        groups.add(size);
+    }
+    // TRANSLATOR: Memory report item, followed by count and size of known groups and channels
+    report.push_back({_("Groups"), groups});
+    // TRANSLATOR: Memory report item, followed by count and size of stored member lists of groups
+    report.push_back({_("Group members"), members});
+
+    MemoryUsage secretChats;
+    for (const auto &item: m_secretChats)
+        secretChats.add(MAP_NODE_OVERHEAD + sizeof(item) + (item.second ? sizeof(*item.second) : 0));
+    // TRANSLATOR: Memory report item, followed by count and size of known secret chats
+    report.push_back({_("Secret chats"), secretChats});
+
+    MemoryUsage requests;
+    for (const std::unique_ptr<PendingRequest> &request: m_requests)
+        requests.add(sizeof(request) + request->getMemoryUsage());
+    // TRANSLATOR: Memory report item, followed by count and size of requests sent to Telegram library and not answered yet
+    report.push_back({_("Pending requests"), requests});
+
+    MemoryUsage messages;
+    pendingMessages.getMemoryUsage(messages);
+    // TRANSLATOR: Memory report item, followed by count and size of received messages waiting to be shown
+    report.push_back({_("Pending messages"), messages});
+
+    MemoryUsage summaries;
+    recentMessages.getMemoryUsage(summaries);
+    // TRANSLATOR: Memory report item, followed by count and size of recent messages kept for quoting them in replies
+    report.push_back({_("Recent messages for replies"), summaries});
+
+    MemoryUsage memberNames;
+    for (const auto &chat: chatMemberNames)
+        for (const auto &name: chat.second)
+            memberNames.add(MAP_NODE_OVERHEAD + sizeof(name) + getStringMemory(name.second));
+    // TRANSLATOR: Memory report item, followed by count and size of names of members shown in open group chats
+    report.push_back({_("Member names shown in chats"), memberNames});
+}
@@ -4,12 +4,15 @@
 #include "buildopt.h"
 #include "identifiers.h"
 #include "transceiver.h"
+#include "memory-usage.h"
 #include <td/telegram/td_api.h>
 
 #include <map>
 #include <mutex>
 #include <set>
+#include <unordered_map>
 #include <list>
+#include <memory>
 #include <purple.h>
 
 #ifndef NoVoip
@@ -45,6 +48,8 @@ public:
 
     PendingRequest(uint64_t requestId) : requestId(requestId) {}
     virtual ~PendingRequest() {}
+    // For memory report
+    virtual size_t getMemoryUsage() const = 0;
 };
 
 class GroupInfoRequest: public PendingRequest {
@@ -53,6 +58,7 @@ public:
 
     GroupInfoRequest(uint64_t requestId, BasicGroupId groupId)
     : PendingRequest(requestId), groupId(groupId) {}
+    size_t getMemoryUsage() const override { return sizeof(*this); }
 };
 
 class SupergroupInfoRequest: public PendingRequest {
@@ -61,15 +67,21 @@ public:
 
     SupergroupInfoRequest(uint64_t requestId, SupergroupId groupId)
     : PendingRequest(requestId), groupId(groupId) {}
+    size_t getMemoryUsage() const override { return sizeof(*this); }
 };
 
-class GroupMembersRequestCont: public PendingRequest {
+class SupergroupMembersRequest: public PendingRequest {
 public:
     SupergroupId groupId;
-    td::td_api::object_ptr<td::td_api::chatMembers> members;
-
-    GroupMembersRequestCont(uint64_t requestId, SupergroupId groupId, td::td_api::chatMembers *members)
-    : PendingRequest(requestId), groupId(groupId), members(std::move(members)) {}
+    int32_t      offset;
+    int32_t      limit;
+    // Only re-reading the first page of an already known member list
+    bool         refresh;
+
+    SupergroupMembersRequest(uint64_t requestId, SupergroupId groupId, int32_t offset, int32_t limit,
+                             bool refresh)
+    : PendingRequest(requestId), groupId(groupId), offset(offset), limit(limit), refresh(refresh) {}
+    size_t getMemoryUsage() const override { return sizeof(*this); }
 };
 
 class ContactRequest: public PendingRequest {
@@ -83,6 +95,11 @@ public:
                    const std::string &groupName, UserId userId)
     : PendingRequest(requestId), phoneNumber(phoneNumber), alias(alias), groupName(groupName),
       userId(userId) {}
+    size_t getMemoryUsage() const override
+    {
+        return sizeof(*this) + getStringMemory(phoneNumber) + getStringMemory(alias) +
+               getStringMemory(groupName);
+    }
 };
 
 class GroupJoinRequest: public PendingRequest {
@@ -98,15 +115,30 @@ public:
     GroupJoinRequest(uint64_t requestId, const std::string &joinString, Type type,
                      ChatId chatId = ChatId::invalid)
     : PendingRequest(requestId), joinString(joinString), type(type), chatId(chatId) {}
+    size_t getMemoryUsage() const override { return sizeof(*this) + getStringMemory(joinString); }
 };
 
+// For sendMessage, sendMessageAlbum or resendMessages
 class SendMessageRequest: public PendingRequest {
 public:
     ChatId      chatId;
-    std::string tempFile;
-
-    SendMessageRequest(uint64_t requestId, ChatId chatId, const char *tempFile)
-    : PendingRequest(requestId), chatId(chatId), tempFile(tempFile ? tempFile : "") {}
+    // Temporary file of each message in the request, empty string if none
+    std::vector<std::string> tempFiles;
+    // For documents: local file, or remote id if it was sent without uploading
+    std::string uploadPath;
+    std::string remoteFileId;
+    // For photos: remote ids of images sent without uploading
+    std::vector<std::string> remotePhotoIds;
+    // For resendMessages: uploaded local file of each message, empty string if none
+    std::vector<std::string> resendUploadPaths;
+    // Transfer of a document sent without uploading, ref'd until message is sent
+    PurpleXfer *xfer = nullptr;
+    // Copy of the request, to send it again if tdlib rejects it because of flood wait
+    td::td_api::object_ptr<td::td_api::Function> function;
+
+    SendMessageRequest(uint64_t requestId, ChatId chatId)
+    : PendingRequest(requestId), chatId(chatId) {}
+    size_t getMemoryUsage() const override;
 };
 
 class UploadRequest: public PendingRequest {
@@ -116,7 +148,16 @@ public:
 
     UploadRequest(uint64_t requestId, PurpleXfer *xfer, ChatId chatId)
     : PendingRequest(requestId), xfer(xfer), chatId(chatId) {}
+    size_t getMemoryUsage() const override { return sizeof(*this); }
+};
+
+// Enough of a message to quote it in a reply without fetching it again
+struct MessageSummary {
+    MessageId   id;
+    UserId      senderId;
+    std::string text; // Quotable text or description of the content, HTML-escaped
 };
+using MessageSummaryPtr = std::shared_ptr<const MessageSummary>;
 
 struct TgMessageInfo {
     enum class Type {
@@ -132,7 +173,9 @@ struct TgMessageInfo {
     bool        sentLocally = false; // For outgoing messages, whether sent by this very client
     MessageId   repliedMessageId;
     td::td_api::object_ptr<td::td_api::message> repliedMessage;
+    MessageSummaryPtr repliedSummary; // Used if repliedMessage was not fetched
     std::string forwardedFrom;
+    std::string stickerFileId; // Remote unique id of sticker file, if any
 
     void assign(const TgMessageInfo &other)
     {
@@ -144,7 +187,9 @@ struct TgMessageInfo {
         sentLocally = other.sentLocally;
         repliedMessageId = other.repliedMessageId;
         repliedMessage = nullptr;
+        repliedSummary = other.repliedSummary;
         forwardedFrom = other.forwardedFrom;
+        stickerFileId = other.stickerFileId;
     }
 };
 
@@ -166,6 +211,16 @@ public:
     int            tempFd = -1;
     std::string    tempFileName;
     td::td_api::object_ptr<td::td_api::file> thumbnail;
+    // Standard downloads pass already downloaded part of tdlib file to PurpleXfer as it arrives
+    bool           streaming    = false;
+    FILE          *streamFile   = NULL;
+    std::string    streamPath;
+    int64_t        streamedSize = 0;
+    // Downloaded prefix not yet passed on is written from idle callback, holding a reference to
+    // the transfer while it's pending
+    int64_t        streamAvailable = 0;
+    guint          streamSource    = 0;
+    PurpleXfer    *streamXfer      = NULL;
 
     // Could not pass object_ptr through variadic funciton :(
     DownloadRequest(uint64_t requestId, ChatId chatId, TgMessageInfo &message,
@@ -183,6 +238,16 @@ public:
         if (message.repliedMessage)
             this->message.repliedMessage = std::move(message.repliedMessage);
     }
+    ~DownloadRequest()
+    {
+        if (streamSource) {
+            g_source_remove(streamSource);
+            purple_xfer_unref(streamXfer);
+        }
+        if (streamFile)
+            fclose(streamFile);
+    }
+    size_t getMemoryUsage() const override;
 };
 
 class AvatarDownloadRequest: public PendingRequest {
@@ -194,6 +259,7 @@ public:
     : PendingRequest(requestId), userId(getId(*user)), chatId(ChatId::invalid) {}
     AvatarDownloadRequest(uint64_t requestId, const td::td_api::chat *chat)
     : PendingRequest(requestId), userId(UserId::invalid), chatId(getId(*chat)) {}
+    size_t getMemoryUsage() const override { return sizeof(*this); }
 };
 
 class NewPrivateChatForMessage: public PendingRequest {
@@ -208,6 +274,10 @@ public:
 
     NewPrivateChatForMessage(uint64_t requestId, const char *username, PurpleXfer *upload)
     : PendingRequest(requestId), username(username), fileUpload(upload) {}
+    size_t getMemoryUsage() const override
+    {
+        return sizeof(*this) + getStringMemory(username) + getStringMemory(message);
+    }
 };
 
 class ChatActionRequest: public PendingRequest {
@@ -221,6 +291,7 @@ public:
     ChatId chatId;
     ChatActionRequest(uint64_t requestId, Type type, ChatId chatId)
     : PendingRequest(requestId), type(type), chatId(chatId) {}
+    size_t getMemoryUsage() const override { return sizeof(*this); }
 };
 
 struct IncomingMessage {
@@ -239,9 +310,9 @@ struct IncomingMessage {
     bool     repliedMessageFetchDoneOrFailed;
     bool     inlineDownloadComplete;
     bool     inlineDownloadTimeout;
-    bool     animatedStickerConverted;
-    bool     animatedStickerConvertSuccess;
-    int      animatedStickerImageId;
+    bool     stickerConverted;
+    bool     stickerConvertSuccess;
+    int      stickerImageId;
 };
 
 class PendingMessageQueue {
@@ -263,6 +334,7 @@ public:
     void             setChatNotReady(ChatId chatId);
     void             setChatReady(ChatId chatId, std::vector<IncomingMessage> &readyMessages);
     bool             isChatReady(ChatId chatId);
+    void             getMemoryUsage(MemoryUsage &usage) const;
 private:
     struct Message {
         IncomingMessage message;
@@ -281,11 +353,172 @@ private:
                               std::vector<IncomingMessage> &readyMessages);
 };
 
+// Inline downloads by file id. Messages showing the same file share one downloadFile query,
+// and only so many queries are sent at a time, conversations with focus going first.
+class InlineDownloadScheduler {
+public:
+    enum { MAX_ACTIVE_DOWNLOADS = 4 };
+
+    struct Download {
+        int32_t               fileId;
+        bool                  focused;
+        uint64_t              queryId;    // 0 while queued
+        std::vector<uint64_t> requestIds; // DownloadRequest for each waiting message
+    };
+
+    // Returns false if the file is already being downloaded or queued
+    bool      add(int32_t fileId, uint64_t requestId, bool focused);
+    // Next queued download that can be started now, if any
+    Download *getNextQueued();
+    void      extractRequests(uint64_t queryId, std::vector<uint64_t> &requestIds);
+private:
+    std::vector<Download> m_downloads;
+};
+
 struct ReadReceipt {
     ChatId    chatId;
     MessageId messageId;
 };
 
+// Outgoing messages to chats where tdlib reported flood wait. They are sent in original order once
+// waiting is over, after resending messages which failed because of it.
+class OutgoingMessageQueue {
+public:
+    struct Request {
+        td::td_api::object_ptr<td::td_api::Function> function;
+        std::unique_ptr<SendMessageRequest>          pendingRequest;
+        // Rejected because of flood wait, goes before requests which were never sent
+        bool                                         retry = false;
+    };
+    struct Chat {
+        ChatId                   chatId;
+        std::vector<int64_t>     resendIds;
+        std::vector<std::string> resendTempFiles;
+        std::vector<std::string> resendUploadPaths;
+        std::vector<Request>     requests;
+    };
+
+    // Returns false if the chat is already waiting
+    bool  startWaiting(ChatId chatId);
+    Chat *findWaiting(ChatId chatId);
+    bool  extractWaiting(ChatId chatId, Chat &chat);
+private:
+    std::vector<Chat> m_chats;
+};
+
+// This account's buddies and chats in buddy list, so that they can be found without walking the
+// whole buddy list. Kept current through blist-node-added and blist-node-removed signals. Buddies
+// renamed without either are found by falling back to purple_find_buddy, and indexed again.
+class BuddyListIndex {
+public:
+    BuddyListIndex(PurpleAccount *account) : m_account(account) {}
+    void         build();
+    // Also moves an already indexed node to its current key
+    void         add(PurpleBlistNode *node);
+    void         remove(PurpleBlistNode *node);
+
+    // Like purple_find_buddy and purple_blist_find_chat, these return NULL if account is not connected
+    PurpleBuddy *findBuddy(const char *name);
+    PurpleChat  *findChat(const char *name) const;
+    // Manually added chats without tdlib chat id, for joining by invite link or creating a group
+    void         findChatsByJoinString(const char *joinString, std::vector<PurpleChat *> &result) const;
+    void         findChatsByNewGroup(const char *groupName, int groupType, std::vector<PurpleChat *> &result) const;
+private:
+    PurpleAccount                                        *m_account;
+    std::unordered_multimap<std::string, PurpleBuddy *>   m_buddies;
+    std::unordered_multimap<std::string, PurpleChat *>    m_chats;
+    std::unordered_multimap<std::string, PurpleChat *>    m_chatsWithoutId;
+    // Key each node was indexed under, so that it can be removed without searching
+    std::unordered_map<PurpleBlistNode *, std::string>    m_keys;
+
+    void findChatsWithoutId(const std::string &key, std::vector<PurpleChat *> &result) const;
+};
+
+// Users whose status changed since buddy list was last updated. Statuses arrive in bursts for big
+// contact lists, so they are applied once per tick, with only the latest status of each user shown.
+class UserStatusQueue {
+public:
+    // Returns true if this is the first change since last extract, so that a tick needs to be scheduled
+    bool add(UserId userId);
+    void extract(std::vector<UserId> &userIds);
+
+    uint64_t receivedCount() const  { return m_received; }
+    uint64_t collapsedCount() const { return m_collapsed; }
+private:
+    std::set<UserId> m_userIds;
+    uint64_t         m_received  = 0;
+    uint64_t         m_collapsed = 0;
+};
+
+// Recently seen messages in each chat, most recently used first, for quoting replies
+class MessageSummaryCache {
+public:
+    enum { MESSAGES_PER_CHAT = 50 };
+
+    void              add(ChatId chatId, MessageSummaryPtr summary);
+    MessageSummaryPtr find(ChatId chatId, MessageId messageId) const;
+    // For edited or deleted messages
+    void              remove(ChatId chatId, MessageId messageId);
+    void              removeChat(ChatId chatId);
+    void              getMemoryUsage(MemoryUsage &usage) const;
+private:
+    // Lookups reorder the list, but that's not a visible state change
+    mutable std::map<ChatId, std::list<MessageSummaryPtr>> m_chats;
+};
+
+// Remote ids of files sent earlier, so that sending same content again (even from a different
+// path) does not upload it again. Persisted in a file next to tdlib database.
+class UploadCache {
+public:
+    enum { MAX_ENTRIES = 1000 };
+    // Bigger files are recognized only by path, size and modification time
+    static constexpr int64_t MAX_HASHED_SIZE = 256*1024*1024;
+
+    void        load(const std::string &fileName);
+    // Remote file id of earlier upload of the same file not modified since, or empty string. In the
+    // latter case, if needsHash is set, findByHash has to be called with file content hash, which
+    // can take a while so it's left to the caller.
+    std::string find(const std::string &path, bool &needsHash);
+    // Remote file id of earlier upload with same content and file name, or empty string
+    std::string findByHash(const std::string &path, const std::string &hash);
+    // Same for an inline image, saved under a name made from its content. If not found, the
+    // image is written there, and add or cancel are called with that path as for documents.
+    std::string findImage(const std::string &path, int64_t size);
+    // Can be called from any thread
+    static bool hashFile(const std::string &path, std::string &hash);
+    // Remember remote id after a file found missing by find was sent
+    void        add(const std::string &path, const std::string &remoteId);
+    // File found missing by find was not sent after all
+    void        cancel(const std::string &path);
+    void        remove(const std::string &remoteId);
+
+    unsigned    getHits() const   { return m_hits; }
+    unsigned    getMisses() const { return m_misses; }
+private:
+    struct FileKey {
+        std::string hash; // empty for big files and images
+        int64_t     size;
+        int64_t     mtime;
+    };
+    struct Entry {
+        FileKey     key;
+        std::string path;
+        std::string remoteId;
+        uint64_t    lastUsed;
+    };
+
+    std::string                    m_fileName;
+    std::vector<Entry>             m_entries;
+    // Keys computed by find, to be used by add once the file is sent
+    std::map<std::string, FileKey> m_pendingKeys;
+    uint64_t                       m_useCounter = 0;
+    unsigned                       m_hits       = 0;
+    unsigned                       m_misses     = 0;
+
+    void save();
+    void countLookup(const std::string &path, bool found);
+};
+
 class TdAccountData {
 public:
     using TdUserPtr           = td::td_api::object_ptr<td::td_api::user>;
@@ -305,7 +538,7 @@ public:
     PurpleAccount *const  purpleAccount;
     TdTransceiver        &transceiver;
     TdAccountData(PurpleAccount *purpleAccount, TdTransceiver &transceiver)
-    : purpleAccount(purpleAccount), transceiver(transceiver) {}
+    : purpleAccount(purpleAccount), transceiver(transceiver), buddyList(purpleAccount) {}
 
     void updateUser(TdUserPtr user);
     void setUserStatus(UserId UserId, td::td_api::object_ptr<td::td_api::UserStatus> status);
@@ -318,7 +551,17 @@ public:
     void setSupergroupInfoRequested(SupergroupId groupId);
     bool isSupergroupInfoRequested(SupergroupId groupId);
     void updateSupergroupInfo(SupergroupId groupId, TdSupergroupInfoPtr groupInfo);
-    void updateSupergroupMembers(SupergroupId groupId, TdChatMembersPtr members);
+    // Merges a page of recent members into the known list: known members get their status updated,
+    // others are appended (or put in front if refresh is true). Recent members are then cut to maxCount,
+    // 0 meaning no limit, but administrators among them are kept. Members whose status was updated or
+    // who were added are returned in changedMembers, those dropped from the list in removedMembers.
+    void addSupergroupMembers(SupergroupId groupId, td::td_api::chatMembers &page, bool refresh,
+                              size_t maxCount, std::vector<const td::td_api::chatMember *> &changedMembers,
+                              std::vector<UserId> &removedMembers);
+    // Same for a page of administrators, which are kept after recent members regardless of limit.
+    // Members that are not users are left out of both lists.
+    void addSupergroupAdministrators(SupergroupId groupId, td::td_api::chatMembers &page,
+                                     std::vector<const td::td_api::chatMember *> &changedMembers);
 
     void addChat(TdChatPtr chat); // Updates existing chat if any
     void updateChatPosition(ChatId chatId, td::td_api::object_ptr<td::td_api::chatPosition> &&position);
@@ -380,6 +623,12 @@ public:
     const ContactRequest *     findContactRequest(UserId userId);
     void                       addTempFileUpload(int64_t messageId, const std::string &path);
     std::string                extractTempFileUpload(int64_t messageId);
+    void                       addDocumentUpload(int64_t messageId, const std::string &path);
+    std::string                extractDocumentUpload(int64_t messageId);
+    // Image temp files are named after content, so same file can be used by several messages
+    void                       acquireTempFile(const std::string &path);
+    bool                       isTempFileInUse(const std::string &path) const;
+    bool                       releaseTempFile(const std::string &path);
     DownloadRequest *          findDownloadRequest(int32_t fileId);
     void                       extractFileTransferRequests(std::vector<PurpleXfer *> &transfers);
 
@@ -403,6 +652,19 @@ public:
     void                       removeActiveCall();
 
     PendingMessageQueue        pendingMessages;
+    MessageSummaryCache        recentMessages;
+    InlineDownloadScheduler    inlineDownloads;
+    UploadCache                uploadCache;
+    OutgoingMessageQueue       outgoingMessages;
+    BuddyListIndex             buddyList;
+    UserStatusQueue            statusUpdates;
+    // Reused for rendering incoming message text
+    std::string                messageTextBuffer;
+    // Member names last shown in each chat conversation (by conversation name), to recognize renames
+    std::map<std::string, std::map<UserId, std::string>> chatMemberNames;
+
+    // Adds an item for each kind of data kept for the account
+    void                       getMemoryUsage(MemoryReport &report) const;
 
     void                       addPendingReadReceipt(ChatId chatId, MessageId messageId);
     void                       extractPendingReadReceipts(ChatId chatId, std::vector<ReadReceipt> &receipts);
@@ -431,14 +693,21 @@ private:
     struct SupergroupInfo {
         TdSupergroupPtr     group;
         TdSupergroupInfoPtr fullInfo;
+        // Recent members first, then administrators who are not among them
         TdChatMembersPtr    members;
+        size_t              recentMemberCount = 0;
+        // Kept up to date with members so that merging a page does not scan the whole list
+        std::map<UserId, td::td_api::chatMember *> memberIndex;
         bool                fullInfoRequested = false;
     };
+    static void removeSupergroupMembers(SupergroupInfo &info, const std::set<UserId> &userIds,
+                                        std::vector<UserId> &removedMembers);
 
     struct SendMessageInfo {
         int64_t     messageId;
-        std::string tempFile;
+        std::string path;
     };
+    static std::string extractSentMessage(std::vector<SendMessageInfo> &messages, int64_t messageId);
 
     struct FileTransferInfo {
         int32_t     fileId;
@@ -461,6 +730,9 @@ private:
     // Used to remember stuff during asynchronous communication when adding contact
     std::vector<ContactRequest>        m_addContactRequests;
 
+    // Number of messages being sent using each temporary file
+    std::map<std::string, unsigned>    m_tempFileUsers;
+
     // Chats we want to libpurple-join when we get an updateNewChat about them
     std::vector<ChatId>                m_expectedChats;
 
@@ -469,6 +741,8 @@ private:
     // Newly sent messages containing inline images, for which a temporary file must be removed when
     // transfer is completed
     std::vector<SendMessageInfo>       m_sentMessages;
+    // Newly sent documents, whose remote id goes to upload cache when sending succeeds
+    std::vector<SendMessageInfo>       m_sentDocuments;
 
     // Currently active file transfers for which PurpleXfer is used
     std::vector<FileTransferInfo>      m_fileTransfers;
@@ -161,8 +161,7 @@ static void notifyCallError(const td::td_api::callStateError &error, const std::
 {
     std::string message;
     if (error.error_)
-        message = formatMessage(errorCodeMessage(), {std::to_string(error.error_->code_),
-                                error.error_->message_});
+        message = formatMessage(errorCodeMessage(), error.error_->code_, error.error_->message_);
     else
         // Unlikely message not worth translating
         message = "unknown error";
@@ -186,7 +185,7 @@ void updateCall(const td::td_api::call &call, TdAccountData &account, TdTranscei
 #else
     if (true) {
 #endif
-        purple_debug_misc(config::pluginId, "Ignoring incoming call: no audio capability\n");
+        DEBUG_MISC("Ignoring incoming call: no audio capability\n");
         if (call.state_ && (call.state_->get_id() == td::td_api::callStatePending::ID)) {
             if (!buddyName.empty())
                 showMessageTextIm(account, buddyName.c_str(), NULL,
@@ -298,6 +297,6 @@ void showCallMessage(const td::td_api::chat &chat, const TgMessageInfo &message,
     }
 
     // TRANSLATOR: In-chat message, arguments will be a duration and a few words (like "hung up")
-    notification = formatMessage(_("Call ended ({0}): {1}"), {formatDuration(callEnded.duration_), notification});
+    notification = formatMessage(_("Call ended ({0}): {1}"), formatDuration(callEnded.duration_), notification);
     showMessageText(account, chat, message, NULL, notification.c_str());
 }
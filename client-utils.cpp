@@ -4,14 +4,17 @@
 #include "format.h"
 #include "receiving.h"
 #include "file-transfer.h"
+#include "html-parser.h"
 #include <string.h>
 #include <stdlib.h>
 #include <algorithm>
 #include <functional>
 #include <ctime>
+#include <cmath>
 
 enum {
     MAX_MESSAGE_PARTS = 10,
+    MAX_ALBUM_SIZE    = 10,
 };
 
 const char *errorCodeMessage()
@@ -92,7 +95,7 @@ std::string getDisplayedError(const td::td_api::object_ptr<td::td_api::Object> &
     }
     else if (object->get_id() == td::td_api::error::ID) {
         const td::td_api::error &error = static_cast<const td::td_api::error &>(*object);
-        return formatMessage(errorCodeMessage(), {std::to_string(error.code_), error.message_});
+        return formatMessage(errorCodeMessage(), error.code_, error.message_);
     } else {
         // Should not be possible
         return "Unexpected response";
@@ -149,15 +152,15 @@ std::vector<const td::td_api::user *> getUsersByPurpleName(const char *buddyName
         if (tdUser != nullptr)
             result.push_back(tdUser);
         else if (action)
-            purple_debug_warning(config::pluginId, "Cannot %s: no user with id %s\n", action, buddyName);
+            DEBUG_WARNING("Cannot %s: no user with id %s\n", action, buddyName);
     } else {
         account.getUsersByDisplayName(buddyName, result);
         if (action) {
             if (result.empty())
-                purple_debug_warning(config::pluginId, "Cannot %s: no user with display name '%s'\n",
+                DEBUG_WARNING("Cannot %s: no user with display name '%s'\n",
                                     action, buddyName);
             else if (result.size() != 1)
-                purple_debug_warning(config::pluginId, "Cannot %s: more than one user with display name '%s'\n",
+                DEBUG_WARNING("Cannot %s: more than one user with display name '%s'\n",
                                     action, buddyName);
         }
     }
@@ -193,28 +196,28 @@ PurpleConvChat *getChatConversation(TdAccountData &account, const td::td_api::ch
     // the kind of thing we were called for here.
     if ((conv == NULL) || purple_conv_chat_has_left(purple_conversation_get_chat_data(conv))) {
         if (chatPurpleId != 0) {
-            purple_debug_misc(config::pluginId, "Creating conversation for chat %s (purple id %d)\n",
-                              chat.title_.c_str(), chatPurpleId);
+            DEBUG_MISC("Creating conversation for chat %s (purple id %d)\n",
+                       chat.title_.c_str(), chatPurpleId);
             serv_got_joined_chat(purple_account_get_connection(account.purpleAccount), chatPurpleId, chatName.c_str());
             conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT, chatName.c_str(),
                                                          account.purpleAccount);
             if (conv == NULL)
-                purple_debug_warning(config::pluginId, "Did not create conversation for chat %s\n", chat.title_.c_str());
+                DEBUG_WARNING("Did not create conversation for chat %s\n", chat.title_.c_str());
             else {
                 // Sometimes when the group has just been created, or we left it and then got
                 // messageChatDeleteMember, the chat will not be in buddy list. In that case,
                 // libpurpleis going to use chatXXXXXXXXXXX as chat title. Set chat title explicitly
                 // to prevent that.
-                PurpleChat *purpleChat = purple_blist_find_chat(account.purpleAccount, chatName.c_str());
+                PurpleChat *purpleChat = account.buddyList.findChat(chatName.c_str());
                 if (!purpleChat) {
-                    purple_debug_misc(config::pluginId, "Setting conversation title to '%s'\n", chat.title_.c_str());
+                    DEBUG_MISC("Setting conversation title to '%s'\n", chat.title_.c_str());
                     purple_conversation_set_title(conv, chat.title_.c_str());
                 }
                 newChatCreated = true;
             }
 
         } else
-            purple_debug_warning(config::pluginId, "No internal ID for chat %s\n", chat.title_.c_str());
+            DEBUG_WARNING("No internal ID for chat %s\n", chat.title_.c_str());
     }
 
     if (conv) {
@@ -270,16 +273,16 @@ void updatePrivateChat(TdAccountData &account, const td::td_api::chat *chat, con
     std::string purpleUserName = getPurpleBuddyName(user);
     std::string alias          = chat ? chat->title_ : makeBasicDisplayName(user);
 
-    PurpleBuddy *buddy = purple_find_buddy(account.purpleAccount, purpleUserName.c_str());
+    PurpleBuddy *buddy = account.buddyList.findBuddy(purpleUserName.c_str());
     if (buddy == NULL) {
-        purple_debug_misc(config::pluginId, "Adding new buddy %s for user %s\n",
-                          alias.c_str(), purpleUserName.c_str());
+        DEBUG_MISC("Adding new buddy %s for user %s\n",
+                   alias.c_str(), purpleUserName.c_str());
 
         const ContactRequest *contactReq = account.findContactRequest(getId(user));
         PurpleGroup          *group      = (contactReq && !contactReq->groupName.empty()) ?
                                            purple_find_group(contactReq->groupName.c_str()) : NULL;
         if (group)
-            purple_debug_misc(config::pluginId, "Adding into group %s\n", purple_group_get_name(group));
+            DEBUG_MISC("Adding into group %s\n", purple_group_get_name(group));
 
         buddy = purple_buddy_new(account.purpleAccount, purpleUserName.c_str(), alias.c_str());
         purple_blist_add_buddy(buddy, NULL, group, NULL);
@@ -317,21 +320,21 @@ void updatePrivateChat(TdAccountData &account, const td::td_api::chat *chat, con
                 GError *err = NULL;
                 g_file_get_contents(photo.local_->path_.c_str(), &img, &len, &err);
                 if (err) {
-                    purple_debug_warning(config::pluginId, "Failed to load profile photo %s for %s: %s\n",
-                                         photo.local_->path_.c_str(), purpleUserName.c_str(),  err->message);
+                    DEBUG_WARNING("Failed to load profile photo %s for %s: %s\n",
+                                  photo.local_->path_.c_str(), purpleUserName.c_str(),  err->message);
                     g_error_free(err);
                 } else {
                     std::string newPhotoIdStr = std::to_string(user.profile_photo_->id_);
                     purple_blist_node_set_string(PURPLE_BLIST_NODE(buddy), BuddyOptions::ProfilePhotoId,
                                                  newPhotoIdStr.c_str());
-                    purple_debug_info(config::pluginId, "Loaded new profile photo for %s (id %s)\n",
-                                      purpleUserName.c_str(), newPhotoIdStr.c_str());
+                    DEBUG_INFO("Loaded new profile photo for %s (id %s)\n",
+                               purpleUserName.c_str(), newPhotoIdStr.c_str());
                     purple_buddy_icons_set_for_user(account.purpleAccount, purpleUserName.c_str(),
                                                     img, len, NULL);
                 }
             }
         } else if (oldPhotoId) {
-            purple_debug_info(config::pluginId, "Removing profile photo from %s\n", purpleUserName.c_str());
+            DEBUG_INFO("Removing profile photo from %s\n", purpleUserName.c_str());
             purple_blist_node_remove_setting(PURPLE_BLIST_NODE(buddy), BuddyOptions::ProfilePhotoId);
             purple_buddy_icons_set_for_user(account.purpleAccount, purpleUserName.c_str(), NULL, 0, NULL);
         }
@@ -343,20 +346,21 @@ static void updateGroupChat(TdAccountData &account, const td::td_api::chat &chat
                             const char *groupType, const std::string &groupId)
 {
     if (!isGroupMember(groupStatus)) {
-        purpleDebug("Skipping {} {} because we are not a member", {std::string(groupType), groupId});
+        purpleDebug("Skipping {} {} because we are not a member", groupType, groupId);
+        account.chatMemberNames.erase(getPurpleChatName(chat));
         return;
     }
 
     std::string  chatName   = getPurpleChatName(chat);
-    PurpleChat  *purpleChat = purple_blist_find_chat(account.purpleAccount, chatName.c_str());
+    PurpleChat  *purpleChat = account.buddyList.findChat(chatName.c_str());
     if (!purpleChat) {
-        purpleDebug("Adding new chat for {} {} ({})", {std::string(groupType), groupId, chat.title_});
+        purpleDebug("Adding new chat for {} {} ({})", groupType, groupId, chat.title_);
         purpleChat = purple_chat_new(account.purpleAccount, chat.title_.c_str(), getChatComponents(chat));
         purple_blist_add_chat(purpleChat, NULL, NULL);
     } else {
         const char *oldName = purple_chat_get_name(purpleChat);
         if (chat.title_ != oldName) {
-            purple_debug_misc(config::pluginId, "Renaming chat '%s' to '%s'\n", oldName, chat.title_.c_str());
+            DEBUG_MISC("Renaming chat '%s' to '%s'\n", oldName, chat.title_.c_str());
             purple_blist_alias_chat(purpleChat, chat.title_.c_str());
         }
     }
@@ -365,7 +369,7 @@ static void updateGroupChat(TdAccountData &account, const td::td_api::chat &chat
         PurpleConversation *baseConv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT,
                                                                             chatName.c_str(), account.purpleAccount);
         if (baseConv && purple_conv_chat_has_left(purple_conversation_get_chat_data(baseConv))) {
-            purple_debug_misc(config::pluginId, "Rejoining chat %s as previously requested\n", chatName.c_str());
+            DEBUG_MISC("Rejoining chat %s as previously requested\n", chatName.c_str());
             serv_got_joined_chat(purple_account_get_connection(account.purpleAccount),
                                  account.getPurpleChatId(getId(chat)), chatName.c_str());
         }
@@ -384,20 +388,20 @@ static void updateGroupChat(TdAccountData &account, const td::td_api::chat &chat
             GError *err = NULL;
             g_file_get_contents(photo.local_->path_.c_str(), &img, &len, &err);
             if (err) {
-                purple_debug_warning(config::pluginId, "Failed to load chat photo %s for %s: %s\n",
+                DEBUG_WARNING("Failed to load chat photo %s for %s: %s\n",
                                         photo.local_->path_.c_str(), chat.title_.c_str(),  err->message);
                 g_error_free(err);
             } else {
                 purple_blist_node_set_string(PURPLE_BLIST_NODE(purpleChat), BuddyOptions::ProfilePhotoId,
                                              photo.remote_->unique_id_.c_str());
-                purple_debug_info(config::pluginId, "Loaded new chat photo for %s (id %s)\n",
-                                  chat.title_.c_str(), photo.remote_->unique_id_.c_str());
+                DEBUG_INFO("Loaded new chat photo for %s (id %s)\n",
+                           chat.title_.c_str(), photo.remote_->unique_id_.c_str());
                 purple_buddy_icons_node_set_custom_icon(PURPLE_BLIST_NODE(purpleChat),
                                                         reinterpret_cast<guchar *>(img), len);
             }
         }
     } else if (oldPhotoId) {
-        purple_debug_info(config::pluginId, "Removing chat photo from %s\n", chat.title_.c_str());
+        DEBUG_INFO("Removing chat photo from %s\n", chat.title_.c_str());
         purple_blist_node_remove_setting(PURPLE_BLIST_NODE(purpleChat), BuddyOptions::ProfilePhotoId);
         purple_buddy_icons_node_set_custom_icon(PURPLE_BLIST_NODE(purpleChat), NULL, 0);
     }
@@ -441,13 +445,14 @@ static std::string lastMessageSetting(ChatId chatId)
     return "last-message-chat" + std::to_string(chatId.value());
 }
 
-void removeGroupChat(PurpleAccount *purpleAccount, const td::td_api::chat &chat)
+void removeGroupChat(TdAccountData &account, const td::td_api::chat &chat)
 {
     std::string  chatName   = getPurpleChatName(chat);
-    PurpleChat  *purpleChat = purple_blist_find_chat(purpleAccount, chatName.c_str());
+    PurpleChat  *purpleChat = account.buddyList.findChat(chatName.c_str());
 
     if (purpleChat)
         purple_blist_remove_chat(purpleChat);
+    account.chatMemberNames.erase(chatName);
     // TODO: uncomment when updateNewChat(chat_list=NULL) + updateChatChatList(non-NULL) at login
     // no longer removes chat
     //std::string setting = lastMessageSetting(getId(chat));
@@ -551,117 +556,143 @@ void getNamesFromAlias(const char *alias, std::string &firstName, std::string &l
     lastName = name2start;
 }
 
-static void findChatsByComponents(PurpleBlistNode *node,
-                                  const char *joinString, const char *groupName, int groupType,
-                                  std::vector<PurpleChat *> &result)
+std::vector<PurpleChat *> findChatsByJoinString(const TdAccountData &account, const std::string &joinString)
 {
-    PurpleBlistNodeType nodeType = purple_blist_node_get_type(node);
-
-    if (nodeType == PURPLE_BLIST_CHAT_NODE) {
-        PurpleChat *chat           = PURPLE_CHAT(node);
-        GHashTable *components     = purple_chat_get_components(chat);
-        const char *nodeName       = getChatName(components);
-        const char *nodeJoinString = getChatJoinString(components);
-        const char *nodeGroupName  = getChatGroupName(components);
-        int         nodeGroupType  = getChatGroupType(components);
-
-        if (!nodeName) nodeName = "";
-        if (!nodeJoinString) nodeJoinString = "";
-        if (!nodeGroupName) nodeGroupName = "";
-
-        if (!strcmp(nodeName, "") && !strcmp(nodeJoinString, joinString)) {
-            if ((*joinString != '\0') ||
-                (!strcmp(nodeGroupName, groupName) && (nodeGroupType == groupType)))
-            {
-                result.push_back(chat);
-            }
-        }
-    }
-
-    for (PurpleBlistNode *child = purple_blist_node_get_first_child(node); child;
-         child = purple_blist_node_get_sibling_next(child))
-    {
-        findChatsByComponents(child, joinString, groupName, groupType, result);
-    }
+    std::vector<PurpleChat *> result;
+    account.buddyList.findChatsByJoinString(joinString.c_str(), result);
+    return result;
 }
 
-std::vector<PurpleChat *>findChatsByJoinString(const std::string &joinString)
+std::vector<PurpleChat *> findChatsByNewGroup(const TdAccountData &account, const char *name, int type)
 {
     std::vector<PurpleChat *> result;
+    account.buddyList.findChatsByNewGroup(name, type, result);
+    return result;
+}
 
-    for (PurpleBlistNode *root = purple_blist_get_root(); root;
-         root = purple_blist_node_get_sibling_next(root)) // LOL
-    {
-        findChatsByComponents(root, joinString.c_str(), "", 0, result);
-    }
+namespace {
+
+struct ChatMember {
+    UserId                   userId;
+    std::string              name;
+    PurpleConvChatBuddyFlags flags;
+};
 
-    return result;
 }
 
-std::vector<PurpleChat *> findChatsByNewGroup(const char *name, int type)
+static bool getChatMember(const td::td_api::chatMember &member, const char *ownPhoneNumber,
+                          TdAccountData &account, ChatMember &result)
 {
-    std::vector<PurpleChat *> result;
-
-    for (PurpleBlistNode *root = purple_blist_get_root(); root;
-         root = purple_blist_node_get_sibling_next(root)) // LOL
-    {
-        findChatsByComponents(root, "", name, type, result);
+    if (!isGroupMember(member.status_))
+        return false;
+
+    const td::td_api::user *user = account.getUser(getUserId(member));
+    if (!user || (user->type_ && (user->type_->get_id() == td::td_api::userTypeDeleted::ID)))
+        return false;
+
+    result.userId = getId(*user);
+
+    std::string userName    = getPurpleBuddyName(*user);
+    const char *phoneNumber = getCanonicalPhoneNumber(user->phone_number_.c_str());
+    if (account.buddyList.findBuddy(userName.c_str()))
+        // libpurple will be able to map user name to alias because there is a buddy
+        result.name = std::move(userName);
+    else if (!strcmp(ownPhoneNumber, phoneNumber))
+        // This is us, so again libpurple will map phone number to alias
+        result.name = purple_account_get_username(account.purpleAccount);
+    else {
+        // Use first and last name instead
+        result.name = account.getDisplayName(*user);
     }
 
-    return result;
+    if (member.status_->get_id() == td::td_api::chatMemberStatusCreator::ID)
+        result.flags = PURPLE_CBFLAGS_FOUNDER;
+    else if (member.status_->get_id() == td::td_api::chatMemberStatusAdministrator::ID)
+        result.flags = PURPLE_CBFLAGS_OP;
+    else
+        result.flags = PURPLE_CBFLAGS_NONE;
+    return true;
 }
 
 static void setChatMembers(PurpleConvChat *purpleChat,
                            const std::vector<td::td_api::object_ptr<td::td_api::chatMember>> &members,
-                           const TdAccountData &account)
+                           TdAccountData &account)
 {
-    GList *flags = NULL;
-    std::vector<std::string> nameData;
+    std::vector<ChatMember> newMembers;
+    std::set<std::string>   newMemberNames;
+    const char             *ownPhoneNumber = getCanonicalPhoneNumber(purple_account_get_username(account.purpleAccount));
+    newMembers.reserve(members.size());
 
     for (const auto &member: members) {
-        if (!member || !isGroupMember(member->status_))
-            continue;
+        newMembers.emplace_back();
+        if (member && getChatMember(*member, ownPhoneNumber, account, newMembers.back()))
+            newMemberNames.insert(newMembers.back().name);
+        else
+            newMembers.pop_back();
+    }
 
-        const td::td_api::user *user = account.getUser(getUserId(*member));
-        if (!user || (user->type_ && (user->type_->get_id() == td::td_api::userTypeDeleted::ID)))
-            continue;
+    // Rebuilding the whole list is slow for big groups and makes it flicker, so only apply
+    // differences to what the conversation currently shows
+    std::map<std::string, PurpleConvChatBuddyFlags> shownMembers;
+    for (GList *item = purple_conv_chat_get_users(purpleChat); item; item = g_list_next(item)) {
+        PurpleConvChatBuddy *chatBuddy = static_cast<PurpleConvChatBuddy *>(item->data);
+        shownMembers[purple_conv_chat_cb_get_name(chatBuddy)] = chatBuddy->flags;
+    }
 
-        std::string userName    = getPurpleBuddyName(*user);
-        const char *phoneNumber = getCanonicalPhoneNumber(user->phone_number_.c_str());
-        if (purple_find_buddy(account.purpleAccount, userName.c_str()))
-            // libpurple will be able to map user name to alias because there is a buddy
-            nameData.emplace_back(userName);
-        else if (!strcmp(getCanonicalPhoneNumber(purple_account_get_username(account.purpleAccount)), phoneNumber))
-            // This is us, so again libpurple will map phone number to alias
-            nameData.emplace_back(purple_account_get_username(account.purpleAccount));
-        else {
-            // Use first and last name instead
-            std::string displayName = account.getDisplayName(*user);
-            nameData.emplace_back(displayName);
+    const char *chatName = purple_conversation_get_name(purple_conv_chat_get_conversation(purpleChat));
+    std::map<UserId, std::string> &shownNames = account.chatMemberNames[chatName];
+    GList   *addedNames   = NULL;
+    GList   *addedFlags   = NULL;
+    unsigned renamedCount = 0;
+
+    for (const ChatMember &member: newMembers) {
+        auto shownMember = shownMembers.find(member.name);
+        if (shownMember == shownMembers.end()) {
+            auto oldName = shownNames.find(member.userId);
+            if ((oldName != shownNames.end()) && !newMemberNames.count(oldName->second)) {
+                shownMember = shownMembers.find(oldName->second);
+                if (shownMember != shownMembers.end()) {
+                    purple_conv_chat_rename_user(purpleChat, oldName->second.c_str(), member.name.c_str());
+                    renamedCount++;
+                }
+            }
         }
 
-        PurpleConvChatBuddyFlags flag;
-        if (member->status_->get_id() == td::td_api::chatMemberStatusCreator::ID)
-            flag = PURPLE_CBFLAGS_FOUNDER;
-        else if (member->status_->get_id() == td::td_api::chatMemberStatusAdministrator::ID)
-            flag = PURPLE_CBFLAGS_OP;
-        else
-            flag = PURPLE_CBFLAGS_NONE;
-        flags = g_list_append(flags, GINT_TO_POINTER(flag));
+        if (shownMember == shownMembers.end()) {
+            addedNames = g_list_prepend(addedNames, const_cast<char *>(member.name.c_str()));
+            addedFlags = g_list_prepend(addedFlags, GINT_TO_POINTER(member.flags));
+        } else {
+            if (shownMember->second != member.flags)
+                purple_conv_chat_user_set_flags(purpleChat, member.name.c_str(), member.flags);
+            shownMembers.erase(shownMember);
+        }
     }
 
-    GList *names = NULL;
-    for (const std::string &name: nameData)
-        names = g_list_append(names, const_cast<char *>(name.c_str()));
-
-    purple_conv_chat_clear_users(purpleChat);
-    purple_conv_chat_add_users(purpleChat, names, NULL, flags, false);
-    g_list_free(names);
-    g_list_free(flags);
+    // Whatever is still in shownMembers is no longer a member
+    GList *removedNames = NULL;
+    for (const auto &removed: shownMembers)
+        removedNames = g_list_prepend(removedNames, const_cast<char *>(removed.first.c_str()));
+    removedNames = g_list_reverse(removedNames);
+    addedNames   = g_list_reverse(addedNames);
+    addedFlags   = g_list_reverse(addedFlags);
+
+    DEBUG_MISC("Chat %s: %u members added, %zu removed, %u renamed\n", chatName,
+               g_list_length(addedNames), shownMembers.size(), renamedCount);
+    if (removedNames)
+        purple_conv_chat_remove_users(purpleChat, removedNames, NULL);
+    if (addedNames)
+        purple_conv_chat_add_users(purpleChat, addedNames, NULL, addedFlags, FALSE);
+    g_list_free(removedNames);
+    g_list_free(addedNames);
+    g_list_free(addedFlags);
+
+    shownNames.clear();
+    for (const ChatMember &member: newMembers)
+        shownNames[member.userId] = member.name;
 }
 
 void updateChatConversation(PurpleConvChat *purpleChat, const td::td_api::basicGroupFullInfo &groupInfo,
-                    const TdAccountData &account)
+                    TdAccountData &account)
 {
     purple_conv_chat_set_topic(purpleChat, NULL, groupInfo.description_.c_str());
     setChatMembers(purpleChat, groupInfo.members_, account);
@@ -674,162 +705,436 @@ void updateChatConversation(PurpleConvChat *purpleChat, const td::td_api::superg
 }
 
 void updateSupergroupChatMembers(PurpleConvChat* purpleChat, const td::td_api::chatMembers& members,
-                                 const TdAccountData& account)
+                                 TdAccountData& account)
 {
     setChatMembers(purpleChat, members.members_, account);
 }
 
-struct MessagePart {
-    bool        isImage = false;
-    int         imageId = 0;
-    std::string text;
-};
-
-static size_t splitTextChunk(MessagePart &part, const char *text, size_t length, TdAccountData &account)
-{
-    enum {MIN_LENGTH_LIMIT = 8};
-    unsigned lengthLimit = part.isImage ? account.options.maxCaptionLength : account.options.maxMessageLength;
-    if (lengthLimit == 0)
-        purple_debug_warning(config::pluginId, "No %s length limit\n", part.isImage ? "caption" : "message");
-    else if (lengthLimit <= MIN_LENGTH_LIMIT)
-        purple_debug_warning(config::pluginId, "%u is a ridiculous %s length limit\n",
-                             lengthLimit, part.isImage ? "caption" : "message");
-    if ((lengthLimit <= MIN_LENGTH_LIMIT) || (length <= lengthLimit)) {
-        part.text = std::string(text, length);
-        return length;
-    }
-
-    // Try to truncate at a line break, with no lower length limit in case of image caption
-    unsigned newlineSplitLowerLimit = part.isImage ? 1 : lengthLimit/2;
-    for (unsigned chunkLength = lengthLimit; chunkLength >= newlineSplitLowerLimit; chunkLength--)
-        if (text[chunkLength-1] == '\n') {
-            part.text = std::string(text, chunkLength-1);
-            return chunkLength;
+void updateSupergroupChatMembers(PurpleConvChat *purpleChat,
+                                 const std::vector<const td::td_api::chatMember *> &changedMembers,
+                                 const std::vector<UserId> &removedMembers, TdAccountData &account)
+{
+    const char *chatName       = purple_conversation_get_name(purple_conv_chat_get_conversation(purpleChat));
+    const char *ownPhoneNumber = getCanonicalPhoneNumber(purple_account_get_username(account.purpleAccount));
+    std::map<UserId, std::string> &shownNames = account.chatMemberNames[chatName];
+
+    std::vector<std::string> removedNames;
+    for (UserId userId: removedMembers) {
+        auto shownName = shownNames.find(userId);
+        if (shownName != shownNames.end()) {
+            if (purple_conv_chat_cb_find(purpleChat, shownName->second.c_str()))
+                removedNames.push_back(std::move(shownName->second));
+            shownNames.erase(shownName);
         }
+    }
 
-    // Try to truncate to a whole number of utf-8 characters
-    size_t      chunkLen;
-    const char *pos = g_utf8_find_prev_char(text, text+lengthLimit);
-    if (pos != NULL) {
-        const char *next = g_utf8_find_next_char(pos, NULL);
-        if (next == text+lengthLimit)
-            chunkLen = lengthLimit;
-        else
-            chunkLen = pos-text;
-    } else
-        chunkLen = lengthLimit;
-    part.text = std::string(text, chunkLen);
-    return chunkLen;
-}
-
-static void appendText(std::vector<MessagePart> &parts, const char *s, size_t len, TdAccountData &account)
-{
-    if (len != 0) {
-        if (parts.empty())
-            parts.emplace_back();
-
-        std::string sourceText(s, len);
-        char *halfNewText = purple_markup_strip_html(sourceText.c_str());
-        char *newText = purple_unescape_html(halfNewText);
-        g_free(halfNewText);
-
-        const char *remaining    = newText;
-        size_t      lenRemaining = strlen(newText);
-        while (lenRemaining) {
-            size_t chunkLength = splitTextChunk(parts.back(), remaining, lenRemaining, account);
-            lenRemaining -= chunkLength;
-            remaining += chunkLength;
-            if (lenRemaining)
-                parts.emplace_back();
+    std::vector<ChatMember> addedMembers;
+    std::set<std::string>   addedNames;
+    unsigned                renamedCount = 0;
+    for (const td::td_api::chatMember *member: changedMembers) {
+        ChatMember newMember;
+        if (!getChatMember(*member, ownPhoneNumber, account, newMember))
+            continue;
+
+        PurpleConvChatBuddy *chatBuddy = purple_conv_chat_cb_find(purpleChat, newMember.name.c_str());
+        auto                 oldName   = shownNames.find(newMember.userId);
+        if (!chatBuddy && (oldName != shownNames.end()) &&
+            purple_conv_chat_cb_find(purpleChat, oldName->second.c_str()))
+        {
+            purple_conv_chat_rename_user(purpleChat, oldName->second.c_str(), newMember.name.c_str());
+            chatBuddy = purple_conv_chat_cb_find(purpleChat, newMember.name.c_str());
+            renamedCount++;
         }
 
-        g_free(newText);
+        if (chatBuddy) {
+            if (chatBuddy->flags != newMember.flags)
+                purple_conv_chat_user_set_flags(purpleChat, newMember.name.c_str(), newMember.flags);
+        } else if (addedNames.insert(newMember.name).second)
+            addedMembers.push_back(newMember);
+        shownNames[newMember.userId] = std::move(newMember.name);
     }
-}
-
-static void parseMessage(const char *message, std::vector<MessagePart> &parts, TdAccountData &account)
-{
-    parts.clear();
-    if (!message)
-        return;
 
-    const char *s         = message;
-    const char *textStart = message;
+    DEBUG_MISC("Chat %s: %zu members added, %zu removed, %u renamed\n", chatName,
+               addedMembers.size(), removedNames.size(), renamedCount);
 
-    while (*s) {
-        bool  isImage = false;
-        long  imageId;
-        char *pastImage = NULL;
-
-        if (!strncasecmp(s, "<img id=\"", 9)) {
-            const char *idString = s+9;
+    if (!removedNames.empty()) {
+        GList *names = NULL;
+        for (const std::string &name: removedNames)
+            names = g_list_prepend(names, const_cast<char *>(name.c_str()));
+        names = g_list_reverse(names);
+        purple_conv_chat_remove_users(purpleChat, names, NULL);
+        g_list_free(names);
+    }
 
-            imageId = strtol(idString, &pastImage, 10);
-            if ((pastImage != idString) && !strncmp(pastImage, "\">", 2) && (imageId <= INT32_MAX) &&
-                (imageId >= INT32_MIN))
-            {
-                isImage = true;
-                pastImage += 2;
-                if (*pastImage == '\n')
-                    pastImage++;
-            }
+    if (!addedMembers.empty()) {
+        GList *names = NULL;
+        GList *flags = NULL;
+        for (const ChatMember &member: addedMembers) {
+            names = g_list_prepend(names, const_cast<char *>(member.name.c_str()));
+            flags = g_list_prepend(flags, GINT_TO_POINTER(member.flags));
         }
-
-        if (isImage) {
-            appendText(parts, textStart, s-textStart, account);
-            parts.emplace_back();
-            parts.back().isImage = true;
-            parts.back().imageId = imageId;
-            s = pastImage;
-            textStart = pastImage;
-        } else
-            s++;
+        names = g_list_reverse(names);
+        flags = g_list_reverse(flags);
+        purple_conv_chat_add_users(purpleChat, names, NULL, flags, FALSE);
+        g_list_free(names);
+        g_list_free(flags);
     }
-
-    appendText(parts, textStart, s-textStart, account);
 }
 
 int transmitMessage(ChatId chatId, const char *message, TdTransceiver &transceiver,
                     TdAccountData &account, TdTransceiver::ResponseCb response)
 {
     std::vector<MessagePart> parts;
-    parseMessage(message, parts, account);
+    parseOutgoingHtml(message, account.options.maxMessageLength, account.options.maxCaptionLength, parts);
     if (parts.size() > MAX_MESSAGE_PARTS)
         return -E2BIG;
 
-    for (const MessagePart &input: parts) {
-        td::td_api::object_ptr<td::td_api::sendMessage> sendMessageRequest = td::td_api::make_object<td::td_api::sendMessage>();
-        sendMessageRequest->chat_id_ = chatId.value();
-        char *tempFileName = NULL;
-        bool  hasImage     = false;
+    std::vector<td::td_api::object_ptr<td::td_api::InputMessageContent>> contents;
+    std::vector<std::string> tempFiles;
+    std::vector<std::string> remoteIds;
+    for (MessagePart &input: parts) {
+        std::string tempFileName;
+        std::string remoteId;
 
         if (input.isImage)
-            hasImage = saveImage(input.imageId, &tempFileName);
+            tempFileName = saveImage(input.imageId, account, remoteId);
 
-        if (hasImage) {
+        if (!tempFileName.empty() || !remoteId.empty()) {
             td::td_api::object_ptr<td::td_api::inputMessagePhoto> content = td::td_api::make_object<td::td_api::inputMessagePhoto>();
-            content->photo_ = td::td_api::make_object<td::td_api::inputFileLocal>(tempFileName);
+            if (!remoteId.empty())
+                content->photo_ = td::td_api::make_object<td::td_api::inputFileRemote>(remoteId);
+            else
+                content->photo_ = td::td_api::make_object<td::td_api::inputFileLocal>(tempFileName);
             content->caption_ = td::td_api::make_object<td::td_api::formattedText>();
-            content->caption_->text_ = input.text;
+            content->caption_->text_ = std::move(input.text);
+            content->caption_->entities_ = std::move(input.entities);
 
-            sendMessageRequest->input_message_content_ = std::move(content);
-            purple_debug_misc(config::pluginId, "Sending photo %s\n", tempFileName);
+            contents.push_back(std::move(content));
+            DEBUG_MISC("Sending photo %s\n", remoteId.empty() ? tempFileName.c_str() : remoteId.c_str());
         } else {
             td::td_api::object_ptr<td::td_api::inputMessageText> content = td::td_api::make_object<td::td_api::inputMessageText>();
             content->text_ = td::td_api::make_object<td::td_api::formattedText>();
-            content->text_->text_ = input.text;
-            sendMessageRequest->input_message_content_ = std::move(content);
+            content->text_->text_ = std::move(input.text);
+            content->text_->entities_ = std::move(input.entities);
+            contents.push_back(std::move(content));
+        }
+        tempFiles.push_back(std::move(tempFileName));
+        remoteIds.push_back(std::move(remoteId));
+    }
+
+    // Consecutive images are sent as an album, everything else one by one
+    for (size_t i = 0; i < contents.size(); ) {
+        size_t albumSize = 0;
+        while ((i + albumSize < contents.size()) && (albumSize < MAX_ALBUM_SIZE) &&
+               (contents[i + albumSize]->get_id() == td::td_api::inputMessagePhoto::ID))
+        {
+            albumSize++;
+        }
+
+        auto request = std::make_unique<SendMessageRequest>(0, chatId);
+        td::td_api::object_ptr<td::td_api::Function> function;
+        if (albumSize >= 2) {
+            auto sendAlbumRequest = td::td_api::make_object<td::td_api::sendMessageAlbum>();
+            sendAlbumRequest->chat_id_ = chatId.value();
+            for (size_t j = i; j < i + albumSize; j++) {
+                sendAlbumRequest->input_message_contents_.push_back(std::move(contents[j]));
+                request->tempFiles.push_back(std::move(tempFiles[j]));
+                if (!remoteIds[j].empty())
+                    request->remotePhotoIds.push_back(std::move(remoteIds[j]));
+            }
+            function = std::move(sendAlbumRequest);
+            i += albumSize;
+        } else {
+            auto sendMessageRequest = td::td_api::make_object<td::td_api::sendMessage>();
+            sendMessageRequest->chat_id_ = chatId.value();
+            sendMessageRequest->input_message_content_ = std::move(contents[i]);
+            request->tempFiles.push_back(std::move(tempFiles[i]));
+            if (!remoteIds[i].empty())
+                request->remotePhotoIds.push_back(std::move(remoteIds[i]));
+            function = std::move(sendMessageRequest);
+            i++;
         }
 
-        uint64_t requestId = transceiver.sendQuery(std::move(sendMessageRequest), response);
-        account.addPendingRequest<SendMessageRequest>(requestId, chatId, tempFileName);
-        if (tempFileName)
-            g_free(tempFileName);
+        sendMessageInOrder(chatId, std::move(function), std::move(request), transceiver, account, response);
     }
 
     return 0;
 }
 
+static td::td_api::object_ptr<td::td_api::formattedText> copyFormattedText(const td::td_api::formattedText *text)
+{
+    if (!text)
+        return nullptr;
+
+    auto copy = td::td_api::make_object<td::td_api::formattedText>();
+    copy->text_ = text->text_;
+    for (const td::td_api::object_ptr<td::td_api::textEntity> &entity: text->entities_) {
+        if (!entity || !entity->type_)
+            continue;
+        // Entity types which parseOutgoingHtml produces
+        td::td_api::object_ptr<td::td_api::TextEntityType> type;
+        switch (entity->type_->get_id()) {
+        case td::td_api::textEntityTypeBold::ID:
+            type = td::td_api::make_object<td::td_api::textEntityTypeBold>();
+            break;
+        case td::td_api::textEntityTypeItalic::ID:
+            type = td::td_api::make_object<td::td_api::textEntityTypeItalic>();
+            break;
+        case td::td_api::textEntityTypeUnderline::ID:
+            type = td::td_api::make_object<td::td_api::textEntityTypeUnderline>();
+            break;
+        case td::td_api::textEntityTypeStrikethrough::ID:
+            type = td::td_api::make_object<td::td_api::textEntityTypeStrikethrough>();
+            break;
+        case td::td_api::textEntityTypeCode::ID:
+            type = td::td_api::make_object<td::td_api::textEntityTypeCode>();
+            break;
+        case td::td_api::textEntityTypePre::ID:
+            type = td::td_api::make_object<td::td_api::textEntityTypePre>();
+            break;
+        case td::td_api::textEntityTypeTextUrl::ID:
+            type = td::td_api::make_object<td::td_api::textEntityTypeTextUrl>(
+                static_cast<const td::td_api::textEntityTypeTextUrl &>(*entity->type_).url_);
+            break;
+        }
+        if (type)
+            copy->entities_.push_back(td::td_api::make_object<td::td_api::textEntity>(
+                entity->offset_, entity->length_, std::move(type)));
+    }
+
+    return copy;
+}
+
+static td::td_api::object_ptr<td::td_api::InputFile> copyInputFile(const td::td_api::InputFile *file)
+{
+    if (!file)
+        return nullptr;
+
+    switch (file->get_id()) {
+    case td::td_api::inputFileLocal::ID:
+        return td::td_api::make_object<td::td_api::inputFileLocal>(
+            static_cast<const td::td_api::inputFileLocal &>(*file).path_);
+    case td::td_api::inputFileRemote::ID:
+        return td::td_api::make_object<td::td_api::inputFileRemote>(
+            static_cast<const td::td_api::inputFileRemote &>(*file).id_);
+    case td::td_api::inputFileId::ID:
+        return td::td_api::make_object<td::td_api::inputFileId>(
+            static_cast<const td::td_api::inputFileId &>(*file).id_);
+    }
+
+    return nullptr;
+}
+
+// Only the fields which transmitMessage and sendDocument fill in are copied
+static td::td_api::object_ptr<td::td_api::InputMessageContent>
+copyMessageContent(const td::td_api::InputMessageContent *content)
+{
+    if (!content)
+        return nullptr;
+
+    switch (content->get_id()) {
+    case td::td_api::inputMessageText::ID: {
+        const auto &text = static_cast<const td::td_api::inputMessageText &>(*content);
+        return td::td_api::make_object<td::td_api::inputMessageText>(copyFormattedText(text.text_.get()),
+                                                                     text.disable_web_page_preview_,
+                                                                     text.clear_draft_);
+    }
+    case td::td_api::inputMessagePhoto::ID: {
+        const auto &photo = static_cast<const td::td_api::inputMessagePhoto &>(*content);
+        auto copy = td::td_api::make_object<td::td_api::inputMessagePhoto>();
+        copy->photo_ = copyInputFile(photo.photo_.get());
+        copy->caption_ = copyFormattedText(photo.caption_.get());
+        if (!copy->photo_)
+            return nullptr;
+        return std::move(copy);
+    }
+    case td::td_api::inputMessageDocument::ID: {
+        const auto &document = static_cast<const td::td_api::inputMessageDocument &>(*content);
+        auto copy = td::td_api::make_object<td::td_api::inputMessageDocument>();
+        copy->document_ = copyInputFile(document.document_.get());
+        copy->caption_ = copyFormattedText(document.caption_.get());
+        if (!copy->document_)
+            return nullptr;
+        return std::move(copy);
+    }
+    }
+
+    return nullptr;
+}
+
+// tdlib objects can't be copied, so this only knows requests sent by sendMessageInOrder and endFloodWait
+static td::td_api::object_ptr<td::td_api::Function> copySendRequest(const td::td_api::Function &function)
+{
+    switch (function.get_id()) {
+    case td::td_api::sendMessage::ID: {
+        const auto &sendMessage = static_cast<const td::td_api::sendMessage &>(function);
+        auto copy = td::td_api::make_object<td::td_api::sendMessage>();
+        copy->chat_id_ = sendMessage.chat_id_;
+        copy->input_message_content_ = copyMessageContent(sendMessage.input_message_content_.get());
+        if (!copy->input_message_content_)
+            return nullptr;
+        return std::move(copy);
+    }
+    case td::td_api::sendMessageAlbum::ID: {
+        const auto &sendAlbum = static_cast<const td::td_api::sendMessageAlbum &>(function);
+        auto copy = td::td_api::make_object<td::td_api::sendMessageAlbum>();
+        copy->chat_id_ = sendAlbum.chat_id_;
+        for (const auto &content: sendAlbum.input_message_contents_) {
+            copy->input_message_contents_.push_back(copyMessageContent(content.get()));
+            if (!copy->input_message_contents_.back())
+                return nullptr;
+        }
+        return std::move(copy);
+    }
+    case td::td_api::resendMessages::ID: {
+        const auto &resend = static_cast<const td::td_api::resendMessages &>(function);
+        return td::td_api::make_object<td::td_api::resendMessages>(resend.chat_id_, resend.message_ids_);
+    }
+    }
+
+    return nullptr;
+}
+
+static void sendMessageRequest(td::td_api::object_ptr<td::td_api::Function> function,
+                               std::unique_ptr<SendMessageRequest> request, TdTransceiver &transceiver,
+                               TdAccountData &account, TdTransceiver::ResponseCb response)
+{
+    request->function = copySendRequest(*function);
+    uint64_t requestId = transceiver.sendQuery(std::move(function), response);
+    account.addPendingRequest<SendMessageRequest>(requestId, std::move(request));
+}
+
+void sendMessageInOrder(ChatId chatId, td::td_api::object_ptr<td::td_api::Function> function,
+                        std::unique_ptr<SendMessageRequest> request, TdTransceiver &transceiver,
+                        TdAccountData &account, TdTransceiver::ResponseCb response)
+{
+    // tdlib keeps messages in order of requests, so without flood wait they can all go at once
+    OutgoingMessageQueue::Chat *waitingChat = account.outgoingMessages.findWaiting(chatId);
+    if (waitingChat) {
+        DEBUG_MISC("Chat %" G_GINT64_FORMAT " is in flood wait, queueing message\n",
+                   chatId.value());
+        waitingChat->requests.emplace_back();
+        waitingChat->requests.back().function       = std::move(function);
+        waitingChat->requests.back().pendingRequest = std::move(request);
+    } else
+        sendMessageRequest(std::move(function), std::move(request), transceiver, account, response);
+}
+
+unsigned getFloodWaitSeconds(int32_t errorCode, const std::string &errorMessage)
+{
+    // E.g. "Too Many Requests: retry after 5"
+    if (errorCode != 429)
+        return 0;
+
+    const char *const retryAfter = "retry after ";
+    size_t            pos        = errorMessage.find(retryAfter);
+    unsigned          seconds    = 0;
+    if (pos != std::string::npos)
+        seconds = strtoul(errorMessage.c_str() + pos + strlen(retryAfter), NULL, 10);
+
+    return std::max(seconds, 1U);
+}
+
+static void endFloodWait(ChatId chatId, TdTransceiver &transceiver, TdAccountData &account,
+                         TdTransceiver::ResponseCb response)
+{
+    OutgoingMessageQueue::Chat chat;
+    if (!account.outgoingMessages.extractWaiting(chatId, chat))
+        return;
+
+    DEBUG_MISC("Flood wait over for chat %" G_GINT64_FORMAT ": resending %zu, sending %zu\n",
+               chatId.value(), chat.resendIds.size(), chat.requests.size());
+    if (!chat.resendIds.empty()) {
+        auto resendRequest = td::td_api::make_object<td::td_api::resendMessages>();
+        resendRequest->chat_id_     = chatId.value();
+        resendRequest->message_ids_ = std::move(chat.resendIds);
+        auto request = std::make_unique<SendMessageRequest>(0, chatId);
+        request->tempFiles = std::move(chat.resendTempFiles);
+        request->resendUploadPaths = std::move(chat.resendUploadPaths);
+
+        sendMessageRequest(std::move(resendRequest), std::move(request), transceiver, account, response);
+    }
+
+    for (OutgoingMessageQueue::Request &queued: chat.requests)
+        sendMessageRequest(std::move(queued.function), std::move(queued.pendingRequest), transceiver,
+                           account, response);
+}
+
+void startFloodWait(ChatId chatId, unsigned seconds, TdTransceiver &transceiver, TdAccountData &account,
+                    TdTransceiver::ResponseCb response)
+{
+    if (!account.outgoingMessages.startWaiting(chatId))
+        return;
+
+    DEBUG_MISC("Flood wait for chat %" G_GINT64_FORMAT ": %u seconds\n",
+               chatId.value(), seconds);
+    const td::td_api::chat *chat = account.getChat(chatId);
+    if (chat) {
+        // TRANSLATOR: In-chat notification, argument is a number
+        std::string notification = formatMessage(_("Sending messages too fast, waiting for {} seconds"),
+                                                 seconds);
+        showChatNotification(account, *chat, notification.c_str());
+    }
+
+    transceiver.setQueryTimer(transceiver.reserveQueryId(),
+                              [chatId, &transceiver, &account, response](uint64_t, td::td_api::object_ptr<td::td_api::Object>) {
+                                  endFloodWait(chatId, transceiver, account, response);
+                              }, seconds, false);
+}
+
+bool sendAfterFloodWait(std::unique_ptr<SendMessageRequest> &request, unsigned seconds,
+                        TdTransceiver &transceiver, TdAccountData &account,
+                        TdTransceiver::ResponseCb response)
+{
+    if (!request->function)
+        return false;
+
+    startFloodWait(request->chatId, seconds, transceiver, account, response);
+    OutgoingMessageQueue::Chat *waitingChat = account.outgoingMessages.findWaiting(request->chatId);
+    if (!waitingChat)
+        return false;
+
+    DEBUG_MISC("Chat %" G_GINT64_FORMAT " is in flood wait, will send rejected message again\n",
+               request->chatId.value());
+    // Requests sent to tdlib later than this one and not rejected still overtake it
+    auto it = std::find_if(waitingChat->requests.begin(), waitingChat->requests.end(),
+                           [](const OutgoingMessageQueue::Request &queued) { return !queued.retry; });
+    it = waitingChat->requests.emplace(it);
+    it->function       = std::move(request->function);
+    it->pendingRequest = std::move(request);
+    it->retry          = true;
+    return true;
+}
+
+bool resendAfterFloodWait(const td::td_api::updateMessageSendFailed &sendFailed, TdTransceiver &transceiver,
+                          TdAccountData &account, TdTransceiver::ResponseCb response)
+{
+    const td::td_api::message *message = sendFailed.message_.get();
+    if (!message || !message->sending_state_ ||
+        (message->sending_state_->get_id() != td::td_api::messageSendingStateFailed::ID))
+    {
+        return false;
+    }
+
+    const auto &state   = static_cast<const td::td_api::messageSendingStateFailed &>(*message->sending_state_);
+    unsigned    seconds = (state.retry_after_ > 0) ? (unsigned)ceil(state.retry_after_) :
+                          sendFailed.error_ ? getFloodWaitSeconds(sendFailed.error_->code_, sendFailed.error_->message_) : 0;
+    if (!state.can_retry_ || (seconds == 0))
+        return false;
+
+    ChatId chatId = getChatId(*message);
+    startFloodWait(chatId, seconds, transceiver, account, response);
+    OutgoingMessageQueue::Chat *waitingChat = account.outgoingMessages.findWaiting(chatId);
+    if (!waitingChat)
+        return false;
+
+    waitingChat->resendIds.push_back(message->id_);
+    waitingChat->resendTempFiles.push_back(account.extractTempFileUpload(sendFailed.old_message_id_));
+    // Resent message gets a new id, under which upload cache entry is added once it's sent
+    waitingChat->resendUploadPaths.push_back(account.extractDocumentUpload(sendFailed.old_message_id_));
+    return true;
+}
+
 std::string getSenderDisplayName(const td::td_api::chat &chat, const TgMessageInfo &message,
                                  PurpleAccount *account)
 {
@@ -862,8 +1167,8 @@ void notifySendFailed(const td::td_api::updateMessageSendFailed &sendFailed, TdA
     if (sendFailed.message_) {
         const td::td_api::chat *chat = account.getChat(getChatId(*sendFailed.message_));
         if (chat) {
-            std::string errorMessage = formatMessage(errorCodeMessage(), {std::to_string(sendFailed.error_->code_),
-                                                     sendFailed.error_->message_});
+            std::string errorMessage = formatMessage(errorCodeMessage(), sendFailed.error_->code_,
+                                                     sendFailed.error_->message_);
             // TRANSLATOR: In-chat error message, argument will be text.
             errorMessage = formatMessage(_("Failed to send message: {}"), errorMessage);
             showChatNotification(account, *chat, errorMessage.c_str(), sendFailed.message_->date_,
@@ -883,7 +1188,7 @@ void updateOption(const td::td_api::updateOption &option, TdAccountData &account
     if ((option.name_ == "version") && option.value_ &&
         (option.value_->get_id() == td::td_api::optionValueString::ID))
     {
-        purple_debug_misc(config::pluginId, "tdlib version: %s\n",
+        DEBUG_MISC("tdlib version: %s\n",
                             static_cast<const td::td_api::optionValueString &>(*option.value_).value_.c_str());
     } else if ((option.name_ == "message_caption_length_max") && option.value_ &&
         (option.value_->get_id() == td::td_api::optionValueInteger::ID))
@@ -894,7 +1199,7 @@ void updateOption(const td::td_api::updateOption &option, TdAccountData &account
     {
         account.options.maxMessageLength = zeroIfNegative(static_cast<const td::td_api::optionValueInteger &>(*option.value_).value_);
     } else
-        purple_debug_misc(config::pluginId, "Option update %s\n", option.name_.c_str());
+        DEBUG_MISC("Option update %s\n", option.name_.c_str());
 }
 
 void populateGroupChatList(PurpleRoomlist *roomlist, const std::vector<const td::td_api::chat *> &chats,
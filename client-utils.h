@@ -26,7 +26,7 @@ void                updatePrivateChat(TdAccountData &account, const td::td_api::
 void                updateBasicGroupChat(TdAccountData &account, BasicGroupId groupId);
 void                updateSupergroupChat(TdAccountData &account, SupergroupId groupId);
 bool                isInviteLinkActive(const td::td_api::chatInviteLink &linkInfo);
-void                removeGroupChat(PurpleAccount *purpleAccount, const td::td_api::chat &chat);
+void                removeGroupChat(TdAccountData &account, const td::td_api::chat &chat);
 void                removePrivateChat(TdAccountData &account, const td::td_api::chat &chat);
 void                saveChatLastMessage(TdAccountData &account, ChatId chatId, MessageId messageId);
 MessageId           getChatLastMessage(TdAccountData &account, ChatId chatId);
@@ -36,8 +36,8 @@ std::string         getIncomingGroupchatSenderPurpleName(const td::td_api::chat
 std::string         getForwardSource(const td::td_api::messageForwardInfo &forwardInfo,
                                      const TdAccountData &accountData);
 void                getNamesFromAlias(const char *alias, std::string &firstName, std::string &lastName);
-std::vector<PurpleChat *> findChatsByJoinString(const std::string &inviteLink);
-std::vector<PurpleChat *> findChatsByNewGroup(const char *name, int type);
+std::vector<PurpleChat *> findChatsByJoinString(const TdAccountData &account, const std::string &inviteLink);
+std::vector<PurpleChat *> findChatsByNewGroup(const TdAccountData &account, const char *name, int type);
 
 std::string getSenderDisplayName(const td::td_api::chat &chat, const TgMessageInfo &message,
                                  PurpleAccount *account);
@@ -47,14 +47,32 @@ std::string getDownloadXferPeerName(ChatId chatId,
 
 void notifySendFailed(const td::td_api::updateMessageSendFailed &sendFailed, TdAccountData &account);
 void updateChatConversation(PurpleConvChat *purpleChat, const td::td_api::basicGroupFullInfo &groupInfo,
-                    const TdAccountData &account);
+                    TdAccountData &account);
 void updateChatConversation(PurpleConvChat *purpleChat, const td::td_api::supergroupFullInfo &groupInfo,
                     const TdAccountData &account);
 void updateSupergroupChatMembers(PurpleConvChat *purpleChat, const td::td_api::chatMembers &members,
-                                 const TdAccountData &account);
+                                 TdAccountData &account);
+// Shows only the members that changed, rather than going through the whole list
+void updateSupergroupChatMembers(PurpleConvChat *purpleChat,
+                                 const std::vector<const td::td_api::chatMember *> &changedMembers,
+                                 const std::vector<UserId> &removedMembers, TdAccountData &account);
 
 int  transmitMessage(ChatId chatId, const char *message, TdTransceiver &transceiver,
                      TdAccountData &account, TdTransceiver::ResponseCb response);
+// Sends sendMessage-like request right away, or queues it if the chat is in flood wait
+void sendMessageInOrder(ChatId chatId, td::td_api::object_ptr<td::td_api::Function> function,
+                        std::unique_ptr<SendMessageRequest> request, TdTransceiver &transceiver,
+                        TdAccountData &account, TdTransceiver::ResponseCb response);
+unsigned getFloodWaitSeconds(int32_t errorCode, const std::string &errorMessage);
+void startFloodWait(ChatId chatId, unsigned seconds, TdTransceiver &transceiver, TdAccountData &account,
+                    TdTransceiver::ResponseCb response);
+// Returns true if the request will be sent again once flood wait is over
+bool sendAfterFloodWait(std::unique_ptr<SendMessageRequest> &request, unsigned seconds,
+                        TdTransceiver &transceiver, TdAccountData &account,
+                        TdTransceiver::ResponseCb response);
+// Returns true if the message will be resent once flood wait is over
+bool resendAfterFloodWait(const td::td_api::updateMessageSendFailed &sendFailed, TdTransceiver &transceiver,
+                          TdAccountData &account, TdTransceiver::ResponseCb response);
 
 void requestRecoveryEmailConfirmation(PurpleConnection *gc, const char *emailInfo);
 
@@ -0,0 +1,187 @@
+#include "debug-log.h"
+#include "config.h"
+#include <algorithm>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+std::atomic<int> DebugLog::s_bufferLevel{PURPLE_DEBUG_WARNING};
+
+namespace {
+
+// Fixed-size slots written without locking: a writer claims the next sequence number, and marks
+// the slot with it once the text is in place, so that a reader copying a slot being overwritten
+// can tell and skip it
+class RingBuffer {
+public:
+    enum {
+        SLOT_COUNT = 2048,
+        TEXT_SIZE  = 240
+    };
+
+    void add(PurpleDebugLevel level, const char *text, size_t length)
+    {
+        uint64_t seq  = m_nextSeq.fetch_add(1, std::memory_order_relaxed);
+        Slot    &slot = m_slots[seq % SLOT_COUNT];
+
+        // Odd while being written
+        slot.state.store(2*seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.time   = g_get_real_time();
+        slot.level  = level;
+        slot.length = std::min<size_t>(length, TEXT_SIZE);
+        memcpy(slot.text, text, slot.length);
+        slot.state.store(2*seq + 2, std::memory_order_release);
+    }
+
+    template<typename Callback>
+    void forEach(Callback callback)
+    {
+        uint64_t end   = m_nextSeq.load(std::memory_order_acquire);
+        uint64_t start = (end > SLOT_COUNT) ? end - SLOT_COUNT : 0;
+        for (uint64_t seq = start; seq < end; seq++) {
+            const Slot &slot = m_slots[seq % SLOT_COUNT];
+            Slot        copy;
+            if (slot.state.load(std::memory_order_acquire) != 2*seq + 2)
+                continue;
+            copy.time   = slot.time;
+            copy.level  = slot.level;
+            copy.length = slot.length;
+            memcpy(copy.text, slot.text, copy.length);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.state.load(std::memory_order_relaxed) == 2*seq + 2)
+                callback(copy.time, copy.level, copy.text, copy.length);
+        }
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> state{0};
+        gint64                time;
+        PurpleDebugLevel      level;
+        size_t                length;
+        char                  text[TEXT_SIZE];
+    };
+
+    std::atomic<uint64_t> m_nextSeq{0};
+    Slot                  m_slots[SLOT_COUNT];
+};
+
+}
+
+static RingBuffer       g_ringBuffer;
+static std::atomic<int> g_verboseUsers{0};
+
+bool DebugLog::outputEnabled(PurpleDebugLevel level)
+{
+    // Same condition under which purple_debug would print anything
+    if (purple_debug_is_enabled())
+        return true;
+    PurpleDebugUiOps *ops = purple_debug_get_ui_ops();
+    return ops && ops->print && (!ops->is_enabled || ops->is_enabled(level, config::pluginId));
+}
+
+void DebugLog::write(PurpleDebugLevel level, const char *format, ...)
+{
+    char    buffer[1024];
+    va_list va;
+    va_start(va, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, va);
+    va_end(va);
+    if (length < 0)
+        return;
+
+    // Longer messages (like whole tdlib objects) are truncated in the buffer but not in the output
+    std::string longMessage;
+    const char *message = buffer;
+    if (size_t(length) >= sizeof(buffer) && outputEnabled(level)) {
+        va_start(va, format);
+        longMessage.resize(length + 1);
+        vsnprintf(&longMessage[0], longMessage.size(), format, va);
+        va_end(va);
+        longMessage.resize(length);
+        message = longMessage.c_str();
+    }
+    length = std::min<size_t>(length, sizeof(buffer) - 1);
+
+    if (level >= s_bufferLevel.load(std::memory_order_relaxed)) {
+        size_t bufferedLength = length;
+        if (bufferedLength && (buffer[bufferedLength-1] == '\n'))
+            bufferedLength--;
+        g_ringBuffer.add(level, buffer, bufferedLength);
+    }
+
+    if (outputEnabled(level)) {
+        switch (level) {
+        case PURPLE_DEBUG_ALL:
+        case PURPLE_DEBUG_MISC:
+            purple_debug_misc(config::pluginId, "%s", message);
+            break;
+        case PURPLE_DEBUG_INFO:
+            purple_debug_info(config::pluginId, "%s", message);
+            break;
+        case PURPLE_DEBUG_WARNING:
+            purple_debug_warning(config::pluginId, "%s", message);
+            break;
+        case PURPLE_DEBUG_ERROR:
+        case PURPLE_DEBUG_FATAL:
+            purple_debug_error(config::pluginId, "%s", message);
+            break;
+        }
+    }
+}
+
+void DebugLog::retainVerbose()
+{
+    if (g_verboseUsers.fetch_add(1) == 0)
+        s_bufferLevel = PURPLE_DEBUG_MISC;
+}
+
+void DebugLog::releaseVerbose()
+{
+    if (g_verboseUsers.fetch_sub(1) == 1)
+        s_bufferLevel = PURPLE_DEBUG_WARNING;
+}
+
+static const char *getLevelName(PurpleDebugLevel level)
+{
+    switch (level) {
+    case PURPLE_DEBUG_INFO:
+        return "info";
+    case PURPLE_DEBUG_WARNING:
+        return "warning";
+    case PURPLE_DEBUG_ERROR:
+    case PURPLE_DEBUG_FATAL:
+        return "error";
+    default:
+        return "misc";
+    }
+}
+
+bool DebugLog::save(const char *path, std::string &errorMessage)
+{
+    std::string contents;
+    g_ringBuffer.forEach([&contents](gint64 time, PurpleDebugLevel level, const char *text, size_t length) {
+        GDateTime *dateTime = g_date_time_new_from_unix_local(time / G_USEC_PER_SEC);
+        gchar     *timestamp = g_date_time_format(dateTime, "%Y-%m-%d %H:%M:%S");
+        char       milliseconds[8];
+        snprintf(milliseconds, sizeof(milliseconds), ".%03d", int(time % G_USEC_PER_SEC / 1000));
+        contents += timestamp;
+        contents += milliseconds;
+        g_free(timestamp);
+        g_date_time_unref(dateTime);
+        contents += " (";
+        contents += getLevelName(level);
+        contents += ") ";
+        contents.append(text, length);
+        contents += '\n';
+    });
+
+    GError *error = NULL;
+    if (!g_file_set_contents(path, contents.c_str(), contents.size(), &error)) {
+        errorMessage = error->message;
+        g_error_free(error);
+        return false;
+    }
+    return true;
+}
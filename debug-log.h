@@ -0,0 +1,57 @@
+#ifndef _DEBUG_LOG_H
+#define _DEBUG_LOG_H
+
+#include "buildopt.h"
+#include <purple.h>
+#include <atomic>
+#include <string>
+
+// Debug messages go to purple debug log if anyone is listening, and to an in-memory ring buffer of
+// recent messages which can be saved on demand. The macros below check that before evaluating
+// arguments, so building a message costs nothing if it is not going anywhere.
+class DebugLog {
+public:
+    static bool enabled(PurpleDebugLevel level)
+    {
+        return (level >= s_bufferLevel.load(std::memory_order_relaxed)) || outputEnabled(level);
+    }
+
+    // printf-style, like purple_debug_*
+    static void write(PurpleDebugLevel level, const char *format, ...) G_GNUC_PRINTF(2, 3);
+
+    // Warnings and errors are always kept in the buffer; all messages are while at least one
+    // account has asked for it
+    static void retainVerbose();
+    static void releaseVerbose();
+
+    static bool save(const char *path, std::string &errorMessage);
+private:
+    static bool outputEnabled(PurpleDebugLevel level);
+
+    static std::atomic<int> s_bufferLevel;
+};
+
+#define DEBUG_LOG(level, ...) \
+    do { \
+        if (DebugLog::enabled(level)) \
+            DebugLog::write(level, __VA_ARGS__); \
+    } while (0)
+
+#define DEBUG_MISC(...)    DEBUG_LOG(PURPLE_DEBUG_MISC, __VA_ARGS__)
+#define DEBUG_INFO(...)    DEBUG_LOG(PURPLE_DEBUG_INFO, __VA_ARGS__)
+#define DEBUG_WARNING(...) DEBUG_LOG(PURPLE_DEBUG_WARNING, __VA_ARGS__)
+#define DEBUG_ERROR(...)   DEBUG_LOG(PURPLE_DEBUG_ERROR, __VA_ARGS__)
+
+// Messages for every update, request and response are only compiled in with -DTraceLog=TRUE
+#ifdef TraceLog
+#define DEBUG_TRACE(...)   DEBUG_MISC(__VA_ARGS__)
+#else
+// Still type-checked, but never evaluated
+#define DEBUG_TRACE(...) \
+    do { \
+        if (false) \
+            DebugLog::write(PURPLE_DEBUG_MISC, __VA_ARGS__); \
+    } while (0)
+#endif
+
+#endif
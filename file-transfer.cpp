@@ -5,43 +5,179 @@
 #include "receiving.h"
 #include "sticker.h"
 #include "purple-info.h"
+#include "buildopt.h"
+#include "trace.h"
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
 enum {
     FILE_UPLOAD_PRIORITY = 1,
 };
 
-bool saveImage(int id, char **fileName)
+// Image files are written into a directory of our own rather than shared temporary directory, so
+// that nobody else can put a file there under the expected name
+static std::string getUploadDirectoryPath()
 {
-    *fileName = NULL;
-    char *tempFileName = NULL;
+    gchar *path = g_build_filename(purple_user_dir(), config::configSubdir, "upload", NULL);
+    std::string result = path;
+    g_free(path);
+    return result;
+}
 
+static std::string getUploadDirectory()
+{
+    std::string result = getUploadDirectoryPath();
+    if (g_mkdir_with_parents(result.c_str(), 0700) != 0) {
+        DEBUG_MISC("Could not create %s: %s\n", result.c_str(), strerror(errno));
+        return "";
+    }
+    return result;
+}
+
+// Temporary file is named after image content (and account, so that one account doesn't remove
+// it from under another), so sending the same image while an earlier message with it is still
+// being sent doesn't write it again.
+static std::string getImageFileName(PurpleStoredImage *psi, PurpleAccount *account,
+                                    const std::string &directory)
+{
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    const char *userName = purple_account_get_username(account);
+    g_checksum_update(checksum, reinterpret_cast<const guchar *>(userName), strlen(userName) + 1);
+    g_checksum_update(checksum, static_cast<const guchar *>(purple_imgstore_get_data(psi)),
+                      purple_imgstore_get_size(psi));
+    std::string baseName = std::string("tdlib_upload_") + g_checksum_get_string(checksum);
+    g_checksum_free(checksum);
+
+    gchar *path = g_build_filename(directory.c_str(), baseName.c_str(), NULL);
+    std::string result = path;
+    g_free(path);
+    return result;
+}
+
+std::string saveImage(int id, TdAccountData &account, std::string &remoteId)
+{
+    remoteId.clear();
     PurpleStoredImage *psi = purple_imgstore_find_by_id (id);
     if (!psi) {
-        purple_debug_misc(config::pluginId, "Failed to send image: id %d not found\n", id);
-        return false;
+        DEBUG_MISC("Failed to send image: id %d not found\n", id);
+        return "";
+    }
+
+    std::string directory = getUploadDirectory();
+    if (directory.empty()) {
+        DEBUG_MISC("Failed to send image: could not create upload directory\n");
+        return "";
     }
-    int fd = g_file_open_tmp("tdlib_upload_XXXXXX", &tempFileName, NULL);
+
+    // Only a file written by us for a message still being sent is reused. Anything else under
+    // that name, such as a file left over from a crash, is overwritten.
+    std::string fileName = getImageFileName(psi, account.purpleAccount, directory);
+    remoteId = account.uploadCache.findImage(fileName, purple_imgstore_get_size(psi));
+    if (!remoteId.empty()) {
+        DEBUG_MISC("Image id %d was sent before as %s\n", id, remoteId.c_str());
+        return "";
+    }
+    if (account.isTempFileInUse(fileName)) {
+        DEBUG_MISC("Reusing %s for image id %d\n", fileName.c_str(), id);
+        account.acquireTempFile(fileName);
+        return fileName;
+    }
+
+    // Written under a unique name and renamed, so a partially written file is never sent
+    gchar *tempFileName = g_build_filename(directory.c_str(), "tdlib_upload_XXXXXX", NULL);
+    int fd = g_mkstemp(tempFileName);
     if (fd < 0) {
-        purple_debug_misc(config::pluginId, "Failed to send image: could not create temporary file\n");
-        return false;
+        DEBUG_MISC("Failed to send image: could not create temporary file\n");
+        account.uploadCache.cancel(fileName);
+        g_free(tempFileName);
+        return "";
     }
     ssize_t len = write(fd, purple_imgstore_get_data (psi), purple_imgstore_get_size (psi));
     close(fd);
-    if (len != (ssize_t)purple_imgstore_get_size(psi)) {
-        purple_debug_misc(config::pluginId, "Failed to send image: could not write temporary file\n");
+    // Stale file, rename won't replace it on Windows
+    remove(fileName.c_str());
+    if ((len != (ssize_t)purple_imgstore_get_size(psi)) || (rename(tempFileName, fileName.c_str()) != 0)) {
+        DEBUG_MISC("Failed to send image: could not write temporary file\n");
+        account.uploadCache.cancel(fileName);
         remove(tempFileName);
         g_free(tempFileName);
-        return false;
+        return "";
     }
+    g_free(tempFileName);
 
-    *fileName = tempFileName;
-    return true;
+    account.acquireTempFile(fileName);
+    return fileName;
 }
 
-void startDocumentUpload(ChatId chatId, const std::string &filename, PurpleXfer *xfer,
-                         TdTransceiver &transceiver, TdAccountData &account,
-                         TdTransceiver::ResponseCb response)
+void releaseImageFile(const std::string &path, TdAccountData &account)
+{
+    if (account.releaseTempFile(path)) {
+        DEBUG_MISC("Removing temporary file %s\n", path.c_str());
+        remove(path.c_str());
+    }
+}
+
+void removeStaleImageFiles()
+{
+    // The directory is shared by all accounts, so once one is connected, files there may be in use
+    static bool removed = false;
+    if (removed)
+        return;
+    removed = true;
+
+    std::string directory = getUploadDirectoryPath();
+    GDir *dir = g_dir_open(directory.c_str(), 0, NULL);
+    if (!dir)
+        return;
+
+    while (const gchar *name = g_dir_read_name(dir)) {
+        if (!g_str_has_prefix(name, "tdlib_upload_"))
+            continue;
+        gchar *path = g_build_filename(directory.c_str(), name, NULL);
+        DEBUG_MISC("Removing stale temporary file %s\n", path);
+        remove(path);
+        g_free(path);
+    }
+    g_dir_close(dir);
+}
+
+static void sendDocument(ChatId chatId, td::td_api::object_ptr<td::td_api::InputFile> &&file,
+                         std::unique_ptr<SendMessageRequest> &&request, TdTransceiver &transceiver,
+                         TdAccountData &account, TdTransceiver::ResponseCb sendMessageResponse)
+{
+    auto sendMessageRequest = td::td_api::make_object<td::td_api::sendMessage>();
+    auto content = td::td_api::make_object<td::td_api::inputMessageDocument>();
+    content->caption_ = td::td_api::make_object<td::td_api::formattedText>();
+    content->document_ = std::move(file);
+    sendMessageRequest->input_message_content_ = std::move(content);
+    sendMessageRequest->chat_id_ = chatId.value();
+
+    sendMessageInOrder(chatId, std::move(sendMessageRequest), std::move(request), transceiver, account,
+                       sendMessageResponse);
+}
+
+static void sendCachedDocument(ChatId chatId, const std::string &filename, const std::string &remoteId,
+                               PurpleXfer *xfer, TdTransceiver &transceiver, TdAccountData &account,
+                               TdTransceiver::ResponseCb sendMessageResponse)
+{
+    DEBUG_MISC("Sending %s without uploading, remote file id %s\n",
+               filename.c_str(), remoteId.c_str());
+    purple_xfer_start(xfer, -1, NULL, 0);
+
+    // Transfer is completed by finishCachedDocumentUpload once the message is sent
+    auto request = std::make_unique<SendMessageRequest>(0, chatId);
+    request->remoteFileId = remoteId;
+    request->xfer = xfer;
+    purple_xfer_ref(xfer);
+    sendDocument(chatId, td::td_api::make_object<td::td_api::inputFileRemote>(remoteId),
+                 std::move(request), transceiver, account, sendMessageResponse);
+}
+
+static void uploadDocument(ChatId chatId, const std::string &filename, PurpleXfer *xfer,
+                           TdTransceiver &transceiver, TdAccountData &account,
+                           TdTransceiver::ResponseCb response)
 {
     auto uploadRequest = td::td_api::make_object<td::td_api::preliminaryUploadFile>();
     uploadRequest->file_ = td::td_api::make_object<td::td_api::inputFileLocal>(filename);
@@ -52,6 +188,75 @@ void startDocumentUpload(ChatId chatId, const std::string &filename, PurpleXfer
     account.addPendingRequest<UploadRequest>(requestId, xfer, chatId);
 }
 
+void startDocumentUpload(ChatId chatId, const std::string &filename, PurpleXfer *xfer,
+                         TdTransceiver &transceiver, TdAccountData &account,
+                         TdTransceiver::ResponseCb response,
+                         TdTransceiver::ResponseCb sendMessageResponse)
+{
+    bool        needsHash = false;
+    std::string remoteId  = account.uploadCache.find(filename, needsHash);
+    if (!remoteId.empty())
+        sendCachedDocument(chatId, filename, remoteId, xfer, transceiver, account, sendMessageResponse);
+    else if (needsHash) {
+        // Continues in continueDocumentUpload
+        purple_xfer_ref(xfer);
+        FileHashThread *thread = new FileHashThread(account.purpleAccount, chatId, filename, xfer);
+        thread->startThread();
+    } else
+        uploadDocument(chatId, filename, xfer, transceiver, account, response);
+}
+
+void continueDocumentUpload(const FileHashThread &thread, TdTransceiver &transceiver, TdAccountData &account,
+                            TdTransceiver::ResponseCb response,
+                            TdTransceiver::ResponseCb sendMessageResponse)
+{
+    if (purple_xfer_is_canceled(thread.xfer)) {
+        // Cancelled while hashing
+        account.uploadCache.cancel(thread.path);
+    } else {
+        std::string remoteId = account.uploadCache.findByHash(thread.path, thread.getHash());
+        if (!remoteId.empty())
+            sendCachedDocument(thread.chatId, thread.path, remoteId, thread.xfer, transceiver, account,
+                               sendMessageResponse);
+        else
+            uploadDocument(thread.chatId, thread.path, thread.xfer, transceiver, account, response);
+    }
+    purple_xfer_unref(thread.xfer);
+}
+
+void finishCachedDocumentUpload(PurpleXfer *xfer, bool sent)
+{
+    if (!purple_xfer_is_canceled(xfer)) {
+        if (sent) {
+            purple_xfer_set_bytes_sent(xfer, purple_xfer_get_size(xfer));
+            purple_xfer_set_completed(xfer, TRUE);
+            purple_xfer_end(xfer);
+        } else
+            purple_xfer_cancel_remote(xfer);
+    }
+    purple_xfer_unref(xfer);
+}
+
+void FileHashThread::run()
+{
+    TRACE_SPAN("FileHashThread::run");
+    if (!UploadCache::hashFile(path, m_hash))
+        m_hash.clear();
+}
+
+FileHashThread::Callback FileHashThread::g_callback = nullptr;
+
+void FileHashThread::setCallback(AccountThread::Callback callback)
+{
+    g_callback = callback;
+}
+
+void FileHashThread::callback(PurpleTdClient *tdClient)
+{
+    if (g_callback)
+        (tdClient->*g_callback)(this);
+}
+
 static void updateDocumentUploadProgress(const td::td_api::file &file, PurpleXfer *xfer, ChatId chatId,
                                          TdTransceiver &transceiver, TdAccountData &account,
                                          TdTransceiver::ResponseCb sendMessageResponse);
@@ -64,9 +269,11 @@ void startDocumentUploadProgress(ChatId chatId, PurpleXfer *xfer, const td::td_a
         // Someone managed to cancel the upload REAL fast
         auto cancelRequest = td::td_api::make_object<td::td_api::cancelPreliminaryUploadFile>(file.id_);
         transceiver.sendQuery(std::move(cancelRequest), nullptr);
+        if (purple_xfer_get_local_filename(xfer))
+            account.uploadCache.cancel(purple_xfer_get_local_filename(xfer));
         purple_xfer_unref(xfer);
     } else {
-        purple_debug_misc(config::pluginId, "Got file id %d for uploading %s\n", (int)file.id_,
+        DEBUG_MISC("Got file id %d for uploading %s\n", (int)file.id_,
                             purple_xfer_get_local_filename(xfer));
         account.addFileTransfer(file.id_, xfer, chatId);
         updateDocumentUploadProgress(file, xfer, chatId, transceiver, account, sendMessageResponse);
@@ -75,6 +282,8 @@ void startDocumentUploadProgress(ChatId chatId, PurpleXfer *xfer, const td::td_a
 
 void uploadResponseError(PurpleXfer *xfer, const std::string &message, TdAccountData &account)
 {
+    if (purple_xfer_get_local_filename(xfer))
+        account.uploadCache.cancel(purple_xfer_get_local_filename(xfer));
     purple_xfer_cancel_remote(xfer);
     purple_xfer_error(purple_xfer_get_type(xfer), account.purpleAccount,
                       purple_xfer_get_remote_user(xfer), message.c_str());
@@ -90,36 +299,64 @@ static void updateDocumentUploadProgress(const td::td_api::file &file, PurpleXfe
     if (file.remote_) {
         if (file.remote_->is_uploading_active_) {
             if (purple_xfer_get_status(upload) != PURPLE_XFER_STATUS_STARTED) {
-                purple_debug_misc(config::pluginId, "Started uploading %s\n", purple_xfer_get_local_filename(upload));
+                DEBUG_MISC("Started uploading %s\n", purple_xfer_get_local_filename(upload));
                 purple_xfer_start(upload, -1, NULL, 0);
             }
             size_t bytesSent = std::max((td::td_api::int53)0, file.remote_->uploaded_size_);
             purple_xfer_set_bytes_sent(upload, std::min(fileSize, bytesSent));
             purple_xfer_update_progress(upload);
         } else if (file.local_ && (file.remote_->uploaded_size_ == file.local_->downloaded_size_)) {
-            purple_debug_misc(config::pluginId, "Finishing uploading %s\n", purple_xfer_get_local_filename(upload));
+            DEBUG_MISC("Finishing uploading %s\n", purple_xfer_get_local_filename(upload));
+            auto request = std::make_unique<SendMessageRequest>(0, chatId);
+            if (purple_xfer_get_local_filename(upload))
+                request->uploadPath = purple_xfer_get_local_filename(upload);
             purple_xfer_set_bytes_sent(upload, fileSize);
             purple_xfer_set_completed(upload, TRUE);
             purple_xfer_end(upload);
             purple_xfer_unref(upload);
             account.removeFileTransfer(file.id_);
-            auto sendMessageRequest = td::td_api::make_object<td::td_api::sendMessage>();
-            auto content = td::td_api::make_object<td::td_api::inputMessageDocument>();
-            content->caption_ = td::td_api::make_object<td::td_api::formattedText>();
-            content->document_ = td::td_api::make_object<td::td_api::inputFileId>(file.id_);
-            sendMessageRequest->input_message_content_ = std::move(content);
-            sendMessageRequest->chat_id_ = chatId.value();
-
-            uint64_t requestId = transceiver.sendQuery(std::move(sendMessageRequest), sendMessageResponse);
-            account.addPendingRequest<SendMessageRequest>(requestId, chatId, nullptr);
+
+            sendDocument(chatId, td::td_api::make_object<td::td_api::inputFileId>(file.id_),
+                         std::move(request), transceiver, account, sendMessageResponse);
         }
     } else {
+        if (purple_xfer_get_local_filename(upload))
+            account.uploadCache.cancel(purple_xfer_get_local_filename(upload));
         purple_xfer_cancel_remote(upload);
         purple_xfer_unref(upload);
         account.removeFileTransfer(file.id_);
     }
 }
 
+void updateUploadCache(int64_t oldMessageId, const std::string &imagePath,
+                       const td::td_api::message &message, bool sent, TdAccountData &account)
+{
+    std::string path = account.extractDocumentUpload(oldMessageId);
+    if (path.empty())
+        path = imagePath;
+    if (!sent && !path.empty())
+        account.uploadCache.cancel(path);
+    const td::td_api::file *file = nullptr;
+    if (message.content_ && (message.content_->get_id() == td::td_api::messageDocument::ID)) {
+        const auto &document = static_cast<const td::td_api::messageDocument &>(*message.content_);
+        if (document.document_ && document.document_->document_)
+            file = document.document_->document_.get();
+    } else if (message.content_ && (message.content_->get_id() == td::td_api::messagePhoto::ID)) {
+        // Any size stands for the whole photo when sending it again, largest comes last
+        const auto &photo = static_cast<const td::td_api::messagePhoto &>(*message.content_);
+        if (photo.photo_ && !photo.photo_->sizes_.empty() && photo.photo_->sizes_.back())
+            file = photo.photo_->sizes_.back()->photo_.get();
+    }
+    if (!file || !file->remote_ || file->remote_->id_.empty())
+        return;
+
+    if (!sent)
+        // Could be that server no longer knows the file, upload it next time
+        account.uploadCache.remove(file->remote_->id_);
+    else if (!path.empty())
+        account.uploadCache.add(path, file->remote_->id_);
+}
+
 struct DownloadData {
     TdAccountData *account;
     TdTransceiver *transceiver;
@@ -140,7 +377,7 @@ static void cancelDownload(PurpleXfer *xfer)
 
     int32_t fileId;
     if (data->account->getFileIdForTransfer(xfer, fileId)) {
-        purple_debug_misc(config::pluginId, "Cancelling download of %s (file id %d)\n",
+        DEBUG_MISC("Cancelling download of %s (file id %d)\n",
                             purple_xfer_get_local_filename(xfer), fileId);
         auto cancelRequest = td::td_api::make_object<td::td_api::cancelDownloadFile>();
         cancelRequest->file_id_ = fileId;
@@ -174,14 +411,12 @@ static void finishInlineDownloadProgress(DownloadRequest &downloadReq, TdAccount
     }
 }
 
-static void inlineDownloadResponse(uint64_t requestId,
-                                   td::td_api::object_ptr<td::td_api::Object> object,
-                                   TdTransceiver &transceiver, TdAccountData &account)
+static void finishInlineDownload(uint64_t requestId, const std::string &path,
+                                 TdTransceiver &transceiver, TdAccountData &account)
 {
     std::unique_ptr<DownloadRequest> request = account.getPendingRequest<DownloadRequest>(requestId);
 
     if (request) {
-        std::string path = getDownloadPath(object);
         finishInlineDownloadProgress(*request, account);
         IncomingMessage *pendingMessage = account.pendingMessages.findPendingMessage(request->chatId, request->message.id);
 
@@ -190,15 +425,14 @@ static void inlineDownloadResponse(uint64_t requestId,
             const td::td_api::file *replacementFile = nullptr;
 
             if (pendingMessage->message && pendingMessage->message->content_ &&
-                (pendingMessage->message->content_->get_id() == td::td_api::messageSticker::ID) &&
-                isStickerAnimated(path))
+                (pendingMessage->message->content_->get_id() == td::td_api::messageSticker::ID))
             {
-                if (shouldConvertAnimatedSticker(pendingMessage->messageInfo, account.purpleAccount)) {
+                if (shouldConvertSticker(path, pendingMessage->messageInfo, account.purpleAccount)) {
                     StickerConversionThread *thread;
                     thread = new StickerConversionThread(account.purpleAccount, path, getChatId(*pendingMessage->message),
                                                          &pendingMessage->messageInfo);
                     thread->startThread();
-                } else
+                } else if (isStickerAnimated(path))
                     replacementFile = pendingMessage->thumbnail.get();
             }
 
@@ -222,10 +456,73 @@ static void inlineDownloadResponse(uint64_t requestId,
     }
 }
 
+static void startQueuedInlineDownloads(TdTransceiver &transceiver, TdAccountData &account);
+
+static void inlineDownloadResponse(uint64_t queryId,
+                                   td::td_api::object_ptr<td::td_api::Object> object,
+                                   TdTransceiver &transceiver, TdAccountData &account)
+{
+    std::vector<uint64_t> requestIds;
+    account.inlineDownloads.extractRequests(queryId, requestIds);
+    std::string path = getDownloadPath(object);
+
+    for (uint64_t requestId: requestIds) {
+        transceiver.cancelQueryTimer(requestId);
+        finishInlineDownload(requestId, path, transceiver, account);
+    }
+
+    startQueuedInlineDownloads(transceiver, account);
+}
+
+static void startQueuedInlineDownloads(TdTransceiver &transceiver, TdAccountData &account)
+{
+    InlineDownloadScheduler::Download *download;
+    while ((download = account.inlineDownloads.getNextQueued()) != nullptr) {
+        td::td_api::object_ptr<td::td_api::downloadFile> downloadReq =
+            td::td_api::make_object<td::td_api::downloadFile>();
+        downloadReq->file_id_     = download->fileId;
+        downloadReq->priority_    = download->focused ? FILE_DOWNLOAD_PRIORITY_FOCUSED : FILE_DOWNLOAD_PRIORITY;
+        downloadReq->offset_      = 0;
+        downloadReq->limit_       = 0;
+        downloadReq->synchronous_ = true;
+
+        download->queryId = transceiver.sendQuery(
+            std::move(downloadReq),
+            [&transceiver, &account](uint64_t queryId, td::td_api::object_ptr<td::td_api::Object> object) {
+                inlineDownloadResponse(queryId, std::move(object), transceiver, account);
+            });
+    }
+}
+
+static bool isChatFocused(ChatId chatId, TdAccountData &account)
+{
+    const td::td_api::chat *chat = account.getChat(chatId);
+    if (!chat) return false;
+
+    PurpleConversation     *conv         = NULL;
+    const td::td_api::user *privateUser  = account.getUserByPrivateChat(*chat);
+    SecretChatId            secretChatId = getSecretChatId(*chat);
+    if (privateUser) {
+        std::string userName = getPurpleBuddyName(*privateUser);
+        conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, userName.c_str(),
+                                                     account.purpleAccount);
+    } else if (secretChatId.valid()) {
+        std::string userName = getSecretChatBuddyName(secretChatId);
+        conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, userName.c_str(),
+                                                     account.purpleAccount);
+    } else {
+        PurpleConvChat *convChat = findChatConversation(account.purpleAccount, *chat);
+        if (convChat)
+            conv = purple_conv_chat_get_conversation(convChat);
+    }
+
+    return conv && purple_conversation_has_focus(conv);
+}
+
 static void startInlineDownloadProgress(DownloadRequest &request, TdTransceiver &transceiver,
                                         TdAccountData &account)
 {
-    purple_debug_misc(config::pluginId, "Tracking download progress of file id %d: downloaded %d/%d\n",
+    DEBUG_MISC("Tracking download progress of file id %d: downloaded %d/%d\n",
         (int)request.fileId, (int)request.downloadedSize, (int)request.fileSize);
 
     char *tempFileName = NULL;
@@ -275,11 +572,16 @@ static void handleLongInlineDownload(uint64_t requestId, TdTransceiver &transcei
     if (pRequest) {
         const char *option = purple_account_get_string(account.purpleAccount, AccountOptions::DownloadBehaviour,
                                                        AccountOptions::DownloadBehaviourDefault());
-        if (!strcmp(option, AccountOptions::DownloadBehaviourHyperlink))
+        // Progress is tracked on the first request for the file, if several messages are waiting
+        // for the same download
+        if (!strcmp(option, AccountOptions::DownloadBehaviourHyperlink) &&
+            (account.findDownloadRequest(pRequest->fileId) == pRequest))
+        {
             // We didn't want inline downloads, but got one anyway because it's image or sticker.
             // At least don't get the fake file transfer going, because that tends to get bitlbee
             // and spectrum in trouble.
             startInlineDownloadProgress(*pRequest, transceiver, account);
+        }
 
         IncomingMessage *pendingMessage = account.pendingMessages.findPendingMessage(pRequest->chatId, pRequest->message.id);
         if (pendingMessage) {
@@ -310,19 +612,9 @@ void downloadFileInline(int32_t fileId, ChatId chatId, TgMessageInfo &message,
                         td::td_api::object_ptr<td::td_api::file> thumbnail,
                         TdTransceiver &transceiver, TdAccountData &account)
 {
-    td::td_api::object_ptr<td::td_api::downloadFile> downloadReq =
-        td::td_api::make_object<td::td_api::downloadFile>();
-    downloadReq->file_id_     = fileId;
-    downloadReq->priority_    = FILE_DOWNLOAD_PRIORITY;
-    downloadReq->offset_      = 0;
-    downloadReq->limit_       = 0;
-    downloadReq->synchronous_ = true;
-
-    uint64_t requestId = transceiver.sendQuery(
-        std::move(downloadReq),
-        [&transceiver, &account](uint64_t reqId, td::td_api::object_ptr<td::td_api::Object> object) {
-            inlineDownloadResponse(reqId, std::move(object), transceiver, account);
-        });
+    // The actual downloadFile query may be shared with other messages, or sent later, so the
+    // request is tracked under its own id
+    uint64_t requestId = transceiver.reserveQueryId();
     std::unique_ptr<DownloadRequest> request = std::make_unique<DownloadRequest>(requestId, chatId,
                                                message, fileId, 0, fileDescription, thumbnail.release());
 
@@ -331,6 +623,95 @@ void downloadFileInline(int32_t fileId, ChatId chatId, TgMessageInfo &message,
                               [&transceiver, &account](uint64_t reqId, td::td_api::object_ptr<td::td_api::Object>) {
                                   handleLongInlineDownload(reqId, transceiver, account);
                               }, 1, false);
+
+    if (!account.inlineDownloads.add(fileId, requestId, isChatFocused(chatId, account)))
+        DEBUG_MISC("File id %d is already being downloaded\n", (int)fileId);
+    startQueuedInlineDownloads(transceiver, account);
+}
+
+enum {
+    DOWNLOAD_STREAM_CHUNK = 1048576,
+};
+
+// Writes next chunk of downloaded prefix. Returns false once there is nothing more to write, or if
+// writing failed, in which case PurpleXfer has been cancelled.
+static bool streamDownloadChunk(PurpleXfer *xfer, DownloadRequest &request)
+{
+    if ((request.streamedSize >= request.streamAvailable) || !request.streamFile ||
+        (fseeko(request.streamFile, request.streamedSize, SEEK_SET) != 0))
+    {
+        return false;
+    }
+
+    size_t chunkSize = std::min<int64_t>(request.streamAvailable - request.streamedSize,
+                                         DOWNLOAD_STREAM_CHUNK);
+    std::vector<uint8_t> buffer(chunkSize);
+    size_t bytesRead = fread(buffer.data(), 1, chunkSize, request.streamFile);
+    if ((bytesRead == 0) || !purple_xfer_write_file(xfer, buffer.data(), bytesRead))
+        return false;
+    request.streamedSize += bytesRead;
+
+    return true;
+}
+
+static gboolean streamDownloadIdle(void *data)
+{
+    DownloadRequest *request = static_cast<DownloadRequest *>(data);
+    PurpleXfer      *xfer    = request->streamXfer;
+    TRACE_SPAN("streamDownload", "offset", request->streamedSize);
+
+    if (!purple_xfer_is_canceled(xfer) && streamDownloadChunk(xfer, *request))
+        return G_SOURCE_CONTINUE;
+
+    request->streamSource = 0;
+    request->streamXfer   = NULL;
+    purple_xfer_unref(xfer);
+    return G_SOURCE_REMOVE;
+}
+
+// Returns false if writing failed, in which case PurpleXfer has been cancelled and freed
+static bool streamDownload(const td::td_api::file &file, PurpleXfer *xfer, DownloadRequest &request)
+{
+    if (!file.local_ || file.local_->path_.empty() ||
+        (file.local_->downloaded_prefix_size_ <= request.streamedSize))
+    {
+        return true;
+    }
+
+    // tdlib moves the file when download completes
+    if (request.streamFile && (request.streamPath != file.local_->path_)) {
+        fclose(request.streamFile);
+        request.streamFile = NULL;
+    }
+    if (!request.streamFile) {
+        request.streamFile = fopen(file.local_->path_.c_str(), "r");
+        if (!request.streamFile) {
+            DEBUG_MISC("Cannot stream download from %s: %s\n",
+                       file.local_->path_.c_str(), strerror(errno));
+            return true;
+        }
+        request.streamPath = file.local_->path_;
+    }
+
+    // Progress reported so far was tdlib's downloaded size, now it's what was written.
+    // Everything downloaded so far is written one chunk per idle callback, so that a fast download
+    // doesn't stall the main loop; whatever is left when download completes is written then.
+    request.streamAvailable = file.local_->downloaded_prefix_size_;
+    if (request.streamSource)
+        return true;
+    purple_xfer_set_bytes_sent(xfer, request.streamedSize);
+    purple_xfer_ref(xfer);
+    request.streamXfer = xfer;
+    if (AccountThread::isSingleThread()) {
+        purple_xfer_ref(xfer);
+        while (streamDownloadIdle(&request) == G_SOURCE_CONTINUE) ;
+        bool canceled = purple_xfer_is_canceled(xfer);
+        purple_xfer_unref(xfer);
+        return !canceled;
+    } else
+        request.streamSource = g_idle_add(streamDownloadIdle, &request);
+
+    return true;
 }
 
 static void updateDownloadProgress(const td::td_api::file &file, PurpleXfer *xfer, TdAccountData &account)
@@ -358,8 +739,16 @@ static void updateDownloadProgress(const td::td_api::file &file, PurpleXfer *xfe
                 purple_xfer_start(xfer, -1, NULL, 0);
         }
 
-        purple_xfer_set_bytes_sent(xfer, downloadedSize);
-        purple_xfer_update_progress(xfer);
+        if (downloadReq->streaming && (purple_xfer_get_status(xfer) == PURPLE_XFER_STATUS_STARTED) &&
+            !streamDownload(file, xfer, *downloadReq))
+        {
+            return;
+        }
+        // Once streaming has begun, purple_xfer_write_file keeps track of progress
+        if (downloadReq->streamAvailable == 0) {
+            purple_xfer_set_bytes_sent(xfer, downloadedSize);
+            purple_xfer_update_progress(xfer);
+        }
     }
 
     downloadReq->fileSize = fileSize;
@@ -384,29 +773,31 @@ std::string getDownloadPath(const td::td_api::object_ptr<td::td_api::Object> &do
     if (downloadResponse && (downloadResponse->get_id() == td::td_api::file::ID)) {
         const td::td_api::file &file = static_cast<const td::td_api::file &>(*downloadResponse);
         if (!file.local_)
-            purple_debug_warning(config::pluginId, "No local file info after downloading\n");
+            DEBUG_WARNING("No local file info after downloading\n");
         else if (!file.local_->is_downloading_completed_)
-            purple_debug_warning(config::pluginId, "File not completely downloaded\n");
+            DEBUG_WARNING("File not completely downloaded\n");
         else
             return file.local_->path_;
     } else {
         std::string message = getDisplayedError(downloadResponse);
-        purple_debug_warning(config::pluginId, "Error downloading file: %s\n", message.c_str());
+        DEBUG_WARNING("Error downloading file: %s\n", message.c_str());
     }
 
     return "";
 }
 
 struct DownloadWrapup {
-    PurpleXfer *download;
-    FILE       *tdlibFile;
-    std::string tdlibPath;
+    PurpleXfer          *download;
+    FILE                *tdlibFile;
+    std::string          tdlibPath;
+    std::vector<uint8_t> buffer;
 };
 
 static gboolean wrapupDownload(void *data)
 {
     DownloadWrapup *wrapupData = static_cast<DownloadWrapup *>(data);
     unsigned chunkSize = AccountThread::isSingleThread() ? 10 : 1048576;
+    TRACE_SPAN("wrapupDownload", "offset", purple_xfer_get_bytes_sent(wrapupData->download));
 
     bool last = false;
     if (!purple_xfer_is_canceled(wrapupData->download)) {
@@ -415,22 +806,23 @@ static gboolean wrapupDownload(void *data)
             chunkSize = purple_xfer_get_size(wrapupData->download) - purple_xfer_get_bytes_sent(wrapupData->download);
         }
 
-        uint8_t *buf = new uint8_t[chunkSize];
+        if (wrapupData->buffer.size() < chunkSize)
+            wrapupData->buffer.resize(chunkSize);
+        uint8_t *buf = wrapupData->buffer.data();
         unsigned bytesRead = fread(buf, 1, chunkSize, wrapupData->tdlibFile);
         if (bytesRead < chunkSize) {
             // Unlikely error message not worth translating
             std::string message = formatMessage("Failed to download {}: error reading {} after {} bytes",
-                                                {purple_xfer_get_local_filename(wrapupData->download),
+                                                purple_xfer_get_local_filename(wrapupData->download),
                                                 wrapupData->tdlibPath,
-                                                std::to_string(purple_xfer_get_bytes_sent(wrapupData->download) + bytesRead)});
-            purple_debug_warning(config::pluginId, "%s\n", message.c_str());
+                                                purple_xfer_get_bytes_sent(wrapupData->download) + bytesRead);
+            DEBUG_WARNING("%s\n", message.c_str());
             purple_xfer_error(PURPLE_XFER_RECEIVE, purple_xfer_get_account(wrapupData->download),
                               wrapupData->download->who, message.c_str());
             last = true;
         }
 
         purple_xfer_write_file(wrapupData->download, buf, bytesRead);
-        delete[] buf;
 
         if (last) {
             purple_xfer_set_completed(wrapupData->download, TRUE);
@@ -448,6 +840,181 @@ static gboolean wrapupDownload(void *data)
         return G_SOURCE_CONTINUE;
 }
 
+#ifdef HAVE_COPY_FILE_RANGE
+
+enum {
+    DOWNLOAD_COPY_CHUNK         = 16*1048576,
+    DOWNLOAD_COPY_POLL_INTERVAL = 200, // milliseconds
+};
+
+// Fast path for completing standard downloads: tdlib file is copied into the transfer destination
+// on a worker thread with copy_file_range, so the data does not pass through user space (and
+// filesystems supporting reflinks don't copy it at all). Main thread only polls for progress.
+struct DownloadCopy {
+    PurpleXfer           *download;
+    std::string           tdlibPath;
+    std::string           localPath;
+    int                   sourceFd;
+    int                   destFd;
+    uint64_t              size;
+    std::atomic<uint64_t> copied{0};
+    std::atomic<bool>     canceled{false};
+    std::atomic<bool>     finished{false};
+    // Written by worker thread before setting finished
+    std::string           errorMessage;
+    std::thread           thread;
+};
+
+static bool writeAll(int fd, const uint8_t *data, size_t size, off_t offset)
+{
+    while (size > 0) {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data   += written;
+        size   -= written;
+        offset += written;
+    }
+    return true;
+}
+
+static void copyDownload(DownloadCopy *copy)
+{
+    loff_t               inOffset  = copy->copied;
+    loff_t               outOffset = copy->copied;
+    bool                 readWrite = false;
+    std::vector<uint8_t> buffer;
+
+    while (((uint64_t)inOffset < copy->size) && !copy->canceled) {
+        size_t  chunkSize = std::min<uint64_t>(copy->size - inOffset, DOWNLOAD_COPY_CHUNK);
+        ssize_t result;
+
+        if (!readWrite) {
+            result = copy_file_range(copy->sourceFd, &inOffset, copy->destFd, &outOffset, chunkSize, 0);
+            // Older kernels and some filesystems can't do it, at least not across filesystems
+            if ((result < 0) &&
+                ((errno == ENOSYS) || (errno == EXDEV) || (errno == EINVAL) || (errno == EOPNOTSUPP)))
+            {
+                readWrite = true;
+                continue;
+            }
+        } else {
+            buffer.resize(chunkSize);
+            result = pread(copy->sourceFd, buffer.data(), chunkSize, inOffset);
+            if (result > 0) {
+                if (writeAll(copy->destFd, buffer.data(), result, outOffset)) {
+                    inOffset  += result;
+                    outOffset += result;
+                } else
+                    result = -1;
+            }
+        }
+
+        if ((result < 0) && (errno == EINTR))
+            continue;
+        if (result <= 0) {
+            // Unlikely error message not worth translating
+            copy->errorMessage = formatMessage("Failed to download {}: error copying {} after {} bytes: {}",
+                                               copy->localPath, copy->tdlibPath, inOffset,
+                                               (result < 0) ? strerror(errno) : "unexpected end of file");
+            break;
+        }
+        copy->copied = inOffset;
+    }
+
+    copy->finished = true;
+}
+
+static gboolean pollDownloadCopy(void *data)
+{
+    DownloadCopy *copy = static_cast<DownloadCopy *>(data);
+
+    if (purple_xfer_is_canceled(copy->download))
+        copy->canceled = true;
+    else {
+        purple_xfer_set_bytes_sent(copy->download, copy->copied);
+        purple_xfer_update_progress(copy->download);
+    }
+
+    if (!copy->finished)
+        return G_SOURCE_CONTINUE;
+
+    if (copy->thread.joinable())
+        copy->thread.join();
+    close(copy->sourceFd);
+    close(copy->destFd);
+
+    if (!purple_xfer_is_canceled(copy->download)) {
+        if (copy->errorMessage.empty()) {
+            purple_xfer_set_completed(copy->download, TRUE);
+            purple_xfer_end(copy->download);
+        } else {
+            DEBUG_WARNING("%s\n", copy->errorMessage.c_str());
+            purple_xfer_error(PURPLE_XFER_RECEIVE, purple_xfer_get_account(copy->download),
+                              copy->download->who, copy->errorMessage.c_str());
+            purple_xfer_cancel_local(copy->download);
+        }
+    }
+
+    purple_xfer_unref(copy->download);
+    delete copy;
+    return G_SOURCE_REMOVE;
+}
+
+static bool startDownloadCopy(PurpleXfer *download, FILE *tdlibFile, const std::string &tdlibPath,
+                              int64_t offset)
+{
+    // dest_fp is not opened if UI does its own writing, which only purple_xfer_write_file can feed
+    if (!download->dest_fp)
+        return false;
+
+    // Anything already streamed must be on disk before writing past it
+    if (fflush(download->dest_fp) != 0)
+        return false;
+    int sourceFd = dup(fileno(tdlibFile));
+    if (sourceFd < 0)
+        return false;
+    // Separate descriptor, because libpurple closes dest_fp if transfer is cancelled meanwhile
+    int destFd = dup(fileno(download->dest_fp));
+    if (destFd < 0) {
+        close(sourceFd);
+        return false;
+    }
+
+    DEBUG_MISC("Copying %s to %s on worker thread\n", tdlibPath.c_str(),
+               purple_xfer_get_local_filename(download));
+    DownloadCopy *copy = new DownloadCopy;
+    copy->download  = download;
+    copy->tdlibPath = tdlibPath;
+    copy->localPath = purple_xfer_get_local_filename(download);
+    copy->sourceFd  = sourceFd;
+    copy->destFd    = destFd;
+    copy->size      = purple_xfer_get_size(download);
+    copy->copied    = offset;
+    purple_xfer_ref(download);
+    if (AccountThread::isSingleThread()) {
+        copyDownload(copy);
+        while (pollDownloadCopy(copy) == G_SOURCE_CONTINUE) ;
+    } else {
+        copy->thread = std::thread(copyDownload, copy);
+        g_timeout_add(DOWNLOAD_COPY_POLL_INTERVAL, pollDownloadCopy, copy);
+    }
+
+    return true;
+}
+
+#else
+
+static bool startDownloadCopy(PurpleXfer *download, FILE *tdlibFile, const std::string &tdlibPath,
+                              int64_t offset)
+{
+    return false;
+}
+
+#endif
+
 static void standardDownloadResponse(TdAccountData *account, uint64_t requestId,
                                      td::td_api::object_ptr<td::td_api::Object> object)
 {
@@ -468,34 +1035,40 @@ static void standardDownloadResponse(TdAccountData *account, uint64_t requestId,
             f = fopen(path.c_str(), "r");
 
         if (f) {
-            purple_xfer_set_bytes_sent(download, 0);
-            long fileSize;
-            if (fseek(f, 0, SEEK_END) == 0) {
-                fileSize = ftell(f);
-                if (fileSize >= 0)
+            // Part of the file may have already been passed on while downloading
+            int64_t offset = request->streamedSize;
+            purple_xfer_set_bytes_sent(download, offset);
+            off_t fileSize;
+            if (fseeko(f, 0, SEEK_END) == 0) {
+                fileSize = ftello(f);
+                if (fileSize >= offset)
                     purple_xfer_set_size(download, fileSize);
-                fseek(f, 0, SEEK_SET);
+                fseeko(f, offset, SEEK_SET);
             }
 
-            DownloadWrapup *idleData = new DownloadWrapup;
-            idleData->download = download;
-            idleData->tdlibFile = f;
-            idleData->tdlibPath = path;
-            purple_xfer_ref(download);
-            if (AccountThread::isSingleThread()) {
-                while (wrapupDownload(idleData) == G_SOURCE_CONTINUE) ;
-            } else
-                g_idle_add(wrapupDownload, idleData);
+            if (startDownloadCopy(download, f, path, offset))
+                fclose(f);
+            else {
+                DownloadWrapup *idleData = new DownloadWrapup;
+                idleData->download = download;
+                idleData->tdlibFile = f;
+                idleData->tdlibPath = path;
+                purple_xfer_ref(download);
+                if (AccountThread::isSingleThread()) {
+                    while (wrapupDownload(idleData) == G_SOURCE_CONTINUE) ;
+                } else
+                    g_idle_add(wrapupDownload, idleData);
+            }
         } else {
             if (!path.empty()) {
                 // Unlikely error message not worth translating
-                std::string message = formatMessage("Failed to open {}: {}", {path, std::string(strerror(errno))});
-                purple_debug_misc(config::pluginId, "%s\n", message.c_str());
+                std::string message = formatMessage("Failed to open {}: {}", path, strerror(errno));
+                DEBUG_MISC("%s\n", message.c_str());
                 purple_xfer_error(PURPLE_XFER_RECEIVE, account->purpleAccount, download->who, message.c_str());
             }
             if (path.empty())
-                purple_debug_warning(config::pluginId, "Incomplete file in download response for %s\n",
-                                     purple_xfer_get_local_filename(download));
+                DEBUG_WARNING("Incomplete file in download response for %s\n",
+                              purple_xfer_get_local_filename(download));
             purple_xfer_cancel_remote(download);
         }
     }
@@ -524,6 +1097,7 @@ static void startStandardDownload(PurpleXfer *xfer)
         std::unique_ptr<DownloadRequest> request = std::make_unique<DownloadRequest>(requestId,
                                                         ChatId::invalid,
                                                         messageInfo, fileId, 0, "", nullptr);
+        request->streaming = true;
         data->account->addPendingRequest<DownloadRequest>(requestId, std::move(request));
         // Start immediately, because standardDownloadResponse will call purple_xfer_write_file, which
         // will fail if purple_xfer_start hasn't been called
@@ -2,15 +2,52 @@
 #define _FILE_TRANSFER_H
 
 #include "account-data.h"
+#include "client-utils.h"
 
 enum {
-    FILE_DOWNLOAD_PRIORITY       = 1,
+    FILE_DOWNLOAD_PRIORITY         = 1,
+    FILE_DOWNLOAD_PRIORITY_FOCUSED = 16,
 };
 
-bool saveImage(int id, char **fileName);
+// Writes image from imgstore to a file to upload, or if it was sent before, returns empty string
+// and sets remoteId instead. Both are empty on failure.
+std::string saveImage(int id, TdAccountData &account, std::string &remoteId);
+void        releaseImageFile(const std::string &path, TdAccountData &account);
+// Removes image files left over from an earlier run, e.g. after a crash. Does anything only for the
+// first account to connect, before any image could be in use.
+void        removeStaleImageFiles();
 void startDocumentUpload(ChatId chatId, const std::string &filename, PurpleXfer *xfer,
                          TdTransceiver &transceiver, TdAccountData &account,
-                         TdTransceiver::ResponseCb response);
+                         TdTransceiver::ResponseCb response,
+                         TdTransceiver::ResponseCb sendMessageResponse);
+// Hashes file to be sent for upload cache lookup, which is too slow for main thread
+class FileHashThread: public AccountThread {
+public:
+    const ChatId      chatId;
+    const std::string path;
+    PurpleXfer *const xfer;
+
+    FileHashThread(PurpleAccount *purpleAccount, ChatId chatId, const std::string &path, PurpleXfer *xfer)
+    : AccountThread(purpleAccount), chatId(chatId), path(path), xfer(xfer) {}
+
+    // Empty if the file could not be read
+    const std::string &getHash() const { return m_hash; }
+
+    static void setCallback(Callback callback);
+private:
+    std::string m_hash;
+
+    static Callback g_callback;
+    void run() override;
+    void callback(PurpleTdClient *tdClient) override;
+};
+
+void continueDocumentUpload(const FileHashThread &thread, TdTransceiver &transceiver, TdAccountData &account,
+                            TdTransceiver::ResponseCb response,
+                            TdTransceiver::ResponseCb sendMessageResponse);
+void finishCachedDocumentUpload(PurpleXfer *xfer, bool sent);
+void updateUploadCache(int64_t oldMessageId, const std::string &imagePath,
+                       const td::td_api::message &message, bool sent, TdAccountData &account);
 void uploadResponseError(PurpleXfer *xfer, const std::string &message, TdAccountData &account);
 void startDocumentUploadProgress(ChatId chatId, PurpleXfer *xfer, const td::td_api::file &file,
                                  TdTransceiver &transceiver, TdAccountData &account,
@@ -1,19 +1,17 @@
 #include "format.h"
-#include <fmt/format.h>
+#include <string.h>
 
-std::string formatMessage(const char *fmt, std::initializer_list<std::string> args)
+void formatMessageTo(fmt::memory_buffer &buffer, const char *fmt, fmt::format_args args)
 {
-    fmt::dynamic_format_arg_store<fmt::format_context> fa;
-
-    for (const std::string &arg: args)
-        fa.push_back(arg);
-
-    return fmt::vformat(fmt, fa);
-}
-
-std::string formatMessage(const char *fmt, const std::string &s)
-{
-    return formatMessage(fmt, {s});
+    try {
+        fmt::vformat_to(buffer, fmt, args);
+    } catch (const fmt::format_error &e) {
+        // The untranslated string is not known here, so broken translation is shown with its
+        // placeholders still in it
+        DEBUG_WARNING("Broken format string '%s': %s\n", fmt, e.what());
+        buffer.clear();
+        buffer.append(fmt, fmt + strlen(fmt));
+    }
 }
 
 std::string formatDuration(int32_t seconds)
@@ -26,8 +24,8 @@ std::string formatDuration(int32_t seconds)
     return fmt::format(_("{:02}:{:02}:{:02}"), hours, minutes, seconds);
 }
 
-void purpleDebug(const char *fmt, std::initializer_list<std::string> args)
+void purpleDebugBuffer(fmt::memory_buffer &buffer)
 {
-    std::string message = formatMessage(fmt, args);
-    purple_debug_misc(config::pluginId, "%s\n", message.c_str());
+    buffer.push_back('\0');
+    DebugLog::write(PURPLE_DEBUG_MISC, "%s\n", buffer.data());
 }
@@ -3,27 +3,42 @@
 
 #include <string>
 #include <purple.h>
+#include <fmt/format.h>
 #include "translate.h"
 #include "config.h"
+#include "debug-log.h"
 
-std::string formatMessage(const char *fmt, std::initializer_list<std::string> args);
-std::string formatMessage(const char *fmt, const std::string &s);
+// Non-template part of the functions below. Format string is often a translation and so can only
+// be checked at run time: if it is broken, it is output as is, placeholders included, rather than
+// throwing, and a warning is logged.
+void formatMessageTo(fmt::memory_buffer &buffer, const char *fmt, fmt::format_args args);
+void purpleDebugBuffer(fmt::memory_buffer &buffer);
 
-template<typename T>
-std::string formatMessage(const char *fmt, T arg)
+// Arguments are passed to fmt as they are, so numbers need no std::to_string and strings are not
+// copied. Formatting happens in a stack buffer, leaving only the result to allocate.
+template<typename... Args>
+std::string formatMessage(const char *fmt, const Args &... args)
 {
-    return formatMessage(fmt, {std::to_string(arg)});
+    fmt::memory_buffer buffer;
+    formatMessageTo(buffer, fmt, fmt::make_format_args(args...));
+    return std::string(buffer.data(), buffer.size());
 }
 
 std::string formatDuration(int32_t seconds);
 
-void purpleDebug(const char *fmt, std::initializer_list<std::string> args);
-
-template<typename T>
-void purpleDebug(const char *fmt, T arg)
+template<typename... Args>
+void purpleDebugFormatted(const char *fmt, const Args &... args)
 {
-    std::string message = formatMessage(fmt, arg);
-    purple_debug_misc(config::pluginId, "%s\n", message.c_str());
+    fmt::memory_buffer buffer;
+    formatMessageTo(buffer, fmt, fmt::make_format_args(args...));
+    purpleDebugBuffer(buffer);
 }
 
+// A macro so that arguments are not even evaluated unless the message goes somewhere
+#define purpleDebug(...) \
+    do { \
+        if (DebugLog::enabled(PURPLE_DEBUG_MISC)) \
+            purpleDebugFormatted(__VA_ARGS__); \
+    } while (0)
+
 #endif
@@ -0,0 +1,615 @@
+#include "html-parser.h"
+#include "config.h"
+#include "debug-log.h"
+#include <purple.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+enum class EntityKind {
+    Bold,
+    Italic,
+    Underline,
+    Strikethrough,
+    Code,
+    Pre,
+    TextUrl
+};
+
+struct TagInfo {
+    const char *name;
+    EntityKind  kind;
+};
+
+const TagInfo entityTags[] = {
+    {"b",      EntityKind::Bold},
+    {"strong", EntityKind::Bold},
+    {"i",      EntityKind::Italic},
+    {"em",     EntityKind::Italic},
+    {"u",      EntityKind::Underline},
+    {"s",      EntityKind::Strikethrough},
+    {"strike", EntityKind::Strikethrough},
+    {"del",    EntityKind::Strikethrough},
+    {"code",   EntityKind::Code},
+    {"tt",     EntityKind::Code},
+    {"pre",    EntityKind::Pre},
+    {"a",      EntityKind::TextUrl},
+};
+
+// Offsets are in bytes within current text run
+struct Entity {
+    EntityKind  kind;
+    size_t      start;
+    size_t      end;
+    std::string url;
+};
+
+class HtmlParser {
+public:
+    HtmlParser(unsigned maxMessageLength, unsigned maxCaptionLength, std::vector<MessagePart> &parts)
+    : m_maxMessageLength(maxMessageLength), m_maxCaptionLength(maxCaptionLength), m_parts(parts) {}
+
+    void parse(const char *message);
+private:
+    unsigned                  m_maxMessageLength;
+    unsigned                  m_maxCaptionLength;
+    std::vector<MessagePart> &m_parts;
+    // Text between images, and entities found in it so far
+    std::string               m_text;
+    std::vector<Entity>       m_entities;
+    std::vector<Entity>       m_openEntities;
+
+    const char *parseTag(const char *s);
+    const char *parseCharRef(const char *s, std::string &dest);
+    void        openEntity(EntityKind kind, const char *attributes, const char *tagEnd);
+    void        closeEntity(EntityKind kind);
+    void        flushText();
+    size_t      splitTextChunk(bool isImage, size_t start, size_t &textLength);
+    void        addEntities(MessagePart &part, size_t start, size_t end);
+};
+
+}
+
+size_t getUtf16Length(const char *text, size_t length)
+{
+    size_t result = 0;
+    for (size_t i = 0; i < length; i++) {
+        uint8_t c = text[i];
+        // Count leading bytes; 4-byte sequences are surrogate pairs in UTF-16
+        if ((c & 0xC0) != 0x80)
+            result++;
+        if (c >= 0xF0)
+            result++;
+    }
+
+    return result;
+}
+
+static bool isTagName(const char *s, size_t length, const char *name)
+{
+    return (strlen(name) == length) && !g_ascii_strncasecmp(s, name, length);
+}
+
+static bool parseImageTag(const char *s, int &imageId, const char *&pastImage)
+{
+    if (g_ascii_strncasecmp(s, "<img id=\"", 9))
+        return false;
+
+    const char *idString = s+9;
+    char       *idEnd;
+    long        id = strtol(idString, &idEnd, 10);
+    if ((idEnd == idString) || strncmp(idEnd, "\">", 2) || (id > INT32_MAX) || (id < INT32_MIN))
+        return false;
+
+    imageId   = id;
+    pastImage = idEnd + 2;
+    if (*pastImage == '\n')
+        pastImage++;
+    return true;
+}
+
+void HtmlParser::parse(const char *message)
+{
+    m_parts.clear();
+    if (!message)
+        return;
+
+    m_text.reserve(strlen(message));
+    const char *s = message;
+    while (*s) {
+        size_t plainLength = strcspn(s, "<&");
+        m_text.append(s, plainLength);
+        s += plainLength;
+
+        if (*s == '<')
+            s = parseTag(s);
+        else if (*s == '&')
+            s = parseCharRef(s, m_text);
+    }
+
+    flushText();
+}
+
+const char *HtmlParser::parseTag(const char *s)
+{
+    int         imageId;
+    const char *pastImage;
+    if (parseImageTag(s, imageId, pastImage)) {
+        flushText();
+        m_parts.emplace_back();
+        m_parts.back().isImage = true;
+        m_parts.back().imageId = imageId;
+        return pastImage;
+    }
+
+    const char *tagEnd = strchr(s, '>');
+    if (!tagEnd) {
+        // Not a tag after all
+        m_text += *s;
+        return s+1;
+    }
+
+    const char *name      = s+1;
+    bool        isClosing = (*name == '/');
+    if (isClosing)
+        name++;
+    size_t nameLength = 0;
+    while (g_ascii_isalnum(name[nameLength]))
+        nameLength++;
+
+    if (isTagName(name, nameLength, "br")) {
+        m_text += '\n';
+        return tagEnd+1;
+    }
+
+    for (const TagInfo &tag: entityTags)
+        if (isTagName(name, nameLength, tag.name)) {
+            if (isClosing)
+                closeEntity(tag.kind);
+            else
+                openEntity(tag.kind, name+nameLength, tagEnd);
+            break;
+        }
+
+    // Other tags are dropped, keeping text inside them
+    return tagEnd+1;
+}
+
+const char *HtmlParser::parseCharRef(const char *s, std::string &dest)
+{
+    static const struct {
+        const char *name;
+        const char *text;
+    } namedRefs[] = {
+        {"&amp;",  "&"},
+        {"&lt;",   "<"},
+        {"&gt;",   ">"},
+        {"&quot;", "\""},
+        {"&apos;", "'"},
+        {"&nbsp;", " "},
+    };
+
+    for (const auto &ref: namedRefs) {
+        size_t refLength = strlen(ref.name);
+        if (!strncmp(s, ref.name, refLength)) {
+            dest += ref.text;
+            return s + refLength;
+        }
+    }
+
+    if (s[1] == '#') {
+        bool        hex  = (s[2] == 'x') || (s[2] == 'X');
+        const char *code = s + (hex ? 3 : 2);
+        char       *codeEnd;
+        long        c    = strtol(code, &codeEnd, hex ? 16 : 10);
+        if ((codeEnd != code) && (*codeEnd == ';') && (c > 0) && g_unichar_validate(c)) {
+            char utf8[6];
+            dest.append(utf8, g_unichar_to_utf8(c, utf8));
+            return codeEnd+1;
+        }
+    }
+
+    dest += '&';
+    return s+1;
+}
+
+void HtmlParser::openEntity(EntityKind kind, const char *attributes, const char *tagEnd)
+{
+    Entity entity;
+    entity.kind  = kind;
+    entity.start = m_text.size();
+
+    if (kind == EntityKind::TextUrl) {
+        std::string tagText(attributes, tagEnd);
+        size_t      pos = tagText.find("href=");
+        if ((pos == std::string::npos) || (pos+5 >= tagText.size()))
+            return;
+        char   quote    = tagText[pos+5];
+        size_t urlStart = pos+6;
+        size_t urlEnd   = tagText.find(quote, urlStart);
+        if (((quote != '"') && (quote != '\'')) || (urlEnd == std::string::npos))
+            return;
+
+        tagText[urlEnd] = '\0';
+        for (const char *s = tagText.c_str() + urlStart; *s; ) {
+            if (*s == '&')
+                s = parseCharRef(s, entity.url);
+            else
+                entity.url += *s++;
+        }
+        if (entity.url.empty())
+            return;
+    }
+
+    m_openEntities.push_back(std::move(entity));
+}
+
+void HtmlParser::closeEntity(EntityKind kind)
+{
+    auto it = std::find_if(m_openEntities.rbegin(), m_openEntities.rend(), [kind](const Entity &entity) {
+        return (entity.kind == kind);
+    });
+    if (it == m_openEntities.rend())
+        return;
+
+    it->end = m_text.size();
+    // Links to their own text, as inserted by pidgin for plain URLs, are auto-detected anyway
+    bool isPlainLink = (kind == EntityKind::TextUrl) &&
+                       (m_text.compare(it->start, it->end - it->start, it->url) == 0);
+    if ((it->end > it->start) && !isPlainLink)
+        m_entities.push_back(std::move(*it));
+    m_openEntities.erase(std::next(it).base());
+}
+
+void HtmlParser::flushText()
+{
+    // Formatting continues in the caption after an image
+    for (Entity &entity: m_openEntities) {
+        if (m_text.size() > entity.start) {
+            m_entities.push_back(entity);
+            m_entities.back().end = m_text.size();
+        }
+        entity.start = 0;
+    }
+
+    if (!m_text.empty()) {
+        if (m_parts.empty())
+            m_parts.emplace_back();
+        std::stable_sort(m_entities.begin(), m_entities.end(), [](const Entity &a, const Entity &b) {
+            return (a.start < b.start);
+        });
+
+        size_t pos = 0;
+        while (pos < m_text.size()) {
+            MessagePart &part = m_parts.back();
+            size_t       textLength;
+            size_t       chunkLength = splitTextChunk(part.isImage, pos, textLength);
+            part.text.assign(m_text, pos, textLength);
+            addEntities(part, pos, pos+textLength);
+            pos += chunkLength;
+            if (pos < m_text.size())
+                m_parts.emplace_back();
+        }
+    }
+
+    m_text.clear();
+    m_entities.clear();
+}
+
+size_t HtmlParser::splitTextChunk(bool isImage, size_t start, size_t &textLength)
+{
+    enum {MIN_LENGTH_LIMIT = 8};
+    const char *text   = m_text.c_str() + start;
+    size_t      length = m_text.size() - start;
+
+    unsigned lengthLimit = isImage ? m_maxCaptionLength : m_maxMessageLength;
+    if (lengthLimit == 0)
+        DEBUG_WARNING("No %s length limit\n", isImage ? "caption" : "message");
+    else if (lengthLimit <= MIN_LENGTH_LIMIT)
+        DEBUG_WARNING("%u is a ridiculous %s length limit\n",
+                      lengthLimit, isImage ? "caption" : "message");
+    // Byte count is never smaller than UTF-16 length, so this is the common case
+    if ((lengthLimit <= MIN_LENGTH_LIMIT) || (length <= lengthLimit)) {
+        textLength = length;
+        return length;
+    }
+
+    // Limits are in UTF-16 code units. Find how many bytes of whole characters fit, and where a
+    // chunk ending in a line break may start being accepted (no lower length limit in case of image
+    // caption).
+    unsigned newlineSplitLowerLimit = isImage ? 1 : lengthLimit/2;
+    size_t   limitPos      = 0;
+    size_t   lowerLimitPos = 0;
+    size_t   utf16Length   = 0;
+    while (limitPos < length) {
+        size_t charLength = 1;
+        while ((limitPos + charLength < length) && ((text[limitPos + charLength] & 0xC0) == 0x80))
+            charLength++;
+        size_t charUtf16Length = getUtf16Length(text + limitPos, charLength);
+        if (utf16Length + charUtf16Length > lengthLimit)
+            break;
+        utf16Length += charUtf16Length;
+        limitPos    += charLength;
+        if ((lowerLimitPos == 0) && (utf16Length >= newlineSplitLowerLimit))
+            lowerLimitPos = limitPos;
+    }
+    if (limitPos == length) {
+        textLength = length;
+        return length;
+    }
+
+    // Try to truncate at a line break
+    if (lowerLimitPos != 0)
+        for (size_t chunkLength = limitPos; chunkLength >= lowerLimitPos; chunkLength--)
+            if (text[chunkLength-1] == '\n') {
+                textLength = chunkLength-1;
+                return chunkLength;
+            }
+
+    textLength = limitPos;
+    return limitPos;
+}
+
+static td::td_api::object_ptr<td::td_api::TextEntityType> makeEntityType(const Entity &entity)
+{
+    switch (entity.kind) {
+    case EntityKind::Bold:
+        return td::td_api::make_object<td::td_api::textEntityTypeBold>();
+    case EntityKind::Italic:
+        return td::td_api::make_object<td::td_api::textEntityTypeItalic>();
+    case EntityKind::Underline:
+        return td::td_api::make_object<td::td_api::textEntityTypeUnderline>();
+    case EntityKind::Strikethrough:
+        return td::td_api::make_object<td::td_api::textEntityTypeStrikethrough>();
+    case EntityKind::Code:
+        return td::td_api::make_object<td::td_api::textEntityTypeCode>();
+    case EntityKind::Pre:
+        return td::td_api::make_object<td::td_api::textEntityTypePre>();
+    case EntityKind::TextUrl:
+        return td::td_api::make_object<td::td_api::textEntityTypeTextUrl>(entity.url);
+    }
+
+    return nullptr;
+}
+
+void HtmlParser::addEntities(MessagePart &part, size_t start, size_t end)
+{
+    // Entities are sorted by start, so UTF-16 offset can be counted incrementally
+    size_t bytePos  = start;
+    size_t utf16Pos = 0;
+    for (const Entity &entity: m_entities) {
+        size_t entityStart = std::max(entity.start, start);
+        size_t entityEnd   = std::min(entity.end, end);
+        if (entityStart >= entityEnd)
+            continue;
+
+        utf16Pos += getUtf16Length(m_text.c_str() + bytePos, entityStart - bytePos);
+        bytePos   = entityStart;
+        size_t utf16Length = getUtf16Length(m_text.c_str() + entityStart, entityEnd - entityStart);
+        part.entities.push_back(td::td_api::make_object<td::td_api::textEntity>(utf16Pos, utf16Length,
+                                                                                makeEntityType(entity)));
+    }
+}
+
+void parseOutgoingHtml(const char *message, unsigned maxMessageLength, unsigned maxCaptionLength,
+                       std::vector<MessagePart> &parts)
+{
+    HtmlParser parser(maxMessageLength, maxCaptionLength, parts);
+    parser.parse(message);
+}
+
+static bool isHtmlSpecial(char c)
+{
+    return (c == '<') || (c == '>') || (c == '&') || (c == '"') || (c == '\'');
+}
+
+static size_t findHtmlSpecial(const char *text, size_t length)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    // Most message text has nothing to escape, so check 16 bytes at a time
+    const __m128i lt   = _mm_set1_epi8('<');
+    const __m128i gt   = _mm_set1_epi8('>');
+    const __m128i amp  = _mm_set1_epi8('&');
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+        __m128i match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, lt), _mm_cmpeq_epi8(chunk, gt)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(chunk, amp), _mm_cmpeq_epi8(chunk, quot)));
+        match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, apos));
+        int mask = _mm_movemask_epi8(match);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < length; i++)
+        if (isHtmlSpecial(text[i]))
+            return i;
+
+    return length;
+}
+
+void appendEscapedHtml(std::string &dest, const char *text, size_t length)
+{
+    while (length) {
+        size_t plainLength = findHtmlSpecial(text, length);
+        dest.append(text, plainLength);
+        if (plainLength == length)
+            break;
+
+        switch (text[plainLength]) {
+        case '<': dest += "&lt;"; break;
+        case '>': dest += "&gt;"; break;
+        case '&': dest += "&amp;"; break;
+        case '"': dest += "&quot;"; break;
+        case '\'': dest += "&apos;"; break;
+        }
+        text   += plainLength + 1;
+        length -= plainLength + 1;
+    }
+}
+
+namespace {
+
+struct OpenTag {
+    int32_t     end;
+    std::string openTag;
+    const char *closeTag;
+};
+
+}
+
+static size_t getUtf8SequenceLength(uint8_t c)
+{
+    return (c < 0xC0) ? 1 : (c < 0xE0) ? 2 : (c < 0xF0) ? 3 : 4;
+}
+
+// Byte length of text starting at given position that takes given number of UTF-16 code units
+static size_t getUtf8Length(const std::string &text, size_t start, int32_t utf16Length)
+{
+    size_t pos = start;
+    while ((pos < text.size()) && (utf16Length > 0)) {
+        uint8_t c = text[pos];
+        utf16Length -= (c >= 0xF0) ? 2 : 1;
+        pos += getUtf8SequenceLength(c);
+    }
+
+    return std::min(pos, text.size()) - start;
+}
+
+static bool getEntityTags(const td::td_api::textEntity &entity, const std::string &text, size_t bytePos,
+                          OpenTag &tag)
+{
+    if (!entity.type_)
+        return false;
+
+    switch (entity.type_->get_id()) {
+    case td::td_api::textEntityTypeBold::ID:
+    case td::td_api::textEntityTypeMentionName::ID:
+        tag.openTag  = "<b>";
+        tag.closeTag = "</b>";
+        return true;
+    case td::td_api::textEntityTypeItalic::ID:
+        tag.openTag  = "<i>";
+        tag.closeTag = "</i>";
+        return true;
+    case td::td_api::textEntityTypeUnderline::ID:
+        tag.openTag  = "<u>";
+        tag.closeTag = "</u>";
+        return true;
+    case td::td_api::textEntityTypeStrikethrough::ID:
+        tag.openTag  = "<s>";
+        tag.closeTag = "</s>";
+        return true;
+    case td::td_api::textEntityTypeCode::ID:
+        tag.openTag  = "<tt>";
+        tag.closeTag = "</tt>";
+        return true;
+    case td::td_api::textEntityTypePre::ID:
+    case td::td_api::textEntityTypePreCode::ID:
+        tag.openTag  = "<pre>";
+        tag.closeTag = "</pre>";
+        return true;
+    case td::td_api::textEntityTypeTextUrl::ID: {
+        const std::string &url = static_cast<const td::td_api::textEntityTypeTextUrl &>(*entity.type_).url_;
+        tag.openTag = "<a href=\"";
+        appendEscapedHtml(tag.openTag, url.c_str(), url.size());
+        tag.openTag += "\">";
+        tag.closeTag = "</a>";
+        return true;
+    }
+    case td::td_api::textEntityTypeMention::ID: {
+        // @username
+        size_t length = getUtf8Length(text, bytePos, entity.length_);
+        if ((length < 2) || (text[bytePos] != '@'))
+            return false;
+        tag.openTag = "<a href=\"https://t.me/";
+        appendEscapedHtml(tag.openTag, text.c_str() + bytePos + 1, length - 1);
+        tag.openTag += "\">";
+        tag.closeTag = "</a>";
+        return true;
+    }
+    }
+
+    return false;
+}
+
+static void closeEndedTags(std::string &dest, std::vector<OpenTag> &openTags, int32_t pos)
+{
+    auto firstEnded = std::find_if(openTags.begin(), openTags.end(), [pos](const OpenTag &tag) {
+        return (tag.end <= pos);
+    });
+    if (firstEnded == openTags.end())
+        return;
+
+    // Entities may overlap without nesting, so close everything above and reopen what continues
+    size_t first = firstEnded - openTags.begin();
+    for (size_t i = openTags.size(); i > first; i--)
+        dest += openTags[i-1].closeTag;
+    openTags.erase(std::remove_if(openTags.begin() + first, openTags.end(), [pos](const OpenTag &tag) {
+        return (tag.end <= pos);
+    }), openTags.end());
+    for (size_t i = first; i < openTags.size(); i++)
+        dest += openTags[i].openTag;
+}
+
+void appendFormattedTextHtml(std::string &dest, const td::td_api::formattedText &text)
+{
+    const std::string &source = text.text_;
+    dest.reserve(dest.size() + source.size());
+    if (text.entities_.empty()) {
+        appendEscapedHtml(dest, source.c_str(), source.size());
+        return;
+    }
+
+    std::vector<const td::td_api::textEntity *> entities;
+    entities.reserve(text.entities_.size());
+    for (const auto &entity: text.entities_)
+        if (entity && (entity->length_ > 0))
+            entities.push_back(entity.get());
+    // Outer entities first
+    std::stable_sort(entities.begin(), entities.end(),
+                     [](const td::td_api::textEntity *a, const td::td_api::textEntity *b) {
+                         return (a->offset_ < b->offset_) ||
+                                ((a->offset_ == b->offset_) && (a->length_ > b->length_));
+                     });
+
+    std::vector<OpenTag> openTags;
+    size_t               bytePos    = 0;
+    int32_t              utf16Pos   = 0;
+    size_t               nextEntity = 0;
+    while (true) {
+        closeEndedTags(dest, openTags, utf16Pos);
+        for (; (nextEntity < entities.size()) && (entities[nextEntity]->offset_ <= utf16Pos); nextEntity++) {
+            OpenTag tag;
+            tag.end = entities[nextEntity]->offset_ + entities[nextEntity]->length_;
+            if (getEntityTags(*entities[nextEntity], source, bytePos, tag)) {
+                dest += tag.openTag;
+                openTags.push_back(std::move(tag));
+            }
+        }
+        if (bytePos >= source.size())
+            break;
+
+        int32_t boundary = INT32_MAX;
+        if (nextEntity < entities.size())
+            boundary = entities[nextEntity]->offset_;
+        for (const OpenTag &tag: openTags)
+            boundary = std::min(boundary, tag.end);
+
+        size_t spanLength = getUtf8Length(source, bytePos, boundary - utf16Pos);
+        appendEscapedHtml(dest, source.c_str() + bytePos, spanLength);
+        utf16Pos += getUtf16Length(source.c_str() + bytePos, spanLength);
+        bytePos  += spanLength;
+    }
+
+    for (size_t i = openTags.size(); i > 0; i--)
+        dest += openTags[i-1].closeTag;
+}
@@ -0,0 +1,26 @@
+#ifndef _HTML_PARSER_H
+#define _HTML_PARSER_H
+
+#include <td/telegram/td_api.h>
+#include <string>
+#include <vector>
+
+struct MessagePart {
+    bool        isImage = false;
+    int         imageId;
+    std::string text;
+    std::vector<td::td_api::object_ptr<td::td_api::textEntity>> entities;
+};
+
+// Converts outgoing message from libpurple HTML to plain text with entities in one pass. Inline images
+// start new parts (following text becomes caption), and text is split into more parts so that it
+// fits into length limits. Limit of 0 means no limit.
+void   parseOutgoingHtml(const char *message, unsigned maxMessageLength, unsigned maxCaptionLength,
+                         std::vector<MessagePart> &parts);
+size_t getUtf16Length(const char *text, size_t length);
+
+// Appends incoming text as libpurple HTML, escaping special characters and turning entities into tags
+void   appendFormattedTextHtml(std::string &dest, const td::td_api::formattedText &text);
+void   appendEscapedHtml(std::string &dest, const char *text, size_t length);
+
+#endif
@@ -127,6 +127,16 @@ ChatId getChatId(const td::td_api::updateChatLastMessage &update)
     return ChatId(update.chat_id_);
 }
 
+ChatId getChatId(const td::td_api::updateMessageContent &update)
+{
+    return ChatId(update.chat_id_);
+}
+
+ChatId getChatId(const td::td_api::updateDeleteMessages &update)
+{
+    return ChatId(update.chat_id_);
+}
+
 BasicGroupId getBasicGroupId(const td::td_api::updateBasicGroupFullInfo &update)
 {
     return BasicGroupId(update.basic_group_id_);
@@ -160,3 +170,13 @@ MessageId getReplyMessageId(const td::td_api::message &message)
         return MessageId(0);
     }
 }
+
+MessageId getMessageId(const td::td_api::updateMessageContent &update)
+{
+    return MessageId(update.message_id_);
+}
+
+MessageId getMessageId(const td::td_api::updateDeleteMessages &update, unsigned index)
+{
+    return MessageId(update.message_ids_.at(index));
+}
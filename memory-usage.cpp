@@ -0,0 +1,174 @@
+#include "memory-usage.h"
+#include "format.h"
+#include <map>
+#include <stdio.h>
+#include <unistd.h>
+
+// Images added by addPurpleImage, with their sizes, by imgstore id
+static std::map<int, size_t> g_purpleImages;
+
+size_t getStringMemory(const std::string &s)
+{
+    // Short strings are stored inside std::string itself
+    return (s.capacity() > 15) ? s.capacity() + 1 : 0;
+}
+
+static size_t getFormattedTextMemory(const td::td_api::formattedText *text)
+{
+    if (!text)
+        return 0;
+    return sizeof(*text) + getStringMemory(text->text_) +
+           text->entities_.capacity() * sizeof(text->entities_[0]) +
+           text->entities_.size() * sizeof(td::td_api::textEntity);
+}
+
+size_t getMessageMemory(const td::td_api::message &message)
+{
+    size_t size = sizeof(message);
+    if (!message.content_)
+        return size;
+
+    // Beyond text and captions, only the content object itself is counted
+    switch (message.content_->get_id()) {
+    case td::td_api::messageText::ID: {
+        const auto &text = static_cast<const td::td_api::messageText &>(*message.content_);
+        size += sizeof(text) + getFormattedTextMemory(text.text_.get());
+        break;
+    }
+    case td::td_api::messagePhoto::ID: {
+        const auto &photo = static_cast<const td::td_api::messagePhoto &>(*message.content_);
+        size += sizeof(photo) + getFormattedTextMemory(photo.caption_.get());
+        break;
+    }
+    case td::td_api::messageDocument::ID: {
+        const auto &document = static_cast<const td::td_api::messageDocument &>(*message.content_);
+        size += sizeof(document) + getFormattedTextMemory(document.caption_.get());
+        break;
+    }
+    case td::td_api::messageVideo::ID: {
+        const auto &video = static_cast<const td::td_api::messageVideo &>(*message.content_);
+        size += sizeof(video) + getFormattedTextMemory(video.caption_.get());
+        break;
+    }
+    default:
+        size += sizeof(td::td_api::messageText);
+        break;
+    }
+
+    return size;
+}
+
+size_t getUserMemory(const td::td_api::user &user)
+{
+    size_t size = sizeof(user) + getStringMemory(user.first_name_) + getStringMemory(user.last_name_) +
+                  getStringMemory(user.phone_number_);
+    if (user.profile_photo_)
+        size += sizeof(td::td_api::profilePhoto) + 2*sizeof(td::td_api::file);
+    if (user.status_)
+        size += sizeof(td::td_api::userStatusOffline);
+    return size;
+}
+
+size_t getChatMemory(const td::td_api::chat &chat)
+{
+    size_t size = sizeof(chat) + getStringMemory(chat.title_) +
+                  chat.positions_.size() * (sizeof(chat.positions_[0]) + sizeof(td::td_api::chatPosition));
+    if (chat.photo_)
+        size += sizeof(td::td_api::chatPhotoInfo) + 2*sizeof(td::td_api::file);
+    if (chat.last_message_)
+        size += getMessageMemory(*chat.last_message_);
+    return size;
+}
+
+size_t getChatMembersMemory(const std::vector<td::td_api::object_ptr<td::td_api::chatMember>> &members)
+{
+    size_t size = members.capacity() * sizeof(members[0]);
+    for (const auto &member: members)
+        if (member)
+            size += sizeof(*member) + sizeof(td::td_api::messageSenderUser) +
+                    sizeof(td::td_api::chatMemberStatusMember);
+    return size;
+}
+
+int addPurpleImage(gpointer data, size_t size)
+{
+    int id = purple_imgstore_add_with_id(data, size, NULL);
+    g_purpleImages[id] = size;
+    return id;
+}
+
+void prunePurpleImages()
+{
+    for (auto it = g_purpleImages.begin(); it != g_purpleImages.end(); ) {
+        if (purple_imgstore_find_by_id(it->first))
+            ++it;
+        else
+            it = g_purpleImages.erase(it);
+    }
+}
+
+void getPurpleImageUsage(MemoryUsage &usage)
+{
+    prunePurpleImages();
+    for (const auto &item: g_purpleImages)
+        usage.add(item.second);
+}
+
+static size_t getResidentMemory()
+{
+    FILE          *statm    = fopen("/proc/self/statm", "r");
+    unsigned long  total    = 0;
+    unsigned long  resident = 0;
+    if (!statm)
+        return 0;
+    if (fscanf(statm, "%lu %lu", &total, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void appendSize(std::string &text, size_t bytes)
+{
+    char *size = g_format_size(bytes);
+    text += size;
+    g_free(size);
+}
+
+std::string formatMemoryReport(const MemoryReport &report, const CacheStatsReport &cacheStats)
+{
+    // TRANSLATOR: Memory report title, followed by lines like "Users: 10, 2.0 kB"
+    std::string text = _("Approximate memory used by plugin data:");
+    size_t      total = 0;
+
+    for (const MemoryReportItem &item: report) {
+        text += "\n";
+        text += item.name;
+        text += ": ";
+        text += std::to_string(item.usage.count);
+        text += ", ";
+        appendSize(text, item.usage.bytes);
+        total += item.usage.bytes;
+    }
+
+    char *size = g_format_size(total);
+    // TRANSLATOR: Memory report line, argument is a size like "2.0 MB"
+    text += "\n" + formatMessage(_("Total: {}"), size);
+    g_free(size);
+
+    size_t resident = getResidentMemory();
+    if (resident) {
+        size = g_format_size(resident);
+        // TRANSLATOR: Memory report line, argument is a size like "2.0 MB". This is the whole messenger program, not just this plugin.
+        text += "\n" + formatMessage(_("Whole process: {}"), size);
+        g_free(size);
+    }
+
+    for (const CacheStatsItem &item: cacheStats) {
+        unsigned lookups = item.hits + item.misses;
+        // TRANSLATOR: Memory report line, arguments are cache name, number of lookups that found something, number of lookups that did not, and percentage of the former
+        text += "\n" + formatMessage(_("{0}: {1} hits, {2} misses ({3}%)"), item.name, item.hits,
+                                     item.misses, lookups ? 100 * item.hits / lookups : 0);
+    }
+
+    return text;
+}
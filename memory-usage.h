@@ -0,0 +1,55 @@
+#ifndef _MEMORY_USAGE_H
+#define _MEMORY_USAGE_H
+
+#include <td/telegram/td_api.h>
+#include <purple.h>
+#include <string>
+#include <vector>
+
+// Approximate memory held by plugin data structures: objects themselves plus strings and lists
+// known to be owned by them. Good enough to tell which part keeps growing, not for exact numbers.
+struct MemoryUsage {
+    size_t count = 0;
+    size_t bytes = 0;
+
+    void add(size_t objectBytes, size_t objectCount = 1)
+    {
+        count += objectCount;
+        bytes += objectBytes;
+    }
+};
+
+struct MemoryReportItem {
+    const char  *name;
+    MemoryUsage  usage;
+};
+using MemoryReport = std::vector<MemoryReportItem>;
+
+// How often a cache had what was looked up, shown along with memory use
+struct CacheStatsItem {
+    const char *name;
+    unsigned    hits;
+    unsigned    misses;
+};
+using CacheStatsReport = std::vector<CacheStatsItem>;
+
+// Per-element bookkeeping of std::map/std::set and std::list
+constexpr size_t MAP_NODE_OVERHEAD  = 4*sizeof(void *);
+constexpr size_t LIST_NODE_OVERHEAD = 2*sizeof(void *);
+
+size_t getStringMemory(const std::string &s);
+size_t getMessageMemory(const td::td_api::message &message);
+size_t getUserMemory(const td::td_api::user &user);
+size_t getChatMemory(const td::td_api::chat &chat);
+size_t getChatMembersMemory(const std::vector<td::td_api::object_ptr<td::td_api::chatMember>> &members);
+
+// Adds image to imgstore, remembering it for memory report. Images stay there until libpurple
+// releases them.
+int    addPurpleImage(gpointer data, size_t size);
+void   getPurpleImageUsage(MemoryUsage &usage);
+// Forgets images libpurple has released since, so that the list does not keep growing
+void   prunePurpleImages();
+
+std::string formatMemoryReport(const MemoryReport &report, const CacheStatsReport &cacheStats);
+
+#endif
@@ -40,6 +40,16 @@ namespace AccountOptions {
     constexpr gboolean    EnableSecretChatsDefault   = TRUE;
     constexpr const char *AnimatedStickers           = "animated-stickers";
     constexpr gboolean    AnimatedStickersDefault    = TRUE;
+    constexpr const char *AnimatedStickerFps         = "animated-sticker-fps";
+    constexpr int         AnimatedStickerFpsDefault  = 0;
+    constexpr const char *AnimatedStickerMaxDuration = "animated-sticker-max-duration";
+    constexpr int         AnimatedStickerMaxDurationDefault = 0;
+    constexpr const char *AnimatedStickerSize        = "animated-sticker-size";
+    constexpr int         AnimatedStickerSizeDefault = 200;
+    constexpr const char *AnimatedStickerAdaptive    = "animated-sticker-adaptive";
+    constexpr gboolean    AnimatedStickerAdaptiveDefault = FALSE;
+    constexpr const char *AnimatedStickerCacheSize   = "animated-sticker-cache-size";
+    constexpr int         AnimatedStickerCacheSizeDefault = 10;
     constexpr const char *ShowSelfDestruct           = "show-self-destruct";
     constexpr gboolean    ShowSelfDestructDefault    = FALSE;
     constexpr const char *DownloadBehaviour          = "download-behaviour";
@@ -48,8 +58,18 @@ namespace AccountOptions {
     const char           *DownloadBehaviourDefault();
     constexpr const char *KeepInlineDownloads        = "keep-inline-downloads";
     constexpr gboolean    KeepInlineDownloadsDefault = FALSE;
+    constexpr const char *MemberListLimit            = "member-list-limit";
+    constexpr int         MemberListLimitDefault     = 200;
     constexpr const char *ReadReceipts               = "read-receipts";
     constexpr gboolean    ReadReceiptsDefault        = TRUE;
+    constexpr const char *KeepDebugLog               = "keep-debug-log";
+    constexpr gboolean    KeepDebugLogDefault        = FALSE;
+    constexpr const char *RecordTimeline             = "record-timeline";
+    constexpr gboolean    RecordTimelineDefault      = FALSE;
+    constexpr const char *FileCacheMaxSize           = "file-cache-max-size";
+    constexpr int         FileCacheMaxSizeDefault    = 0;
+    constexpr const char *FileCacheMaxAge            = "file-cache-max-age";
+    constexpr int         FileCacheMaxAgeDefault     = 0;
     constexpr const char *ApiId                      = "api-id";
     constexpr const char *ApiHash                    = "api-hash";
 };
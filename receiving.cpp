@@ -6,7 +6,10 @@
 #include "sticker.h"
 #include "config.h"
 #include "call.h"
+#include "html-parser.h"
+#include "trace.h"
 #include <algorithm>
+#include <string.h>
 
 enum {
     HISTORY_MESSAGES_ABSOLUTE_LIMIT = 80
@@ -23,9 +26,8 @@ std::string makeNoticeWithSender(const td::td_api::chat &chat, const TgMessageIn
 
 std::string getMessageText(const td::td_api::formattedText &text)
 {
-    char *newText = purple_markup_escape_text(text.text_.c_str(), text.text_.size());
-    std::string result(newText);
-    g_free(newText);
+    std::string result;
+    appendFormattedTextHtml(result, text);
     return result;
 }
 
@@ -70,8 +72,8 @@ void sendConversationReadReceipts(TdAccountData &account, PurpleConversation *co
     account.extractPendingReadReceipts(chatId, receipts);
 
     if (!receipts.empty()) {
-        purple_debug_misc(config::pluginId, "Sending %zu read receipts for chat %" G_GINT64_FORMAT "\n",
-                          receipts.size(), chatId.value());
+        DEBUG_MISC("Sending %zu read receipts for chat %" G_GINT64_FORMAT "\n",
+                   receipts.size(), chatId.value());
         td::td_api::object_ptr<td::td_api::viewMessages> viewMessagesReq = td::td_api::make_object<td::td_api::viewMessages>();
         viewMessagesReq->chat_id_ = chatId.value();
         viewMessagesReq->force_read_ = true; // no idea what "closed chats" are at this point
@@ -153,21 +155,8 @@ static void showMessageTextChat(TdAccountData &account, const td::td_api::chat &
         sendConversationReadReceipts(account, baseConv);
 }
 
-static std::string quoteMessage(const td::td_api::message *message, TdAccountData &account)
+static std::string getQuotedText(const td::td_api::message *message)
 {
-    const td::td_api::user *originalAuthor = nullptr;
-    if (message)
-        originalAuthor = account.getUser(getSenderUserId(*message));
-
-    std::string originalName;
-    if (originalAuthor)
-        originalName = account.getDisplayName(*originalAuthor);
-    else {
-        // message == NULL means it could not be fetched, or took too long to fetch
-        // TRANSLATOR: In-line placeholder if the original author of a quote is unknown. Is at the beginning of the line if and only if you make it so, see "<b>&bt {} wrote:"...
-        originalName = _("Unknown user");
-    }
-
     std::string text;
     if (!message || !message->content_) {
         // TRANSLATOR: In-chat placeholder when something unknown is being replied to.
@@ -193,8 +182,8 @@ static std::string quoteMessage(const td::td_api::message *message, TdAccountDat
             const td::td_api::messageDocument &document = static_cast<const td::td_api::messageDocument &>(*message->content_);
             if (document.document_) {
                 // TRANSLATOR: In-line placeholder when a file is being replied to. Arguments will be the file name and MIME type (e.g. "application/gzip")
-                text = formatMessage(_("[file: {0} ({1})]"), {document.document_->file_name_,
-                                                           document.document_->mime_type_});
+                text = formatMessage(_("[file: {0} ({1})]"), document.document_->file_name_,
+                                     document.document_->mime_type_);
             } else {
                 // Not supposed to be possible, but just in case
                 text = "[file]";
@@ -234,8 +223,40 @@ static std::string quoteMessage(const td::td_api::message *message, TdAccountDat
     for (unsigned i = 0; i < text.size(); i++)
         if (text[i] == '\n') text[i] = ' ';
 
+    return text;
+}
+
+static MessageSummaryPtr makeMessageSummary(const td::td_api::message &message)
+{
+    return std::make_shared<MessageSummary>(MessageSummary{getId(message), getSenderUserId(message),
+                                                           getQuotedText(&message)});
+}
+
+static std::string quoteMessage(const TgMessageInfo &message, TdAccountData &account)
+{
+    UserId      senderId = UserId::invalid;
+    std::string text;
+    if (!message.repliedMessage && message.repliedSummary) {
+        senderId = message.repliedSummary->senderId;
+        text     = message.repliedSummary->text;
+    } else {
+        if (message.repliedMessage)
+            senderId = getSenderUserId(*message.repliedMessage);
+        text = getQuotedText(message.repliedMessage.get());
+    }
+
+    const td::td_api::user *originalAuthor = account.getUser(senderId);
+    std::string originalName;
+    if (originalAuthor)
+        originalName = account.getDisplayName(*originalAuthor);
+    else {
+        // No message means it could not be fetched, or took too long to fetch
+        // TRANSLATOR: In-line placeholder if the original author of a quote is unknown. Is at the beginning of the line if and only if you make it so, see "<b>&bt {} wrote:"...
+        originalName = _("Unknown user");
+    }
+
     // TRANSLATOR: In-chat notification of a reply. Arguments will be username and the original text or description thereof. Please preserve the HTML.
-    return formatMessage(_("<b>&gt; {0} wrote:</b>\n&gt; {1}"), {originalName, text});
+    return formatMessage(_("<b>&gt; {0} wrote:</b>\n&gt; {1}"), originalName, text);
 }
 
 void showMessageText(TdAccountData &account, const td::td_api::chat &chat, const TgMessageInfo &message,
@@ -246,22 +267,22 @@ void showMessageText(TdAccountData &account, const td::td_api::chat &chat, const
     if (message.outgoing && !message.sentLocally)
         flags = (PurpleMessageFlags) (flags | PURPLE_MESSAGE_REMOTE_SEND);
 
+    // Plain messages are passed through as they are, only replies and forwards need prefixing
     std::string newText;
-    if (text) {
+    if (text && (message.repliedMessageId.valid() || !message.forwardedFrom.empty())) {
         if (message.repliedMessageId.valid())
-            newText = quoteMessage(message.repliedMessage.get(), account);
+            newText = quoteMessage(message, account);
         if (!message.forwardedFrom.empty()) {
             if (!newText.empty())
                 newText += "\n";
             // TRANSLATOR: In-chat notification of forward. Argument will be a username. Please preserve the HTML.
             newText += formatMessage(_("<b>Forwarded from {}:</b>"), message.forwardedFrom);
         }
-        if (!newText.empty())
-            newText += "\n";
+        newText.reserve(newText.size() + 1 + strlen(text));
+        newText += "\n";
         newText += text;
-    }
-    if (!newText.empty())
         text = newText.c_str();
+    }
 
     const td::td_api::user *privateUser = account.getUserByPrivateChat(chat);
     if (privateUser) {
@@ -269,7 +290,7 @@ void showMessageText(TdAccountData &account, const td::td_api::chat &chat, const
 
         // If there is no buddy in the buddy list, libpurple won't be able to translate buddy name
         // to alias, so use display name instead of idXXXXXXXXX
-        if (!purple_find_buddy(account.purpleAccount, userName.c_str()))
+        if (!account.buddyList.findBuddy(userName.c_str()))
             userName = account.getDisplayName(*privateUser);
         showMessageTextIm(account, userName.c_str(), text, notification, message.timestamp, flags);
     }
@@ -311,7 +332,7 @@ static void showDownloadedImage(const td::td_api::chat &chat, TgMessageInfo &mes
     size_t       len    = 0;
 
     if (g_file_get_contents (filePath.c_str(), &data, &len, NULL)) {
-        int id = purple_imgstore_add_with_id (data, len, NULL);
+        int id = addPurpleImage(data, len);
         text = makeInlineImageText(id);
     } else if (filePath.find('"') == std::string::npos)
         text = "<img src=\"file://" + filePath + "\">";
@@ -347,6 +368,17 @@ bool shouldConvertAnimatedSticker(const TgMessageInfo &message, const PurpleAcco
 #endif
 }
 
+bool shouldConvertSticker(const std::string &filePath, const TgMessageInfo &message,
+                          const PurpleAccount *purpleAccount)
+{
+    if (filePath.empty())
+        return false;
+    else if (isStickerAnimated(filePath))
+        return shouldConvertAnimatedSticker(message, purpleAccount);
+    else
+        return canDecodeWebpSticker();
+}
+
 static void showDownloadedSticker(const td::td_api::chat &chat, TgMessageInfo &message,
                                   const std::string &filePath,
                                   const std::string &fileDescription,
@@ -375,8 +407,13 @@ static void showDownloadedSticker(const td::td_api::chat &chat, TgMessageInfo &m
         } else {
             showGenericFileInline(chat, message, filePath, NULL, fileDescription, account);
         }
+    } else if (canDecodeWebpSticker()) {
+        StickerConversionThread *thread;
+        thread = new StickerConversionThread(account.purpleAccount, filePath, getId(chat),
+                                             std::move(message));
+        thread->startThread();
     } else {
-        showWebpSticker(chat, message, filePath, fileDescription, account);
+        showGenericFileInline(chat, message, filePath, NULL, fileDescription, account);
     }
 }
 
@@ -425,7 +462,10 @@ static void showTextMessage(const td::td_api::chat &chat, const TgMessageInfo &m
                             const td::td_api::messageText &text, TdAccountData &account)
 {
     if (text.text_) {
-        std::string displayText = getMessageText(*text.text_);
+        // Most frequent kind of message, so render into a buffer that keeps its capacity
+        std::string &displayText = account.messageTextBuffer;
+        displayText.clear();
+        appendFormattedTextHtml(displayText, *text.text_);
         showMessageText(account, chat, message, displayText.c_str(), NULL);
     }
 }
@@ -464,8 +504,7 @@ static void requestInlineDownload(const char *sender, const td::td_api::file &fi
     // TRANSLATOR: Download dialog, placeholder chat title, in the sentence "posted in a private chat".
     std::string chatName = isPrivateChat(chat) ? _("a private chat") : chat.title_;
     // TRANSLATOR: Download dialog, secondary content. Arguments will be file description (text), chat name (text), and a file size (text!)
-    std::string fileInfo = formatMessage(_("{0} posted in {1}, size: {2}"), {fileDesc,
-                                         chatName, std::string(sizeStr)});
+    std::string fileInfo = formatMessage(_("{0} posted in {1}, size: {2}"), fileDesc, chatName, sizeStr);
     g_free(sizeStr);
 
     InlineDownloadInfo *info = new InlineDownloadInfo;
@@ -508,17 +547,17 @@ static void showFileInline(const td::td_api::chat &chat, IncomingMessage &fullMe
              !fullMessage.inlineDownloadComplete )
         {
             // TRANSLATOR: In-chat notification, appears after a colon (':'). Argument is a file *type*, not a filename.
-            notice = formatMessage(_("Downloading {}"), std::string(fileDesc));
+            notice = formatMessage(_("Downloading {}"), fileDesc);
         }
         autoDownload = true;
     } else if (!ignoreBigDownloads(account.purpleAccount)) {
         // TRANSLATOR: In-chat notification, appears after a colon (':'). Argument is a file *type*, not a filename.
-        notice = formatMessage(_("Requesting {} download"), std::string(fileDesc));
+        notice = formatMessage(_("Requesting {} download"), fileDesc);
         askDownload = true;
     } else {
         char *fileSizeStr = purple_str_size_to_units(fileSize); // File size above limit, so it's non-zero
         // TRANSLATOR: In-chat notification, appears after a colon (':'). Arguments are a file *type*, not a filename; second argument is a file size with unit.
-        notice = formatMessage(_("Ignoring {0} download ({1})"), {std::string(fileDesc), std::string(fileSizeStr)});
+        notice = formatMessage(_("Ignoring {0} download ({1})"), fileDesc, fileSizeStr);
         g_free(fileSizeStr);
     }
 
@@ -532,9 +571,9 @@ static void showFileInline(const td::td_api::chat &chat, IncomingMessage &fullMe
         showMessageText(account, chat, fullMessage.messageInfo, caption, notice.c_str());
 
     if (autoDownload || askDownload) {
-        if (fullMessage.animatedStickerConverted) {
-            if (fullMessage.animatedStickerConvertSuccess) {
-                std::string text = makeInlineImageText(fullMessage.animatedStickerImageId);
+        if (fullMessage.stickerConverted) {
+            if (fullMessage.stickerConvertSuccess) {
+                std::string text = makeInlineImageText(fullMessage.stickerImageId);
                 showMessageText(account, chat, fullMessage.messageInfo, text.c_str(), NULL, PURPLE_MESSAGE_IMAGES);
             }
         } else if (file.local_ && file.local_->is_downloading_completed_)
@@ -547,7 +586,7 @@ static void showFileInline(const td::td_api::chat &chat, IncomingMessage &fullMe
             // When download takes too long, message will leave PendingMessageQueue and be "shown".
             // However, nothing more should be done at that point except keep waiting for the download.
             if (!fullMessage.inlineDownloadTimeout) {
-                purple_debug_misc(config::pluginId, "Downloading %s (file id %d)\n", fileDesc.c_str(),
+                DEBUG_MISC("Downloading %s (file id %d)\n", fileDesc.c_str(),
                                 (int)file.id_);
                 downloadFileInline(file.id_, getId(chat), fullMessage.messageInfo, fileDesc,
                                 std::move(fullMessage.thumbnail), transceiver, account);
@@ -628,7 +667,8 @@ void showMessage(const td::td_api::chat &chat, IncomingMessage &fullMessage,
 
     if (!message.content_)
         return;
-    purple_debug_misc(config::pluginId, "Displaying message %" G_GINT64_FORMAT "\n", message.id_);
+    TRACE_SPAN("showMessage", "messageId", message.id_);
+    DEBUG_TRACE("Displaying message %" G_GINT64_FORMAT "\n", message.id_);
 
     TgMessageInfo &messageInfo = fullMessage.messageInfo;
     messageInfo.repliedMessage = std::move(fullMessage.repliedMessage);
@@ -692,8 +732,8 @@ void showMessage(const td::td_api::chat &chat, IncomingMessage &fullMessage,
             const auto &titleChange = static_cast<const td::td_api::messageChatChangeTitle &>(*message.content_);
             // TRANSLATOR: In-chat status update, arguments are chat names.
             std::string notice = formatMessage(_("{0} changed group name to {1}"),
-                                               {getSenderDisplayName(chat, messageInfo, account.purpleAccount),
-                                                titleChange.title_});
+                                               getSenderDisplayName(chat, messageInfo, account.purpleAccount),
+                                               titleChange.title_);
             showMessageText(account, chat, messageInfo, NULL, notice.c_str());
             break;
         }
@@ -749,10 +789,10 @@ const td::td_api::file *selectPhotoSize(PurpleAccount *account, const td::td_api
             }
 
     if (selectedSize)
-        purple_debug_misc(config::pluginId, "Selected size %dx%d for photo\n",
-                          (int)selectedSize->width_, (int)selectedSize->height_);
+        DEBUG_MISC("Selected size %dx%d for photo\n",
+                   (int)selectedSize->width_, (int)selectedSize->height_);
     else
-        purple_debug_warning(config::pluginId, "No file found for a photo\n");
+        DEBUG_WARNING("No file found for a photo\n");
 
     return selectedSize ? selectedSize->photo_.get() : nullptr;
 }
@@ -770,9 +810,9 @@ void makeFullMessage(const td::td_api::chat &chat, td::td_api::object_ptr<td::td
     fullMessage.repliedMessageFetchDoneOrFailed = false;
     fullMessage.inlineDownloadComplete = false;
     fullMessage.inlineDownloadTimeout = false;
-    fullMessage.animatedStickerConverted = false;
-    fullMessage.animatedStickerConvertSuccess = false;
-    fullMessage.animatedStickerImageId = 0;
+    fullMessage.stickerConverted = false;
+    fullMessage.stickerConvertSuccess = false;
+    fullMessage.stickerImageId = 0;
 
     const char *option = purple_account_get_string(account.purpleAccount, AccountOptions::DownloadBehaviour,
                                                    AccountOptions::DownloadBehaviourDefault());
@@ -787,6 +827,12 @@ void makeFullMessage(const td::td_api::chat &chat, td::td_api::object_ptr<td::td
     messageInfo.outgoing         = message->is_outgoing_;
     messageInfo.sentLocally      = (message->sending_state_ != nullptr);
     messageInfo.repliedMessageId = getReplyMessageId(*message);
+    messageInfo.repliedSummary   = nullptr;
+    if (messageInfo.repliedMessageId.valid()) {
+        // Message being replied to is often one that was just displayed, no need to fetch it then
+        messageInfo.repliedSummary = account.recentMessages.find(getId(chat), messageInfo.repliedMessageId);
+        fullMessage.repliedMessageFetchDoneOrFailed = (messageInfo.repliedSummary != nullptr);
+    }
 
     if (message->forward_info_)
         messageInfo.forwardedFrom = getForwardSource(*message->forward_info_, account);
@@ -804,6 +850,8 @@ void makeFullMessage(const td::td_api::chat &chat, td::td_api::object_ptr<td::td
             if (sticker.sticker_ && sticker.sticker_->thumbnail_) {
                 fullMessage.thumbnail = std::move(sticker.sticker_->thumbnail_->file_);
             }
+            if (sticker.sticker_ && sticker.sticker_->sticker_ && sticker.sticker_->sticker_->remote_)
+                messageInfo.stickerFileId = sticker.sticker_->sticker_->remote_->unique_id_;
         }
     }
 
@@ -849,17 +897,17 @@ static bool isFileMessageReady(const IncomingMessage &fullMessage, ChatId chatId
 
     if (chat && isInlineDownload(fullMessage, content, *chat)) {
         // File will be shown inline
-        // Animated stickers are not ready until converted
+        // Stickers are not ready until converted
         if (fullMessage.inlineDownloadComplete)
             return !((content.get_id() == td::td_api::messageSticker::ID) &&
-                     isStickerAnimated(fullMessage.inlineDownloadedFilePath) &&
-                     shouldConvertAnimatedSticker(fullMessage.messageInfo, account.purpleAccount) &&
-                     !fullMessage.animatedStickerConverted);
+                     shouldConvertSticker(fullMessage.inlineDownloadedFilePath, fullMessage.messageInfo,
+                                          account.purpleAccount) &&
+                     !fullMessage.stickerConverted);
         else if (file.local_ && file.local_->is_downloading_completed_)
             return !((content.get_id() == td::td_api::messageSticker::ID) &&
-                     isStickerAnimated(file.local_->path_) &&
-                     shouldConvertAnimatedSticker(fullMessage.messageInfo, account.purpleAccount) &&
-                     !fullMessage.animatedStickerConverted);
+                     shouldConvertSticker(file.local_->path_, fullMessage.messageInfo,
+                                          account.purpleAccount) &&
+                     !fullMessage.stickerConverted);
         else
             // Files above limit will either be ignored (in which case, message is ready)
             // or requested (in which case, don't try do display in order)
@@ -988,8 +1036,8 @@ void fetchExtras(IncomingMessage &fullMessage, TdTransceiver &transceiver, TdAcc
     ChatId    chatId         = getChatId(message);
     const td::td_api::chat *chat = account.getChat(chatId);
 
-    if (replyMessageId.valid()) {
-        purple_debug_misc(config::pluginId, "Fetching message %" G_GINT64_FORMAT " which message %" G_GINT64_FORMAT " replies to\n",
+    if (replyMessageId.valid() && !fullMessage.repliedMessageFetchDoneOrFailed) {
+        DEBUG_MISC("Fetching message %" G_GINT64_FORMAT " which message %" G_GINT64_FORMAT " replies to\n",
                         replyMessageId.value(), messageId.value());
         auto getMessageReq = td::td_api::make_object<td::td_api::getMessage>();
         getMessageReq->chat_id_    = chatId.value();
@@ -1002,15 +1050,12 @@ void fetchExtras(IncomingMessage &fullMessage, TdTransceiver &transceiver, TdAcc
     if (fileInfo.file && message.content_ && chat && isInlineDownload(fullMessage, *message.content_, *chat)) {
         if (fileInfo.file->local_ && fileInfo.file->local_->is_downloading_completed_ &&
             (message.content_->get_id() == td::td_api::messageSticker::ID) &&
-            isStickerAnimated(fileInfo.file->local_->path_))
+            shouldConvertSticker(fileInfo.file->local_->path_, fullMessage.messageInfo, account.purpleAccount))
         {
-            if (shouldConvertAnimatedSticker(fullMessage.messageInfo, account.purpleAccount)) {
-                StickerConversionThread *thread;
-                thread = new StickerConversionThread(account.purpleAccount, fileInfo.file->local_->path_,
-                                                     chatId, &fullMessage.messageInfo);
-                thread->startThread();
-            }
-            // TODO: if animated stickers are disabled, fetch thumbnail instead
+            StickerConversionThread *thread;
+            thread = new StickerConversionThread(account.purpleAccount, fileInfo.file->local_->path_,
+                                                 chatId, &fullMessage.messageInfo);
+            thread->startThread();
         } else if (inlineDownloadNeedAutoDl(fullMessage, *fileInfo.file)) {
             // TgMessageInfo on fullMessage has replyMessage=NULL which will be copied onto DownloadRequest.
             // If message leaves PendingMessageQueue while download is still active, there's probably
@@ -1043,11 +1088,13 @@ static void findMessageResponse(TdAccountData &account, ChatId chatId, MessageId
     if (!pendingMessage) return;
 
     pendingMessage->repliedMessageFetchDoneOrFailed = true;
-    if (object && (object->get_id() == td::td_api::message::ID))
+    if (object && (object->get_id() == td::td_api::message::ID)) {
         pendingMessage->repliedMessage = td::move_tl_object_as<td::td_api::message>(object);
+        account.recentMessages.add(chatId, makeMessageSummary(*pendingMessage->repliedMessage));
+    }
     else
-        purple_debug_misc(config::pluginId, "Failed to fetch reply source for message %" G_GINT64_FORMAT "\n",
-                          pendingMessageId.value());
+        DEBUG_MISC("Failed to fetch reply source for message %" G_GINT64_FORMAT "\n",
+                   pendingMessageId.value());
 
     checkMessageReady(pendingMessage, account.transceiver, account);
 }
@@ -1062,6 +1109,8 @@ void handleIncomingMessage(TdAccountData &account, const td::td_api::chat &chat,
     if (isReadReceiptsEnabled(account.purpleAccount))
         account.addPendingReadReceipt(chatId, getId(*message));
 
+    account.recentMessages.add(chatId, makeMessageSummary(*message));
+
     IncomingMessage fullMessage;
     makeFullMessage(chat, std::move(message), fullMessage, account);
 
@@ -1092,25 +1141,25 @@ static void fetchHistoryResponse(TdAccountData &account, ChatId chatId, MessageI
 
     if (response && (response->get_id() == td::td_api::messages::ID)) {
         td::td_api::messages &messages = static_cast<td::td_api::messages &>(*response);
-        purple_debug_misc(config::pluginId, "Fetched %zu messages for chat %" G_GINT64_FORMAT "\n",
-                          messages.messages_.size(), chatId.value());
+        DEBUG_MISC("Fetched %zu messages for chat %" G_GINT64_FORMAT "\n",
+                   messages.messages_.size(), chatId.value());
         auto stop = messages.messages_.begin();
         MessageId lastMessageId = MessageId::invalid;
         for (; stop != messages.messages_.end(); ++stop) {
             td::td_api::object_ptr<td::td_api::message> message = std::move(*stop);
             if (!message) {
-                purple_debug_warning(config::pluginId, "Erroneous message in history, stopping\n");
+                DEBUG_WARNING("Erroneous message in history, stopping\n");
                 break;
             }
             if (stopAt.valid() && (getId(*message) == stopAt)) {
-                purple_debug_misc(config::pluginId, "Found message %" G_GINT64_FORMAT ", stopping\n",
-                                  stopAt.value());
+                DEBUG_MISC("Found message %" G_GINT64_FORMAT ", stopping\n",
+                           stopAt.value());
                 break;
             }
             if ((!stopAt.valid() && (messagesFetched >= 100)) ||
                 (messagesFetched >= HISTORY_MESSAGES_ABSOLUTE_LIMIT))
             {
-                purple_debug_misc(config::pluginId, "Reached history limit, stopping\n");
+                DEBUG_MISC("Reached history limit, stopping\n");
                 break;
             }
             messagesFetched++;
@@ -1124,7 +1173,7 @@ static void fetchHistoryResponse(TdAccountData &account, ChatId chatId, MessageI
     } else {
         std::string message = formatMessage(_("Failed to fetch earlier messages: {}"),
                                             getDisplayedError(response));
-        purple_debug_warning(config::pluginId, "%s\n", message.c_str());
+        DEBUG_WARNING("%s\n", message.c_str());
         if (chat)
             showChatNotification(account, *chat, message.c_str(), PURPLE_MESSAGE_ERROR);
     }
@@ -1132,8 +1181,8 @@ static void fetchHistoryResponse(TdAccountData &account, ChatId chatId, MessageI
     if (requestMoreFrom.valid() && messagesFetched < HISTORY_MESSAGES_ABSOLUTE_LIMIT)
         fetchHistoryRequest(account, chatId, messagesFetched, requestMoreFrom, stopAt);
     else {
-        purple_debug_misc(config::pluginId, "Done fetching history for chat %" G_GINT64_FORMAT " (%u msgs)\n",
-                          chatId.value(), messagesFetched);
+        DEBUG_MISC("Done fetching history for chat %" G_GINT64_FORMAT " (%u msgs)\n",
+                   chatId.value(), messagesFetched);
         std::vector<IncomingMessage> readyMessages;
         account.pendingMessages.setChatReady(chatId, readyMessages);
         showMessages(readyMessages, account);
@@ -1149,8 +1198,8 @@ static void fetchHistoryRequest(TdAccountData &account, ChatId chatId, unsigned
     request->limit_ = 30;
     request->offset_ = 0;
     request->only_local_ = false;
-    purple_debug_misc(config::pluginId, "Requesting history for chat %" G_GINT64_FORMAT
-                      " starting from %" G_GINT64_FORMAT "\n", chatId.value(), fetchBackFrom.value());
+    DEBUG_MISC("Requesting history for chat %" G_GINT64_FORMAT
+               " starting from %" G_GINT64_FORMAT "\n", chatId.value(), fetchBackFrom.value());
     account.transceiver.sendQuery(std::move(request),
         [&account, chatId, messagesFetched, stopAt](uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> response) {
             fetchHistoryResponse(account, chatId, stopAt, messagesFetched, std::move(response));
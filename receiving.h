@@ -27,6 +27,8 @@ void showDownloadedFileInline(ChatId chatId, TgMessageInfo &message,
                               TdTransceiver &transceiver, TdAccountData &account);
 bool isStickerAnimated(const std::string &filePath);
 bool shouldConvertAnimatedSticker(const TgMessageInfo &message, const PurpleAccount *purpleAccount);
+bool shouldConvertSticker(const std::string &filePath, const TgMessageInfo &message,
+                          const PurpleAccount *purpleAccount);
 void showMessage(const td::td_api::chat &chat, IncomingMessage &fullMessage,
                  TdTransceiver &transceiver, TdAccountData &account);
 void showMessages(std::vector<IncomingMessage>& messages, TdAccountData &account);
@@ -173,4 +173,14 @@ CompositionFunction COMP_functionForMode_C[] = {
     comp_func_Source, comp_func_SourceOver, comp_func_DestinationIn,
     comp_func_DestinationOut};
 
+// Plain C versions, which are left alone when vectorized functions are installed into the
+// tables above. Used by benchmarks for comparison.
+CompositionFunctionSolid COMP_functionForModeSolid_Ref[] = {
+    comp_func_solid_Source, comp_func_solid_SourceOver,
+    comp_func_solid_DestinationIn, comp_func_solid_DestinationOut};
+
+CompositionFunction COMP_functionForMode_Ref[] = {
+    comp_func_Source, comp_func_SourceOver, comp_func_DestinationIn,
+    comp_func_DestinationOut};
+
 void vInitBlendFunctions() {}
@@ -948,6 +948,31 @@ void vInitDrawhelperFunctions()
     // COMP_functionForMode_C[uint(BlendMode::SrcOver)] =
     // Vcomp_func_SourceOver_sse2;
 #endif
+
+#if defined(VECTOR_AVX2_DISPATCH)
+    // update fast path for AVX2 if the CPU has it
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        extern void Vcomp_func_solid_SourceOver_avx2(
+            uint32_t * dest, int length, uint32_t color, uint32_t const_alpha);
+        extern void Vcomp_func_solid_Source_avx2(
+            uint32_t * dest, int length, uint32_t color, uint32_t const_alpha);
+        extern void Vcomp_func_Source_avx2(uint32_t * dest, const uint32_t *src,
+                                           int length, uint32_t const_alpha);
+        extern void Vcomp_func_SourceOver_avx2(uint32_t * dest, const uint32_t *src,
+                                               int length, uint32_t const_alpha);
+
+        COMP_functionForModeSolid_C[uint(BlendMode::Src)] =
+            Vcomp_func_solid_Source_avx2;
+        COMP_functionForModeSolid_C[uint(BlendMode::SrcOver)] =
+            Vcomp_func_solid_SourceOver_avx2;
+
+        COMP_functionForMode_C[uint(BlendMode::Src)] = Vcomp_func_Source_avx2;
+        // Unlike the SSE2 one, this gives same results as the C version
+        COMP_functionForMode_C[uint(BlendMode::SrcOver)] =
+            Vcomp_func_SourceOver_avx2;
+    }
+#endif
 }
 
 V_CONSTRUCTOR_FUNCTION(vInitDrawhelperFunctions)
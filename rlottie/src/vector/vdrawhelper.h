@@ -44,6 +44,13 @@ typedef void (*ProcessRleSpan)(size_t count, const VRle::Span *spans,
 
 extern void memfill32(uint32_t *dest, uint32_t value, int count);
 
+// AVX2 composition functions are chosen at runtime, so they need compiler support for
+// per-function target attributes rather than -mavx2
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define VECTOR_AVX2_DISPATCH
+#endif
+
 struct LinearGradientValues {
     float dx;
     float dy;
@@ -0,0 +1,148 @@
+#include "vdrawhelper.h"
+
+#if defined(VECTOR_AVX2_DISPATCH)
+
+#include <immintrin.h>
+
+// Compiled for AVX2 regardless of build flags, and only installed by vInitDrawhelperFunctions
+// after checking that the CPU supports it. Results are bit-exact with the C versions in
+// vcompositionfunctions.cpp, so spans can be mixed freely.
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+// Each 32bits component of a must be in the form 0x00AA00AA, like for v4_byte_mul_sse2
+AVX2_TARGET static inline __m256i v8_byte_mul_avx2(__m256i c, __m256i a)
+{
+    const __m256i ag_mask = _mm256_set1_epi32(0xFF00FF00);
+    const __m256i rb_mask = _mm256_set1_epi32(0x00FF00FF);
+
+    __m256i v_ag = _mm256_srli_epi32(_mm256_and_si256(ag_mask, c), 8);
+    v_ag = _mm256_and_si256(ag_mask, _mm256_mullo_epi16(a, v_ag));
+
+    __m256i v_rb = _mm256_and_si256(rb_mask, c);
+    v_rb = _mm256_and_si256(rb_mask, _mm256_srli_epi16(_mm256_mullo_epi16(a, v_rb), 8));
+
+    return _mm256_add_epi32(v_ag, v_rb);
+}
+
+// 255 - alpha of each pixel, in the form 0x00AA00AA
+AVX2_TARGET static inline __m256i v8_ialpha_avx2(__m256i c)
+{
+    __m256i ia = _mm256_sub_epi32(_mm256_set1_epi32(0xff), _mm256_srli_epi32(c, 24));
+    return _mm256_or_si256(ia, _mm256_slli_epi32(ia, 16));
+}
+
+// dest = color + BYTE_MUL(dest, alpha)
+AVX2_TARGET static void comp_func_helper_avx2(uint32_t *dest, int length, uint32_t color,
+                                              uint32_t alpha)
+{
+    const __m256i v_color = _mm256_set1_epi32(color);
+    const __m256i v_a     = _mm256_set1_epi16(alpha);
+
+    for (; length >= 8; length -= 8, dest += 8) {
+        __m256i v_dest = _mm256_loadu_si256((__m256i *)dest);
+        v_dest = _mm256_add_epi32(v8_byte_mul_avx2(v_dest, v_a), v_color);
+        _mm256_storeu_si256((__m256i *)dest, v_dest);
+    }
+    for (; length; length--, dest++) *dest = color + BYTE_MUL(*dest, alpha);
+}
+
+AVX2_TARGET void Vcomp_func_solid_Source_avx2(uint32_t *dest, int length,
+                                              uint32_t color, uint32_t const_alpha)
+{
+    if (const_alpha == 255) {
+        const __m256i v_color = _mm256_set1_epi32(color);
+        for (; length >= 8; length -= 8, dest += 8)
+            _mm256_storeu_si256((__m256i *)dest, v_color);
+        for (; length; length--) *dest++ = color;
+    } else {
+        color = BYTE_MUL(color, const_alpha);
+        comp_func_helper_avx2(dest, length, color, 255 - const_alpha);
+    }
+}
+
+AVX2_TARGET void Vcomp_func_solid_SourceOver_avx2(uint32_t *dest, int length,
+                                                  uint32_t color, uint32_t const_alpha)
+{
+    if (const_alpha != 255) color = BYTE_MUL(color, const_alpha);
+    comp_func_helper_avx2(dest, length, color, 255 - vAlpha(color));
+}
+
+AVX2_TARGET void Vcomp_func_Source_avx2(uint32_t *dest, const uint32_t *src, int length,
+                                        uint32_t const_alpha)
+{
+    if (const_alpha == 255) {
+        memcpy(dest, src, size_t(length) * sizeof(uint32_t));
+        return;
+    }
+
+    // Same as INTERPOLATE_PIXEL_255: s * ca + d * cia never exceeds 16 bits, because ca + cia = 255
+    const uint32_t ialpha  = 255 - const_alpha;
+    const __m256i  v_ca    = _mm256_set1_epi16(const_alpha);
+    const __m256i  v_cia   = _mm256_set1_epi16(ialpha);
+    const __m256i  rb_mask = _mm256_set1_epi32(0x00FF00FF);
+    const __m256i  ag_mask = _mm256_set1_epi32(0xFF00FF00);
+
+    for (; length >= 8; length -= 8, dest += 8, src += 8) {
+        __m256i v_src  = _mm256_loadu_si256((const __m256i *)src);
+        __m256i v_dest = _mm256_loadu_si256((__m256i *)dest);
+
+        __m256i rb = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(v_src, rb_mask), v_ca),
+                                      _mm256_mullo_epi16(_mm256_and_si256(v_dest, rb_mask), v_cia));
+        rb = _mm256_srli_epi16(rb, 8);
+        __m256i ag = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_srli_epi16(v_src, 8), v_ca),
+                                      _mm256_mullo_epi16(_mm256_srli_epi16(v_dest, 8), v_cia));
+        ag = _mm256_and_si256(ag, ag_mask);
+
+        _mm256_storeu_si256((__m256i *)dest, _mm256_or_si256(rb, ag));
+    }
+    for (; length; length--, dest++, src++)
+        *dest = INTERPOLATE_PIXEL_255(*src, const_alpha, *dest, ialpha);
+}
+
+AVX2_TARGET void Vcomp_func_SourceOver_avx2(uint32_t *dest, const uint32_t *src, int length,
+                                            uint32_t const_alpha)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    if (const_alpha == 255) {
+        const __m256i opaque = _mm256_set1_epi32(0xff000000);
+        for (; length >= 8; length -= 8, dest += 8, src += 8) {
+            __m256i v_src = _mm256_loadu_si256((const __m256i *)src);
+
+            // Transparent spans are common, and so are opaque ones
+            if (_mm256_testz_si256(v_src, v_src)) continue;
+            __m256i v_alpha = _mm256_and_si256(v_src, opaque);
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(v_alpha, opaque)) == -1) {
+                _mm256_storeu_si256((__m256i *)dest, v_src);
+                continue;
+            }
+
+            __m256i v_dest = _mm256_loadu_si256((__m256i *)dest);
+            __m256i result = _mm256_add_epi32(v_src, v8_byte_mul_avx2(v_dest, v8_ialpha_avx2(v_src)));
+            // Like the C version, leave destination untouched where source is 0
+            result = _mm256_blendv_epi8(result, v_dest, _mm256_cmpeq_epi32(v_src, zero));
+            _mm256_storeu_si256((__m256i *)dest, result);
+        }
+        for (; length; length--, dest++, src++) {
+            uint32_t s = *src;
+            if (s >= 0xff000000)
+                *dest = s;
+            else if (s != 0)
+                *dest = s + BYTE_MUL(*dest, vAlpha(~s));
+        }
+    } else {
+        const __m256i v_ca = _mm256_set1_epi32(const_alpha | (const_alpha << 16));
+        for (; length >= 8; length -= 8, dest += 8, src += 8) {
+            __m256i v_src  = v8_byte_mul_avx2(_mm256_loadu_si256((const __m256i *)src), v_ca);
+            __m256i v_dest = _mm256_loadu_si256((__m256i *)dest);
+            v_dest = _mm256_add_epi32(v_src, v8_byte_mul_avx2(v_dest, v8_ialpha_avx2(v_src)));
+            _mm256_storeu_si256((__m256i *)dest, v_dest);
+        }
+        for (; length; length--, dest++, src++) {
+            uint32_t s = BYTE_MUL(*src, const_alpha);
+            *dest = s + BYTE_MUL(*dest, vAlpha(~s));
+        }
+    }
+}
+
+#endif
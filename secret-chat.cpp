@@ -19,10 +19,10 @@ void updateKnownSecretChat(SecretChatId secretChatId, TdTransceiver &transceiver
     // TRANSLATOR: Default buddy-alias for a new secret chat. Argument is the Telegram nick, I think.
     std::string alias = formatMessage(_("Secret chat: {}"), chat->title_);
 
-    PurpleBuddy *buddy = purple_find_buddy(account.purpleAccount, purpleBuddyName.c_str());
+    PurpleBuddy *buddy = account.buddyList.findBuddy(purpleBuddyName.c_str());
     if (buddy == NULL) {
-        purple_debug_misc(config::pluginId, "Adding buddy '%s' for secret chat %d with %s\n",
-                          alias.c_str(), secretChatId.value(), chat->title_.c_str());
+        DEBUG_MISC("Adding buddy '%s' for secret chat %d with %s\n",
+                   alias.c_str(), secretChatId.value(), chat->title_.c_str());
         buddy = purple_buddy_new(account.purpleAccount, purpleBuddyName.c_str(), alias.c_str());
         purple_blist_add_buddy(buddy, NULL, NULL, NULL);
 
@@ -34,11 +34,11 @@ void updateKnownSecretChat(SecretChatId secretChatId, TdTransceiver &transceiver
             GError *err = NULL;
             g_file_get_contents(photo->local_->path_.c_str(), &img, &len, &err);
             if (err) {
-                purple_debug_warning(config::pluginId, "Failed to load photo %s for %s: %s\n",
-                                     photo->local_->path_.c_str(), purpleBuddyName.c_str(),  err->message);
+                DEBUG_WARNING("Failed to load photo %s for %s: %s\n",
+                              photo->local_->path_.c_str(), purpleBuddyName.c_str(),  err->message);
                 g_error_free(err);
             } else {
-                purple_debug_info(config::pluginId, "Using downloaded photo for %s\n", purpleBuddyName.c_str());
+                DEBUG_INFO("Using downloaded photo for %s\n", purpleBuddyName.c_str());
                 purple_buddy_icons_set_for_user(account.purpleAccount, purpleBuddyName.c_str(),
                                                 img, len, NULL);
             }
@@ -2,7 +2,18 @@
 #include "buildopt.h"
 #include "config.h"
 #include "format.h"
+#include "purple-info.h"
 #include "receiving.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <list>
+#include <map>
+#include <mutex>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifndef NoWebp
 #include <png.h>
@@ -17,8 +28,94 @@
 
 constexpr int MAX_W = 256;
 constexpr int MAX_H = 256;
-constexpr unsigned ANIMATED_WIDTH  = 200;
-constexpr unsigned ANIMATED_HEIGHT = 200;
+constexpr unsigned ANIMATED_MIN_SIZE = 32;
+constexpr unsigned ANIMATED_MAX_SIZE = 512;
+// GIF frame delays are in 1/100 s, and many viewers treat delays below 2 as "slow"
+constexpr unsigned GIF_MAX_FRAME_RATE = 50;
+// Conversions waiting or running, beyond which adaptive mode starts cutting corners
+constexpr unsigned ADAPTIVE_BACKLOG_LOW  = 4;
+constexpr unsigned ADAPTIVE_BACKLOG_HIGH = 8;
+
+static std::atomic<unsigned> g_animationCacheHits(0);
+static std::atomic<unsigned> g_animationCacheMisses(0);
+static std::atomic<uint64_t> g_parseTimeSaved(0);
+// Parsed animation cache size of each connected account, only used on main thread
+static std::map<PurpleAccount *, unsigned> g_accountCacheSizes;
+static unsigned                           g_modelCacheSize = 0;
+
+StickerCacheStats getStickerCacheStats()
+{
+    StickerCacheStats stats;
+    stats.hits           = g_animationCacheHits;
+    stats.misses         = g_animationCacheMisses;
+    stats.parseTimeSaved = g_parseTimeSaved;
+    return stats;
+}
+
+// Fully transparent pixels become background color. Others are put over background unless
+// transparent output is wanted: color is premultiplied, so background * (1 - alpha) is added.
+void argbToRgbaScalar(uint8_t *buffer, size_t pixelCount, uint32_t bgColor, bool transparent)
+{
+    const unsigned bg[3] = {(bgColor >> 16) & 0xff, (bgColor >> 8) & 0xff, bgColor & 0xff};
+
+    for (uint8_t *pixel = buffer; pixel < buffer + 4*pixelCount; pixel += 4) {
+        unsigned a = pixel[3];
+        if (a) {
+            uint8_t r = pixel[2];
+            uint8_t g = pixel[1];
+            uint8_t b = pixel[0];
+            unsigned ia = transparent ? 0 : 255 - a;
+            pixel[0] = r + bg[0] * ia / 255;
+            pixel[1] = g + bg[1] * ia / 255;
+            pixel[2] = b + bg[2] * ia / 255;
+        } else {
+            pixel[0] = bg[0];
+            pixel[1] = bg[1];
+            pixel[2] = bg[2];
+        }
+    }
+}
+
+void argbToRgba(uint8_t *buffer, size_t pixelCount, uint32_t bgColor, bool transparent)
+{
+#ifdef __SSE2__
+    const __m128i zero     = _mm_setzero_si128();
+    const __m128i ff       = _mm_set1_epi32(0xff);
+    const __m128i rbMask   = _mm_set1_epi32(0x00ff00ff);
+    const __m128i agMask   = _mm_set1_epi32(0xff00ff00);
+    // Background in 16-bit lanes, in output byte order: R, G, B, nothing added to alpha
+    const __m128i bg       = _mm_set_epi16(0, bgColor & 0xff, (bgColor >> 8) & 0xff, (bgColor >> 16) & 0xff,
+                                           0, bgColor & 0xff, (bgColor >> 8) & 0xff, (bgColor >> 16) & 0xff);
+    const __m128i one      = _mm_set1_epi16(1);
+
+    for (; pixelCount >= 4; pixelCount -= 4, buffer += 16) {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<__m128i *>(buffer));
+        __m128i alpha  = _mm_srli_epi32(pixels, 24);
+        __m128i isZero = _mm_cmpeq_epi32(alpha, zero);
+
+        // Background weight: 1 for transparent pixels, 1 - alpha (or 0) for the rest
+        __m128i weight = transparent ? zero : _mm_sub_epi32(ff, alpha);
+        weight = _mm_or_si128(_mm_andnot_si128(isZero, weight), _mm_and_si128(isZero, ff));
+        weight = _mm_or_si128(weight, _mm_slli_epi32(weight, 16));
+
+        // Swap R and B, and drop color of fully transparent pixels (alpha stays 0)
+        __m128i rb    = _mm_and_si128(pixels, rbMask);
+        __m128i color = _mm_or_si128(_mm_and_si128(pixels, agMask),
+                                     _mm_or_si128(_mm_srli_epi32(rb, 16), _mm_slli_epi32(rb, 16)));
+        color = _mm_andnot_si128(isZero, color);
+
+        // bg * weight / 255, rounded down: (t + 1 + (t >> 8)) >> 8 is exact for t <= 255*255
+        __m128i tLo = _mm_mullo_epi16(bg, _mm_unpacklo_epi32(weight, weight));
+        __m128i tHi = _mm_mullo_epi16(bg, _mm_unpackhi_epi32(weight, weight));
+        tLo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(tLo, one), _mm_srli_epi16(tLo, 8)), 8);
+        tHi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(tHi, one), _mm_srli_epi16(tHi, 8)), 8);
+
+        color = _mm_add_epi8(color, _mm_packus_epi16(tLo, tHi));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer), color);
+    }
+#endif
+    argbToRgbaScalar(buffer, pixelCount, bgColor, transparent);
+}
 
 #ifndef NoWebp
 
@@ -28,9 +125,13 @@ static void p2tgl_png_mem_write (png_structp png_ptr, png_bytep data, png_size_t
     g_byte_array_append (png_mem, data, length);
 }
 
-static int p2tgl_imgstore_add_with_id_png (const unsigned char *raw_bitmap, unsigned width, unsigned height)
+static void p2tgl_png_mem_flush (png_structp png_ptr)
+{
+}
+
+static bool encodePng(const unsigned char *raw_bitmap, unsigned width, unsigned height,
+                      GByteArray *png_mem, std::string &errorMessage)
 {
-    GByteArray *png_mem = NULL;
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
     png_bytepp rows = NULL;
@@ -38,45 +139,45 @@ static int p2tgl_imgstore_add_with_id_png (const unsigned char *raw_bitmap, unsi
     // init png write struct
     png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (png_ptr == NULL) {
-        purple_debug_misc(config::pluginId, "error encoding png (create_write_struct failed)\n");
-        return 0;
+        // Unlikely error message not worth translating
+        errorMessage = "error encoding png (create_write_struct failed)";
+        return false;
     }
 
     // init png info struct
     info_ptr = png_create_info_struct (png_ptr);
     if (info_ptr == NULL) {
         png_destroy_write_struct(&png_ptr, NULL);
-        purple_debug_misc(config::pluginId, "error encoding png (create_info_struct failed)\n");
-        return 0;
+        // Unlikely error message not worth translating
+        errorMessage = "error encoding png (create_info_struct failed)";
+        return false;
     }
 
+    // alloc row pointers
+    rows = g_new0 (png_bytep, height);
+
     // Set up error handling.
     if (setjmp(png_jmpbuf(png_ptr))) {
         png_destroy_write_struct(&png_ptr, &info_ptr);
-        purple_debug_misc(config::pluginId, "error while writing png\n");
-        return 0;
+        g_free(rows);
+        // Unlikely error message not worth translating
+        errorMessage = "error while writing png";
+        return false;
     }
 
     // set img attributes
     png_set_IHDR (png_ptr, info_ptr, width, height,
                     8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-    // alloc row pointers
-    rows = g_new0 (png_bytep, height);
-    if (rows == NULL) {
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        purple_debug_misc(config::pluginId, "error converting to png: malloc failed\n");
-        return 0;
-    }
+    // The result only lives in imgstore for the session, so favour speed over size
+    png_set_compression_level(png_ptr, 1);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
 
     unsigned i;
     for (i = 0; i < height; i++)
         rows[i] = (png_bytep)(raw_bitmap + i * width * 4);
 
-    // create array and set own png write function
-    png_mem = g_byte_array_new();
-    png_set_write_fn (png_ptr, png_mem, p2tgl_png_mem_write, NULL);
+    png_set_write_fn (png_ptr, png_mem, p2tgl_png_mem_write, p2tgl_png_mem_flush);
 
     // write png
     png_set_rows (png_ptr, info_ptr, rows);
@@ -85,31 +186,30 @@ static int p2tgl_imgstore_add_with_id_png (const unsigned char *raw_bitmap, unsi
     // cleanup
     g_free(rows);
     png_destroy_write_struct (&png_ptr, &info_ptr);
-    unsigned png_size = png_mem->len;
-    gpointer png_data = g_byte_array_free (png_mem, FALSE);
-
-    return purple_imgstore_add_with_id (png_data, png_size, NULL);
+    return true;
 }
 
-static int p2tgl_imgstore_add_with_id_webp (const char *filename)
+static bool decodeWebpToPng(const char *filename, gchar *&pngData, gsize &pngSize,
+                            std::string &errorMessage)
 {
     const uint8_t *data = NULL;
     size_t len;
     GError *err = NULL;
     g_file_get_contents (filename, (gchar **) &data, &len, &err);
     if (err) {
-        purple_debug_misc(config::pluginId, "cannot open file %s: %s\n", filename, err->message);
+        errorMessage = err->message;
         g_error_free(err);
-        return 0;
+        return false;
     }
 
     // downscale oversized sticker images displayed in chat, otherwise it would harm readabillity
     WebPDecoderConfig config;
     WebPInitDecoderConfig (&config);
     if (WebPGetFeatures(data, len, &config.input) != VP8_STATUS_OK) {
-        purple_debug_misc(config::pluginId, "error reading webp bitstream: %s\n", filename);
+        // Unlikely error message not worth translating
+        errorMessage = "error reading webp bitstream";
         g_free ((gchar *)data);
-        return 0;
+        return false;
     }
 
     config.options.use_scaling = 0;
@@ -131,47 +231,71 @@ static int p2tgl_imgstore_add_with_id_webp (const char *filename)
         // (or double), and only THEN cast back to int.
         config.options.scaled_width = (int) (config.options.scaled_width * max_scale_height);
         }
+        // Scaling is done by libwebp while decoding, using its own SIMD code paths
         config.options.use_scaling = 1;
     }
     config.output.colorspace = MODE_RGBA;
     if (WebPDecode(data, len, &config) != VP8_STATUS_OK) {
-        purple_debug_misc(config::pluginId, "error decoding webp: %s\n", filename);
+        // Unlikely error message not worth translating
+        errorMessage = "error decoding webp";
         g_free ((gchar *)data);
-        return 0;
+        return false;
     }
     g_free ((gchar *)data);
     const uint8_t *decoded = config.output.u.RGBA.rgba;
+    unsigned width  = config.options.scaled_width;
+    unsigned height = config.options.scaled_height;
 
-    // convert and add
-    int imgStoreId = p2tgl_imgstore_add_with_id_png(decoded, config.options.scaled_width, config.options.scaled_height);
+    // Raw size plus per-row filter bytes is a good upper estimate at fast compression level
+    GByteArray *png_mem = g_byte_array_sized_new(width * height * 4 + height + 1024);
+    bool success = encodePng(decoded, width, height, png_mem, errorMessage);
     WebPFreeDecBuffer (&config.output);
-    return imgStoreId;
+
+    if (success) {
+        pngSize = png_mem->len;
+        pngData = reinterpret_cast<gchar *>(g_byte_array_free (png_mem, FALSE));
+    } else
+        g_byte_array_free (png_mem, TRUE);
+
+    return success;
 }
 
 #else
 
-int p2tgl_imgstore_add_with_id_webp (const char *filename)
+static bool decodeWebpToPng(const char *filename, gchar *&pngData, gsize &pngSize,
+                            std::string &errorMessage)
 {
-    return 0;
+    errorMessage = "Not supported";
+    return false;
 }
 
 #endif
 
-void showWebpSticker(const td::td_api::chat &chat, const TgMessageInfo &message,
-                     const std::string &filePath, const std::string &fileDescription,
-                     TdAccountData &account)
+bool canDecodeWebpSticker()
 {
-    int id = p2tgl_imgstore_add_with_id_webp(filePath.c_str());
-    if (id != 0) {
-        std::string text = makeInlineImageText(id);
-        showMessageText(account, chat, message, text.c_str(), NULL, PURPLE_MESSAGE_IMAGES);
-    } else
-        showGenericFileInline(chat, message, filePath, NULL, fileDescription, account);
+#ifndef NoWebp
+    return true;
+#else
+    return false;
+#endif
 }
 
 #ifndef NoLottie
 
-static bool gunzip(gchar *compressedData, gsize compressedSize, std::string &output,
+// Largest plausible .tgs contents, so that a corrupt gzip trailer can't make us allocate gigabytes
+constexpr size_t MAX_UNPACKED_SIZE = 64 * 1024 * 1024;
+
+// Last 4 bytes of a gzip stream are the uncompressed size modulo 2^32, little-endian
+static size_t getGzipUncompressedSize(const uint8_t *data, size_t size)
+{
+    if (size < 18)
+        return 0;
+    const uint8_t *trailer = data + size - 4;
+    return size_t(trailer[0]) | (size_t(trailer[1]) << 8) | (size_t(trailer[2]) << 16) |
+           (size_t(trailer[3]) << 24);
+}
+
+bool gunzipSticker(const uint8_t *compressedData, size_t compressedSize, std::string &output,
                    std::string &errorMessage)
 {
     z_stream strm;
@@ -187,28 +311,29 @@ static bool gunzip(gchar *compressedData, gsize compressedSize, std::string &out
         return false;
     }
 
-    if (compressedSize) {
-        char unzipBuffer[16384];
-        strm.avail_in = compressedSize;
-        strm.next_in  = reinterpret_cast<uint8_t *>(compressedData);
-        do {
-            strm.avail_out = sizeof(unzipBuffer);
-            strm.next_out = reinterpret_cast<uint8_t *>(unzipBuffer);
-            unzipResult = inflate(&strm, Z_NO_FLUSH);
-            if ((unzipResult != Z_OK) && (unzipResult != Z_STREAM_END))
-                break;
-
-            if (strm.avail_out > sizeof(unzipBuffer)) {
-                unzipResult = Z_STREAM_ERROR;
+    size_t expectedSize = std::min(getGzipUncompressedSize(compressedData, compressedSize),
+                                   MAX_UNPACKED_SIZE);
+    output.resize(std::max<size_t>(expectedSize, 4096));
+    strm.avail_in = compressedSize;
+    strm.next_in  = const_cast<uint8_t *>(compressedData);
+
+    // Runs once even for empty input, which is then not an error
+    while (unzipResult == Z_OK) {
+        if (strm.total_out == output.size()) {
+            if (output.size() >= MAX_UNPACKED_SIZE) {
+                unzipResult = Z_MEM_ERROR;
                 break;
             }
-            unsigned have = sizeof(unzipBuffer) - strm.avail_out;
-            output.append(unzipBuffer, have);
-        } while (strm.avail_out == 0);
+            output.resize(std::min(2 * output.size(), MAX_UNPACKED_SIZE));
+        }
+        strm.next_out  = reinterpret_cast<uint8_t *>(&output[strm.total_out]);
+        strm.avail_out = output.size() - strm.total_out;
+        unzipResult = inflate(&strm, Z_NO_FLUSH);
     }
+    output.resize(strm.total_out);
     (void)inflateEnd(&strm);
 
-    if ((unzipResult != Z_OK) && (unzipResult != Z_STREAM_END)) {
+    if (compressedSize && (unzipResult != Z_STREAM_END)) {
         // Unlikely error message not worth translating
         errorMessage = "Decompression error";
         return false;
@@ -220,12 +345,9 @@ class GifBuilder {
 public:
     explicit GifBuilder(int fd, const uint32_t width,
                         const uint32_t height, const uint32_t bgColor=0xffffffff, const uint32_t delay = 2)
+    : bgColor(bgColor), transparent((bgColor >> 24) < 0x80)
     {
         GifBegin(&handle, fd, width, height, delay);
-        bgColorR = (uint8_t) ((bgColor & 0xff0000) >> 16);
-        bgColorG = (uint8_t) ((bgColor & 0x00ff00) >> 8);
-        bgColorB = (uint8_t) ((bgColor & 0x0000ff));
-        transparent = ((bgColor >> 24) < 0x80);
     }
     ~GifBuilder()
     {
@@ -233,7 +355,8 @@ public:
     }
     void addFrame(rlottie::Surface &s, uint32_t delay = 2)
     {
-        argbTorgba(s);
+        argbToRgba(reinterpret_cast<uint8_t *>(s.buffer()), s.height() * s.bytesPerLine() / 4,
+                   bgColor, transparent);
         GifWriteFrame(&handle,
                       reinterpret_cast<uint8_t *>(s.buffer()),
                       s.width(),
@@ -241,72 +364,126 @@ public:
                       delay,
                       transparent);
     }
-    void argbTorgba(rlottie::Surface &s)
+
+private:
+    GifWriter      handle;
+    const uint32_t bgColor;
+    const bool     transparent;
+};
+
+// Animated sticker conversions running now, for adaptive rendering
+static std::atomic<unsigned> g_pendingConversions(0);
+
+namespace {
+struct PendingConversionGuard {
+    PendingConversionGuard()  { g_pendingConversions++; }
+    ~PendingConversionGuard() { g_pendingConversions--; }
+};
+
+// Animations parsed from recently converted stickers, most recently used first. A conversion thread
+// takes its entry out while rendering and puts it back afterwards, so an Animation is never used by
+// two threads at once; concurrent conversions of the same sticker just parse it again.
+class AnimationCache {
+public:
+    std::unique_ptr<rlottie::Animation> take(const std::string &key, gint64 &loadTime)
     {
-        uint8_t *buffer = reinterpret_cast<uint8_t *>(s.buffer());
-        uint32_t totalBytes = s.height() * s.bytesPerLine();
-
-        for (uint32_t i = 0; i < totalBytes; i += 4) {
-           unsigned char a = buffer[i+3];
-           // compute only if alpha is non zero
-           if (a) {
-               unsigned char r = buffer[i+2];
-               unsigned char g = buffer[i+1];
-               unsigned char b = buffer[i];
-
-               if (!transparent && (a != 255)) { //un premultiply
-                   unsigned char r2 = (unsigned char) ((float) bgColorR * ((float) (255 - a) / 255));
-                   unsigned char g2 = (unsigned char) ((float) bgColorG * ((float) (255 - a) / 255));
-                   unsigned char b2 = (unsigned char) ((float) bgColorB * ((float) (255 - a) / 255));
-                   buffer[i] = r + r2;
-                   buffer[i+1] = g + g2;
-                   buffer[i+2] = b + b2;
-
-               } else {
-                 // only swizzle r and b
-                 buffer[i] = r;
-                 buffer[i+2] = b;
-               }
-           } else {
-               buffer[i+2] = bgColorB;
-               buffer[i+1] = bgColorG;
-               buffer[i] = bgColorR;
-           }
-        }
+        std::lock_guard<std::mutex> guard(m_mutex);
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+            if (it->key == key) {
+                std::unique_ptr<rlottie::Animation> animation = std::move(it->animation);
+                loadTime = it->loadTime;
+                m_entries.erase(it);
+                return animation;
+            }
+        return nullptr;
     }
 
+    void put(const std::string &key, std::unique_ptr<rlottie::Animation> animation,
+             gint64 loadTime, size_t capacity)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+            if (it->key == key) {
+                m_entries.erase(it);
+                break;
+            }
+        m_entries.push_front(Entry{key, std::move(animation), loadTime});
+        while (m_entries.size() > capacity)
+            m_entries.pop_back();
+    }
 private:
-    GifWriter      handle;
-    uint8_t bgColorR, bgColorG, bgColorB;
-    bool    transparent;
+    struct Entry {
+        std::string                         key;
+        std::unique_ptr<rlottie::Animation> animation;
+        gint64                              loadTime; // Reading, unpacking and parsing, microseconds
+    };
+    std::mutex       m_mutex;
+    std::list<Entry> m_entries;
 };
 
-void StickerConversionThread::run()
-{
-    gchar  *compressedData = NULL;
-    gsize   compressedSize = 0;
-    GError *error = NULL;
+AnimationCache g_animationCache;
+}
 
-    g_file_get_contents(inputFileName.c_str(), &compressedData, &compressedSize, &error);
+static std::unique_ptr<rlottie::Animation> loadAnimation(const std::string &fileName,
+                                                         const std::string &cacheKey,
+                                                         std::string &errorMessage)
+{
+    GError      *error = NULL;
+    GMappedFile *compressedFile = g_mapped_file_new(fileName.c_str(), FALSE, &error);
     if (error) {
-        m_errorMessage = error->message;
+        errorMessage = error->message;
         g_error_free(error);
-        return;
+        return nullptr;
     }
 
     std::string lottieData;
-    bool gunzipSuccess = gunzip(compressedData, compressedSize, lottieData, m_errorMessage);
-    g_free(compressedData);
+    bool gunzipSuccess = gunzipSticker(reinterpret_cast<const uint8_t *>(g_mapped_file_get_contents(compressedFile)),
+                                       g_mapped_file_get_length(compressedFile), lottieData, errorMessage);
+    g_mapped_file_unref(compressedFile);
     if (!gunzipSuccess)
-        return;
+        return nullptr;
 
-    std::unique_ptr<rlottie::Animation> player = rlottie::Animation::loadFromData(lottieData, "");
-    if (!player) {
+    // rlottie parses the string in place once it's moved in, so the JSON is never copied. It also
+    // keeps its own cache of parsed models, which is no use without a key.
+    std::unique_ptr<rlottie::Animation> player = rlottie::Animation::loadFromData(
+        std::move(lottieData), cacheKey, "", !cacheKey.empty());
+    if (!player)
         // Unlikely error message not worth translating
-        m_errorMessage = "Could not render animation";
+        errorMessage = "Could not render animation";
+    return player;
+}
+
+void StickerConversionThread::run()
+{
+    TRACE_SPAN("StickerConversionThread::run", "animated", m_animated);
+    if (!m_animated) {
+        decodeWebpToPng(inputFileName.c_str(), m_imageData, m_imageSize, m_errorMessage);
         return;
     }
 
+    PendingConversionGuard pendingGuard;
+    const bool useCache = m_cacheSize && !m_cacheKey.empty();
+    std::unique_ptr<rlottie::Animation> player;
+    gint64 loadTime = 0;
+
+    if (useCache)
+        player = g_animationCache.take(m_cacheKey, loadTime);
+    if (player) {
+        m_cacheHit       = true;
+        m_loadTime       = loadTime;
+        m_cacheHits      = ++g_animationCacheHits;
+        m_cacheMisses    = g_animationCacheMisses;
+        m_parseTimeSaved = g_parseTimeSaved += loadTime;
+    } else {
+        gint64 startTime = g_get_monotonic_time();
+        player = loadAnimation(inputFileName, m_cacheKey, m_errorMessage);
+        if (!player)
+            return;
+        loadTime = g_get_monotonic_time() - startTime;
+        if (useCache)
+            g_animationCacheMisses++;
+    }
+
     char *tempFileName = NULL;
     int fd = g_file_open_tmp("tdlib_sticker_XXXXXX", &tempFileName, NULL);
     if (fd < 0) {
@@ -317,28 +494,149 @@ void StickerConversionThread::run()
     m_outputFileName = tempFileName;
     g_free(tempFileName);
 
-    unsigned w = ANIMATED_WIDTH;
-    unsigned h = ANIMATED_HEIGHT;
+    unsigned size        = m_size;
+    unsigned frameRate   = m_frameRate;
+    double   maxDuration = m_maxDuration;
+    if (m_adaptive) {
+        // Count includes this conversion
+        unsigned backlog = g_pendingConversions;
+        if (backlog >= ADAPTIVE_BACKLOG_LOW) {
+            size      = std::min(size, 128U);
+            frameRate = frameRate ? std::min(frameRate, 15U) : 15;
+        }
+        if (backlog >= ADAPTIVE_BACKLOG_HIGH) {
+            frameRate   = std::min(frameRate, 8U);
+            maxDuration = maxDuration ? std::min(maxDuration, 3.0) : 3;
+        }
+        if (backlog >= ADAPTIVE_BACKLOG_LOW) {
+            m_backlog           = backlog;
+            m_renderedFrameRate = frameRate;
+            m_renderedSize      = size;
+        }
+    }
+
+    size_t frameCount  = player->totalFrame();
+    double sourceRate  = player->frameRate();
+    if (!(sourceRate > 0)) sourceRate = GIF_MAX_FRAME_RATE;
+    double targetRate  = frameRate ? std::min<double>(frameRate, sourceRate) : sourceRate;
+    targetRate         = std::min<double>(targetRate, GIF_MAX_FRAME_RATE);
+    double duration    = frameCount / sourceRate;
+    if ((maxDuration > 0) && (duration > maxDuration))
+        duration = maxDuration;
+    size_t outputFrames = std::max<size_t>(1, std::lround(duration * targetRate));
+
+    unsigned w = size;
+    unsigned h = size;
     auto buffer = std::unique_ptr<uint32_t[]>(new uint32_t[w * h]);
-    size_t frameCount = player->totalFrame();
 
+    // Output frame n is shown at n/targetRate seconds. Delays are computed from rounded absolute
+    // timestamps, so that rounding to 1/100 s doesn't accumulate into a speed change.
     GifBuilder builder(fd, w, h, UINT32_MAX);
-    for (size_t i = 0; i < frameCount ; i++) {
+    size_t lastFrame = frameCount ? frameCount - 1 : 0;
+    for (size_t n = 0; n < outputFrames; n++) {
+        size_t   sourceFrame = std::min(lastFrame, static_cast<size_t>(n * sourceRate / targetRate));
+        unsigned start       = std::lround(n * 100 / targetRate);
+        unsigned end         = std::lround((n + 1) * 100 / targetRate);
         rlottie::Surface surface(buffer.get(), w, h, w * 4);
-        player->renderSync(i, surface);
-        builder.addFrame(surface);
+        player->renderSync(sourceFrame, surface);
+        builder.addFrame(surface, std::max(end - start, 2U));
     }
+
+    if (useCache)
+        g_animationCache.put(m_cacheKey, std::move(player), loadTime, m_cacheSize);
 }
 
 #else
 
 void StickerConversionThread::run()
 {
-    m_errorMessage = "Not supported";
+    TRACE_SPAN("StickerConversionThread::run", "animated", m_animated);
+    if (!m_animated)
+        decodeWebpToPng(inputFileName.c_str(), m_imageData, m_imageSize, m_errorMessage);
+    else
+        m_errorMessage = "Not supported";
 }
 
 #endif
 
+static void configureModelCacheSize()
+{
+    unsigned size = 0;
+    for (const auto &account: g_accountCacheSizes)
+        size = std::max(size, account.second);
+    if (size == g_modelCacheSize)
+        return;
+    g_modelCacheSize = size;
+#ifndef NoLottie
+    rlottie::configureModelCacheSize(size);
+#endif
+}
+
+void addStickerCacheAccount(PurpleAccount *account)
+{
+    int cacheSize = purple_account_get_int(account, AccountOptions::AnimatedStickerCacheSize,
+                                           AccountOptions::AnimatedStickerCacheSizeDefault);
+    g_accountCacheSizes[account] = std::max(cacheSize, 0);
+    configureModelCacheSize();
+}
+
+void removeStickerCacheAccount(PurpleAccount *account)
+{
+    g_accountCacheSizes.erase(account);
+    configureModelCacheSize();
+}
+
+void StickerConversionThread::init(PurpleAccount *purpleAccount)
+{
+    m_animated = isStickerAnimated(inputFileName);
+    if (!m_animated)
+        return;
+
+    int frameRate   = purple_account_get_int(purpleAccount, AccountOptions::AnimatedStickerFps,
+                                             AccountOptions::AnimatedStickerFpsDefault);
+    int maxDuration = purple_account_get_int(purpleAccount, AccountOptions::AnimatedStickerMaxDuration,
+                                             AccountOptions::AnimatedStickerMaxDurationDefault);
+    int size        = purple_account_get_int(purpleAccount, AccountOptions::AnimatedStickerSize,
+                                             AccountOptions::AnimatedStickerSizeDefault);
+
+    m_frameRate   = std::max(frameRate, 0);
+    m_maxDuration = std::max(maxDuration, 0);
+    if (size <= 0)
+        size = AccountOptions::AnimatedStickerSizeDefault;
+    m_size        = std::min(std::max(unsigned(size), ANIMATED_MIN_SIZE), ANIMATED_MAX_SIZE);
+    m_adaptive    = purple_account_get_bool(purpleAccount, AccountOptions::AnimatedStickerAdaptive,
+                                            AccountOptions::AnimatedStickerAdaptiveDefault);
+    int cacheSize = purple_account_get_int(purpleAccount, AccountOptions::AnimatedStickerCacheSize,
+                                           AccountOptions::AnimatedStickerCacheSizeDefault);
+    m_cacheSize   = std::max(cacheSize, 0);
+    m_cacheKey    = m_message.stickerFileId;
+}
+
+void StickerConversionThread::logConversion() const
+{
+    if (m_cacheHit)
+        DEBUG_MISC("Reused parsed animation for sticker %s, saved %.1f ms (%u hits, %u misses, %.1f ms saved in total)\n",
+                   m_cacheKey.c_str(), m_loadTime / 1000.0, m_cacheHits, m_cacheMisses,
+                   m_parseTimeSaved / 1000.0);
+    if (m_backlog)
+        DEBUG_MISC("Sticker conversion backlog %u: rendered at %u fps, %ux%u\n",
+                   m_backlog, m_renderedFrameRate, m_renderedSize, m_renderedSize);
+}
+
+StickerConversionThread::~StickerConversionThread()
+{
+    g_free(m_imageData);
+}
+
+gchar *StickerConversionThread::takeImageData(gsize &size)
+{
+    gchar *result = m_imageData;
+    size = m_imageSize;
+    m_imageData = NULL;
+    m_imageSize = 0;
+    return result;
+}
+
 StickerConversionThread::Callback StickerConversionThread::g_callback = nullptr;
 
 void StickerConversionThread::setCallback(AccountThread::Callback callback)
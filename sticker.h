@@ -1,16 +1,64 @@
 #ifndef _STICKER_H
 #define _STICKER_H
 
+#include "buildopt.h"
 #include "client-utils.h"
 
-void showWebpSticker(const td::td_api::chat &chat, const TgMessageInfo &message,
-                     const std::string &filePath, const std::string &fileDescription,
-                     TdAccountData &account);
+bool canDecodeWebpSticker();
 
+// Converts rendered frame from premultiplied ARGB32 to RGBA for gif encoder in place, putting it
+// over background color unless transparent. The scalar version is the reference implementation.
+void argbToRgba(uint8_t *buffer, size_t pixelCount, uint32_t bgColor, bool transparent);
+void argbToRgbaScalar(uint8_t *buffer, size_t pixelCount, uint32_t bgColor, bool transparent);
+
+#ifndef NoLottie
+// Inflates .tgs file contents straight into output, which is sized up front from the gzip trailer
+// and only grown if the trailer was wrong. Fails for broken streams and above 64 MB of output.
+bool gunzipSticker(const uint8_t *compressedData, size_t compressedSize, std::string &output,
+                   std::string &errorMessage);
+#endif
+
+struct StickerCacheStats {
+    unsigned hits;
+    unsigned misses;
+    uint64_t parseTimeSaved; // Microseconds not spent reading, unpacking and parsing .tgs files
+};
+
+// Reuse of parsed animated stickers across conversions, for all accounts
+StickerCacheStats getStickerCacheStats();
+// rlottie's model cache is shared too, so it is sized for the account with the largest
+// parsed animation cache. Called on main thread when account connects and disconnects.
+void addStickerCacheAccount(PurpleAccount *account);
+void removeStickerCacheAccount(PurpleAccount *account);
+
+// Converts sticker file to an image that can be put into imgstore: .tgs into animated gif file,
+// anything else is decoded as webp into in-memory png
 class StickerConversionThread: public AccountThread {
 private:
     std::string   m_errorMessage;
     std::string   m_outputFileName;
+    gchar        *m_imageData   = NULL;
+    gsize         m_imageSize   = 0;
+    bool          m_animated    = false;
+    // Rendering budget, read from account options on main thread
+    unsigned      m_frameRate   = 0;
+    unsigned      m_maxDuration = 0;
+    unsigned      m_size        = 0;
+    bool          m_adaptive    = false;
+    // What adaptive mode chose, for logging on main thread (conversion backlog 0 if it did nothing)
+    unsigned      m_backlog     = 0;
+    unsigned      m_renderedFrameRate = 0;
+    unsigned      m_renderedSize      = 0;
+    // Parsed animations are cached by remote file unique id
+    unsigned      m_cacheSize   = 0;
+    std::string   m_cacheKey;
+    // Cache hit and totals at the time, for logging on main thread
+    bool          m_cacheHit       = false;
+    gint64        m_loadTime       = 0;
+    unsigned      m_cacheHits      = 0;
+    unsigned      m_cacheMisses    = 0;
+    uint64_t      m_parseTimeSaved = 0;
+    void init(PurpleAccount *purpleAccount);
     void run() override;
 
     static Callback g_callback;
@@ -22,18 +70,30 @@ public:
     StickerConversionThread(PurpleAccount *purpleAccount, const std::string &filename,
                             ChatId chatId, TgMessageInfo &&message)
     : AccountThread(purpleAccount), m_message(std::move(message)), inputFileName(filename),
-        chatId(chatId) {}
+        chatId(chatId)
+    {
+        init(purpleAccount);
+    }
     StickerConversionThread(PurpleAccount *purpleAccount, const std::string &filename,
                             ChatId chatId, const TgMessageInfo *message)
     : AccountThread(purpleAccount), inputFileName(filename), chatId(chatId)
     {
         if (message)
             m_message.assign(*message);
+        init(purpleAccount);
     }
 
+    ~StickerConversionThread();
+
+    bool               isAnimated()        const { return m_animated; }
+    // Animated stickers are converted into this file
     const std::string &getOutputFileName() const { return m_outputFileName; }
+    // Other stickers are converted into png data, allocated with g_malloc
+    gchar             *takeImageData(gsize &size);
     const std::string &getErrorMessage()   const { return m_errorMessage; }
     const TgMessageInfo &message()         const { return m_message; }
+    // Debug output about the conversion, which cannot be written from the worker thread
+    void               logConversion()     const;
 
     static void setCallback(Callback callback);
 };
@@ -8,6 +8,7 @@
 #include "secret-chat.h"
 #include "sticker.h"
 #include "receiving.h"
+#include "trace.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <algorithm>
@@ -15,15 +16,39 @@
 enum {
     // Typing notifications seems to be resent every 5-6 seconds, so 10s timeout hould be appropriate
     REMOTE_TYPING_NOTICE_TIMEOUT = 10,
-    SUPERGROUP_MEMBER_LIMIT      = 200,
+    // Maximum page size for getSupergroupMembers
+    SUPERGROUP_MEMBER_PAGE_SIZE  = 200,
+    // Buddy status changes are collected for this long before buddy list is updated
+    USER_STATUS_TICK             = 1,
+    // Memory report goes to debug log this often, in seconds
+    MEMORY_REPORT_INTERVAL       = 600,
+    // File cache is trimmed to configured limits this long after login, then at this interval
+    FILE_CACHE_CLEANUP_DELAY     = 600,
+    FILE_CACHE_CLEANUP_INTERVAL  = 6*3600,
+    // Cleanup waits until no updates have arrived for this long, checking again after as long
+    FILE_CACHE_CLEANUP_IDLE      = 60,
 };
 
 PurpleTdClient::PurpleTdClient(PurpleAccount *acct, ITransceiverBackend *testBackend)
 :   m_transceiver(this, acct, &PurpleTdClient::processUpdate, testBackend),
     m_data(acct, m_transceiver)
 {
-    StickerConversionThread::setCallback(&PurpleTdClient::onAnimatedStickerConverted);
+    StickerConversionThread::setCallback(&PurpleTdClient::onStickerConverted);
+    FileHashThread::setCallback(&PurpleTdClient::onFileHashed);
     m_account = acct;
+    addStickerCacheAccount(acct);
+    removeStaleImageFiles();
+    m_keepDebugLog = purple_account_get_bool(acct, AccountOptions::KeepDebugLog,
+                                             AccountOptions::KeepDebugLogDefault);
+    if (m_keepDebugLog)
+        DebugLog::retainVerbose();
+    m_recordTimeline = purple_account_get_bool(acct, AccountOptions::RecordTimeline,
+                                               AccountOptions::RecordTimelineDefault);
+    if (m_recordTimeline)
+        Trace::retain();
+    m_transceiver.setQueryTimer(m_transceiver.reserveQueryId(), &PurpleTdClient::memoryReportTimer,
+                                MEMORY_REPORT_INTERVAL, false);
+    m_data.buddyList.build();
     setPurpleConnectionInProgress();
 }
 
@@ -52,6 +77,11 @@ PurpleTdClient::~PurpleTdClient()
         fullMessage.inlineDownloadTimeout = true;
 
     showMessages(messages, m_data);
+    if (m_keepDebugLog)
+        DebugLog::releaseVerbose();
+    if (m_recordTimeline)
+        Trace::release();
+    removeStickerCacheAccount(m_account);
 }
 
 void PurpleTdClient::setLogLevel(int level)
@@ -65,14 +95,50 @@ void PurpleTdClient::setTdlibFatalErrorCallback(td::Log::FatalErrorCallbackPtr c
     td::Log::set_fatal_error_callback(callback);
 }
 
+std::string PurpleTdClient::getMemoryReport()
+{
+    MemoryReport report;
+    m_data.getMemoryUsage(report);
+    m_transceiver.getMemoryUsage(report);
+
+    MemoryUsage images;
+    getPurpleImageUsage(images);
+    // TRANSLATOR: Memory report item, followed by count and size of images kept by the messenger program for showing in conversations, for all accounts together
+    report.push_back({_("Images in imgstore (all accounts)"), images});
+
+    CacheStatsReport cacheStats;
+    // TRANSLATOR: Memory report cache name, for files and images sent again without uploading
+    cacheStats.push_back({_("Upload cache"), m_data.uploadCache.getHits(), m_data.uploadCache.getMisses()});
+    StickerCacheStats stickerStats = getStickerCacheStats();
+    // TRANSLATOR: Memory report cache name, for animated stickers parsed once and shown again, for all accounts together
+    cacheStats.push_back({_("Animated sticker cache (all accounts)"), stickerStats.hits, stickerStats.misses});
+
+    return formatMemoryReport(report, cacheStats);
+}
+
+void PurpleTdClient::memoryReportTimer(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object)
+{
+    // Done even without debug log, as nothing else forgets released images
+    prunePurpleImages();
+    if (DebugLog::enabled(PURPLE_DEBUG_INFO)) {
+        std::string report = getMemoryReport();
+        DEBUG_INFO("%s: %s\n", purple_account_get_username(m_account), report.c_str());
+    }
+    m_transceiver.setQueryTimer(m_transceiver.reserveQueryId(), &PurpleTdClient::memoryReportTimer,
+                                MEMORY_REPORT_INTERVAL, false);
+}
+
 void PurpleTdClient::processUpdate(td::td_api::Object &update)
 {
-    purple_debug_misc(config::pluginId, "Incoming update\n");
+    // For running file cache cleanup while nothing else is happening
+    m_lastUpdateTime = g_get_monotonic_time();
+    DEBUG_TRACE("Incoming update\n");
 
     switch (update.get_id()) {
     case td::td_api::updateAuthorizationState::ID: {
+        TRACE_SPAN("updateAuthorizationState");
         auto &update_authorization_state = static_cast<td::td_api::updateAuthorizationState &>(update);
-        purple_debug_misc(config::pluginId, "Incoming update: authorization state\n");
+        DEBUG_TRACE("Incoming update: authorization state\n");
         if (update_authorization_state.authorization_state_) {
             m_lastAuthState = update_authorization_state.authorization_state_->get_id();
             processAuthorizationState(*update_authorization_state.authorization_state_);
@@ -81,101 +147,140 @@ void PurpleTdClient::processUpdate(td::td_api::Object &update)
     }
 
     case td::td_api::updateUser::ID: {
+        TRACE_SPAN("updateUser");
         auto &userUpdate = static_cast<td::td_api::updateUser &>(update);
         updateUser(std::move(userUpdate.user_));
         break;
     }
 
     case td::td_api::updateNewChat::ID: {
+        TRACE_SPAN("updateNewChat");
         auto &newChat = static_cast<td::td_api::updateNewChat &>(update);
-        purple_debug_misc(config::pluginId, "Incoming update: new chat\n");
+        DEBUG_TRACE("Incoming update: new chat\n");
         if (newChat.chat_->type_->get_id() == td::td_api::chatTypePrivate::ID ||
             newChat.chat_->type_->get_id() == td::td_api::chatTypeSecret::ID  ||
             m_data.isGroupChatWithMembership(*newChat.chat_.get()))
             addChat(std::move(newChat.chat_));
         else {
-            purple_debug_misc(config::pluginId,
-                              "Incoming update: ignorig ID=%d\n",
-                              update.get_id());
-            purple_debug_misc(config::pluginId,
-                              "Not adding a group that we are not a member of");
+            DEBUG_TRACE("Incoming update: ignorig ID=%d\n", update.get_id());
+            DEBUG_MISC("Not adding a group that we are not a member of");
         }
 
         break;
     }
 
     case td::td_api::updateNewMessage::ID: {
+        TRACE_SPAN("updateNewMessage");
         auto &newMessageUpdate = static_cast<td::td_api::updateNewMessage &>(update);
-        purple_debug_misc(config::pluginId, "Incoming update: new message\n");
+        DEBUG_TRACE("Incoming update: new message\n");
         if (newMessageUpdate.message_)
             onIncomingMessage(std::move(newMessageUpdate.message_));
         else
-            purple_debug_warning(config::pluginId, "Received null new message\n");
+            DEBUG_WARNING("Received null new message\n");
+        break;
+    }
+
+    case td::td_api::updateMessageContent::ID: {
+        TRACE_SPAN("updateMessageContent");
+        auto &contentUpdate = static_cast<const td::td_api::updateMessageContent &>(update);
+        DEBUG_TRACE("Incoming update: message content\n");
+        // Edited message is fetched again if it's replied to
+        m_data.recentMessages.remove(getChatId(contentUpdate), getMessageId(contentUpdate));
+        break;
+    }
+
+    case td::td_api::updateDeleteMessages::ID: {
+        TRACE_SPAN("updateDeleteMessages");
+        auto &deleteUpdate = static_cast<const td::td_api::updateDeleteMessages &>(update);
+        DEBUG_TRACE("Incoming update: delete messages\n");
+        // Messages only dropped from tdlib's cache are still there to be quoted
+        if (deleteUpdate.is_permanent_)
+            for (unsigned i = 0; i < deleteUpdate.message_ids_.size(); i++)
+                m_data.recentMessages.remove(getChatId(deleteUpdate), getMessageId(deleteUpdate, i));
         break;
     }
 
     case td::td_api::updateUserStatus::ID: {
+        TRACE_SPAN("updateUserStatus");
         auto &updateStatus = static_cast<td::td_api::updateUserStatus &>(update);
-        purple_debug_misc(config::pluginId, "Incoming update: user status\n");
+        DEBUG_TRACE("Incoming update: user status\n");
         if (updateStatus.status_)
             updateUserStatus(getUserId(updateStatus), std::move(updateStatus.status_));
         break;
     }
 
     case td::td_api::updateChatAction::ID: {
+        TRACE_SPAN("updateChatAction");
         auto &updateChatAction = static_cast<td::td_api::updateChatAction &>(update);
-        purple_debug_misc(config::pluginId, "Incoming update: chat action %d\n",
+        DEBUG_TRACE("Incoming update: chat action %d\n",
             updateChatAction.action_ ? updateChatAction.action_->get_id() : 0);
         handleUserChatAction(updateChatAction);
         break;
     }
 
     case td::td_api::updateBasicGroup::ID: {
+        TRACE_SPAN("updateBasicGroup");
         auto &groupUpdate = static_cast<td::td_api::updateBasicGroup &>(update);
         updateGroup(std::move(groupUpdate.basic_group_));
         break;
     }
 
     case td::td_api::updateSupergroup::ID: {
+        TRACE_SPAN("updateSupergroup");
         auto &groupUpdate = static_cast<td::td_api::updateSupergroup &>(update);
         updateSupergroup(std::move(groupUpdate.supergroup_));
         break;
     }
 
     case td::td_api::updateBasicGroupFullInfo::ID: {
+        TRACE_SPAN("updateBasicGroupFullInfo");
         auto &groupUpdate = static_cast<td::td_api::updateBasicGroupFullInfo &>(update);
         updateGroupFull(getBasicGroupId(groupUpdate), std::move(groupUpdate.basic_group_full_info_));
         break;
     };
 
     case td::td_api::updateSupergroupFullInfo::ID: {
+        TRACE_SPAN("updateSupergroupFullInfo");
         auto &groupUpdate = static_cast<td::td_api::updateSupergroupFullInfo &>(update);
         updateSupergroupFull(getSupergroupId(groupUpdate), std::move(groupUpdate.supergroup_full_info_));
         break;
     };
 
     case td::td_api::updateMessageSendSucceeded::ID: {
+        TRACE_SPAN("updateMessageSendSucceeded");
         auto &sendSucceeded = static_cast<const td::td_api::updateMessageSendSucceeded &>(update);
-        purple_debug_misc(config::pluginId, "Incoming update: message %" G_GINT64_FORMAT " send succeeded\n",
-                          sendSucceeded.old_message_id_);
-        removeTempFile(sendSucceeded.old_message_id_);
+        DEBUG_TRACE("Incoming update: message %" G_GINT64_FORMAT " send succeeded\n",
+                    sendSucceeded.old_message_id_);
+        std::string imagePath = m_data.extractTempFileUpload(sendSucceeded.old_message_id_);
+        if (sendSucceeded.message_)
+            updateUploadCache(sendSucceeded.old_message_id_, imagePath, *sendSucceeded.message_, true, m_data);
+        if (!imagePath.empty())
+            releaseImageFile(imagePath, m_data);
         break;
     }
 
     case td::td_api::updateMessageSendFailed::ID: {
+        TRACE_SPAN("updateMessageSendFailed");
         auto &sendFailed = static_cast<const td::td_api::updateMessageSendFailed &>(update);
-        purple_debug_misc(config::pluginId, "Incoming update: message %" G_GINT64_FORMAT " send failed\n",
-                          sendFailed.old_message_id_);
-        removeTempFile(sendFailed.old_message_id_);
+        DEBUG_TRACE("Incoming update: message %" G_GINT64_FORMAT " send failed\n",
+                    sendFailed.old_message_id_);
+        if (resendAfterFloodWait(sendFailed, m_transceiver, m_data, &PurpleTdClient::sendMessageResponse))
+            break;
+        std::string imagePath = m_data.extractTempFileUpload(sendFailed.old_message_id_);
+        if (sendFailed.message_)
+            updateUploadCache(sendFailed.old_message_id_, imagePath, *sendFailed.message_, false, m_data);
+        if (!imagePath.empty())
+            releaseImageFile(imagePath, m_data);
         notifySendFailed(sendFailed, m_data);
         // TODO notify in chat
         break;
     }
 
     case td::td_api::updateChatPosition::ID: {
+        TRACE_SPAN("updateChatPosition");
         auto &chatPositionUpdate = static_cast<td::td_api::updateChatPosition &>(update);
-        purple_debug_misc(config::pluginId, "Incoming update: update chat position for chat %" G_GINT64_FORMAT "\n",
-                          chatPositionUpdate.chat_id_);
+        DEBUG_TRACE("Incoming update: update chat position for chat %" G_GINT64_FORMAT "\n",
+                    chatPositionUpdate.chat_id_);
         if (chatPositionUpdate.position_)
             m_data.updateChatPosition(getChatId(chatPositionUpdate), std::move(chatPositionUpdate.position_));
         updateChat(m_data.getChat(getChatId(chatPositionUpdate)));
@@ -183,30 +288,34 @@ void PurpleTdClient::processUpdate(td::td_api::Object &update)
     }
 
     case td::td_api::updateChatTitle::ID: {
+        TRACE_SPAN("updateChatTitle");
         auto &chatTitleUpdate = static_cast<td::td_api::updateChatTitle &>(update);
-        purple_debug_misc(config::pluginId, "Incoming update: update chat title for chat %" G_GINT64_FORMAT "\n",
-                          chatTitleUpdate.chat_id_);
+        DEBUG_TRACE("Incoming update: update chat title for chat %" G_GINT64_FORMAT "\n",
+                    chatTitleUpdate.chat_id_);
         m_data.updateChatTitle(getChatId(chatTitleUpdate), chatTitleUpdate.title_);
         updateChat(m_data.getChat(getChatId(chatTitleUpdate)));
         break;
     }
 
     case td::td_api::updateChatLastMessage::ID: {
+        TRACE_SPAN("updateChatLastMessage");
         auto &lastMessage = static_cast<td::td_api::updateChatLastMessage &>(update);
         updateChatLastMessage(lastMessage);
         break;
     }
 
     case td::td_api::updateOption::ID: {
+        TRACE_SPAN("updateOption");
         const td::td_api::updateOption &option = static_cast<const td::td_api::updateOption &>(update);
         updateOption(option, m_data);
         break;
     }
 
     case td::td_api::updateFile::ID: {
+        TRACE_SPAN("updateFile");
         auto &fileUpdate = static_cast<const td::td_api::updateFile &>(update);
-        purple_debug_misc(config::pluginId, "Incoming update: file update, id %d\n",
-                          fileUpdate.file_ ? fileUpdate.file_->id_ : 0);
+        DEBUG_TRACE("Incoming update: file update, id %d\n",
+                    fileUpdate.file_ ? fileUpdate.file_->id_ : 0);
         if (fileUpdate.file_)
             updateFileTransferProgress(*fileUpdate.file_, m_transceiver, m_data,
                                        &PurpleTdClient::sendMessageResponse);
@@ -214,28 +323,29 @@ void PurpleTdClient::processUpdate(td::td_api::Object &update)
     };
 
     case td::td_api::updateSecretChat::ID: {
+        TRACE_SPAN("updateSecretChat");
         auto &chatUpdate = static_cast<td::td_api::updateSecretChat &>(update);
-        purple_debug_misc(config::pluginId, "Incoming update: secret chat, id %d\n",
-                          chatUpdate.secret_chat_ ? chatUpdate.secret_chat_->id_ : 0);
+        DEBUG_TRACE("Incoming update: secret chat, id %d\n",
+                    chatUpdate.secret_chat_ ? chatUpdate.secret_chat_->id_ : 0);
         updateSecretChat(std::move(chatUpdate.secret_chat_), m_transceiver, m_data);
         break;
     };
 
     case td::td_api::updateCall::ID: {
+        TRACE_SPAN("updateCall");
         auto &callUpdate = static_cast<const td::td_api::updateCall &>(update);
         if (callUpdate.call_) {
-            purpleDebug("Call update: id {}, outgoing={}, user id {}, state {}", {
-                        std::to_string(callUpdate.call_->id_),
-                        std::to_string(callUpdate.call_->user_id_),
-                        std::to_string((int)callUpdate.call_->is_outgoing_),
-                        std::to_string(callUpdate.call_->state_ ? callUpdate.call_->state_->get_id() : 0)});
+            purpleDebug("Call update: id {}, outgoing={}, user id {}, state {}",
+                        callUpdate.call_->id_, callUpdate.call_->user_id_, (int)callUpdate.call_->is_outgoing_,
+                        callUpdate.call_->state_ ? callUpdate.call_->state_->get_id() : 0);
             updateCall(*callUpdate.call_, m_data, m_transceiver);
         }
         break;
     };
 
     default:
-        purple_debug_misc(config::pluginId, "Incoming update: ignorig ID=%d\n", update.get_id());
+        TRACE_SPAN("update", "id", update.get_id());
+        DEBUG_TRACE("Incoming update: ignorig ID=%d\n", update.get_id());
         break;
     }
 }
@@ -244,17 +354,17 @@ void PurpleTdClient::processAuthorizationState(td::td_api::AuthorizationState &a
 {
     switch (authState.get_id()) {
     case td::td_api::authorizationStateWaitEmailAddress::ID:
-        purple_debug_misc(config::pluginId, "Authorization email requested\n");
+        DEBUG_MISC("Authorization email requested\n");
         requestAuthEmail();
         break;
 
     case td::td_api::authorizationStateWaitEmailCode::ID:
-        purple_debug_misc(config::pluginId, "Authorization email confirmation code requested\n");
+        DEBUG_MISC("Authorization email confirmation code requested\n");
         requestAuthEmailCode();
         break;
 
     case td::td_api::authorizationStateWaitTdlibParameters::ID: 
-        purple_debug_misc(config::pluginId, "Authorization state update: TDLib parameters requested\n");
+        DEBUG_MISC("Authorization state update: TDLib parameters requested\n");
         m_transceiver.sendQuery(td::td_api::make_object<td::td_api::disableProxy>(), nullptr);
         if (addProxy()) {
             m_transceiver.sendQuery(td::td_api::make_object<td::td_api::getProxies>(),
@@ -264,32 +374,32 @@ void PurpleTdClient::processAuthorizationState(td::td_api::AuthorizationState &a
         break;
 
     case td::td_api::authorizationStateWaitPhoneNumber::ID:
-        purple_debug_misc(config::pluginId, "Authorization state update: phone number requested\n");
+        DEBUG_MISC("Authorization state update: phone number requested\n");
         sendPhoneNumber();
         break;
 
     case td::td_api::authorizationStateWaitCode::ID: {
         auto &codeState = static_cast<td::td_api::authorizationStateWaitCode &>(authState);
-        purple_debug_misc(config::pluginId, "Authorization state update: authentication code requested\n");
+        DEBUG_MISC("Authorization state update: authentication code requested\n");
         requestAuthCode(codeState.code_info_.get());
         break;
     }
 
     case td::td_api::authorizationStateWaitRegistration::ID: {
-        purple_debug_misc(config::pluginId, "Authorization state update: new user registration\n");
+        DEBUG_MISC("Authorization state update: new user registration\n");
         registerUser();
         break;
     }
 
     case td::td_api::authorizationStateWaitPassword::ID: {
-        purple_debug_misc(config::pluginId, "Authorization state update: password requested\n");
+        DEBUG_MISC("Authorization state update: password requested\n");
         auto &pwInfo = static_cast<const td::td_api::authorizationStateWaitPassword &>(authState);
         requestPassword(pwInfo);
         break;
     }
 
     case td::td_api::authorizationStateReady::ID:
-        purple_debug_misc(config::pluginId, "Authorization state update: ready\n");
+        DEBUG_MISC("Authorization state update: ready\n");
         onLoggedIn();
         break;
     }
@@ -400,8 +510,9 @@ void PurpleTdClient::sendTdlibParameters()
     const char *api_hash = purple_account_get_string(m_account, AccountOptions::ApiHash, "");
 
     parameters->database_directory_ = getBaseDatabasePath() + G_DIR_SEPARATOR_S + username;
-    purple_debug_misc(config::pluginId, "Account %s using database directory %s\n",
-                      username, parameters->database_directory_.c_str());
+    DEBUG_MISC("Account %s using database directory %s\n",
+               username, parameters->database_directory_.c_str());
+    m_data.uploadCache.load(parameters->database_directory_ + G_DIR_SEPARATOR_S + "uploads");
     parameters->use_chat_info_database_ = true;
     parameters->use_message_database_ = true;
     parameters->use_secret_chats_ = (purple_account_get_bool(m_account, AccountOptions::EnableSecretChats,
@@ -512,7 +623,7 @@ void PurpleTdClient::requestAuthEmail()
 
 void PurpleTdClient::requestAuthEmailEntered(PurpleTdClient *self, const gchar *email)
 {
-    purple_debug_misc(config::pluginId, "Authentication email entered: '%s'\n", email);
+    DEBUG_MISC("Authentication email entered: '%s'\n", email);
     auto authEmail = td::td_api::make_object<td::td_api::setAuthenticationEmailAddress>(email);
 
     self->m_transceiver.sendQuery(std::move(authEmail), &PurpleTdClient::authResponse);
@@ -552,7 +663,7 @@ void PurpleTdClient::requestAuthEmailCode()
 
 void PurpleTdClient::requestAuthEmailCodeEntered(PurpleTdClient *self, const gchar *code)
 {
-    purple_debug_misc(config::pluginId, "Authentication email code entered: '%s'\n", code);
+    DEBUG_MISC("Authentication email code entered: '%s'\n", code);
     auto authEmailCode = td::td_api::make_object<td::td_api::checkAuthenticationEmailCode>(
                                                td::td_api::make_object<td::td_api::emailAddressAuthenticationCode>(code));
 
@@ -569,7 +680,7 @@ void PurpleTdClient::requestAuthEmailCodeCancelled(PurpleTdClient *self)
 
 void PurpleTdClient::requestCodeEntered(PurpleTdClient *self, const gchar *code)
 {
-    purple_debug_misc(config::pluginId, "Authentication code entered: '%s'\n", code);
+    DEBUG_MISC("Authentication code entered: '%s'\n", code);
     auto checkCode = td::td_api::make_object<td::td_api::checkAuthenticationCode>();
     if (code)
         checkCode->code_ = code;
@@ -585,7 +696,7 @@ void PurpleTdClient::requestCodeCancelled(PurpleTdClient *self)
 
 void PurpleTdClient::passwordEntered(PurpleTdClient *self, const gchar *password)
 {
-    purple_debug_misc(config::pluginId, "Password code entered\n");
+    DEBUG_MISC("Password code entered\n");
     auto checkPassword = td::td_api::make_object<td::td_api::checkAuthenticationPassword>();
     if (password)
         checkPassword->password_ = password;
@@ -693,7 +804,7 @@ void PurpleTdClient::displayNameCancelled(PurpleTdClient *self)
 void PurpleTdClient::authResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object)
 {
     if (object && (object->get_id() == td::td_api::ok::ID))
-        purple_debug_misc(config::pluginId, "Authentication success on query %lu\n", (unsigned long)requestId);
+        DEBUG_MISC("Authentication success on query %lu\n", (unsigned long)requestId);
     else
         notifyAuthError(object);
 }
@@ -710,7 +821,7 @@ void PurpleTdClient::notifyAuthError(const td::td_api::object_ptr<td::td_api::Ob
 
 void PurpleTdClient::setPurpleConnectionInProgress()
 {
-    purple_debug_misc(config::pluginId, "Connection in progress\n");
+    DEBUG_MISC("Connection in progress\n");
     PurpleConnection *gc = purple_account_get_connection(m_account);
 
     if (PURPLE_CONNECTION_IS_CONNECTED(gc))
@@ -726,11 +837,98 @@ void PurpleTdClient::onLoggedIn()
     // This query ensures an updateUser for every contact
     m_transceiver.sendQuery(td::td_api::make_object<td::td_api::getContacts>(),
                             &PurpleTdClient::getContactsResponse);
+
+    if ((purple_account_get_int(m_account, AccountOptions::FileCacheMaxSize, AccountOptions::FileCacheMaxSizeDefault) > 0) ||
+        (purple_account_get_int(m_account, AccountOptions::FileCacheMaxAge, AccountOptions::FileCacheMaxAgeDefault) > 0))
+        scheduleFileCacheCleanup(FILE_CACHE_CLEANUP_DELAY);
+}
+
+void PurpleTdClient::scheduleFileCacheCleanup(unsigned delay)
+{
+    if (m_fileCacheTimer)
+        m_transceiver.cancelQueryTimer(m_fileCacheTimer);
+    m_fileCacheTimer = m_transceiver.reserveQueryId();
+    m_transceiver.setQueryTimer(m_fileCacheTimer, &PurpleTdClient::fileCacheCleanupTimer, delay, false);
+}
+
+void PurpleTdClient::fileCacheCleanupTimer(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object)
+{
+    m_fileCacheTimer = 0;
+
+    if (g_get_monotonic_time() - m_lastUpdateTime < FILE_CACHE_CLEANUP_IDLE * G_USEC_PER_SEC) {
+        if (m_fileCacheDeferrals < FILE_CACHE_MAX_DEFERRALS) {
+            m_fileCacheDeferrals++;
+            scheduleFileCacheCleanup(FILE_CACHE_CLEANUP_IDLE);
+            return;
+        }
+        DEBUG_INFO("Updates keep coming, cleaning up file cache anyway\n");
+    }
+
+    cleanUpFileCache(false);
+}
+
+bool PurpleTdClient::cleanUpFileCache(bool notify)
+{
+    int maxSize = purple_account_get_int(m_account, AccountOptions::FileCacheMaxSize,
+                                         AccountOptions::FileCacheMaxSizeDefault);
+    int maxAge  = purple_account_get_int(m_account, AccountOptions::FileCacheMaxAge,
+                                         AccountOptions::FileCacheMaxAgeDefault);
+    if ((maxSize <= 0) && (maxAge <= 0))
+        return false;
+    if (m_fileCacheCleanupRunning) {
+        // Result of the run in progress will be shown instead
+        if (notify)
+            m_fileCacheCleanupNotify = true;
+        return true;
+    }
+
+    // Limits that are not set must still be given, as -1 would mean tdlib defaults
+    auto request = td::td_api::make_object<td::td_api::optimizeStorage>();
+    request->size_                           = (maxSize > 0) ? int64_t(maxSize) * 1024 * 1024 : INT64_C(1) << 50;
+    request->ttl_                            = (maxAge > 0) ? std::min(maxAge, 10000) * 24 * 3600 : INT32_MAX;
+    request->count_                          = INT32_MAX;
+    request->immunity_delay_                 = -1;
+    request->return_deleted_file_statistics_ = true;
+    request->chat_limit_                     = 0;
+
+    DEBUG_INFO("Cleaning up file cache: size limit %d MB, age limit %d days\n", maxSize, maxAge);
+    m_fileCacheCleanupRunning = true;
+    m_fileCacheCleanupNotify  = notify;
+    m_transceiver.sendQuery(std::move(request), &PurpleTdClient::fileCacheCleanupResponse);
+    return true;
+}
+
+void PurpleTdClient::fileCacheCleanupResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object)
+{
+    std::string message;
+    m_fileCacheCleanupRunning = false;
+    m_fileCacheDeferrals      = 0;
+
+    if (object && (object->get_id() == td::td_api::storageStatistics::ID)) {
+        // With return_deleted_file_statistics, these are the files that were removed
+        auto &removed = static_cast<const td::td_api::storageStatistics &>(*object);
+        char *size    = g_format_size(removed.size_);
+        DEBUG_INFO("File cache cleanup removed %d files, %s\n", (int)removed.count_, size);
+        // TRANSLATOR: Dialog content, arguments are number of files and their total size, like "12 MB"
+        message = formatMessage(_("Removed {0} files, {1}"), removed.count_, size);
+        g_free(size);
+    } else {
+        std::string error = getDisplayedError(object);
+        DEBUG_WARNING("File cache cleanup failed: %s\n", error.c_str());
+        // TRANSLATOR: Dialog content, argument is an error message
+        message = formatMessage(_("Could not clean up file cache: {}"), error);
+    }
+
+    if (m_fileCacheCleanupNotify)
+        // TRANSLATOR: Dialog title
+        purple_notify_info(m_account, _("File cache"), message.c_str(), NULL);
+    m_fileCacheCleanupNotify = false;
+    scheduleFileCacheCleanup(FILE_CACHE_CLEANUP_INTERVAL);
 }
 
 void PurpleTdClient::getContactsResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object)
 {
-    purple_debug_misc(config::pluginId, "getContacts response to request %" G_GUINT64_FORMAT "\n", requestId);
+    DEBUG_MISC("getContacts response to request %" G_GUINT64_FORMAT "\n", requestId);
     if (object && (object->get_id() == td::td_api::users::ID)) {
         m_data.setContacts(*td::move_tl_object_as<td::td_api::users>(object));
         auto getChatsRequest = td::td_api::make_object<td::td_api::loadChats>();
@@ -743,7 +941,7 @@ void PurpleTdClient::getContactsResponse(uint64_t requestId, td::td_api::object_
 
 void PurpleTdClient::getChatsResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object)
 {
-    purple_debug_misc(config::pluginId, "getChats response to request %" G_GUINT64_FORMAT "\n", requestId);
+    DEBUG_MISC("getChats response to request %" G_GUINT64_FORMAT "\n", requestId);
     if (object && (object->get_id() == td::td_api::ok::ID)) {
         auto getChatsRequest = td::td_api::make_object<td::td_api::loadChats>();
         getChatsRequest->chat_list_ = td::td_api::make_object<td::td_api::chatListMain>();
@@ -751,7 +949,7 @@ void PurpleTdClient::getChatsResponse(uint64_t requestId, td::td_api::object_ptr
         m_transceiver.sendQuery(std::move(getChatsRequest), &PurpleTdClient::getChatsResponse);
     } else {
         std::string message = getDisplayedError(object);
-        purple_debug_misc(config::pluginId, "Got no more chats: %s\n", message.c_str());
+        DEBUG_MISC("Got no more chats: %s\n", message.c_str());
             m_data.getContactsWithNoChat(m_usersForNewPrivateChats);
             requestMissingPrivateChats();
     }
@@ -760,7 +958,7 @@ void PurpleTdClient::getChatsResponse(uint64_t requestId, td::td_api::object_ptr
 void PurpleTdClient::requestMissingPrivateChats()
 {
     if (m_usersForNewPrivateChats.empty()) {
-        purple_debug_misc(config::pluginId, "Login sequence complete\n");
+        DEBUG_MISC("Login sequence complete\n");
         onChatListReady();
     } else {
         UserId userId = m_usersForNewPrivateChats.back();
@@ -776,13 +974,13 @@ void PurpleTdClient::loginCreatePrivateChatResponse(uint64_t requestId, td::td_a
 {
     if (object && (object->get_id() == td::td_api::chat::ID)) {
         td::td_api::object_ptr<td::td_api::chat> chat = td::move_tl_object_as<td::td_api::chat>(object);
-        purple_debug_misc(config::pluginId, "Requested private chat received: id %" G_GINT64_FORMAT "\n",
-                          chat->id_);
+        DEBUG_MISC("Requested private chat received: id %" G_GINT64_FORMAT "\n",
+                   chat->id_);
         // Here the "new" chat already exists in AccountData because there has just been
         // updateNewChat about this same chat. But do addChat anyway, just in case.
         m_data.addChat(std::move(chat));
     } else
-        purple_debug_misc(config::pluginId, "Failed to get requested private chat\n");
+        DEBUG_MISC("Failed to get requested private chat\n");
     requestMissingPrivateChats();
 }
 
@@ -803,16 +1001,34 @@ void PurpleTdClient::requestSupergroupFullInfo(SupergroupId groupId)
         uint64_t requestId = m_transceiver.sendQuery(td::td_api::make_object<td::td_api::getSupergroupFullInfo>(groupId.value()),
                                                      &PurpleTdClient::supergroupInfoResponse);
         m_data.addPendingRequest<SupergroupInfoRequest>(requestId, groupId);
-
-        auto getMembersReq = td::td_api::make_object<td::td_api::getSupergroupMembers>();
-        getMembersReq->supergroup_id_ = groupId.value();
-        getMembersReq->filter_ = td::td_api::make_object<td::td_api::supergroupMembersFilterRecent>();
-        getMembersReq->limit_ = SUPERGROUP_MEMBER_LIMIT;
-        requestId = m_transceiver.sendQuery(std::move(getMembersReq), &PurpleTdClient::supergroupMembersResponse);
-        m_data.addPendingRequest<SupergroupInfoRequest>(requestId, groupId);
+        requestSupergroupMembers(groupId, 0, false);
     }
 }
 
+static unsigned getMemberListLimit(PurpleAccount *account)
+{
+    int limit = purple_account_get_int(account, AccountOptions::MemberListLimit,
+                                       AccountOptions::MemberListLimitDefault);
+    return (limit > 0) ? limit : 0;
+}
+
+// Members are fetched page by page, and every page is shown as soon as it arrives
+void PurpleTdClient::requestSupergroupMembers(SupergroupId groupId, int32_t offset, bool refresh)
+{
+    unsigned maxCount = getMemberListLimit(m_account);
+    int32_t  limit    = SUPERGROUP_MEMBER_PAGE_SIZE;
+    if (maxCount && (maxCount - offset < (unsigned)limit))
+        limit = maxCount - offset;
+
+    auto getMembersReq = td::td_api::make_object<td::td_api::getSupergroupMembers>();
+    getMembersReq->supergroup_id_ = groupId.value();
+    getMembersReq->filter_ = td::td_api::make_object<td::td_api::supergroupMembersFilterRecent>();
+    getMembersReq->offset_ = offset;
+    getMembersReq->limit_ = limit;
+    uint64_t requestId = m_transceiver.sendQuery(std::move(getMembersReq), &PurpleTdClient::supergroupMembersResponse);
+    m_data.addPendingRequest<SupergroupMembersRequest>(requestId, groupId, offset, limit, refresh);
+}
+
 // TODO process messageChatAddMembers and messageChatDeleteMember
 // TODO process messageChatUpgradeTo and messageChatUpgradeFrom
 void PurpleTdClient::groupInfoResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object)
@@ -839,52 +1055,65 @@ void PurpleTdClient::supergroupInfoResponse(uint64_t requestId, td::td_api::obje
 
 void PurpleTdClient::supergroupMembersResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object)
 {
-    std::unique_ptr<SupergroupInfoRequest> request = m_data.getPendingRequest<SupergroupInfoRequest>(requestId);
+    std::unique_ptr<SupergroupMembersRequest> request = m_data.getPendingRequest<SupergroupMembersRequest>(requestId);
+    if (!request)
+        return;
 
-    if (request && object && (object->get_id() == td::td_api::chatMembers::ID)) {
+    if (object && (object->get_id() == td::td_api::chatMembers::ID)) {
         td::td_api::object_ptr<td::td_api::chatMembers> members =
             td::move_tl_object_as<td::td_api::chatMembers>(object);
+        unsigned maxCount   = getMemberListLimit(m_account);
+        int32_t  received   = members->members_.size();
+        int32_t  nextOffset = request->offset + received;
+
+        std::vector<const td::td_api::chatMember *> changedMembers;
+        std::vector<UserId>                         removedMembers;
+        m_data.addSupergroupMembers(request->groupId, *members, request->refresh, maxCount,
+                                    changedMembers, removedMembers);
+        showSupergroupMembers(request->groupId, changedMembers, removedMembers);
+
+        if (!request->refresh && (received == request->limit) && (nextOffset < members->total_count_) &&
+            (!maxCount || ((unsigned)nextOffset < maxCount)))
+        {
+            requestSupergroupMembers(request->groupId, nextOffset, false);
+            return;
+        }
+    }
 
+    if (!request->refresh) {
         auto getMembersReq = td::td_api::make_object<td::td_api::getSupergroupMembers>();
         getMembersReq->supergroup_id_ = request->groupId.value();
         getMembersReq->filter_ = td::td_api::make_object<td::td_api::supergroupMembersFilterAdministrators>();
-        getMembersReq->limit_ = SUPERGROUP_MEMBER_LIMIT;
+        getMembersReq->limit_ = SUPERGROUP_MEMBER_PAGE_SIZE;
         uint64_t newRequestId = m_transceiver.sendQuery(std::move(getMembersReq), &PurpleTdClient::supergroupAdministratorsResponse);
-        m_data.addPendingRequest<GroupMembersRequestCont>(newRequestId, request->groupId, members.release());
+        m_data.addPendingRequest<SupergroupInfoRequest>(newRequestId, request->groupId);
     }
 }
 
 void PurpleTdClient::supergroupAdministratorsResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object)
 {
-    std::unique_ptr<GroupMembersRequestCont> request = m_data.getPendingRequest<GroupMembersRequestCont>(requestId);
-    if (request) {
-        auto members = std::move(request->members);
-
-        if (object && (object->get_id() == td::td_api::chatMembers::ID)) {
-            td::td_api::object_ptr<td::td_api::chatMembers> newMembers =
-                td::move_tl_object_as<td::td_api::chatMembers>(object);
-            for (auto &pNewMember: newMembers->members_) {
-                if (! pNewMember || !pNewMember->member_id_) continue;
-                const td::td_api::MessageSender *pNewMemberInfo = pNewMember->member_id_.get();
-                if (std::find_if(members->members_.begin(), members->members_.end(),
-                              [pNewMemberInfo](const td::td_api::object_ptr<td::td_api::chatMember> &pExistingMember) {
-                                  return pExistingMember && pExistingMember->member_id_ &&
-                                         isSameUser(*pExistingMember->member_id_, *pNewMemberInfo);
-                              }) == members->members_.end())
-                {
-                    members->members_.push_back(std::move(pNewMember));
-                }
-            }
-        }
+    std::unique_ptr<SupergroupInfoRequest> request = m_data.getPendingRequest<SupergroupInfoRequest>(requestId);
 
-        const td::td_api::chat *chat = m_data.getSupergroupChatByGroup(request->groupId);
-        if (chat) {
-            PurpleConvChat *purpleChat = findChatConversation(m_account, *chat);
-            if (purpleChat)
-                updateSupergroupChatMembers(purpleChat, *members, m_data);
-        }
+    if (request && object && (object->get_id() == td::td_api::chatMembers::ID)) {
+        td::td_api::object_ptr<td::td_api::chatMembers> admins =
+            td::move_tl_object_as<td::td_api::chatMembers>(object);
+        // Administrators are kept even beyond member list limit, so that their flags are shown
+        std::vector<const td::td_api::chatMember *> changedMembers;
+        m_data.addSupergroupAdministrators(request->groupId, *admins, changedMembers);
+        showSupergroupMembers(request->groupId, changedMembers, {});
+    }
+}
 
-        m_data.updateSupergroupMembers(request->groupId, std::move(members));
+void PurpleTdClient::showSupergroupMembers(SupergroupId groupId,
+                                           const std::vector<const td::td_api::chatMember *> &changedMembers,
+                                           const std::vector<UserId> &removedMembers)
+{
+    const td::td_api::chat *chat = m_data.getSupergroupChatByGroup(groupId);
+
+    if (chat) {
+        PurpleConvChat *purpleChat = findChatConversation(m_account, *chat);
+        if (purpleChat)
+            updateSupergroupChatMembers(purpleChat, changedMembers, removedMembers, m_data);
     }
 }
 
@@ -903,7 +1132,13 @@ void PurpleTdClient::updateGroupFull(BasicGroupId groupId, td::td_api::object_pt
 
 void PurpleTdClient::updateSupergroupFull(SupergroupId groupId, td::td_api::object_ptr<td::td_api::supergroupFullInfo> groupInfo)
 {
-    const td::td_api::chat *chat = m_data.getSupergroupChatByGroup(groupId);
+    const td::td_api::chat               *chat    = m_data.getSupergroupChatByGroup(groupId);
+    const td::td_api::supergroupFullInfo *oldInfo = m_data.getSupergroupInfo(groupId);
+
+    // When member count changes, re-read only the most recent members instead of the whole list
+    if (oldInfo && m_data.getSupergroupMembers(groupId) &&
+        (oldInfo->member_count_ != groupInfo->member_count_))
+        requestSupergroupMembers(groupId, 0, true);
 
     if (chat) {
         PurpleConvChat *purpleChat = findChatConversation(m_account, *chat);
@@ -941,19 +1176,21 @@ void PurpleTdClient::onChatListReady()
     const td::td_api::user *selfInfo = m_data.getUserByPhone(purple_account_get_username(m_account));
     if (selfInfo != nullptr) {
         std::string alias = makeBasicDisplayName(*selfInfo);
-        purple_debug_misc(config::pluginId, "Setting own alias to '%s'\n", alias.c_str());
+        DEBUG_MISC("Setting own alias to '%s'\n", alias.c_str());
         purple_account_set_alias(m_account, alias.c_str());
     } else
-        purple_debug_warning(config::pluginId, "Did not receive user information for self (%s) at login\n",
+        DEBUG_WARNING("Did not receive user information for self (%s) at login\n",
             purple_account_get_username(m_account));
 
     purple_blist_add_account(m_account);
 }
 
-void PurpleTdClient::onAnimatedStickerConverted(AccountThread *arg)
+void PurpleTdClient::onStickerConverted(AccountThread *arg)
 {
     std::unique_ptr<AccountThread> baseThread(arg);
     StickerConversionThread *thread = dynamic_cast<StickerConversionThread *>(arg);
+    if (thread)
+        thread->logConversion();
     const td::td_api::chat  *chat   = thread ? m_data.getChat(thread->chatId) : nullptr;
     if (!chat || !thread)
         return;
@@ -963,14 +1200,17 @@ void PurpleTdClient::onAnimatedStickerConverted(AccountThread *arg)
     gchar       *imageData    =  NULL;
     gsize        imageSize    = 0;
     bool         success      = false;
-    if (errorMessage.empty()) {
+    if (errorMessage.empty() && !thread->isAnimated()) {
+        imageData = thread->takeImageData(imageSize);
+        success = (imageData != NULL);
+    } else if (errorMessage.empty()) {
         GError *error = NULL;
 
         g_file_get_contents(thread->getOutputFileName().c_str(), &imageData, &imageSize, &error);
         if (error) {
             // unlikely error message not worth translating
-            errorMessage = formatMessage("Could not read converted file {}: {}", {
-                                            thread->getOutputFileName(), error->message});
+            errorMessage = formatMessage("Could not read converted file {}: {}", thread->getOutputFileName(),
+                                         error->message);
             g_error_free(error);
         } else
             success = true;
@@ -978,11 +1218,11 @@ void PurpleTdClient::onAnimatedStickerConverted(AccountThread *arg)
     }
 
     if (success) {
-        int id = purple_imgstore_add_with_id (imageData, imageSize, NULL);
+        int id = addPurpleImage(imageData, imageSize);
         if (pendingMessage) {
-            pendingMessage->animatedStickerConverted = true;
-            pendingMessage->animatedStickerConvertSuccess = true;
-            pendingMessage->animatedStickerImageId = id;
+            pendingMessage->stickerConverted = true;
+            pendingMessage->stickerConvertSuccess = true;
+            pendingMessage->stickerImageId = id;
             checkMessageReady(pendingMessage, m_transceiver, m_data);
             pendingMessage = nullptr;
         } else {
@@ -991,19 +1231,36 @@ void PurpleTdClient::onAnimatedStickerConverted(AccountThread *arg)
         }
     } else {
         if (pendingMessage) {
-            pendingMessage->animatedStickerConverted = true;
-            pendingMessage->animatedStickerConvertSuccess = false;
+            pendingMessage->stickerConverted = true;
+            pendingMessage->stickerConvertSuccess = false;
             checkMessageReady(pendingMessage, m_transceiver, m_data);
             pendingMessage = nullptr;
         }
-        // TRANSLATOR: In-chat error message, arguments will be a file name and a proper reason
-        errorMessage = formatMessage(_("Could not read sticker file {0}: {1}"),
-                                        {thread->inputFileName, errorMessage});
-        errorMessage = makeNoticeWithSender(*chat, thread->message(), errorMessage.c_str(), m_account);
-        showMessageText(m_data, *chat, thread->message(), NULL, errorMessage.c_str());
+        if (!thread->isAnimated()) {
+            // Not decodable as webp, so just give a link to the file
+            DEBUG_MISC("Could not decode sticker %s: %s\n",
+                       thread->inputFileName.c_str(), errorMessage.c_str());
+            // TRANSLATOR: File-type, used to describe what is being downloaded, in sentences like "Downloading photo" or "Ignoring photo download".
+            showGenericFileInline(*chat, thread->message(), thread->inputFileName, NULL, _("sticker"), m_data);
+        } else {
+            // TRANSLATOR: In-chat error message, arguments will be a file name and a proper reason
+            errorMessage = formatMessage(_("Could not read sticker file {0}: {1}"),
+                                         thread->inputFileName, errorMessage);
+            errorMessage = makeNoticeWithSender(*chat, thread->message(), errorMessage.c_str(), m_account);
+            showMessageText(m_data, *chat, thread->message(), NULL, errorMessage.c_str());
+        }
     }
 }
 
+void PurpleTdClient::onFileHashed(AccountThread *arg)
+{
+    std::unique_ptr<AccountThread> baseThread(arg);
+    FileHashThread *thread = dynamic_cast<FileHashThread *>(arg);
+    if (thread)
+        continueDocumentUpload(*thread, m_transceiver, m_data, &PurpleTdClient::uploadResponse,
+                               &PurpleTdClient::sendMessageResponse);
+}
+
 void PurpleTdClient::sendReadReceipts(PurpleConversation *conversation)
 {
     if (conversation != NULL) {
@@ -1023,16 +1280,15 @@ void PurpleTdClient::onIncomingMessage(td::td_api::object_ptr<td::td_api::messag
     if (pGap != m_chatGaps.end()) {
         MessageId lastMessageId = pGap->lastMessage;
         m_chatGaps.erase(pGap);
-        purple_debug_misc(config::pluginId,
-            "Fetching skipped messages for chat %" G_GINT64_FORMAT
-            " between %" G_GINT64_FORMAT " and %" G_GINT64_FORMAT "\n",
-            chatId.value(), lastMessageId.value(), getId(*message).value());
+        DEBUG_MISC("Fetching skipped messages for chat %" G_GINT64_FORMAT
+                   " between %" G_GINT64_FORMAT " and %" G_GINT64_FORMAT "\n",
+                   chatId.value(), lastMessageId.value(), getId(*message).value());
         fetchHistory(m_data, chatId, getId(*message), lastMessageId);
     }
 
     const td::td_api::chat *chat = m_data.getChat(chatId);
     if (!chat) {
-        purple_debug_warning(config::pluginId, "Received message with unknown chat id %" G_GINT64_FORMAT "\n",
+        DEBUG_WARNING("Received message with unknown chat id %" G_GINT64_FORMAT "\n",
                             message->chat_id_);
         return;
     }
@@ -1050,10 +1306,9 @@ void PurpleTdClient::updateChatLastMessage(td::td_api::updateChatLastMessage &la
     else {
         MessageId lastMessageId = getChatLastMessage(m_data, chatId);
         if (lastMessageId.valid()) {
-            purple_debug_misc(config::pluginId,
-                "Skipped messages detected for chat %" G_GINT64_FORMAT
-                ", last seen message %" G_GINT64_FORMAT "\n",
-                chatId.value(), lastMessageId.value());
+            DEBUG_MISC("Skipped messages detected for chat %" G_GINT64_FORMAT
+                       ", last seen message %" G_GINT64_FORMAT "\n",
+                       chatId.value(), lastMessageId.value());
             if (std::find_if(m_chatGaps.begin(), m_chatGaps.end(),
                              [chatId](const ChatGap &gap) {
                                  return (gap.chatId == chatId);
@@ -1086,7 +1341,7 @@ int PurpleTdClient::sendMessage(const char *buddyName, const char *message)
             if (users.empty())
                 errorMessage = "User not found";
             else
-                errorMessage = formatMessage("More than one user known with name '{}'", std::string(buddyName));
+                errorMessage = formatMessage("More than one user known with name '{}'", buddyName);
             showMessageTextIm(m_data, buddyName, NULL, errorMessage.c_str(), time(NULL), PURPLE_MESSAGE_ERROR);
             return -1;
         }
@@ -1117,17 +1372,78 @@ void PurpleTdClient::sendMessageResponse(uint64_t requestId, td::td_api::object_
     std::unique_ptr<SendMessageRequest> request = m_data.getPendingRequest<SendMessageRequest>(requestId);
     if (!request)
         return;
-    if (object && (object->get_id() == td::td_api::message::ID)) {
-        if (!request->tempFile.empty()) {
-            const td::td_api::message &message = static_cast<td::td_api::message &>(*object);
-            m_data.addTempFileUpload(message.id_, request->tempFile);
+
+    // sendMessage returns message, sendMessageAlbum and resendMessages return messages
+    std::vector<const td::td_api::message *> messages;
+    if (object && (object->get_id() == td::td_api::message::ID))
+        messages.push_back(static_cast<const td::td_api::message *>(object.get()));
+    else if (object && (object->get_id() == td::td_api::messages::ID)) {
+        for (const auto &message: static_cast<const td::td_api::messages &>(*object).messages_)
+            messages.push_back(message.get());
+    }
+
+    if (!messages.empty()) {
+        for (size_t i = 0; i < request->tempFiles.size(); i++) {
+            if (request->tempFiles[i].empty())
+                continue;
+            if ((i < messages.size()) && messages[i])
+                m_data.addTempFileUpload(messages[i]->id_, request->tempFiles[i]);
+            else {
+                m_data.uploadCache.cancel(request->tempFiles[i]);
+                releaseImageFile(request->tempFiles[i], m_data);
+            }
+        }
+        if (!request->uploadPath.empty() && messages[0])
+            m_data.addDocumentUpload(messages[0]->id_, request->uploadPath);
+        for (size_t i = 0; i < request->resendUploadPaths.size(); i++) {
+            if (request->resendUploadPaths[i].empty())
+                continue;
+            if ((i < messages.size()) && messages[i])
+                m_data.addDocumentUpload(messages[i]->id_, request->resendUploadPaths[i]);
+            else
+                m_data.uploadCache.cancel(request->resendUploadPaths[i]);
         }
+        if (request->xfer)
+            finishCachedDocumentUpload(request->xfer, true);
     } else {
+        unsigned floodWait = 0;
+        if (object && (object->get_id() == td::td_api::error::ID)) {
+            const td::td_api::error &error = static_cast<const td::td_api::error &>(*object);
+            floodWait = getFloodWaitSeconds(error.code_, error.message_);
+        }
+        // Keeps temporary files and cached uploads for sending it again
+        if (floodWait && sendAfterFloodWait(request, floodWait, m_transceiver, m_data,
+                                            &PurpleTdClient::sendMessageResponse))
+        {
+            return;
+        }
+
+        if (!request->remoteFileId.empty())
+            m_data.uploadCache.remove(request->remoteFileId);
+        for (const std::string &remoteId: request->remotePhotoIds)
+            m_data.uploadCache.remove(remoteId);
+        if (!request->uploadPath.empty())
+            m_data.uploadCache.cancel(request->uploadPath);
+        for (const std::string &path: request->resendUploadPaths)
+            if (!path.empty())
+                m_data.uploadCache.cancel(path);
+        if (request->xfer)
+            finishCachedDocumentUpload(request->xfer, false);
+        // No updateMessageSendFailed will follow, so nothing else will remove the files
+        for (const std::string &tempFile: request->tempFiles)
+            if (!tempFile.empty()) {
+                m_data.uploadCache.cancel(tempFile);
+                releaseImageFile(tempFile, m_data);
+            }
         // TRANSLATOR: In-chat error message, argument will be a user-sent message
         std::string errorMessage = formatMessage(_("Failed to send message: {}"), getDisplayedError(object));
         const td::td_api::chat *chat = m_data.getChat(request->chatId);
         if (chat)
             showChatNotification(m_data, *chat, errorMessage.c_str());
+        // Hold back further messages to this chat, so they don't fail as well
+        if (floodWait)
+            startFloodWait(request->chatId, floodWait, m_transceiver, m_data,
+                           &PurpleTdClient::sendMessageResponse);
     }
 }
 
@@ -1158,16 +1474,36 @@ void PurpleTdClient::updateUserStatus(UserId userId, td::td_api::object_ptr<td::
 {
     const td::td_api::user *user = m_data.getUser(userId);
     if (user) {
-        std::string userName = getPurpleBuddyName(*user);
-        purple_prpl_got_user_status(m_account, userName.c_str(), getPurpleStatusId(*status), NULL);
         m_data.setUserStatus(userId, std::move(status));
+        if (m_data.statusUpdates.add(userId))
+            m_transceiver.setQueryTimer(m_transceiver.reserveQueryId(), &PurpleTdClient::applyUserStatuses,
+                                        USER_STATUS_TICK, false);
     }
 }
 
+void PurpleTdClient::applyUserStatuses(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object)
+{
+    std::vector<UserId> userIds;
+    m_data.statusUpdates.extract(userIds);
+
+    // Status stored in account data is the latest one received
+    for (UserId userId: userIds) {
+        const td::td_api::user *user = m_data.getUser(userId);
+        if (user && user->status_) {
+            std::string userName = getPurpleBuddyName(*user);
+            purple_prpl_got_user_status(m_account, userName.c_str(), getPurpleStatusId(*user->status_), NULL);
+        }
+    }
+
+    DEBUG_MISC("Applied status of %zu users (%" G_GUINT64_FORMAT " updates received, %"
+               G_GUINT64_FORMAT " collapsed so far)\n", userIds.size(),
+               m_data.statusUpdates.receivedCount(), m_data.statusUpdates.collapsedCount());
+}
+
 void PurpleTdClient::updateUser(td::td_api::object_ptr<td::td_api::user> userInfo)
 {
     if (!userInfo) {
-        purple_debug_warning(config::pluginId, "updateUser with null user info\n");
+        DEBUG_WARNING("updateUser with null user info\n");
         return;
     }
 
@@ -1239,7 +1575,7 @@ void PurpleTdClient::avatarDownloadResponse(uint64_t requestId, td::td_api::obje
 void PurpleTdClient::updateGroup(td::td_api::object_ptr<td::td_api::basicGroup> group)
 {
     if (!group) {
-        purple_debug_warning(config::pluginId, "updateBasicGroup with null group\n");
+        DEBUG_WARNING("updateBasicGroup with null group\n");
         return;
     }
 
@@ -1256,7 +1592,7 @@ void PurpleTdClient::updateGroup(td::td_api::object_ptr<td::td_api::basicGroup>
 void PurpleTdClient::updateSupergroup(td::td_api::object_ptr<td::td_api::supergroup> group)
 {
     if (!group) {
-        purple_debug_warning(config::pluginId, "updateSupergroup with null group\n");
+        DEBUG_WARNING("updateSupergroup with null group\n");
         return;
     }
 
@@ -1278,10 +1614,8 @@ void PurpleTdClient::updateChat(const td::td_api::chat *chat)
     BasicGroupId            basicGroupId    = getBasicGroupId(*chat);
     SupergroupId            supergroupId    = getSupergroupId(*chat);
     SecretChatId            secretChatId    = getSecretChatId(*chat);
-    purpleDebug("Update chat: {} private user={} basic group={} supergroup={}", {
-        std::to_string(chat->id_), std::to_string(privateChatUser ? privateChatUser->id_ : 0),
-        std::to_string(basicGroupId.value()), std::to_string(supergroupId.value())
-    });
+    purpleDebug("Update chat: {} private user={} basic group={} supergroup={}", chat->id_,
+                privateChatUser ? privateChatUser->id_ : 0, basicGroupId.value(), supergroupId.value());
 
     // For secret chats, chat photo is same as user profile photo, so hopefully already downloaded.
     // But if not (such as when creating secret chat while downloading new photo for the user),
@@ -1311,7 +1645,7 @@ void PurpleTdClient::updateChat(const td::td_api::chat *chat)
         }
     } else {
         if (basicGroupId.valid() || supergroupId.valid())
-            removeGroupChat(m_account, *chat);
+            removeGroupChat(m_data, *chat);
     }
 
     if (secretChatId.valid())
@@ -1355,11 +1689,11 @@ void PurpleTdClient::downloadChatPhoto(const td::td_api::chat &chat)
 void PurpleTdClient::addChat(td::td_api::object_ptr<td::td_api::chat> chat)
 {
     if (!chat) {
-        purple_debug_warning(config::pluginId, "updateNewChat with null chat info\n");
+        DEBUG_WARNING("updateNewChat with null chat info\n");
         return;
     }
 
-    purple_debug_misc(config::pluginId, "Add chat: '%s'\n", chat->title_.c_str());
+    DEBUG_MISC("Add chat: '%s'\n", chat->title_.c_str());
     ChatId chatId = getId(*chat);
     m_data.addChat(std::move(chat));
     updateChat(m_data.getChat(chatId));
@@ -1369,34 +1703,32 @@ void PurpleTdClient::handleUserChatAction(const td::td_api::updateChatAction &up
 {
     const td::td_api::chat *chat = m_data.getChat(getChatId(updateChatAction));
     if (!chat) {
-        purple_debug_warning(config::pluginId, "Got user chat action for unknown chat %" G_GINT64_FORMAT "\n",
-                             updateChatAction.chat_id_);
+        DEBUG_WARNING("Got user chat action for unknown chat %" G_GINT64_FORMAT "\n",
+                      updateChatAction.chat_id_);
         return;
     }
 
     UserId chatUserId = getUserIdByPrivateChat(*chat);
     if (!chatUserId.valid()) {
-        purple_debug_misc(config::pluginId, "Ignoring user chat action for non-private chat %" G_GINT64_FORMAT "\n",
-                          updateChatAction.chat_id_);
+        DEBUG_MISC("Ignoring user chat action for non-private chat %" G_GINT64_FORMAT "\n",
+                   updateChatAction.chat_id_);
         return;
     }
 
     if (chatUserId != getUserId(updateChatAction)) {
-        purpleDebug("Got user action for private chat {} (with user {}) for another user {}", {
-            std::to_string(updateChatAction.chat_id_), std::to_string(chatUserId.value()),
-            std::to_string(getUserId(updateChatAction))
-        });
+        purpleDebug("Got user action for private chat {} (with user {}) for another user {}",
+                    updateChatAction.chat_id_, chatUserId.value(), getUserId(updateChatAction).value());
     } else if (updateChatAction.action_) {
         if (updateChatAction.action_->get_id() == td::td_api::chatActionCancel::ID) {
-            purpleDebug("User (id {}) stopped chat action", getUserId(updateChatAction));
+            purpleDebug("User (id {}) stopped chat action", getUserId(updateChatAction).value());
             showUserChatAction(getUserId(updateChatAction), false);
         } else if (updateChatAction.action_->get_id() == td::td_api::chatActionStartPlayingGame::ID) {
-            purpleDebug("User (id %d): treating chatActionStartPlayingGame as cancel", getUserId(updateChatAction));
+            purpleDebug("User (id {}): treating chatActionStartPlayingGame as cancel",
+                        getUserId(updateChatAction).value());
             showUserChatAction(getUserId(updateChatAction), false);
         } else {
-            purpleDebug("User (id {}) started chat action (id {})", {
-		std::to_string(getUserId(updateChatAction)), std::to_string(updateChatAction.action_->get_id())
-            });
+            purpleDebug("User (id {}) started chat action (id {})", getUserId(updateChatAction).value(),
+                        updateChatAction.action_->get_id());
             showUserChatAction(getUserId(updateChatAction), true);
         }
     }
@@ -1442,7 +1774,7 @@ void PurpleTdClient::addContact(const std::string &purpleName, const std::string
                                 const std::string &groupName)
 {
     if (m_data.getUserByPhone(purpleName.c_str())) {
-        purple_debug_info(config::pluginId, "User with phone number %s already exists\n", purpleName.c_str());
+        DEBUG_INFO("User with phone number %s already exists\n", purpleName.c_str());
         return;
     }
 
@@ -1498,7 +1830,7 @@ void PurpleTdClient::addBuddySearchChatResponse(uint64_t requestId, td::td_api::
 void PurpleTdClient::addContactById(UserId userId, const std::string &phoneNumber, const std::string &alias,
                                     const std::string &groupName)
 {
-    purpleDebug("Adding contact: id={} alias={}", {std::to_string(userId.value()), alias});
+    purpleDebug("Adding contact: id={} alias={}", userId.value(), alias);
     std::string firstName, lastName;
     getNamesFromAlias(alias.c_str(), firstName, lastName);
 
@@ -1568,8 +1900,8 @@ void PurpleTdClient::addContactCreatePrivateChatResponse(uint64_t requestId, td:
             getImConversation(m_account, displayName.c_str());
         }
     } else {
-        purple_debug_misc(config::pluginId, "Failed to create private chat to %s\n",
-                          request->phoneNumber.c_str());
+        DEBUG_MISC("Failed to create private chat to %s\n",
+                   request->phoneNumber.c_str());
         notifyFailedContact(getDisplayedError(object));
     }
 }
@@ -1583,7 +1915,7 @@ void PurpleTdClient::renameContact(const char *buddyName, const char *newAlias)
 {
     UserId userId = purpleBuddyNameToUserId(buddyName);
     if (!userId.valid()) {
-        purple_debug_warning(config::pluginId, "Cannot rename %s: not a valid id\n", buddyName);
+        DEBUG_WARNING("Cannot rename %s: not a valid id\n", buddyName);
         return;
     }
 
@@ -1650,14 +1982,14 @@ bool PurpleTdClient::joinChat(const char *chatName)
         PurpleConversation *baseConv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT,
                                                                              chatName, m_account);
         if (baseConv && purple_conv_chat_has_left(purple_conversation_get_chat_data(baseConv))) {
-            purple_debug_misc(config::pluginId, "Scheduling to rejoin group chat %s - "
-                              "no telegram chat found at the moment\n", chatName);
+            DEBUG_MISC("Scheduling to rejoin group chat %s - "
+                       "no telegram chat found at the moment\n", chatName);
             m_data.addExpectedChat(id);
         } else
-            purple_debug_warning(config::pluginId, "No telegram chat found for purple name %s\n", chatName);
+            DEBUG_WARNING("No telegram chat found for purple name %s\n", chatName);
     } else if (!m_data.isGroupChatWithMembership(*chat))
-        purple_debug_warning(config::pluginId, "Chat %s (%s) is not a group we a member of\n",
-                             chatName, chat->title_.c_str());
+        DEBUG_WARNING("Chat %s (%s) is not a group we a member of\n",
+                      chatName, chat->title_.c_str());
     else if (purpleId) {
         conv = getChatConversation(m_data, *chat, purpleId);
         if (conv)
@@ -1672,9 +2004,9 @@ int PurpleTdClient::sendGroupMessage(int purpleChatId, const char *message)
     const td::td_api::chat *chat = m_data.getChatByPurpleId(purpleChatId);
 
     if (!chat)
-        purple_debug_warning(config::pluginId, "No chat found for purple id %d\n", purpleChatId);
+        DEBUG_WARNING("No chat found for purple id %d\n", purpleChatId);
     else if (!m_data.isGroupChatWithMembership(*chat))
-        purple_debug_misc(config::pluginId, "purple id %d (chat %s) is not a group we a member of\n",
+        DEBUG_MISC("purple id %d (chat %s) is not a group we a member of\n",
                              purpleChatId, chat->title_.c_str());
     else {
         int ret = transmitMessage(getId(*chat), message, m_transceiver, m_data, &PurpleTdClient::sendMessageResponse);
@@ -1711,7 +2043,7 @@ void PurpleTdClient::joinChatResponse(uint64_t requestId, td::td_api::object_ptr
         // remove all of them.
         if (request) {
             if (!request->joinString.empty()) {
-                std::vector<PurpleChat *> obsoleteChats = findChatsByJoinString(request->joinString);
+                std::vector<PurpleChat *> obsoleteChats = findChatsByJoinString(m_data, request->joinString);
                 for (PurpleChat *chat: obsoleteChats)
                     purple_blist_remove_chat(chat);
             }
@@ -1783,7 +2115,7 @@ void PurpleTdClient::createGroup(const char *name, int type,
             UserId userId = purpleBuddyNameToUserId(memberName.c_str());
             if (userId.valid()) {
                 if (!m_data.getUser(userId)) {
-                    errorMessage = formatMessage(_("No known user with id {}"), userId);
+                    errorMessage = formatMessage(_("No known user with id {}"), userId.value());
                 }
             } else {
                 std::vector<const td::td_api::user*> users;
@@ -1821,7 +2153,7 @@ void PurpleTdClient::createGroup(const char *name, int type,
 
     if (request) {
         // Same as for joining by invite link
-        std::vector<PurpleChat *> obsoleteChats = findChatsByNewGroup(name, type);
+        std::vector<PurpleChat *> obsoleteChats = findChatsByNewGroup(m_data, name, type);
         for (PurpleChat *chat: obsoleteChats)
             purple_blist_remove_chat(chat);
 
@@ -1880,7 +2212,7 @@ void PurpleTdClient::setGroupDescription(int purpleChatId, const char *descripti
 {
     const td::td_api::chat *chat = m_data.getChatByPurpleId(purpleChatId);
     if (!chat) {
-        purple_debug_warning(config::pluginId, "Unknown libpurple chat id %d\n", purpleChatId);
+        DEBUG_WARNING("Unknown libpurple chat id %d\n", purpleChatId);
         return;
     }
 
@@ -1921,7 +2253,7 @@ void PurpleTdClient::kickUserFromChat(PurpleConversation *conv, const char *name
                                              // Unlikely error message not worth translating
                                              "More than one user found with this name";
         // TRANSLATOR: In-chat error message, argument is a reason (text)
-        std::string message = formatMessage(_("Cannot kick user: {}"), std::string(reason));
+        std::string message = formatMessage(_("Cannot kick user: {}"), reason);
         purple_conversation_write(conv, "", message.c_str(), PURPLE_MESSAGE_NO_LOG, 0);
         return;
     }
@@ -1985,7 +2317,7 @@ void PurpleTdClient::addUserToChat(int purpleChatId, const char *name)
 {
     const td::td_api::chat *chat = m_data.getChatByPurpleId(purpleChatId);
     if (!chat) {
-        purple_debug_warning(config::pluginId, "Unknown libpurple chat id %d\n", purpleChatId);
+        DEBUG_WARNING("Unknown libpurple chat id %d\n", purpleChatId);
         return;
     }
 
@@ -1996,7 +2328,7 @@ void PurpleTdClient::addUserToChat(int purpleChatId, const char *name)
                                              // Unlikely error message not worth translating
                                              "More than one user found with this name";
         // TRANSLATOR: In-chat error message, argument is a reason (text)
-        std::string message = formatMessage(_("Cannot add user to group: {}"), std::string(reason));
+        std::string message = formatMessage(_("Cannot add user to group: {}"), reason);
         showChatNotification(m_data, *chat, message.c_str(), PURPLE_MESSAGE_NO_LOG);
         return;
     }
@@ -2015,7 +2347,7 @@ void PurpleTdClient::showInviteLink(const std::string& purpleChatName)
     ChatId                  chatId = getTdlibChatId(purpleChatName.c_str());
     const td::td_api::chat *chat   = chatId.valid() ? m_data.getChat(chatId) : nullptr;
     if (!chat) {
-        purple_debug_warning(config::pluginId, "chat %s not found\n", purpleChatName.c_str());
+        DEBUG_WARNING("chat %s not found\n", purpleChatName.c_str());
         return;
     }
     BasicGroupId basicGroupId = getBasicGroupId(*chat);
@@ -2072,15 +2404,6 @@ void PurpleTdClient::getGroupChatList(PurpleRoomlist *roomlist)
     }
 }
 
-void PurpleTdClient::removeTempFile(int64_t messageId)
-{
-    std::string path = m_data.extractTempFileUpload(messageId);
-    if (!path.empty()) {
-        purple_debug_misc(config::pluginId, "Removing temporary file %s\n", path.c_str());
-        remove(path.c_str());
-    }
-}
-
 void PurpleTdClient::setTwoFactorAuth(const char *oldPassword, const char *newPassword,
                                     const char *hint, const char *email)
 {
@@ -2146,8 +2469,8 @@ void PurpleTdClient::setTwoFactorAuthResponse(uint64_t requestId, td::td_api::ob
         if (passwordState.recovery_email_address_code_info_) {
             // TRANSLATOR: 2FA setup confirmation dialog, e-mail description
             std::string emailInfo = formatMessage(_("Code sent to {0} (length: {1})"),
-                                                  {passwordState.recovery_email_address_code_info_->email_address_pattern_,
-                                                   std::to_string(passwordState.recovery_email_address_code_info_->length_)});
+                                                  passwordState.recovery_email_address_code_info_->email_address_pattern_,
+                                                  passwordState.recovery_email_address_code_info_->length_);
             requestRecoveryEmailConfirmation(emailInfo);
         } else
             notifyPasswordChangeSuccess(m_account, passwordState);
@@ -2217,9 +2540,10 @@ void PurpleTdClient::sendFileToChat(PurpleXfer *xfer, const char *purpleName,
         chat = m_data.getChatByPurpleId(purpleChatId);
 
     if (filename && chat)
-        startDocumentUpload(getId(*chat), filename, xfer, m_transceiver, m_data, &PurpleTdClient::uploadResponse);
+        startDocumentUpload(getId(*chat), filename, xfer, m_transceiver, m_data, &PurpleTdClient::uploadResponse,
+                            &PurpleTdClient::sendMessageResponse);
     else if (filename && privateUser) {
-        purple_debug_misc(config::pluginId, "Requesting private chat for user id %d\n", (int)privateUser->id_);
+        DEBUG_MISC("Requesting private chat for user id %d\n", (int)privateUser->id_);
         td::td_api::object_ptr<td::td_api::createPrivateChat> createChat =
             td::td_api::make_object<td::td_api::createPrivateChat>(privateUser->id_, false);
         uint64_t requestId = m_transceiver.sendQuery(std::move(createChat), &PurpleTdClient::sendMessageCreatePrivateChatResponse);
@@ -2227,9 +2551,9 @@ void PurpleTdClient::sendFileToChat(PurpleXfer *xfer, const char *purpleName,
         m_data.addPendingRequest<NewPrivateChatForMessage>(requestId, purpleName, xfer);
     } else {
         if (!filename)
-            purple_debug_warning(config::pluginId, "Failed to send file, no file name\n");
+            DEBUG_WARNING("Failed to send file, no file name\n");
         else if (!chat)
-            purple_debug_warning(config::pluginId, "Failed to send file %s, chat not found\n", filename);
+            DEBUG_WARNING("Failed to send file %s, chat not found\n", filename);
         purple_xfer_cancel_local(xfer);
     }
 }
@@ -2248,7 +2572,7 @@ void PurpleTdClient::sendMessageCreatePrivateChatResponse(uint64_t requestId, td
             const char *filename = purple_xfer_get_local_filename(request->fileUpload);
             if (filename)
                 startDocumentUpload(getId(*chat), filename, request->fileUpload, m_transceiver, m_data,
-                                    &PurpleTdClient::uploadResponse);
+                                    &PurpleTdClient::uploadResponse, &PurpleTdClient::sendMessageResponse);
             else
                 purple_xfer_cancel_local(request->fileUpload);
         } else {
@@ -2305,10 +2629,12 @@ void PurpleTdClient::cancelUpload(PurpleXfer *xfer)
 {
     int32_t fileId;
     if (m_data.getFileIdForTransfer(xfer, fileId)) {
-        purple_debug_misc(config::pluginId, "Cancelling upload of %s (file id %d)\n",
-                          purple_xfer_get_local_filename(xfer), fileId);
+        DEBUG_MISC("Cancelling upload of %s (file id %d)\n",
+                   purple_xfer_get_local_filename(xfer), fileId);
         auto cancelRequest = td::td_api::make_object<td::td_api::cancelPreliminaryUploadFile>(fileId);
         m_transceiver.sendQuery(std::move(cancelRequest), nullptr);
+        if (purple_xfer_get_local_filename(xfer))
+            m_data.uploadCache.cancel(purple_xfer_get_local_filename(xfer));
         m_data.removeFileTransfer(fileId);
         purple_xfer_unref(xfer);
     } else {
@@ -2328,7 +2654,7 @@ bool PurpleTdClient::startVoiceCall(const char *buddyName)
         if (users.empty())
             errorMessage = "User not found";
         else
-            errorMessage = formatMessage("More than one user known with name '{}'", std::string(buddyName));
+            errorMessage = formatMessage("More than one user known with name '{}'", buddyName);
         showMessageTextIm(m_data, buddyName, NULL, errorMessage.c_str(), time(NULL), PURPLE_MESSAGE_ERROR);
         return false;
     }
@@ -2352,7 +2678,7 @@ void PurpleTdClient::createSecretChat(const char* buddyName)
         // Unlikely error messages not worth translating
         const char *reason = users.empty() ? "User not found" :
                                              "More than one user found with this name";
-        std::string message = formatMessage("Cannot create secret chat: {}", std::string(reason));
+        std::string message = formatMessage("Cannot create secret chat: {}", reason);
         purple_notify_error(purple_account_get_connection(m_account),
                             // TRANSLATOR: Failure notification, title
                             _("Failed to create secret chat"),
@@ -14,6 +14,9 @@ enum class BasicGroupMembership: uint8_t {
 
 class PurpleTdClient {
 public:
+    // Scheduled file cache cleanup waits for updates to stop arriving, checking at most this many times
+    enum { FILE_CACHE_MAX_DEFERRALS = 30 };
+
     PurpleTdClient(PurpleAccount *acct, ITransceiverBackend *testBackend);
     ~PurpleTdClient();
 
@@ -53,11 +56,24 @@ public:
     bool terminateCall(PurpleConversation *conv);
 
     void createSecretChat(const char *buddyName);
+
+    // Approximate memory used by this account's data and images in imgstore, as text
+    std::string getMemoryReport();
+    // Trims tdlib file cache to limits from account settings. Returns false if there are none.
+    bool cleanUpFileCache(bool notify);
+
+    void buddyListNodeAdded(PurpleBlistNode *node)   { m_data.buddyList.add(node); }
+    void buddyListNodeRemoved(PurpleBlistNode *node) { m_data.buddyList.remove(node); }
+    void chatConversationDestroyed(const char *name) { m_data.chatMemberNames.erase(name); }
 private:
     using TdObjectPtr   = td::td_api::object_ptr<td::td_api::Object>;
     using ResponseCb    = void (PurpleTdClient::*)(uint64_t requestId, TdObjectPtr object);
 
     void       processUpdate(td::td_api::Object &object);
+    void       memoryReportTimer(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
+    void       scheduleFileCacheCleanup(unsigned delay);
+    void       fileCacheCleanupTimer(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
+    void       fileCacheCleanupResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
     void       processAuthorizationState(td::td_api::AuthorizationState &authState);
 
     // Login sequence start
@@ -99,6 +115,7 @@ private:
     void       updateChatLastMessage(td::td_api::updateChatLastMessage &lastMessage);
 
     void       updateUserStatus(UserId userId, td::td_api::object_ptr<td::td_api::UserStatus> status);
+    void       applyUserStatuses(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
     void       updateUser(td::td_api::object_ptr<td::td_api::user> user);
     void       downloadProfilePhoto(const td::td_api::user &user);
     void       avatarDownloadResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
@@ -112,7 +129,11 @@ private:
     void       groupInfoResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
     void       supergroupInfoResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
     void       supergroupMembersResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
+    void       requestSupergroupMembers(SupergroupId groupId, int32_t offset, bool refresh);
     void       supergroupAdministratorsResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
+    void       showSupergroupMembers(SupergroupId groupId,
+                                     const std::vector<const td::td_api::chatMember *> &changedMembers,
+                                     const std::vector<UserId> &removedMembers);
     void       updateGroupFull(BasicGroupId groupId, td::td_api::object_ptr<td::td_api::basicGroupFullInfo> groupInfo);
     void       updateSupergroupFull(SupergroupId groupId, td::td_api::object_ptr<td::td_api::supergroupFullInfo> groupInfo);
 
@@ -132,12 +153,12 @@ private:
     void       setGroupDescriptionResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
     void       chatActionResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
 
-    void       onAnimatedStickerConverted(AccountThread *arg);
+    void       onStickerConverted(AccountThread *arg);
+    void       onFileHashed(AccountThread *arg);
     void       sendMessageCreatePrivateChatResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
     void       uploadResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
 
     void       sendMessageResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
-    void       removeTempFile(int64_t messageId);
 
     void        setTwoFactorAuthResponse(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object);
     void        requestRecoveryEmailConfirmation(const std::string &emailInfo);
@@ -151,6 +172,13 @@ private:
     std::vector<UserId>   m_usersForNewPrivateChats;
     bool                  m_chatListReady = false;
     bool                  m_isProxyAdded = false;
+    bool                  m_keepDebugLog = false;
+    bool                  m_recordTimeline = false;
+    uint64_t              m_fileCacheTimer = 0;
+    unsigned              m_fileCacheDeferrals = 0;
+    bool                  m_fileCacheCleanupRunning = false;
+    bool                  m_fileCacheCleanupNotify = false;
+    gint64                m_lastUpdateTime = 0;
     std::vector<PurpleRoomlist *>               m_pendingRoomLists;
     td::td_api::object_ptr<td::td_api::proxy>   m_addedProxy;
     td::td_api::object_ptr<td::td_api::proxies> m_proxies;
@@ -4,6 +4,7 @@
 #include "purple-info.h"
 #include "format.h"
 #include "buildopt.h"
+#include "trace.h"
 #include <purple.h>
 
 #include <cstdint>
@@ -320,9 +321,49 @@ conversation_updated_cb(PurpleConversation *conv, PurpleConvUpdateType type)
     }
 }
 
+static void deleting_conversation_cb(PurpleConversation *conv, PurpleAccount *account)
+{
+    if ((purple_conversation_get_account(conv) != account) ||
+        (purple_conversation_get_type(conv) != PURPLE_CONV_TYPE_CHAT))
+    {
+        return;
+    }
+
+    PurpleConnection *gc       = purple_account_get_connection(account);
+    PurpleTdClient   *tdClient = gc ? static_cast<PurpleTdClient *>(purple_connection_get_protocol_data(gc)) : NULL;
+    if (tdClient)
+        tdClient->chatConversationDestroyed(purple_conversation_get_name(conv));
+}
+
+static PurpleTdClient *getBuddyListNodeClient(PurpleBlistNode *node, PurpleAccount *account)
+{
+    PurpleAccount *nodeAccount = NULL;
+    if (PURPLE_BLIST_NODE_IS_BUDDY(node))
+        nodeAccount = purple_buddy_get_account(PURPLE_BUDDY(node));
+    else if (PURPLE_BLIST_NODE_IS_CHAT(node))
+        nodeAccount = purple_chat_get_account(PURPLE_CHAT(node));
+
+    PurpleConnection *gc = (nodeAccount == account) ? purple_account_get_connection(account) : NULL;
+    return gc ? static_cast<PurpleTdClient *>(purple_connection_get_protocol_data(gc)) : NULL;
+}
+
+static void blist_node_added_cb(PurpleBlistNode *node, PurpleAccount *account)
+{
+    PurpleTdClient *tdClient = getBuddyListNodeClient(node, account);
+    if (tdClient)
+        tdClient->buddyListNodeAdded(node);
+}
+
+static void blist_node_removed_cb(PurpleBlistNode *node, PurpleAccount *account)
+{
+    PurpleTdClient *tdClient = getBuddyListNodeClient(node, account);
+    if (tdClient)
+        tdClient->buddyListNodeRemoved(node);
+}
+
 static void tgprpl_login (PurpleAccount *acct)
 {
-    purple_debug_misc(config::pluginId, "version %s\n", config::versionString);
+    DEBUG_MISC("version %s\n", config::versionString);
     PurpleConnection *gc       = purple_account_get_connection (acct);
     PurpleTdClient   *tdClient = new PurpleTdClient(acct, g_testBackend);
 
@@ -332,10 +373,23 @@ static void tgprpl_login (PurpleAccount *acct)
 
     purple_signal_connect(purple_conversations_get_handle(), "conversation-updated",
                           acct, PURPLE_CALLBACK(conversation_updated_cb), NULL);
+    purple_signal_connect(purple_conversations_get_handle(), "deleting-conversation",
+                          acct, PURPLE_CALLBACK(deleting_conversation_cb), acct);
+    purple_signal_connect(purple_blist_get_handle(), "blist-node-added",
+                          acct, PURPLE_CALLBACK(blist_node_added_cb), acct);
+    purple_signal_connect(purple_blist_get_handle(), "blist-node-removed",
+                          acct, PURPLE_CALLBACK(blist_node_removed_cb), acct);
 }
 
 static void tgprpl_close (PurpleConnection *gc)
 {
+    PurpleAccount *account = purple_connection_get_account(gc);
+    purple_signal_disconnect(purple_conversations_get_handle(), "deleting-conversation",
+                             account, PURPLE_CALLBACK(deleting_conversation_cb));
+    purple_signal_disconnect(purple_blist_get_handle(), "blist-node-added",
+                             account, PURPLE_CALLBACK(blist_node_added_cb));
+    purple_signal_disconnect(purple_blist_get_handle(), "blist-node-removed",
+                             account, PURPLE_CALLBACK(blist_node_removed_cb));
     delete static_cast<PurpleTdClient *>(purple_connection_get_protocol_data(gc));
     purple_connection_set_protocol_data(gc, NULL);
 }
@@ -343,7 +397,7 @@ static void tgprpl_close (PurpleConnection *gc)
 static int tgprpl_send_im (PurpleConnection *gc, const char *who, const char *message, PurpleMessageFlags flags)
 {
     PurpleTdClient *tdClient = static_cast<PurpleTdClient *>(purple_connection_get_protocol_data(gc));
-    purple_debug_misc(config::pluginId, "tgprpl_send_im to '%s' flags=0x%x\n", who, (unsigned)flags);
+    DEBUG_MISC("tgprpl_send_im to '%s' flags=0x%x\n", who, (unsigned)flags);
     return tdClient->sendMessage(who, message);
 }
 
@@ -554,8 +608,8 @@ static void tgprpl_chat_join (PurpleConnection *gc, GHashTable *data)
             else {
                 // TRANSLATOR: Join error dialog, secondary content. all five arguments are URLs. "name" should be part of the URL, and indicate that it can be a name in your language.
                 std::string extraMessage = formatMessage(_("Invite link must start with {0}, {1} or {2}. Public group link must be {3}name or {4}name."),
-                                                         {invitePrefixes[0], invitePrefixes[1], invitePrefixes[2],
-                                                         groupLinkPrefixes[0], groupLinkPrefixes[1]});
+                                                         invitePrefixes[0], invitePrefixes[1], invitePrefixes[2],
+                                                         groupLinkPrefixes[0], groupLinkPrefixes[1]);
                 // TRANSLATOR: Join error dialog, title
                 purple_notify_error(gc, _("Failed to join chat"),
                                     // TRANSLATOR: Join error dialog, primary content
@@ -598,8 +652,8 @@ static void tgprpl_chat_invite (PurpleConnection *gc, int id, const char *messag
 
 static int tgprpl_send_chat (PurpleConnection *gc, int id, const char *message, PurpleMessageFlags flags)
 {
-    purple_debug_misc(config::pluginId, "Sending group chat message: purple chat id %d, flags=0x%x\n",
-                      id, (unsigned)flags);
+    DEBUG_MISC("Sending group chat message: purple chat id %d, flags=0x%x\n",
+               id, (unsigned)flags);
     PurpleTdClient *tdClient = static_cast<PurpleTdClient *>(purple_connection_get_protocol_data(gc));
     return tdClient->sendGroupMessage(id, message);
 }
@@ -717,7 +771,7 @@ static void sendFileToChat(PurpleConnection *gc, int id, const char *filename)
 {
     PurpleConversation *conv = purple_find_chat(gc, id);
     if (!conv) {
-        purple_debug_warning(config::pluginId, "No chat conversation with id %d\n", id);
+        DEBUG_WARNING("No chat conversation with id %d\n", id);
         return;
     }
 
@@ -796,6 +850,73 @@ static PurpleCmdRet hangupCommand(PurpleConversation *conv, const gchar *cmd, gc
         return PURPLE_CMD_RET_FAILED;
 }
 
+// Recording started with the timeline command, as opposed to account option
+static bool g_timelineCommandRecording = false;
+
+static std::string saveTimeline()
+{
+    gchar       *fileName = g_build_filename(purple_user_dir(), "telegram-tdlib-timeline.json", NULL);
+    std::string  errorMessage;
+    std::string  message;
+
+    if (Trace::save(fileName, errorMessage))
+        // TRANSLATOR: Message after saving activity timeline, argument is a file name
+        message = formatMessage(_("Saved activity timeline to {}"), fileName);
+    else
+        // TRANSLATOR: Error message, argument is an error message
+        message = formatMessage(_("Could not save activity timeline: {}"), errorMessage);
+    g_free(fileName);
+    return message;
+}
+
+static PurpleCmdRet timelineCommand(PurpleConversation *conv, const gchar *cmd, gchar **args, gchar **error, void *data)
+{
+    std::string message;
+
+    if (!strcmp(args[0], "start")) {
+        if (!g_timelineCommandRecording) {
+            g_timelineCommandRecording = true;
+            Trace::retain();
+        }
+        // TRANSLATOR: In-chat status message
+        message = _("Recording activity timeline");
+    } else if (!strcmp(args[0], "stop")) {
+        if (g_timelineCommandRecording) {
+            g_timelineCommandRecording = false;
+            Trace::release();
+        }
+        if (Trace::enabled())
+            // TRANSLATOR: In-chat status message
+            message = _("Activity timeline is still being recorded because of account settings");
+        else
+            // TRANSLATOR: In-chat status message
+            message = _("Stopped recording activity timeline");
+    } else if (!strcmp(args[0], "save"))
+        message = saveTimeline();
+    else {
+        // TRANSLATOR: Command error message, "start", "stop" and "save" must remain verbatim!
+        *error = g_strdup(_("Expected start, stop or save"));
+        return PURPLE_CMD_RET_FAILED;
+    }
+
+    purple_conversation_write(conv, NULL, message.c_str(),
+                              (PurpleMessageFlags)(PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG), time(NULL));
+    return PURPLE_CMD_RET_OK;
+}
+
+static PurpleCmdRet memoryCommand(PurpleConversation *conv, const gchar *cmd, gchar **args, gchar **error, void *data)
+{
+    PurpleTdClient *tdClient = getTdClient(purple_conversation_get_account(conv));
+
+    if (!tdClient)
+        return PURPLE_CMD_RET_FAILED;
+
+    std::string report = tdClient->getMemoryReport();
+    purple_conversation_write(conv, NULL, report.c_str(),
+                              (PurpleMessageFlags)(PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG), time(NULL));
+    return PURPLE_CMD_RET_OK;
+}
+
 static char png[] = "png";
 
 static PurplePluginProtocolInfo prpl_info = {
@@ -904,6 +1025,18 @@ static gboolean tgprpl_load (PurplePlugin *plugin)
                         // TRANSLATOR: Command description, the initial "hangup" must remain verbatim!
                         _("hangup: Terminate any active call (with any user)"), NULL);
 
+    purple_cmd_register("timeline", "w", PURPLE_CMD_P_PLUGIN,
+                        (PurpleCmdFlag)(PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT | PURPLE_CMD_FLAG_PRPL_ONLY),
+                        config::pluginId, timelineCommand,
+                        // TRANSLATOR: Command description, the initial "timeline start|stop|save" must remain verbatim!
+                        _("timeline start|stop|save: Record a timeline of plugin activity, for diagnosing hangs"), NULL);
+
+    purple_cmd_register("memory", "", PURPLE_CMD_P_PLUGIN,
+                        (PurpleCmdFlag)(PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT | PURPLE_CMD_FLAG_PRPL_ONLY),
+                        config::pluginId, memoryCommand,
+                        // TRANSLATOR: Command description, the initial "memory" must remain verbatim!
+                        _("memory: Show approximate memory used by account data"), NULL);
+
     return TRUE;
 }
 
@@ -927,7 +1060,7 @@ static gboolean tdlibFatalErrorHandler(void *data)
           "You will be required to log in into the account again.");
 
     // tdlib messages are untranslated, so can as well leave "tdlib error" untranslated as well
-    std::string details = formatMessage("tdlib error: {}", std::string(message));
+    std::string details = formatMessage("tdlib error: {}", message);
     details += '\n';
     details += formatMessage(dbMessage, PurpleTdClient::getBaseDatabasePath());
 
@@ -1023,13 +1156,73 @@ static void tgprpl_init (PurplePlugin *plugin)
     opt = purple_account_option_bool_new(_("Show animated stickers"), AccountOptions::AnimatedStickers,
                                          AccountOptions::AnimatedStickersDefault);
     prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_int_new(_("Animated sticker frame rate (0 for original)"),
+                                        AccountOptions::AnimatedStickerFps,
+                                        AccountOptions::AnimatedStickerFpsDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_int_new(_("Animated sticker maximum duration, seconds (0 for unlimited)"),
+                                        AccountOptions::AnimatedStickerMaxDuration,
+                                        AccountOptions::AnimatedStickerMaxDurationDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_int_new(_("Animated sticker size, pixels"),
+                                        AccountOptions::AnimatedStickerSize,
+                                        AccountOptions::AnimatedStickerSizeDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (boolean)
+    opt = purple_account_option_bool_new(_("Reduce animated sticker quality under load"),
+                                         AccountOptions::AnimatedStickerAdaptive,
+                                         AccountOptions::AnimatedStickerAdaptiveDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_int_new(_("Number of parsed animated stickers to keep (0 to disable)"),
+                                        AccountOptions::AnimatedStickerCacheSize,
+                                        AccountOptions::AnimatedStickerCacheSizeDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
 #endif
 
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_int_new(_("Maximum number of group members to show (0 for unlimited)"),
+                                        AccountOptions::MemberListLimit,
+                                        AccountOptions::MemberListLimitDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
     // TRANSLATOR: Account settings, key (boolean)
     opt = purple_account_option_bool_new(_("Show self-destructing messages anyway"), AccountOptions::ShowSelfDestruct,
                                          AccountOptions::ShowSelfDestructDefault);
     prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
 
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_int_new(_("Maximum size of downloaded file cache, MB (0 for unlimited)"),
+                                        AccountOptions::FileCacheMaxSize,
+                                        AccountOptions::FileCacheMaxSizeDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (number)
+    opt = purple_account_option_int_new(_("Remove cached files unused for this many days (0 to keep)"),
+                                        AccountOptions::FileCacheMaxAge,
+                                        AccountOptions::FileCacheMaxAgeDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (boolean)
+    opt = purple_account_option_bool_new(_("Keep recent debug messages in memory, for saving them on demand"),
+                                         AccountOptions::KeepDebugLog,
+                                         AccountOptions::KeepDebugLogDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
+    // TRANSLATOR: Account settings, key (boolean)
+    opt = purple_account_option_bool_new(_("Record timeline of plugin activity, for saving it on demand"),
+                                         AccountOptions::RecordTimeline,
+                                         AccountOptions::RecordTimelineDefault);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+
     if (canDisableReadReceipts()) {
         opt = purple_account_option_bool_new ("Send read receipts",
                                               AccountOptions::ReadReceipts,
@@ -1128,6 +1321,45 @@ static void configureTwoFactorAuth(PurplePluginAction *action)
     requestTwoFactorAuth(gc, _("Enter new password and recovery e-mail address"), NULL);
 }
 
+static void saveDebugLog(PurplePluginAction *action)
+{
+    PurpleConnection *gc       = static_cast<PurpleConnection *>(action->context);
+    gchar            *fileName = g_build_filename(purple_user_dir(), "telegram-tdlib-debug.log", NULL);
+    std::string       errorMessage;
+    std::string       message;
+
+    if (DebugLog::save(fileName, errorMessage))
+        // TRANSLATOR: Dialog content after saving debug messages, argument is a file name
+        message = formatMessage(_("Saved recent debug messages to {}"), fileName);
+    else
+        // TRANSLATOR: Dialog content, argument is an error message
+        message = formatMessage(_("Could not save debug messages: {}"), errorMessage);
+    // TRANSLATOR: Dialog title
+    purple_notify_info(gc, _("Debug messages"), message.c_str(), NULL);
+    g_free(fileName);
+}
+
+static void saveTimelineAction(PurplePluginAction *action)
+{
+    PurpleConnection *gc      = static_cast<PurpleConnection *>(action->context);
+    std::string       message = saveTimeline();
+    // TRANSLATOR: Dialog title
+    purple_notify_info(gc, _("Activity timeline"), message.c_str(), NULL);
+}
+
+static void cleanUpFileCache(PurplePluginAction *action)
+{
+    PurpleConnection *gc       = static_cast<PurpleConnection *>(action->context);
+    PurpleTdClient   *tdClient = static_cast<PurpleTdClient *>(purple_connection_get_protocol_data(gc));
+
+    if (tdClient && !tdClient->cleanUpFileCache(true))
+        purple_notify_info(gc,
+                           // TRANSLATOR: Dialog title
+                           _("File cache"),
+                           // TRANSLATOR: Dialog content
+                           _("Set maximum size or age of file cache in account settings first"), NULL);
+}
+
 static GList *tgprpl_actions (PurplePlugin *plugin, gpointer context)
 {
     GList *actionsList = NULL;
@@ -1138,6 +1370,18 @@ static GList *tgprpl_actions (PurplePlugin *plugin, gpointer context)
                                       configureTwoFactorAuth);
     actionsList = g_list_append(actionsList, action);
 
+    // TRANSLATOR: Account menu item
+    action = purple_plugin_action_new(_("Clean up file cache now"), cleanUpFileCache);
+    actionsList = g_list_append(actionsList, action);
+
+    // TRANSLATOR: Account menu item
+    action = purple_plugin_action_new(_("Save recent debug messages"), saveDebugLog);
+    actionsList = g_list_append(actionsList, action);
+
+    // TRANSLATOR: Account menu item
+    action = purple_plugin_action_new(_("Save activity timeline"), saveTimelineAction);
+    actionsList = g_list_append(actionsList, action);
+
     return actionsList;
 }
 
@@ -0,0 +1,136 @@
+#include "benchmark-client.h"
+#include "tdlib-purple.h"
+
+static PurplePluginProtocolInfo &pluginInfo()
+{
+    static PurplePlugin purplePlugin;
+    static bool         loaded = false;
+    if (!loaded) {
+        purple_init_plugin(&purplePlugin);
+        purplePlugin.info->load(&purplePlugin);
+        loaded = true;
+    }
+    return *(PurplePluginProtocolInfo *)purplePlugin.info->extra_info;
+}
+
+BenchmarkClient::BenchmarkClient()
+{
+    setMockOutput(FALSE);
+    tgprpl_set_test_backend(&tgl);
+    tgprpl_set_single_thread();
+    pluginInfo();
+
+    account = purple_account_new("+1234567", NULL);
+    m_connection = new PurpleConnection;
+    m_connection->state = PURPLE_DISCONNECTED;
+    m_connection->account = account;
+    purple_connection_set_protocol_data(m_connection, NULL);
+    account->gc = m_connection;
+    g_purpleEvents.discardEvents();
+    setUiName("Pidgin");
+}
+
+BenchmarkClient::~BenchmarkClient()
+{
+    if (purple_connection_get_protocol_data(m_connection))
+        pluginInfo().close(m_connection);
+    g_purpleEvents.discardEvents();
+
+    delete m_connection;
+    account->gc = NULL;
+    tgl.runTimeouts();
+    purple_account_destroy(account);
+    clearFakeFiles();
+}
+
+void BenchmarkClient::login(std::vector<object_ptr<Object>> updates, std::vector<int32_t> contacts)
+{
+    m_contacts = std::move(contacts);
+    pluginInfo().login(account);
+
+    tgl.update(make_object<updateAuthorizationState>(make_object<authorizationStateWaitTdlibParameters>()));
+    respond();
+    tgl.update(make_object<updateAuthorizationState>(make_object<authorizationStateWaitEncryptionKey>(true)));
+    respond();
+
+    // Like real tdlib, send updates before replying to getContacts
+    tgl.update(make_object<updateAuthorizationState>(make_object<authorizationStateReady>()));
+    tgl.update(make_object<updateConnectionState>(make_object<connectionStateConnecting>()));
+    tgl.update(make_object<updateConnectionState>(make_object<connectionStateUpdating>()));
+    tgl.update(make_object<updateUser>(makeUser(1, "Isaac", "Newton", "1234567",
+                                                make_object<userStatusOffline>())));
+    for (object_ptr<Object> &update: updates)
+        tgl.update(std::move(update));
+    tgl.update(make_object<updateConnectionState>(make_object<connectionStateReady>()));
+    respond();
+
+    g_purpleEvents.discardEvents();
+}
+
+void BenchmarkClient::respond()
+{
+    for (std::vector<td::Client::Request> requests = tgl.takeRequests(); !requests.empty();
+         requests = tgl.takeRequests())
+    {
+        for (td::Client::Request &request: requests) {
+            object_ptr<Object> reply;
+            if (m_responder)
+                reply = m_responder(*request.function);
+            if (!reply)
+                reply = defaultReply(*request.function);
+            tgl.reply(request.id, std::move(reply));
+        }
+    }
+}
+
+object_ptr<Object> BenchmarkClient::defaultReply(const Function &request)
+{
+    switch (request.get_id()) {
+    case disableProxy::ID:
+    case setTdlibParameters::ID:
+    case checkDatabaseEncryptionKey::ID:
+    case viewMessages::ID:
+        return make_object<ok>();
+    case getProxies::ID:
+        return make_object<proxies>();
+    case getContacts::ID:
+        return make_object<users>(m_contacts.size(), m_contacts);
+    case loadChats::ID:
+        // All chats have already been sent as updates
+        if (m_chatsLoaded)
+            return getChatsNoChatsResponse();
+        m_chatsLoaded = true;
+        return make_object<ok>();
+    case createPrivateChat::ID: {
+        int32_t userId = static_cast<const createPrivateChat &>(request).user_id_;
+        tgl.update(makeBenchmarkPrivateChat(userId));
+        return makeChat(userId, make_object<chatTypePrivate>(userId), "User " + std::to_string(userId),
+                        nullptr, 0, 0, 0);
+    }
+    case getSupergroupFullInfo::ID:
+        return make_object<supergroupFullInfo>();
+    case getSupergroupMembers::ID:
+        return make_object<chatMembers>();
+    default:
+        return make_object<error>(400, "Not supported in benchmark");
+    }
+}
+
+object_ptr<updateUser> makeBenchmarkUser(int32_t userId)
+{
+    return make_object<updateUser>(makeUser(userId, "User", std::to_string(userId),
+                                            "555" + std::to_string(userId),
+                                            make_object<userStatusOffline>()));
+}
+
+object_ptr<updateNewChat> makeBenchmarkPrivateChat(int32_t userId)
+{
+    return make_object<updateNewChat>(makeChat(userId, make_object<chatTypePrivate>(userId),
+                                               "User " + std::to_string(userId), nullptr, 0, 0, 0));
+}
+
+object_ptr<message> makeBenchmarkTextMessage(int64_t messageId, int32_t senderId, int64_t chatId,
+                                             const std::string &text)
+{
+    return makeMessage(messageId, senderId, chatId, false, 1600000000 + messageId, makeTextMessage(text));
+}
@@ -0,0 +1,47 @@
+#ifndef _BENCHMARK_CLIENT_H
+#define _BENCHMARK_CLIENT_H
+
+#include "test-transceiver.h"
+#include "purple-events.h"
+#include "libpurple-mock.h"
+#include <functional>
+#include <vector>
+
+using namespace td::td_api;
+
+// Drives the plugin through the same mock layer as the tests, but instead of verifying requests,
+// answers them so that scenarios with synthetic data can run unattended
+class BenchmarkClient {
+public:
+    // Returns reply to a request, or nullptr to use the default reply
+    using Responder = std::function<object_ptr<Object>(const Function &request)>;
+
+    BenchmarkClient();
+    ~BenchmarkClient();
+
+    // Goes through authorization, then sends given updates followed by chat list and contacts
+    void login(std::vector<object_ptr<Object>> updates, std::vector<int32_t> contacts = {});
+    void update(object_ptr<Object> update) { tgl.update(std::move(update)); }
+    // Answers requests until there are none left, including ones sent in reaction to answers
+    void respond();
+    void setResponder(Responder responder) { m_responder = std::move(responder); }
+    void discardEvents() { g_purpleEvents.discardEvents(); }
+
+    PurpleAccount *account;
+    TestTransceiver tgl;
+
+private:
+    PurpleConnection *m_connection;
+    Responder         m_responder;
+    std::vector<int32_t> m_contacts;
+    bool              m_chatsLoaded = false;
+
+    object_ptr<Object> defaultReply(const Function &request);
+};
+
+object_ptr<updateUser>    makeBenchmarkUser(int32_t userId);
+object_ptr<updateNewChat> makeBenchmarkPrivateChat(int32_t userId);
+object_ptr<message>       makeBenchmarkTextMessage(int64_t messageId, int32_t senderId, int64_t chatId,
+                                                   const std::string &text);
+
+#endif
@@ -0,0 +1,200 @@
+#include "benchmark-client.h"
+#include "buildopt.h"
+#include <benchmark/benchmark.h>
+#include <memory>
+
+// End-to-end scenarios: synthetic tdlib traffic goes through PurpleTdClient into the libpurple mock
+
+static const int32_t groupId     = 700;
+static const int64_t groupChatId = -7000;
+static const int32_t firstUserId = 1000;
+
+static std::vector<object_ptr<Object>> makeSupergroupUpdates(int32_t memberCount)
+{
+    std::vector<object_ptr<Object>> updates;
+    for (int32_t i = 0; i < memberCount; i++)
+        updates.push_back(makeBenchmarkUser(firstUserId + i));
+    updates.push_back(make_object<updateSupergroup>(make_object<supergroup>(
+        groupId, "", 0, make_object<chatMemberStatusMember>(), memberCount,
+        false, false, false, false, false, false, "", false
+    )));
+    updates.push_back(make_object<updateNewChat>(makeChat(
+        groupChatId, make_object<chatTypeSupergroup>(groupId, false), "Group", nullptr, 0, 0, 0
+    )));
+    updates.push_back(makeUpdateChatListMain(groupChatId));
+    return updates;
+}
+
+// Users, of which some are contacts, and private chats with some of the contacts. Contacts with
+// no chat get one created during login.
+static void BM_Login(benchmark::State &state)
+{
+    const int32_t userCount    = state.range(0);
+    const int32_t chatCount    = state.range(1);
+    const int32_t contactCount = std::min(userCount, chatCount + chatCount / 5);
+
+    for (auto _: state) {
+        state.PauseTiming();
+        auto client = std::make_unique<BenchmarkClient>();
+        std::vector<object_ptr<Object>> updates;
+        std::vector<int32_t> contacts;
+        for (int32_t i = 0; i < userCount; i++)
+            updates.push_back(makeBenchmarkUser(firstUserId + i));
+        for (int32_t i = 0; i < chatCount; i++) {
+            updates.push_back(makeBenchmarkPrivateChat(firstUserId + i));
+            updates.push_back(makeUpdateChatListMain(firstUserId + i));
+        }
+        for (int32_t i = 0; i < contactCount; i++)
+            contacts.push_back(firstUserId + i);
+        state.ResumeTiming();
+
+        client->login(std::move(updates), std::move(contacts));
+
+        state.PauseTiming();
+        client.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * (userCount + chatCount));
+}
+BENCHMARK(BM_Login)->Args({10000, 5000})->Unit(benchmark::kMillisecond);
+
+// One second worth of group chat traffic per iteration, from a number of different senders
+static void BM_GroupFlood(benchmark::State &state)
+{
+    const int32_t messagesPerSecond = state.range(0);
+    const int32_t senderCount       = 50;
+    BenchmarkClient client;
+    client.login(makeSupergroupUpdates(senderCount));
+
+    int64_t messageId = 1;
+    for (auto _: state) {
+        for (int32_t i = 0; i < messagesPerSecond; i++, messageId++)
+            client.update(make_object<updateNewMessage>(makeBenchmarkTextMessage(
+                messageId, firstUserId + messageId % senderCount, groupChatId,
+                "Message " + std::to_string(messageId)
+            )));
+        client.respond();
+        client.discardEvents();
+    }
+    state.SetItemsProcessed(state.iterations() * messagesPerSecond);
+}
+BENCHMARK(BM_GroupFlood)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+#ifndef NoLottie
+// Burst of animated stickers in a private chat, cycling through a number of distinct stickers, so
+// that parsed animation cache either mostly hits or always misses
+static void BM_StickerStorm(benchmark::State &state)
+{
+    const int32_t stickerCount  = 16;
+    const int32_t distinctCount = state.range(0);
+    BenchmarkClient client;
+    client.login({makeBenchmarkUser(firstUserId), makeBenchmarkPrivateChat(firstUserId),
+                  makeUpdateChatListMain(firstUserId)},
+                 {firstUserId});
+
+    int64_t messageId = 1;
+    for (auto _: state) {
+        for (int32_t i = 0; i < stickerCount; i++, messageId++) {
+            std::string uniqueId = "sticker" + std::to_string(messageId % distinctCount);
+            client.update(make_object<updateNewMessage>(makeMessage(
+                messageId, firstUserId, firstUserId, false, 1600000000 + messageId,
+                make_object<messageSticker>(make_object<sticker>(
+                    0, 320, 200, "", true, false, nullptr,
+                    nullptr,
+                    make_object<file>(
+                        messageId, 10000, 10000,
+                        make_object<localFile>(TEST_SOURCE_DIR "/test.tgs", true, true, false, true, 0, 10000, 10000),
+                        make_object<remoteFile>("", uniqueId, false, true, 10000)
+                    )
+                ))
+            )));
+        }
+        client.respond();
+        client.discardEvents();
+    }
+    state.SetItemsProcessed(state.iterations() * stickerCount);
+}
+BENCHMARK(BM_StickerStorm)->Arg(1)->Arg(16)->Unit(benchmark::kMillisecond);
+#endif
+
+// Skipped messages reported by tdlib, fetched with getChatHistory when next message arrives
+static void BM_HistoryGap(benchmark::State &state)
+{
+    const int32_t gapSize = state.range(0);
+    BenchmarkClient client;
+    client.login(makeSupergroupUpdates(1));
+    client.setResponder([](const Function &request) -> object_ptr<Object> {
+        if (request.get_id() != getChatHistory::ID)
+            return nullptr;
+        const getChatHistory &getHistory = static_cast<const getChatHistory &>(request);
+        std::vector<object_ptr<message>> history;
+        for (int64_t id = getHistory.from_message_id_ - 1;
+             (id > 0) && (id >= getHistory.from_message_id_ - getHistory.limit_); id--)
+            history.push_back(makeBenchmarkTextMessage(id, firstUserId, groupChatId, std::to_string(id)));
+        return make_object<messages>(history.size(), std::move(history));
+    });
+
+    int64_t lastMessageId = 1;
+    for (auto _: state) {
+        client.update(make_object<updateChatLastMessage>(
+            groupChatId, makeBenchmarkTextMessage(lastMessageId, firstUserId, groupChatId, ""), 0
+        ));
+        client.update(make_object<updateChatLastMessage>(groupChatId, nullptr, 0));
+
+        lastMessageId += gapSize + 1;
+        client.update(make_object<updateNewMessage>(makeBenchmarkTextMessage(
+            lastMessageId, firstUserId, groupChatId, std::to_string(lastMessageId)
+        )));
+        client.respond();
+        client.discardEvents();
+    }
+    state.SetItemsProcessed(state.iterations() * gapSize);
+}
+BENCHMARK(BM_HistoryGap)->Arg(60)->Unit(benchmark::kMillisecond);
+
+// Supergroup with an open conversation, whose whole member list is fetched page by page
+static void BM_MemberList(benchmark::State &state)
+{
+    const int32_t memberCount = state.range(0);
+
+    for (auto _: state) {
+        state.PauseTiming();
+        auto client = std::make_unique<BenchmarkClient>();
+        purple_account_set_int(client->account, "member-list-limit", 0);
+        client->setResponder([memberCount](const Function &request) -> object_ptr<Object> {
+            if (request.get_id() != getSupergroupMembers::ID)
+                return nullptr;
+            const getSupergroupMembers &getMembers = static_cast<const getSupergroupMembers &>(request);
+            bool  admins  = getMembers.filter_ &&
+                            (getMembers.filter_->get_id() == supergroupMembersFilterAdministrators::ID);
+            auto  members = make_object<chatMembers>();
+            members->total_count_ = admins ? 1 : memberCount;
+            for (int32_t i = getMembers.offset_;
+                 (i < members->total_count_) && (i < getMembers.offset_ + getMembers.limit_); i++)
+            {
+                object_ptr<ChatMemberStatus> status;
+                if (admins)
+                    status = make_object<chatMemberStatusCreator>("", true);
+                else
+                    status = make_object<chatMemberStatusMember>();
+                members->members_.push_back(makeChatMember(firstUserId + i, firstUserId, 0,
+                                                           std::move(status), nullptr));
+            }
+            return std::move(members);
+        });
+        std::vector<object_ptr<Object>> updates = makeSupergroupUpdates(memberCount);
+        // Incoming message opens the conversation, so that member list is shown
+        updates.push_back(make_object<updateNewMessage>(makeBenchmarkTextMessage(
+            1, firstUserId, groupChatId, "Hello"
+        )));
+        state.ResumeTiming();
+
+        client->login(std::move(updates));
+
+        state.PauseTiming();
+        client.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * memberCount);
+}
+BENCHMARK(BM_MemberList)->Arg(10000)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,276 @@
+#include "html-parser.h"
+#include "sticker.h"
+#include "format.h"
+#include "buildopt.h"
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifndef NoLottie
+#include <rlottie.h>
+#include <zlib.h>
+#endif
+
+// Individual hot paths, on data that resembles real traffic
+
+static std::string makeHtmlPaste(size_t size)
+{
+    static const char *const snippet =
+        "Some <b>bold</b> and <i>italic</i> text with a <a href=\"https://example.com/page?a=1&amp;b=2\">"
+        "link</a>, <code>inline code</code> &amp; entities like &lt;tag&gt;, "
+        "and non-ASCII \xD1\x82\xD0\xB5\xD0\xBA\xD1\x81\xD1\x82 \xF0\x9F\x98\x80<br>"
+        "<pre>int main() { return 0; }</pre><br>\n";
+    std::string result;
+    while (result.size() < size)
+        result += snippet;
+    return result;
+}
+
+// Multi-KB paste into the conversation window, split into several messages
+static void BM_ParseOutgoingHtml(benchmark::State &state)
+{
+    std::string html = makeHtmlPaste(state.range(0) * 1024);
+    std::vector<MessagePart> parts;
+
+    for (auto _: state) {
+        parts.clear();
+        parseOutgoingHtml(html.c_str(), 4096, 1024, parts);
+        benchmark::DoNotOptimize(parts.data());
+    }
+    state.SetBytesProcessed(state.iterations() * html.size());
+}
+BENCHMARK(BM_ParseOutgoingHtml)->Arg(4)->Arg(64);
+
+// Counts allocations made by the whole benchmark binary, for reporting them per iteration
+static std::atomic<size_t> g_allocationCount{0};
+
+void *operator new(size_t size)
+{
+    g_allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+class AllocationCounter {
+public:
+    AllocationCounter() : m_start(g_allocationCount) {}
+    void report(benchmark::State &state)
+    {
+        state.counters["allocs"] = benchmark::Counter(g_allocationCount - m_start,
+                                                      benchmark::Counter::kAvgIterations);
+    }
+private:
+    size_t m_start;
+};
+
+// How formatMessage used to work: every argument converted to std::string first
+static std::string formatMessageLegacy(const char *fmt, std::initializer_list<std::string> args)
+{
+    fmt::dynamic_format_arg_store<fmt::format_context> fa;
+    for (const std::string &arg: args)
+        fa.push_back(arg);
+    return fmt::vformat(fmt, fa);
+}
+
+// File download notice, with string arguments like most notices
+template<bool legacy>
+static void BM_FormatNotice(benchmark::State &state)
+{
+    const char       *fileDesc = "photo";
+    const std::string chatName = "Some group chat with a fairly long title";
+    char             *sizeStr  = g_format_size(1234567);
+    AllocationCounter counter;
+
+    for (auto _: state) {
+        std::string notice;
+        if (legacy)
+            notice = formatMessageLegacy("{0} posted in {1}, size: {2}",
+                                         {std::string(fileDesc), chatName, std::string(sizeStr)});
+        else
+            notice = formatMessage("{0} posted in {1}, size: {2}", fileDesc, chatName, sizeStr);
+        benchmark::DoNotOptimize(notice.data());
+    }
+    counter.report(state);
+    g_free(sizeStr);
+}
+BENCHMARK_TEMPLATE(BM_FormatNotice, true);
+BENCHMARK_TEMPLATE(BM_FormatNotice, false);
+
+// Debug line with numeric arguments, formatted into a buffer and not kept
+template<bool legacy>
+static void BM_FormatDebugLine(benchmark::State &state)
+{
+    int64_t chatId = -1001234567890;
+    int64_t userId = 123456789;
+    int32_t groupId = 0;
+    int32_t supergroupId = 1234567890;
+    AllocationCounter counter;
+
+    for (auto _: state) {
+        if (legacy) {
+            std::string message = formatMessageLegacy("Update chat: {} private user={} basic group={} supergroup={}", {
+                std::to_string(chatId), std::to_string(userId), std::to_string(groupId), std::to_string(supergroupId)
+            });
+            benchmark::DoNotOptimize(message.data());
+        } else {
+            fmt::memory_buffer buffer;
+            formatMessageTo(buffer, "Update chat: {} private user={} basic group={} supergroup={}",
+                            fmt::make_format_args(chatId, userId, groupId, supergroupId));
+            benchmark::DoNotOptimize(buffer.data());
+        }
+    }
+    counter.report(state);
+}
+BENCHMARK_TEMPLATE(BM_FormatDebugLine, true);
+BENCHMARK_TEMPLATE(BM_FormatDebugLine, false);
+
+#ifndef NoLottie
+
+static std::unique_ptr<rlottie::Animation> loadTestSticker()
+{
+    std::string json;
+    gzFile file = gzopen(TEST_SOURCE_DIR "/test.tgs", "rb");
+    if (!file)
+        return nullptr;
+    char buffer[16384];
+    for (int bytesRead; (bytesRead = gzread(file, buffer, sizeof(buffer))) > 0; )
+        json.append(buffer, bytesRead);
+    gzclose(file);
+    return rlottie::Animation::loadFromData(std::move(json), "", "", false);
+}
+
+// Frames of test.tgs, in premultiplied ARGB like rlottie renders them
+static std::vector<uint32_t> renderTestFrame(unsigned size, double position)
+{
+    std::vector<uint32_t> frame(size * size);
+    std::unique_ptr<rlottie::Animation> animation = loadTestSticker();
+    if (animation) {
+        rlottie::Surface surface(frame.data(), size, size, size * 4);
+        animation->renderSync(animation->totalFrame() * position, surface);
+    }
+    return frame;
+}
+
+template<bool scalar>
+static void BM_ArgbToRgba(benchmark::State &state)
+{
+    const unsigned size = state.range(0);
+    std::vector<uint32_t> frame = renderTestFrame(size, 0.5);
+    std::vector<uint32_t> buffer(frame.size());
+
+    // Conversion is in place, so the copy is part of every iteration
+    for (auto _: state) {
+        memcpy(buffer.data(), frame.data(), frame.size() * sizeof(uint32_t));
+        uint8_t *pixels = reinterpret_cast<uint8_t *>(buffer.data());
+        if (scalar)
+            argbToRgbaScalar(pixels, buffer.size(), 0xffffffff, false);
+        else
+            argbToRgba(pixels, buffer.size(), 0xffffffff, false);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+    state.SetItemsProcessed(state.iterations() * frame.size());
+}
+BENCHMARK_TEMPLATE(BM_ArgbToRgba, true)->Arg(256)->Arg(512);
+BENCHMARK_TEMPLATE(BM_ArgbToRgba, false)->Arg(256)->Arg(512);
+
+#ifdef BundledLottie
+
+// Composition function tables of the bundled rlottie: plain C ones, and ones installed at startup,
+// which are the AVX2 versions on CPUs that have it
+using CompositionFunctionSolid = void (*)(uint32_t *dest, int length, uint32_t color, uint32_t const_alpha);
+using CompositionFunction      = void (*)(uint32_t *dest, const uint32_t *src, int length, uint32_t const_alpha);
+extern CompositionFunctionSolid COMP_functionForModeSolid_Ref[];
+extern CompositionFunction      COMP_functionForMode_Ref[];
+extern CompositionFunctionSolid COMP_functionForModeSolid_C[];
+extern CompositionFunction      COMP_functionForMode_C[];
+
+enum { ModeSource = 0, ModeSourceOver = 1 };
+
+static const char *installedKernels()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return "avx2";
+#endif
+    return "default";
+}
+
+// Blends one frame of test.tgs over another, row by row as rlottie does with spans
+template<bool reference>
+static void BM_CompositeSourceOver(benchmark::State &state)
+{
+    const unsigned size = state.range(0);
+    const uint32_t alpha = state.range(1);
+    std::vector<uint32_t> source = renderTestFrame(size, 0.5);
+    std::vector<uint32_t> dest   = renderTestFrame(size, 0);
+    CompositionFunction   func   = reference ? COMP_functionForMode_Ref[ModeSourceOver]
+                                             : COMP_functionForMode_C[ModeSourceOver];
+
+    for (auto _: state) {
+        for (unsigned row = 0; row < size; row++)
+            func(&dest[row * size], &source[row * size], size, alpha);
+        benchmark::DoNotOptimize(dest.data());
+    }
+    state.SetItemsProcessed(state.iterations() * source.size());
+    state.SetLabel(reference ? "c" : installedKernels());
+}
+BENCHMARK_TEMPLATE(BM_CompositeSourceOver, true)->Args({512, 255})->Args({512, 128});
+BENCHMARK_TEMPLATE(BM_CompositeSourceOver, false)->Args({512, 255})->Args({512, 128});
+
+// Solid fills with a translucent color, like shape fills of test.tgs
+template<bool reference>
+static void BM_CompositeSolidSourceOver(benchmark::State &state)
+{
+    const unsigned size = state.range(0);
+    std::vector<uint32_t> dest = renderTestFrame(size, 0);
+    CompositionFunctionSolid func = reference ? COMP_functionForModeSolid_Ref[ModeSourceOver]
+                                              : COMP_functionForModeSolid_C[ModeSourceOver];
+
+    for (auto _: state) {
+        for (unsigned row = 0; row < size; row++)
+            func(&dest[row * size], size, 0x80402010, 255);
+        benchmark::DoNotOptimize(dest.data());
+    }
+    state.SetItemsProcessed(state.iterations() * dest.size());
+    state.SetLabel(reference ? "c" : installedKernels());
+}
+BENCHMARK_TEMPLATE(BM_CompositeSolidSourceOver, true)->Arg(512);
+BENCHMARK_TEMPLATE(BM_CompositeSolidSourceOver, false)->Arg(512);
+
+#endif
+
+// Whole frame as done for every gif frame of a converted sticker
+static void BM_RenderStickerFrame(benchmark::State &state)
+{
+    const unsigned size = state.range(0);
+    std::unique_ptr<rlottie::Animation> animation = loadTestSticker();
+    if (!animation) {
+        state.SkipWithError("Could not load test.tgs");
+        return;
+    }
+    std::vector<uint32_t> frame(size * size);
+    size_t frameNumber = 0;
+
+    for (auto _: state) {
+        rlottie::Surface surface(frame.data(), size, size, size * 4);
+        animation->renderSync(frameNumber, surface);
+        frameNumber = (frameNumber + 1) % std::max<size_t>(animation->totalFrame(), 1);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RenderStickerFrame)->Arg(200)->Arg(512);
+
+#endif
@@ -0,0 +1,92 @@
+#include "fixture.h"
+#include "debug-log.h"
+#include <glib/gstdio.h>
+#include <algorithm>
+
+class DebugLogTest: public CommTest {};
+
+// Saved messages without timestamps, like "(warning) text"
+static std::vector<std::string> getSavedMessages()
+{
+    std::vector<std::string> messages;
+    gchar      *path = g_build_filename(g_get_tmp_dir(), "tdlib-purple-test-debug.log", NULL);
+    std::string errorMessage;
+    bool        saved = DebugLog::save(path, errorMessage);
+    EXPECT_TRUE(saved) << errorMessage;
+
+    gchar *contents = NULL;
+    gsize  length   = 0;
+    if (saved && g_file_get_contents(path, &contents, &length, NULL)) {
+        std::string text(contents, length);
+        size_t      lineStart = 0;
+        for (size_t lineEnd = text.find('\n'); lineEnd != std::string::npos;
+             lineEnd = text.find('\n', lineStart))
+        {
+            std::string line = text.substr(lineStart, lineEnd - lineStart);
+            size_t      levelStart = line.find(" (");
+            EXPECT_NE(std::string::npos, levelStart) << line;
+            if (levelStart != std::string::npos)
+                messages.push_back(line.substr(levelStart + 1));
+            lineStart = lineEnd + 1;
+        }
+        EXPECT_EQ(text.size(), lineStart);
+    }
+
+    g_free(contents);
+    g_unlink(path);
+    g_free(path);
+    return messages;
+}
+
+TEST_F(DebugLogTest, Wraparound)
+{
+    constexpr unsigned slotCount = 2048;
+
+    for (unsigned i = 0; i < slotCount + 100; i++)
+        DEBUG_WARNING("Wraparound %u\n", i);
+
+    std::vector<std::string> messages = getSavedMessages();
+    ASSERT_EQ(slotCount, messages.size());
+    for (unsigned i = 0; i < slotCount; i++)
+        ASSERT_EQ("(warning) Wraparound " + std::to_string(100 + i), messages[i]);
+}
+
+TEST_F(DebugLogTest, LongMessageTruncated)
+{
+    constexpr size_t textSize = 240;
+
+    // Longer than the formatting buffer too
+    std::string longText(2000, 'x');
+    DEBUG_ERROR("%s\n", longText.c_str());
+    std::string shortText(textSize, 'y');
+    DEBUG_WARNING("%s\n", shortText.c_str());
+
+    std::vector<std::string> messages = getSavedMessages();
+    ASSERT_LE(2u, messages.size());
+    ASSERT_EQ("(error) " + longText.substr(0, textSize), messages[messages.size()-2]);
+    ASSERT_EQ("(warning) " + shortText, messages.back());
+}
+
+TEST_F(DebugLogTest, KeepDebugLog)
+{
+    DEBUG_MISC("Not kept 1\n");
+    DEBUG_INFO("Not kept 2\n");
+
+    purple_account_set_bool(account, "keep-debug-log", TRUE);
+    loginWithOneContact();
+    DEBUG_MISC("Kept 1\n");
+    DEBUG_INFO("Kept 2\n");
+
+    pluginInfo().close(connection);
+    DEBUG_MISC("Not kept 3\n");
+    DEBUG_INFO("Not kept 4\n");
+    DEBUG_WARNING("Warning kept\n");
+
+    std::vector<std::string> messages = getSavedMessages();
+    ASSERT_FALSE(messages.empty());
+    ASSERT_EQ("(warning) Warning kept", messages.back());
+    ASSERT_NE(messages.end(), std::find(messages.begin(), messages.end(), "(misc) Kept 1"));
+    ASSERT_NE(messages.end(), std::find(messages.begin(), messages.end(), "(info) Kept 2"));
+    for (const std::string &message: messages)
+        ASSERT_EQ(std::string::npos, message.find("Not kept")) << message;
+}
@@ -1,6 +1,12 @@
 #include "fixture.h"
 #include "libpurple-mock.h"
 #include "buildopt.h"
+#include "sticker.h"
+#include "td-client.h"
+#include "purple-info.h"
+#ifndef NoLottie
+#include <zlib.h>
+#endif
 
 class FileTransferTest: public CommTest {};
 
@@ -237,6 +243,68 @@ TEST_F(FileTransferTest, PhotoWithoutCaption)
     tgl.verifyRequest(viewMessages(chatIds[0], {1}, true));
 }
 
+TEST_F(FileTransferTest, Photo_SameFileTwice_SingleDownload)
+{
+    const int32_t date   = 10001;
+    const int32_t fileId = 1234;
+    loginWithOneContact();
+
+    for (int64_t messageId: {1, 2}) {
+        std::vector<object_ptr<photoSize>> sizes;
+        sizes.push_back(make_object<photoSize>(
+            "whatever",
+            make_object<file>(
+                fileId, 10000, 10000,
+                make_object<localFile>("", true, true, false, false, 0, 0, 0),
+                make_object<remoteFile>("beh", "bleh", false, true, 10000)
+            ),
+            640, 480
+        ));
+        tgl.update(make_object<updateNewMessage>(makeMessage(
+            messageId,
+            userIds[0],
+            chatIds[0],
+            false,
+            date,
+            make_object<messagePhoto>(
+                make_object<photo>(false, nullptr, std::move(sizes)),
+                make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+                false
+            )
+        )));
+    }
+    // Second message waits for the same download
+    tgl.verifyRequest(downloadFile(fileId, 1, 0, 0, true));
+    prpl.verifyNoEvents();
+
+    tgl.reply(make_object<file>(
+        fileId, 10000, 10000,
+        make_object<localFile>("/path", true, true, false, true, 0, 10000, 10000),
+        make_object<remoteFile>("beh", "bleh", false, true, 10000)
+    ));
+
+    prpl.verifyEvents(
+        ServGotImEvent(
+            connection,
+            purpleUserName(0),
+            "<img src=\"file:///path\">",
+            (PurpleMessageFlags)(PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_IMAGES),
+            date
+        ),
+        ServGotImEvent(
+            connection,
+            purpleUserName(0),
+            "<img src=\"file:///path\">",
+            (PurpleMessageFlags)(PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_IMAGES),
+            date
+        )
+    );
+    tgl.verifyRequests({
+        make_object<viewMessages>(chatIds[0], std::vector<int64_t>(1, 1), true),
+        make_object<viewMessages>(chatIds[0], std::vector<int64_t>(1, 2), true)
+    });
+}
+
 TEST_F(FileTransferTest, SendFile_ErrorInUploadResponse)
 {
     const char *const PATH = "/path";
@@ -332,6 +400,230 @@ TEST_F(FileTransferTest, SendFile_SendMessageResponseError)
     );
 }
 
+TEST_F(FileTransferTest, SendFile_SameContentNotUploadedAgain)
+{
+    const int32_t fileId     = 1234;
+    const int64_t msgIdOld   = 10;
+    const int64_t msgIdNew   = 20;
+    uint8_t       data[]     = {1, 2, 3, 4, 5, 6, 7, 8};
+    char         *path       = NULL;
+    int fd = g_file_open_tmp("tdlib_test_XXXXXX", &path, NULL);
+    ASSERT_TRUE(fd >= 0);
+    ASSERT_EQ((ssize_t)sizeof(data), write(fd, data, sizeof(data)));
+    ::close(fd);
+    loginWithOneContact();
+
+    setFakeFileSize(path, 9000);
+    pluginInfo().send_file(connection, purpleUserName(0).c_str(), path);
+    prpl.verifyEvents(XferAcceptedEvent(purpleUserName(0), path));
+    tgl.verifyRequest(uploadFile(
+        make_object<inputFileLocal>(path),
+        make_object<fileTypeDocument>(),
+        1
+    ));
+
+    tgl.reply(make_object<file>(
+        fileId, 10000, 10000,
+        make_object<localFile>(path, false, false, false, true, 0, 10000, 10000),
+        make_object<remoteFile>("", "", true, false, 0)
+    ));
+    prpl.verifyEvents(
+        XferStartEvent(path),
+        XferProgressEvent(path, 0)
+    );
+
+    tgl.update(make_object<updateFile>(make_object<file>(
+        fileId, 10000, 10000,
+        make_object<localFile>(path, false, false, false, true, 0, 10000, 10000),
+        make_object<remoteFile>("", "", false, false, 10000)
+    )));
+    prpl.verifyEvents(
+        XferCompletedEvent(path, TRUE, 9000),
+        XferEndEvent(path)
+    );
+    tgl.verifyRequest(sendMessage(
+        chatIds[0],
+        0,
+        nullptr,
+        nullptr,
+        make_object<inputMessageDocument>(
+            make_object<inputFileId>(fileId),
+            nullptr,
+            make_object<formattedText>()
+        )
+    ));
+
+    auto makeDocumentContent = [&]() {
+        return make_object<messageDocument>(
+            make_object<document>(
+                "file", "mime/type", nullptr, nullptr,
+                make_object<file>(
+                    fileId, 10000, 10000,
+                    make_object<localFile>(path, false, false, false, true, 0, 10000, 10000),
+                    make_object<remoteFile>("remoteId", "uniqueId", false, true, 10000)
+                )
+            ),
+            make_object<formattedText>()
+        );
+    };
+    object_ptr<message> msg = makeMessage(msgIdOld, userIds[0], chatIds[0], true, 1, makeDocumentContent());
+    msg->sending_state_ = make_object<messageSendingStatePending>();
+    tgl.reply(std::move(msg));
+    tgl.update(make_object<updateMessageSendSucceeded>(
+        makeMessage(msgIdNew, userIds[0], chatIds[0], true, 1, makeDocumentContent()),
+        msgIdOld
+    ));
+
+    // Sending again uses remote file id without uploading
+    pluginInfo().send_file(connection, purpleUserName(0).c_str(), path);
+    prpl.verifyEvents(
+        XferAcceptedEvent(purpleUserName(0), path),
+        XferStartEvent(path)
+    );
+    tgl.verifyRequest(sendMessage(
+        chatIds[0],
+        0,
+        nullptr,
+        nullptr,
+        make_object<inputMessageDocument>(
+            make_object<inputFileRemote>("remoteId"),
+            nullptr,
+            make_object<formattedText>()
+        )
+    ));
+
+    // Transfer is only completed once the message is sent
+    msg = makeMessage(msgIdOld+1, userIds[0], chatIds[0], true, 1, makeDocumentContent());
+    msg->sending_state_ = make_object<messageSendingStatePending>();
+    tgl.reply(std::move(msg));
+    prpl.verifyEvents(
+        XferCompletedEvent(path, TRUE, 9000),
+        XferEndEvent(path)
+    );
+
+    remove(path);
+    g_free(path);
+}
+
+TEST_F(FileTransferTest, SendFile_SameContentDifferentName)
+{
+    const int32_t fileId     = 1234;
+    const int64_t msgIdOld   = 10;
+    const int64_t msgIdNew   = 20;
+    uint8_t       data[]     = {1, 2, 3, 4, 5, 6, 7, 8};
+    gchar        *dir[2];
+    std::string   path[3];
+    for (int i = 0; i < 2; i++) {
+        dir[i] = g_strdup("tdlib_test_XXXXXX");
+        ASSERT_NE(nullptr, g_mkdtemp(dir[i]));
+    }
+    path[0] = std::string(dir[0]) + "/doc.bin";
+    path[1] = std::string(dir[1]) + "/doc.bin";
+    path[2] = std::string(dir[1]) + "/other.bin";
+    for (const std::string &p: path)
+        ASSERT_TRUE(g_file_set_contents(p.c_str(), reinterpret_cast<const gchar *>(data), sizeof(data), NULL));
+    loginWithOneContact();
+
+    setFakeFileSize(path[0].c_str(), 9000);
+    pluginInfo().send_file(connection, purpleUserName(0).c_str(), path[0].c_str());
+    prpl.verifyEvents(XferAcceptedEvent(purpleUserName(0), path[0].c_str()));
+    tgl.verifyRequest(uploadFile(
+        make_object<inputFileLocal>(path[0]),
+        make_object<fileTypeDocument>(),
+        1
+    ));
+
+    tgl.reply(make_object<file>(
+        fileId, 10000, 10000,
+        make_object<localFile>(path[0], false, false, false, true, 0, 10000, 10000),
+        make_object<remoteFile>("", "", false, false, 10000)
+    ));
+    prpl.verifyEvents(
+        XferCompletedEvent(path[0].c_str(), TRUE, 9000),
+        XferEndEvent(path[0].c_str())
+    );
+    tgl.verifyRequest(sendMessage(
+        chatIds[0],
+        0,
+        nullptr,
+        nullptr,
+        make_object<inputMessageDocument>(
+            make_object<inputFileId>(fileId),
+            nullptr,
+            make_object<formattedText>()
+        )
+    ));
+
+    auto makeDocumentContent = [&]() {
+        return make_object<messageDocument>(
+            make_object<document>(
+                "doc.bin", "mime/type", nullptr, nullptr,
+                make_object<file>(
+                    fileId, 10000, 10000,
+                    make_object<localFile>(path[0], false, false, false, true, 0, 10000, 10000),
+                    make_object<remoteFile>("remoteId", "uniqueId", false, true, 10000)
+                )
+            ),
+            make_object<formattedText>()
+        );
+    };
+    object_ptr<message> msg = makeMessage(msgIdOld, userIds[0], chatIds[0], true, 1, makeDocumentContent());
+    msg->sending_state_ = make_object<messageSendingStatePending>();
+    tgl.reply(std::move(msg));
+    tgl.update(make_object<updateMessageSendSucceeded>(
+        makeMessage(msgIdNew, userIds[0], chatIds[0], true, 1, makeDocumentContent()),
+        msgIdOld
+    ));
+
+    // Same content under another name is uploaded, so that the document has the right name
+    setFakeFileSize(path[2].c_str(), 9000);
+    pluginInfo().send_file(connection, purpleUserName(0).c_str(), path[2].c_str());
+    prpl.verifyEvents(XferAcceptedEvent(purpleUserName(0), path[2].c_str()));
+    tgl.verifyRequest(uploadFile(
+        make_object<inputFileLocal>(path[2]),
+        make_object<fileTypeDocument>(),
+        1
+    ));
+
+    // Same content and name in another directory is found by hash
+    setFakeFileSize(path[1].c_str(), 9000);
+    pluginInfo().send_file(connection, purpleUserName(0).c_str(), path[1].c_str());
+    prpl.verifyEvents(
+        XferAcceptedEvent(purpleUserName(0), path[1].c_str()),
+        XferStartEvent(path[1].c_str())
+    );
+    tgl.verifyRequest(sendMessage(
+        chatIds[0],
+        0,
+        nullptr,
+        nullptr,
+        make_object<inputMessageDocument>(
+            make_object<inputFileRemote>("remoteId"),
+            nullptr,
+            make_object<formattedText>()
+        )
+    ));
+
+    // Failed send doesn't complete the transfer
+    tgl.reply(make_object<error>(100, "error"));
+    prpl.verifyEvents(
+        XferRemoteCancelEvent(path[1].c_str()),
+        NewConversationEvent(PURPLE_CONV_TYPE_IM, account, purpleUserName(0)),
+        ConversationWriteEvent(
+            purpleUserName(0), purpleUserName(0),
+            "Failed to send message: code 100 (error)",
+            PURPLE_MESSAGE_SYSTEM, 0
+        )
+    );
+
+    for (const std::string &p: path)
+        remove(p.c_str());
+    for (int i = 0; i < 2; i++) {
+        rmdir(dir[i]);
+        g_free(dir[i]);
+    }
+}
+
 TEST_F(FileTransferTest, SendFile_UnknownUser)
 {
     const char *const PATH = "/path";
@@ -381,17 +673,155 @@ TEST_F(FileTransferTest, DISABLED_WebpStickerDecode)
     ));
 }
 
+#ifndef NoWebp
+TEST_F(FileTransferTest, WebpStickerDecode_KeepsOrder)
+#else
+TEST_F(FileTransferTest, DISABLED_WebpStickerDecode_KeepsOrder)
+#endif
+{
+    const int32_t date      = 10001;
+    const int32_t fileId    = 1234;
+    const uint8_t pngSignature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    loginWithOneContact();
+
+    // Text message arriving while sticker is being decoded waits for it
+    tgl.update(make_object<updateNewMessage>(makeMessage(
+        1,
+        userIds[0],
+        chatIds[0],
+        false,
+        date,
+        make_object<messageSticker>(make_object<sticker>(
+            0, 320, 200, "", true, false, nullptr,
+            nullptr,
+            make_object<file>(
+                fileId, 10000, 10000,
+                make_object<localFile>(TEST_SOURCE_DIR "/test.webp", true, true, false, true, 0, 10000, 10000),
+                make_object<remoteFile>("beh", "bleh", false, true, 10000)
+            )
+        ))
+    )));
+    tgl.update(make_object<updateNewMessage>(makeMessage(
+        2,
+        userIds[0],
+        chatIds[0],
+        false,
+        date+1,
+        makeTextMessage("text")
+    )));
+    tgl.verifyRequests({
+        make_object<viewMessages>(chatIds[0], std::vector<int64_t>(1, 1), true),
+        make_object<viewMessages>(chatIds[0], std::vector<int64_t>(1, 2), true)
+    });
+    prpl.verifyEvents(
+        ServGotImEvent(
+            connection,
+            purpleUserName(0),
+            "\n<img id=\"" + std::to_string(getLastImgstoreId()) + "\">",
+            (PurpleMessageFlags)(PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_IMAGES),
+            date
+        ),
+        ServGotImEvent(connection, purpleUserName(0), "text", PURPLE_MESSAGE_RECV, date+1)
+    );
+
+    // Worker thread encoded the sticker as png
+    PurpleStoredImage *image = purple_imgstore_find_by_id(getLastImgstoreId());
+    ASSERT_NE(nullptr, image);
+    ASSERT_LE(sizeof(pngSignature), purple_imgstore_get_size(image));
+    ASSERT_EQ(0, memcmp(pngSignature, purple_imgstore_get_data(image), sizeof(pngSignature)));
+}
+
+TEST_F(FileTransferTest, WebpStickerDecode_Failure)
+{
+    const int32_t date      = 10001;
+    const int32_t fileId    = 1234;
+    loginWithOneContact();
+
+    // Not a webp file, so decoding fails and the sticker is shown as a link
+    tgl.update(make_object<updateNewMessage>(makeMessage(
+        1,
+        userIds[0],
+        chatIds[0],
+        false,
+        date,
+        make_object<messageSticker>(make_object<sticker>(
+            0, 320, 200, "", true, false, nullptr,
+            nullptr,
+            make_object<file>(
+                fileId, 10000, 10000,
+                make_object<localFile>(TEST_SOURCE_DIR "/CMakeLists.txt", true, true, false, true, 0, 10000, 10000),
+                make_object<remoteFile>("beh", "bleh", false, true, 10000)
+            )
+        ))
+    )));
+    tgl.verifyRequest(viewMessages(chatIds[0], {1}, true));
+    prpl.verifyEvents(ServGotImEvent(
+        connection,
+        purpleUserName(0),
+        "<a href=\"file://" TEST_SOURCE_DIR "/CMakeLists.txt\">sticker</a>",
+        PURPLE_MESSAGE_RECV,
+        date
+    ));
+}
+
+#ifndef NoLottie
+TEST_F(FileTransferTest, AnimatedStickerDecode)
+#else
+TEST_F(FileTransferTest, DISABLED_AnimatedStickerDecode)
+#endif
+{
+    const int32_t date    = 10001;
+    const int32_t fileId  = 1234;
+    loginWithOneContact();
+
+    // No thumbnail, only .tgs
+    tgl.update(make_object<updateNewMessage>(makeMessage(
+        1,
+        userIds[0],
+        chatIds[0],
+        false,
+        date,
+        make_object<messageSticker>(make_object<sticker>(
+            0, 320, 200, "", true, false, nullptr,
+            nullptr,
+            make_object<file>(
+                fileId, 10000, 10000,
+                make_object<localFile>(TEST_SOURCE_DIR "/test.tgs", true, true, false, true, 0, 10000, 10000),
+                make_object<remoteFile>("beh", "bleh", false, true, 10000)
+            )
+        ))
+    )));
+    tgl.verifyRequests({
+        make_object<viewMessages>(chatIds[0], std::vector<int64_t>(1, 1), true),
+    });
+
+    tgl.reply(make_object<ok>()); // reply to viewMessages
+
+    prpl.verifyEvents(
+        ServGotImEvent(
+            connection,
+            purpleUserName(0),
+            // Sticker was converted to gif
+            "\n<img id=\"" + std::to_string(getLastImgstoreId()) + "\">",
+            (PurpleMessageFlags)(PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_IMAGES),
+            date
+        )
+    );
+}
+
 #ifndef NoLottie
-TEST_F(FileTransferTest, AnimatedStickerDecode)
+TEST_F(FileTransferTest, AnimatedStickerDecode_RenderBudget)
 #else
-TEST_F(FileTransferTest, DISABLED_AnimatedStickerDecode)
+TEST_F(FileTransferTest, DISABLED_AnimatedStickerDecode_RenderBudget)
 #endif
 {
     const int32_t date    = 10001;
     const int32_t fileId  = 1234;
+    purple_account_set_int(account, "animated-sticker-fps", 10);
+    purple_account_set_int(account, "animated-sticker-max-duration", 1);
+    purple_account_set_int(account, "animated-sticker-size", 64);
     loginWithOneContact();
 
-    // No thumbnail, only .tgs
     tgl.update(make_object<updateNewMessage>(makeMessage(
         1,
         userIds[0],
@@ -418,7 +848,6 @@ TEST_F(FileTransferTest, DISABLED_AnimatedStickerDecode)
         ServGotImEvent(
             connection,
             purpleUserName(0),
-            // Sticker was converted to gif
             "\n<img id=\"" + std::to_string(getLastImgstoreId()) + "\">",
             (PurpleMessageFlags)(PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_IMAGES),
             date
@@ -426,6 +855,57 @@ TEST_F(FileTransferTest, DISABLED_AnimatedStickerDecode)
     );
 }
 
+#ifndef NoLottie
+TEST_F(FileTransferTest, AnimatedStickerDecode_Cached)
+#else
+TEST_F(FileTransferTest, DISABLED_AnimatedStickerDecode_Cached)
+#endif
+{
+    const int32_t date   = 10001;
+    const int32_t fileId = 1234;
+    loginWithOneContact();
+    StickerCacheStats statsBefore = getStickerCacheStats();
+
+    for (int64_t messageId: {1, 2}) {
+        tgl.update(make_object<updateNewMessage>(makeMessage(
+            messageId,
+            userIds[0],
+            chatIds[0],
+            false,
+            date,
+            make_object<messageSticker>(make_object<sticker>(
+                0, 320, 200, "", true, false, nullptr,
+                nullptr,
+                make_object<file>(
+                    fileId, 10000, 10000,
+                    make_object<localFile>(TEST_SOURCE_DIR "/test.tgs", true, true, false, true, 0, 10000, 10000),
+                    make_object<remoteFile>("beh", "cached-sticker", false, true, 10000)
+                )
+            ))
+        )));
+        tgl.verifyRequests({
+            make_object<viewMessages>(chatIds[0], std::vector<int64_t>(1, messageId), true),
+        });
+        tgl.reply(make_object<ok>()); // reply to viewMessages
+
+        prpl.verifyEvents(
+            ServGotImEvent(
+                connection,
+                purpleUserName(0),
+                "\n<img id=\"" + std::to_string(getLastImgstoreId()) + "\">",
+                (PurpleMessageFlags)(PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_IMAGES),
+                date
+            )
+        );
+    }
+
+    // Second conversion reused the animation parsed by the first one
+    StickerCacheStats statsAfter = getStickerCacheStats();
+    ASSERT_EQ(statsBefore.misses + 1, statsAfter.misses);
+    ASSERT_EQ(statsBefore.hits + 1, statsAfter.hits);
+    ASSERT_GE(statsAfter.parseTimeSaved, statsBefore.parseTimeSaved);
+}
+
 TEST_F(FileTransferTest, Sticker_AnimatedDisabled_AlreadyDownloaded)
 {
     const int32_t date      = 10001;
@@ -1272,6 +1752,244 @@ TEST_F(FileTransferTest, ReceiveDocument_StandardTransfer_Progress)
     g_free(tdlibFileName);
 }
 
+TEST_F(FileTransferTest, ReceiveDocument_StandardTransfer_Streaming)
+{
+    const int64_t messageId = 1;
+    const int32_t date      = 10001;
+    const int32_t fileId    = 1234;
+    uint8_t       data[]    = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    const char *outputFileName = ".test_download";
+
+    setUiName("spectrum"); // No longer pidgin - now downloads will use libpurple transfers
+    loginWithOneContact();
+
+    tgl.update(make_object<updateNewMessage>(makeMessage(
+        messageId,
+        userIds[0],
+        chatIds[0],
+        false,
+        date,
+        make_object<messageDocument>(
+            make_object<document>(
+                "doc.file.name", "mime/type", nullptr, nullptr,
+                make_object<file>(
+                    fileId, 10000, 10000,
+                    make_object<localFile>("", true, true, false, false, 0, 0, 0),
+                    make_object<remoteFile>("beh", "bleh", false, true, 10000)
+                )
+            ),
+            make_object<formattedText>("document", std::vector<object_ptr<textEntity>>())
+        )
+    )));
+    prpl.verifyEvents(
+        XferRequestEvent(PURPLE_XFER_RECEIVE, purpleUserName(0).c_str(), "doc.file.name")
+    );
+
+    purple_xfer_request_accepted(prpl.getLastXfer(), outputFileName);
+    prpl.verifyEvents(
+        XferAcceptedEvent(purpleUserName(0), outputFileName),
+        XferStartEvent(outputFileName)
+    );
+
+    tgl.verifyRequest(downloadFile(fileId, 1, 0, 0, true));
+
+    char *tdlibFileName = NULL;
+    int fd = g_file_open_tmp("tdlib_test_XXXXXX", &tdlibFileName, NULL);
+    ASSERT_TRUE(fd >= 0);
+    ASSERT_EQ((ssize_t)sizeof(data), write(fd, data, sizeof(data)));
+    ::close(fd);
+
+    // Downloaded prefix is passed on right away
+    tgl.update(make_object<updateFile>(make_object<file>(
+        fileId, 10000, 10000,
+        make_object<localFile>(tdlibFileName, true, true, true, false, 0, 5, 7),
+        make_object<remoteFile>("beh", "bleh", false, true, 10000)
+    )));
+    prpl.verifyEvents(XferWriteFileEvent(outputFileName, data, 5));
+
+    // No change in prefix - nothing to write
+    tgl.update(make_object<updateFile>(make_object<file>(
+        fileId, 10000, 10000,
+        make_object<localFile>(tdlibFileName, true, true, true, false, 0, 5, 9),
+        make_object<remoteFile>("beh", "bleh", false, true, 10000)
+    )));
+    prpl.verifyNoEvents();
+
+    // Only the rest is written upon completion
+    tgl.reply(make_object<file>(
+        fileId, 10000, 10000,
+        make_object<localFile>(tdlibFileName, true, true, false, true, 0, 12, 12),
+        make_object<remoteFile>("beh", "bleh", false, true, 10000)
+    ));
+    prpl.verifyEvents(
+        XferWriteFileEvent(outputFileName, data+5, sizeof(data)-5),
+        XferCompletedEvent(outputFileName, TRUE, sizeof(data)),
+        XferEndEvent(outputFileName)
+    );
+
+    remove(tdlibFileName);
+    g_free(tdlibFileName);
+}
+
+TEST_F(FileTransferTest, ReceiveDocument_StandardTransfer_StreamingLimit)
+{
+    const int64_t messageId = 1;
+    const int32_t date      = 10001;
+    const int32_t fileId    = 1234;
+    const size_t  chunkSize = 1048576;
+    const char *outputFileName = ".test_download";
+    std::vector<uint8_t> data(chunkSize + 10);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = i % 251;
+
+    setUiName("spectrum");
+    loginWithOneContact();
+
+    tgl.update(make_object<updateNewMessage>(makeMessage(
+        messageId,
+        userIds[0],
+        chatIds[0],
+        false,
+        date,
+        make_object<messageDocument>(
+            make_object<document>(
+                "doc.file.name", "mime/type", nullptr, nullptr,
+                make_object<file>(
+                    fileId, 10000, 10000,
+                    make_object<localFile>("", true, true, false, false, 0, 0, 0),
+                    make_object<remoteFile>("beh", "bleh", false, true, 10000)
+                )
+            ),
+            make_object<formattedText>("document", std::vector<object_ptr<textEntity>>())
+        )
+    )));
+    prpl.verifyEvents(
+        XferRequestEvent(PURPLE_XFER_RECEIVE, purpleUserName(0).c_str(), "doc.file.name")
+    );
+
+    purple_xfer_request_accepted(prpl.getLastXfer(), outputFileName);
+    prpl.verifyEvents(
+        XferAcceptedEvent(purpleUserName(0), outputFileName),
+        XferStartEvent(outputFileName)
+    );
+    tgl.verifyRequest(downloadFile(fileId, 1, 0, 0, true));
+
+    char *tdlibFileName = NULL;
+    int fd = g_file_open_tmp("tdlib_test_XXXXXX", &tdlibFileName, NULL);
+    ASSERT_TRUE(fd >= 0);
+    ASSERT_EQ((ssize_t)data.size(), write(fd, data.data(), data.size()));
+    ::close(fd);
+
+    // Everything available is written, one chunk at a time
+    tgl.update(make_object<updateFile>(make_object<file>(
+        fileId, data.size(), data.size(),
+        make_object<localFile>(tdlibFileName, true, true, true, false, 0, data.size()-2, data.size()-2),
+        make_object<remoteFile>("beh", "bleh", false, true, data.size())
+    )));
+    prpl.verifyEvents(
+        XferWriteFileEvent(outputFileName, data.data(), chunkSize),
+        XferWriteFileEvent(outputFileName, data.data() + chunkSize, data.size()-2-chunkSize)
+    );
+
+    // Nothing left for the next update
+    tgl.update(make_object<updateFile>(make_object<file>(
+        fileId, data.size(), data.size(),
+        make_object<localFile>(tdlibFileName, true, true, true, false, 0, data.size()-2, data.size()-2),
+        make_object<remoteFile>("beh", "bleh", false, true, data.size())
+    )));
+    prpl.verifyNoEvents();
+
+    tgl.reply(make_object<file>(
+        fileId, data.size(), data.size(),
+        make_object<localFile>(tdlibFileName, true, true, false, true, 0, data.size(), data.size()),
+        make_object<remoteFile>("beh", "bleh", false, true, data.size())
+    ));
+    prpl.verifyEvents(
+        XferWriteFileEvent(outputFileName, data.data() + data.size()-2, 2),
+        XferCompletedEvent(outputFileName, TRUE, data.size()),
+        XferEndEvent(outputFileName)
+    );
+
+    remove(tdlibFileName);
+    g_free(tdlibFileName);
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+TEST_F(FileTransferTest, ReceiveDocument_StandardTransfer_CopyFile)
+{
+    const int64_t messageId = 1;
+    const int32_t date      = 10001;
+    const int32_t fileId    = 1234;
+    uint8_t       data[]    = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    const char *outputFileName = ".test_download";
+
+    setUiName("spectrum");
+    // UI leaves writing to libpurple, so completed download is copied rather than passed on
+    setXferDestFile(TRUE);
+    loginWithOneContact();
+
+    tgl.update(make_object<updateNewMessage>(makeMessage(
+        messageId,
+        userIds[0],
+        chatIds[0],
+        false,
+        date,
+        make_object<messageDocument>(
+            make_object<document>(
+                "doc.file.name", "mime/type", nullptr, nullptr,
+                make_object<file>(
+                    fileId, 10000, 10000,
+                    make_object<localFile>("", true, true, false, false, 0, 0, 0),
+                    make_object<remoteFile>("beh", "bleh", false, true, 10000)
+                )
+            ),
+            make_object<formattedText>("document", std::vector<object_ptr<textEntity>>())
+        )
+    )));
+    prpl.verifyEvents(
+        XferRequestEvent(PURPLE_XFER_RECEIVE, purpleUserName(0).c_str(), "doc.file.name")
+    );
+
+    purple_xfer_request_accepted(prpl.getLastXfer(), outputFileName);
+    prpl.verifyEvents(
+        XferAcceptedEvent(purpleUserName(0), outputFileName),
+        XferStartEvent(outputFileName)
+    );
+    tgl.verifyRequest(downloadFile(fileId, 1, 0, 0, true));
+
+    char *tdlibFileName = NULL;
+    int fd = g_file_open_tmp("tdlib_test_XXXXXX", &tdlibFileName, NULL);
+    ASSERT_TRUE(fd >= 0);
+    ASSERT_EQ((ssize_t)sizeof(data), write(fd, data, sizeof(data)));
+    ::close(fd);
+
+    // Downloaded prefix is still passed on while downloading
+    tgl.update(make_object<updateFile>(make_object<file>(
+        fileId, 10000, 10000,
+        make_object<localFile>(tdlibFileName, true, true, true, false, 0, 5, 7),
+        make_object<remoteFile>("beh", "bleh", false, true, 10000)
+    )));
+    prpl.verifyEvents(XferWriteFileEvent(outputFileName, data, 5));
+
+    // The rest is copied past it
+    tgl.reply(make_object<file>(
+        fileId, 10000, 10000,
+        make_object<localFile>(tdlibFileName, true, true, false, true, 0, 12, 12),
+        make_object<remoteFile>("beh", "bleh", false, true, 10000)
+    ));
+    prpl.verifyEvents(
+        XferProgressEvent(outputFileName, sizeof(data)),
+        XferCompletedEvent(outputFileName, TRUE, sizeof(data)),
+        XferEndEvent(outputFileName)
+    );
+    checkFile(outputFileName, data, sizeof(data));
+
+    remove(outputFileName);
+    remove(tdlibFileName);
+    g_free(tdlibFileName);
+}
+#endif
+
 TEST_F(FileTransferTest, Photo_LongDownload_StartandDownloadsConfigured)
 {
     purple_account_set_string(account, "download-behaviour", "file-transfer");
@@ -1467,3 +2185,158 @@ TEST_F(FileTransferTest, ActiveDownloadAtLogout_StuckAtStart)
     pluginInfo().close(connection);
     prpl.verifyEvents(XferLocalCancelEvent(tempFileName));
 }
+
+TEST_F(FileTransferTest, StickerFrameConversion)
+{
+    // Every alpha with every possible premultiplied value in a channel, 7 pixels at a time so that
+    // the non-vectorized tail is used too
+    std::vector<uint8_t> pixels;
+    for (unsigned a = 0; a < 256; a++)
+        for (unsigned c = 0; c <= a; c++) {
+            const uint8_t pixel[4] = {uint8_t(c), uint8_t(a-c), uint8_t(c/2), uint8_t(a)};
+            pixels.insert(pixels.end(), pixel, pixel+4);
+        }
+
+    for (uint32_t bgColor: {0xffffffffu, 0xff102030u, 0x00ffffffu}) {
+        std::vector<uint8_t> expected = pixels;
+        std::vector<uint8_t> actual   = pixels;
+        argbToRgbaScalar(expected.data(), expected.size()/4, bgColor, (bgColor >> 24) < 0x80);
+        for (size_t offset = 0; offset < actual.size(); offset += 4*7)
+            argbToRgba(actual.data() + offset, std::min<size_t>(7, (actual.size()-offset)/4), bgColor,
+                       (bgColor >> 24) < 0x80);
+        ASSERT_EQ(expected, actual);
+    }
+
+    uint8_t pixel[4] = {0x40, 0x20, 0x10, 0x80};
+    argbToRgba(pixel, 1, 0xffffffff, false);
+    ASSERT_EQ(0x10+127, pixel[0]);
+    ASSERT_EQ(0x20+127, pixel[1]);
+    ASSERT_EQ(0x40+127, pixel[2]);
+    ASSERT_EQ(0x80, pixel[3]);
+}
+
+#ifndef NoLottie
+
+static std::string gzipString(const std::string &input)
+{
+    z_stream strm = {};
+    EXPECT_EQ(Z_OK, deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8,
+                                 Z_DEFAULT_STRATEGY));
+    std::string output(deflateBound(&strm, input.size()), '\0');
+    strm.next_in   = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    strm.avail_in  = input.size();
+    strm.next_out  = reinterpret_cast<Bytef *>(&output[0]);
+    strm.avail_out = output.size();
+    EXPECT_EQ(Z_STREAM_END, deflate(&strm, Z_FINISH));
+    output.resize(strm.total_out);
+    deflateEnd(&strm);
+    return output;
+}
+
+static bool gunzipString(const std::string &input, std::string &output, std::string &errorMessage)
+{
+    return gunzipSticker(reinterpret_cast<const uint8_t *>(input.data()), input.size(), output,
+                         errorMessage);
+}
+
+TEST_F(FileTransferTest, StickerGunzip)
+{
+    std::string input;
+    for (unsigned i = 0; i < 10000; i++)
+        input += "{\"frame\": " + std::to_string(i) + "}";
+    std::string compressed = gzipString(input);
+    std::string output;
+    std::string errorMessage;
+    ASSERT_TRUE(gunzipString(compressed, output, errorMessage));
+    ASSERT_EQ(input, output);
+
+    // Trailer understating the size makes the buffer grow. Everything is inflated by the time zlib
+    // checks the trailer and fails.
+    compressed[compressed.size()-1] = 0;
+    compressed[compressed.size()-2] = 0;
+    compressed[compressed.size()-3] = 0;
+    compressed[compressed.size()-4] = 1;
+    output.clear();
+    ASSERT_FALSE(gunzipString(compressed, output, errorMessage));
+    ASSERT_EQ("Decompression error", errorMessage);
+    ASSERT_EQ(input.size(), output.size());
+}
+
+TEST_F(FileTransferTest, StickerGunzip_Truncated)
+{
+    std::string input(100000, 'x');
+    for (size_t i = 0; i < input.size(); i += 7)
+        input[i] = 'a' + i % 26;
+    std::string compressed = gzipString(input);
+
+    for (size_t cut: {compressed.size() - 4, compressed.size() / 2, size_t(10)}) {
+        std::string output;
+        std::string errorMessage;
+        ASSERT_FALSE(gunzipString(compressed.substr(0, cut), output, errorMessage)) << cut;
+        ASSERT_EQ("Decompression error", errorMessage);
+        ASSERT_LE(output.size(), input.size());
+    }
+}
+
+TEST_F(FileTransferTest, StickerGunzip_AboveSizeLimit)
+{
+    // Zeroes compress well enough to test the limit without a big input file
+    std::string compressed = gzipString(std::string(64 * 1024 * 1024 + 1, '\0'));
+    std::string output;
+    std::string errorMessage;
+    ASSERT_FALSE(gunzipString(compressed, output, errorMessage));
+    ASSERT_EQ("Decompression error", errorMessage);
+    ASSERT_EQ(64u * 1024 * 1024, output.size());
+
+    // Trailer claiming 4 GB on a small stream must not be trusted for the allocation
+    compressed = gzipString("{}");
+    for (size_t i = compressed.size() - 4; i < compressed.size(); i++)
+        compressed[i] = '\xff';
+    output.clear();
+    ASSERT_FALSE(gunzipString(compressed, output, errorMessage));
+    ASSERT_LE(output.capacity(), 64u * 1024 * 1024);
+}
+
+#endif
+
+TEST_F(FileTransferTest, CleanUpFileCache)
+{
+    purple_account_set_int(account, AccountOptions::FileCacheMaxSize, 100);
+    loginWithOneContact();
+    PurpleTdClient *tdClient = static_cast<PurpleTdClient *>(purple_connection_get_protocol_data(connection));
+
+    auto request = make_object<optimizeStorage>();
+    request->size_                           = 100 * 1024 * 1024;
+    request->ttl_                            = INT32_MAX;
+    request->count_                          = INT32_MAX;
+    request->immunity_delay_                 = -1;
+    request->return_deleted_file_statistics_ = true;
+    request->chat_limit_                     = 0;
+
+    // Updates from login count as recent, but scheduled cleanup is only put off so many times
+    for (unsigned i = 0; i < PurpleTdClient::FILE_CACHE_MAX_DEFERRALS; i++) {
+        runTimeouts();
+        tgl.verifyNoRequests();
+    }
+    runTimeouts();
+    uint64_t requestId = tgl.verifyRequest(*request);
+
+    // Requested from account menu while scheduled cleanup is running
+    ASSERT_TRUE(tdClient->cleanUpFileCache(true));
+    tgl.verifyNoRequests();
+    prpl.verifyNoEvents();
+
+    tgl.reply(requestId, make_object<storageStatistics>(3000000, 5, std::vector<object_ptr<storageStatisticsByChat>>()));
+    prpl.verifyEvents(NotifyMessageEvent(account, PURPLE_NOTIFY_MSG_INFO, "File cache",
+                                         "Removed 5 files, 3.0 MB", ""));
+
+    ASSERT_TRUE(tdClient->cleanUpFileCache(true));
+    tgl.verifyRequest(*request);
+    tgl.reply(make_object<error>(100, "error"));
+    prpl.verifyEvents(NotifyMessageEvent(account, PURPLE_NOTIFY_MSG_INFO, "File cache",
+                                         "Could not clean up file cache: code 100 (error)", ""));
+
+    purple_account_set_int(account, AccountOptions::FileCacheMaxSize, 0);
+    ASSERT_FALSE(tdClient->cleanUpFileCache(true));
+    tgl.verifyNoRequests();
+}
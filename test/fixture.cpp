@@ -21,6 +21,7 @@ void CommTest::SetUp()
     account->gc = connection;
     prpl.discardEvents();
     setUiName("Pidgin");
+    setXferDestFile(FALSE);
 }
 
 void CommTest::TearDown()
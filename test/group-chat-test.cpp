@@ -110,6 +110,41 @@ TEST_F(GroupChatTest, BasicGroupReceiveTextAndReply)
                          "Hello", PURPLE_MESSAGE_RECV, date[0])
     );
 
+    object_ptr<message> reply = makeMessage(messageId[1], selfId, groupChatId, true, date[1],
+                                            makeTextMessage("Reply"));
+    reply->reply_to_message_id_ = messageId[0];
+    tgl.update(make_object<updateNewMessage>(std::move(reply)));
+    // Message being replied to was just received, so it's quoted without fetching
+    prpl.verifyEvents(ConversationWriteEvent(
+        groupChatPurpleName, selfFirstName + " " + selfLastName,
+        fmt::format(replyPattern, userFirstNames[0] + " " + userLastNames[0], "Hello", "Reply"),
+        PURPLE_MESSAGE_SEND, date[1]
+    ));
+    tgl.verifyRequest(viewMessages(groupChatId, {messageId[1]}, true));
+}
+
+TEST_F(GroupChatTest, BasicGroupReplyToEditedMessage)
+{
+    constexpr int32_t date[]       = {12345, 123456};
+    constexpr int64_t messageId[]  = {10000, 10001};
+    constexpr int     purpleChatId = 1;
+    loginWithBasicGroup();
+
+    tgl.update(standardUpdateUserNoPhone(0));
+    tgl.update(make_object<updateNewMessage>(
+        makeMessage(messageId[0], userIds[0], groupChatId, false, date[0], makeTextMessage("Hello"))
+    ));
+    tgl.verifyRequest(viewMessages(groupChatId, {messageId[0]}, true));
+    prpl.verifyEvents(
+        ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
+        ServGotChatEvent(connection, purpleChatId, userFirstNames[0] + " " + userLastNames[0],
+                         "Hello", PURPLE_MESSAGE_RECV, date[0])
+    );
+
+    tgl.update(make_object<updateMessageContent>(groupChatId, messageId[0], makeTextMessage("Edited")));
+    prpl.verifyNoEvents();
+
+    // Text seen before the edit is not quoted
     object_ptr<message> reply = makeMessage(messageId[1], selfId, groupChatId, true, date[1],
                                             makeTextMessage("Reply"));
     reply->reply_to_message_id_ = messageId[0];
@@ -117,10 +152,47 @@ TEST_F(GroupChatTest, BasicGroupReceiveTextAndReply)
     tgl.verifyRequest(getMessage(groupChatId, messageId[0]));
     prpl.verifyNoEvents();
 
-    tgl.reply(makeMessage(messageId[0], userIds[0], groupChatId, false, date[0], makeTextMessage("Hello")));
+    tgl.reply(makeMessage(messageId[0], userIds[0], groupChatId, false, date[0], makeTextMessage("Edited")));
     prpl.verifyEvents(ConversationWriteEvent(
         groupChatPurpleName, selfFirstName + " " + selfLastName,
-        fmt::format(replyPattern, userFirstNames[0] + " " + userLastNames[0], "Hello", "Reply"),
+        fmt::format(replyPattern, userFirstNames[0] + " " + userLastNames[0], "Edited", "Reply"),
+        PURPLE_MESSAGE_SEND, date[1]
+    ));
+    tgl.verifyRequest(viewMessages(groupChatId, {messageId[1]}, true));
+}
+
+TEST_F(GroupChatTest, BasicGroupReplyToDeletedMessage)
+{
+    constexpr int32_t date[]       = {12345, 123456};
+    constexpr int64_t messageId[]  = {10000, 10001};
+    constexpr int     purpleChatId = 1;
+    loginWithBasicGroup();
+
+    tgl.update(standardUpdateUserNoPhone(0));
+    tgl.update(make_object<updateNewMessage>(
+        makeMessage(messageId[0], userIds[0], groupChatId, false, date[0], makeTextMessage("Hello"))
+    ));
+    tgl.verifyRequest(viewMessages(groupChatId, {messageId[0]}, true));
+    prpl.verifyEvents(
+        ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
+        ServGotChatEvent(connection, purpleChatId, userFirstNames[0] + " " + userLastNames[0],
+                         "Hello", PURPLE_MESSAGE_RECV, date[0])
+    );
+
+    tgl.update(make_object<updateDeleteMessages>(groupChatId, std::vector<int64_t>{messageId[0]}, true, false));
+    prpl.verifyNoEvents();
+
+    object_ptr<message> reply = makeMessage(messageId[1], selfId, groupChatId, true, date[1],
+                                            makeTextMessage("Reply"));
+    reply->reply_to_message_id_ = messageId[0];
+    tgl.update(make_object<updateNewMessage>(std::move(reply)));
+    tgl.verifyRequest(getMessage(groupChatId, messageId[0]));
+    prpl.verifyNoEvents();
+
+    tgl.reply(make_object<error>(404, "Not Found"));
+    prpl.verifyEvents(ConversationWriteEvent(
+        groupChatPurpleName, selfFirstName + " " + selfLastName,
+        fmt::format(replyPattern, "Unknown user", "[message unavailable]", "Reply"),
         PURPLE_MESSAGE_SEND, date[1]
     ));
     tgl.verifyRequest(viewMessages(groupChatId, {messageId[1]}, true));
@@ -244,7 +316,6 @@ TEST_F(GroupChatTest, ExistingBasicGroupReceiveMessageAtLogin_WithMemberList_Rem
             // One code path: adding chat users upon receiving getBasicGroupFullInfo reply, because the chat
             // window is already open due to the received message
             std::make_unique<ChatSetTopicEvent>(groupChatPurpleName, "basic group", ""),
-            std::make_unique<ChatClearUsersEvent>(groupChatPurpleName),
             std::make_unique<ChatAddUserEvent>(
                 groupChatPurpleName,
                 // This user is in our contact list so his libpurple user name is used
@@ -278,24 +349,14 @@ TEST_F(GroupChatTest, ExistingBasicGroupReceiveMessageAtLogin_WithMemberList_Rem
     // But skip it and just say buddy's private chat is magically removed from chatListMain
     tgl.update(makeUpdateRemoveFromChatList(chatIds[0], make_object<chatListMain>()));
 
+    // Other members are unchanged, so only this one is renamed
     prpl.verifyEvents(
         ChatSetTopicEvent(groupChatPurpleName, "basic group", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
-        ChatAddUserEvent(
+        ChatRenameUserEvent(
             groupChatPurpleName,
+            purpleUserName(0),
             // This user is no longer in our contact list so first/last name is used
-            userFirstNames[0] + " " + userLastNames[0],
-            "", PURPLE_CBFLAGS_NONE, false
-        ),
-        ChatAddUserEvent(
-            groupChatPurpleName,
-            userFirstNames[1] + " " + userLastNames[1],
-            "", PURPLE_CBFLAGS_FOUNDER, false
-        ),
-        ChatAddUserEvent(
-            groupChatPurpleName,
-            "+" + selfPhoneNumber,
-            "", PURPLE_CBFLAGS_NONE, false
+            userFirstNames[0] + " " + userLastNames[0]
         )
     );
 }
@@ -368,7 +429,6 @@ TEST_F(GroupChatTest, SendMessageWithMemberList)
     prpl.verifyEvents(
         ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
         ChatSetTopicEvent(groupChatPurpleName, "basic group", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
         ChatAddUserEvent(
             groupChatPurpleName,
             userFirstNames[0] + " " + userLastNames[0],
@@ -515,7 +575,6 @@ TEST_F(GroupChatTest, JoinBasicGroupByInviteLink)
 
     prpl.verifyEvents(
         ChatSetTopicEvent(groupChatPurpleName, "basic group", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
         ChatAddUserEvent(
             groupChatPurpleName,
             // This user is not in our contact list so first/last name is used
@@ -652,7 +711,6 @@ TEST_F(GroupChatTest, CreateRemoveBasicGroupInAnotherClient)
     tgl.verifyRequest(viewMessages(groupChatId, {messageId[1]}, true));
     prpl.verifyEvents(
         ChatSetTopicEvent(groupChatPurpleName, "basic group", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
         ConversationWriteEvent(groupChatPurpleName, NotificationWho,
                                selfFirstName + " " + selfLastName +
                                ": Unsupported message type messageChatDeleteMember",
@@ -803,7 +861,6 @@ TEST_F(GroupChatTest, UsersWithSameName)
     prpl.verifyEvents(
         ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
         ChatSetTopicEvent(groupChatPurpleName, "basic group", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
         ChatAddUserEvent(
             groupChatPurpleName,
             userFirstNames[0] + " " + userLastNames[0],
@@ -897,7 +954,6 @@ TEST_F(GroupChatTest, GroupChatWithDeletedUser_WriteToNonContact)
     prpl.verifyEvents(
         ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
         ChatSetTopicEvent(groupChatPurpleName, "basic group", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
         ChatAddUserEvent(
             groupChatPurpleName,
             userFirstNames[0] + " " + userLastNames[0],
@@ -924,22 +980,8 @@ TEST_F(GroupChatTest, GroupChatWithDeletedUser_WriteToNonContact)
 
     tgl.update(standardPrivateChat(0));
     // Group chat conversation is open, and private chat for one of the members is updated,
-    // so member list is updated just in case
-    prpl.verifyEvents(
-        ChatSetTopicEvent(groupChatPurpleName, "basic group", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
-        ChatAddUserEvent(
-            groupChatPurpleName,
-            userFirstNames[0] + " " + userLastNames[0],
-            "", PURPLE_CBFLAGS_FOUNDER, false
-        ),
-        ChatAddUserEvent(
-            groupChatPurpleName,
-            // This is us (with + to match account name)
-            "+" + selfPhoneNumber,
-            "", PURPLE_CBFLAGS_NONE, false
-        )
-    );
+    // so member list is updated just in case, with nothing actually changed
+    prpl.verifyEvents(ChatSetTopicEvent(groupChatPurpleName, "basic group", ""));
 
     tgl.reply(makeChat(
         chatIds[0],
@@ -1000,19 +1042,12 @@ TEST_F(GroupChatTest, GroupChatWithDeletedUser_WriteToNonContact)
             PURPLE_MESSAGE_SYSTEM, 0
         ),
         ChatSetTopicEvent(groupChatPurpleName, "basic group", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
         // This group member has become a libpurple buddy, so member username will now be changed
         // from display name to buddy username
-        ChatAddUserEvent(
+        ChatRenameUserEvent(
             groupChatPurpleName,
-            purpleUserName(0),
-            "", PURPLE_CBFLAGS_FOUNDER, false
-        ),
-        ChatAddUserEvent(
-            groupChatPurpleName,
-            // This is us (with + to match account name)
-            "+" + selfPhoneNumber,
-            "", PURPLE_CBFLAGS_NONE, false
+            userFirstNames[0] + " " + userLastNames[0],
+            purpleUserName(0)
         )
     );
 
@@ -1212,7 +1247,6 @@ TEST_F(GroupChatTest, GetInviteLink)
     prpl.verifyEvents(
         ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
         ChatSetTopicEvent(groupChatPurpleName, "basic group", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
         ConversationWriteEvent(
             groupChatPurpleName, NotificationWho,
             "Cannot generate invite link: code 100 (error)",
@@ -13,8 +13,27 @@ struct AccountInfo {
     std::map<std::string, std::string> stringsOptions;
 };
 
+struct SignalHandler {
+    std::string    signal;
+    void          *handle;
+    PurpleCallback func;
+    void          *data;
+};
+
 std::vector<AccountInfo>  g_accounts;
 PurplePlugin             *g_plugin;
+// Only buddy list signals are emitted
+static int                        g_blistHandle;
+static std::vector<SignalHandler> g_blistSignalHandlers;
+static gboolean                   g_mockOutput = TRUE;
+
+static void emitBlistNodeSignal(const char *signal, PurpleBlistNode *node)
+{
+    std::vector<SignalHandler> handlers = g_blistSignalHandlers;
+    for (const SignalHandler &handler: handlers)
+        if (handler.signal == signal)
+            ((void (*)(PurpleBlistNode *, void *))handler.func)(node, handler.data);
+}
 
 extern "C" {
 
@@ -22,6 +41,8 @@ extern "C" {
 
 void purple_debug_misc(const char *category, const char *format, ...)
 {
+    if (!g_mockOutput)
+        return;
     va_list va;
     va_start(va, format);
     printf("%s: ", category);
@@ -31,6 +52,8 @@ void purple_debug_misc(const char *category, const char *format, ...)
 
 void purple_debug_info(const char *category, const char *format, ...)
 {
+    if (!g_mockOutput)
+        return;
     va_list va;
     va_start(va, format);
     printf("Info: %s: ", category);
@@ -40,6 +63,8 @@ void purple_debug_info(const char *category, const char *format, ...)
 
 void purple_debug_warning(const char *category, const char *format, ...)
 {
+    if (!g_mockOutput)
+        return;
     va_list va;
     va_start(va, format);
     printf("Warning: %s: ", category);
@@ -47,6 +72,17 @@ void purple_debug_warning(const char *category, const char *format, ...)
     va_end(va);
 }
 
+void purple_debug_error(const char *category, const char *format, ...)
+{
+    if (!g_mockOutput)
+        return;
+    va_list va;
+    va_start(va, format);
+    printf("Error: %s: ", category);
+    vprintf(format, va);
+    va_end(va);
+}
+
 const char *purple_account_get_username(const PurpleAccount *account)
 {
     return account->username;
@@ -186,6 +222,7 @@ void purple_blist_add_buddy(PurpleBuddy *buddy, PurpleContact *contact, PurpleGr
     pAccount->buddies.push_back(buddy);
 
     EVENT(AddBuddyEvent, buddy->name, buddy->alias, buddy->account, contact, group, node);
+    emitBlistNodeSignal("blist-node-added", &buddy->node);
 }
 
 void purple_blist_remove_account(PurpleAccount *account)
@@ -204,6 +241,7 @@ void purple_blist_remove_buddy(PurpleBuddy *buddy)
     pAccount->buddies.erase(it);
 
     EVENT(RemoveBuddyEvent, buddy->account, buddy->name);
+    emitBlistNodeSignal("blist-node-removed", &buddy->node);
     removeNode(buddy->node);
     purple_buddy_destroy(buddy);
 }
@@ -250,6 +288,7 @@ void purple_blist_remove_chat(PurpleChat *chat)
 
     const char *inviteLink = (const char *)g_hash_table_lookup(chat->components, (char *)"link");
     EVENT(RemoveChatEvent, getChatName(chat), inviteLink ? inviteLink : "");
+    emitBlistNodeSignal("blist-node-removed", &chat->node);
 
     free(chat->alias);
     g_hash_table_destroy(chat->components);
@@ -361,6 +400,7 @@ void purple_blist_add_chat(PurpleChat *chat, PurpleGroup *group, PurpleBlistNode
     pAccount->chats.push_back(chat);
 
     EVENT(AddChatEvent, name, chat->alias, chat->account, group, node);
+    emitBlistNodeSignal("blist-node-added", &chat->node);
 }
 
 PurpleChat *purple_blist_find_chat(PurpleAccount *account, const char *name)
@@ -441,6 +481,13 @@ void purple_connection_update_progress(PurpleConnection *gc, const char *text,
     EVENT(ConnectionUpdateProgressEvent, gc, step, count);
 }
 
+static void freeChatUser(gpointer data)
+{
+    PurpleConvChatBuddy *chatBuddy = static_cast<PurpleConvChatBuddy *>(data);
+    g_free(chatBuddy->name);
+    g_free(chatBuddy);
+}
+
 static PurpleConversation *purple_conversation_new_impl(PurpleConversationType type,
 										PurpleAccount *account,
 										const char *name)
@@ -476,6 +523,7 @@ static PurpleConversation *purple_conversation_new_impl(PurpleConversationType t
         conv->u.chat->conv = conv;
         conv->u.chat->left = FALSE;
         conv->u.chat->id = 0;
+        conv->u.chat->in_room = NULL;
     }
 
     if (pAccount != g_accounts.end())
@@ -506,8 +554,10 @@ void purple_conversation_destroy(PurpleConversation *conv)
     free(conv->title);
     if (conv->type == PURPLE_CONV_TYPE_IM)
         delete conv->u.im;
-    if (conv->type == PURPLE_CONV_TYPE_CHAT)
+    if (conv->type == PURPLE_CONV_TYPE_CHAT) {
+        g_list_free_full(conv->u.chat->in_room, freeChatUser);
         delete conv->u.chat;
+    }
     delete conv;
 }
 
@@ -607,7 +657,13 @@ void purple_conv_chat_set_topic(PurpleConvChat *chat, const char *who,
 
 gboolean purple_debug_is_enabled(void)
 {
-    return true;
+    // So that benchmarks don't spend time formatting messages that go nowhere
+    return g_mockOutput;
+}
+
+PurpleDebugUiOps *purple_debug_get_ui_ops(void)
+{
+    return NULL;
 }
 
 gboolean purple_debug_is_verbose(void)
@@ -681,7 +737,10 @@ void *purple_notify_message(void *handle, PurpleNotifyMsgType type,
 						  const char *secondary, PurpleNotifyCloseCallback cb,
 						  gpointer user_data)
 {
-    // TODO event
+    // TODO event for errors and warnings too
+    if (type == PURPLE_NOTIFY_MSG_INFO)
+        EVENT(NotifyMessageEvent, handle, type, title ? title : "", primary ? primary : "",
+              secondary ? secondary : "");
     return NULL;
 }
 
@@ -889,6 +948,7 @@ PurpleXfer *purple_xfer_new(PurpleAccount *account,
     xfer->local_filename = NULL;
     xfer->status = PURPLE_XFER_STATUS_UNKNOWN;
     xfer->size = 0;
+    xfer->dest_fp = NULL;
     memset(&xfer->ops, 0, sizeof(xfer->ops));
     return xfer;
 }
@@ -898,9 +958,25 @@ void purple_xfer_ref(PurpleXfer *xfer)
     xfer->ref++;
 }
 
+static gboolean g_xferDestFile = FALSE;
+
+void setXferDestFile(gboolean enabled)
+{
+    g_xferDestFile = enabled;
+}
+
+static void closeXferDestFile(PurpleXfer *xfer)
+{
+    if (xfer->dest_fp) {
+        fclose(xfer->dest_fp);
+        xfer->dest_fp = NULL;
+    }
+}
+
 void purple_xfer_unref(PurpleXfer *xfer)
 {
     if (--xfer->ref == 0) {
+        closeXferDestFile(xfer);
         free(xfer->who);
         free(xfer->filename);
         free(xfer->local_filename);
@@ -991,12 +1067,15 @@ void purple_xfer_start(PurpleXfer *xfer, int fd, const char *ip,
 {
     EVENT(XferStartEvent, xfer->local_filename);
     xfer->status = PURPLE_XFER_STATUS_STARTED;
+    if (g_xferDestFile && (xfer->type == PURPLE_XFER_RECEIVE) && !xfer->dest_fp)
+        xfer->dest_fp = fopen(xfer->local_filename, "wb");
 }
 
 void purple_xfer_cancel_local(PurpleXfer *xfer)
 {
     EVENT(XferLocalCancelEvent, xfer->local_filename);
     xfer->status = PURPLE_XFER_STATUS_CANCEL_LOCAL;
+    closeXferDestFile(xfer);
     if ((xfer->type == PURPLE_XFER_SEND) && xfer->ops.cancel_send)
         xfer->ops.cancel_send(xfer);
     if ((xfer->type == PURPLE_XFER_RECEIVE) && xfer->ops.cancel_recv)
@@ -1015,6 +1094,7 @@ void purple_xfer_cancel_remote(PurpleXfer *xfer)
 {
     EVENT(XferRemoteCancelEvent, xfer->local_filename);
     xfer->status = PURPLE_XFER_STATUS_CANCEL_REMOTE;
+    closeXferDestFile(xfer);
     if ((xfer->type == PURPLE_XFER_SEND) && xfer->ops.cancel_send)
         xfer->ops.cancel_send(xfer);
     if ((xfer->type == PURPLE_XFER_RECEIVE) && xfer->ops.cancel_recv)
@@ -1055,6 +1135,7 @@ void purple_xfer_update_progress(PurpleXfer *xfer)
 void purple_xfer_end(PurpleXfer *xfer)
 {
     EVENT(XferEndEvent, xfer->local_filename);
+    closeXferDestFile(xfer);
     if (xfer->ops.end)
         xfer->ops.end(xfer);
     purple_xfer_unref(xfer);
@@ -1079,6 +1160,8 @@ purple_xfer_write_file(PurpleXfer *xfer, const guchar *buffer, gsize size)
         return FALSE;
     }
     EXPECT_LE(xfer->bytes_sent + size, xfer->size);
+    if (xfer->dest_fp)
+        EXPECT_EQ(size, fwrite(buffer, 1, size, xfer->dest_fp));
     xfer->bytes_sent += size;
     EVENT(XferWriteFileEvent, xfer->local_filename, buffer, size);
     return TRUE;
@@ -1129,10 +1212,22 @@ void purple_conversation_present(PurpleConversation *conv)
     EVENT(PresentConversationEvent, conv->name);
 }
 
+static GList *findChatUser(PurpleConvChat *chat, const char *user)
+{
+    for (GList *item = chat->in_room; item; item = g_list_next(item))
+        if (!strcmp(static_cast<PurpleConvChatBuddy *>(item->data)->name, user))
+            return item;
+    return NULL;
+}
+
 void purple_conv_chat_add_user(PurpleConvChat *chat, const char *user,
 							 const char *extra_msg, PurpleConvChatBuddyFlags flags,
 							 gboolean new_arrival)
 {
+    PurpleConvChatBuddy *chatBuddy = g_new0(PurpleConvChatBuddy, 1);
+    chatBuddy->name  = g_strdup(user);
+    chatBuddy->flags = flags;
+    chat->in_room    = g_list_append(chat->in_room, chatBuddy);
     EVENT(ChatAddUserEvent, chat->conv->name, user, extra_msg ? extra_msg : "", flags, new_arrival);
 }
 
@@ -1145,8 +1240,62 @@ void purple_conv_chat_add_users(PurpleConvChat *chat, GList *users, GList *extra
                                   (PurpleConvChatBuddyFlags)GPOINTER_TO_INT(flag->data), new_arrivals);
 }
 
+void purple_conv_chat_remove_users(PurpleConvChat *chat, GList *users, const char *reason)
+{
+    for (GList *user = users; user; user = g_list_next(user)) {
+        GList *item = findChatUser(chat, (const char *)user->data);
+        EXPECT_NE(nullptr, item) << "Removing unknown chat user";
+        if (item) {
+            freeChatUser(item->data);
+            chat->in_room = g_list_delete_link(chat->in_room, item);
+        }
+        EVENT(ChatRemoveUserEvent, chat->conv->name, (const char *)user->data);
+    }
+}
+
+void purple_conv_chat_rename_user(PurpleConvChat *chat, const char *old_user,
+                                  const char *new_user)
+{
+    GList *item = findChatUser(chat, old_user);
+    EXPECT_NE(nullptr, item) << "Renaming unknown chat user";
+    if (item) {
+        PurpleConvChatBuddy *chatBuddy = static_cast<PurpleConvChatBuddy *>(item->data);
+        g_free(chatBuddy->name);
+        chatBuddy->name = g_strdup(new_user);
+    }
+    EVENT(ChatRenameUserEvent, chat->conv->name, old_user, new_user);
+}
+
+void purple_conv_chat_user_set_flags(PurpleConvChat *chat, const char *user,
+                                     PurpleConvChatBuddyFlags flags)
+{
+    GList *item = findChatUser(chat, user);
+    EXPECT_NE(nullptr, item) << "Setting flags for unknown chat user";
+    if (item)
+        static_cast<PurpleConvChatBuddy *>(item->data)->flags = flags;
+    EVENT(ChatUserSetFlagsEvent, chat->conv->name, user, flags);
+}
+
+PurpleConvChatBuddy *purple_conv_chat_cb_find(PurpleConvChat *chat, const char *name)
+{
+    GList *item = findChatUser(chat, name);
+    return item ? static_cast<PurpleConvChatBuddy *>(item->data) : NULL;
+}
+
+GList *purple_conv_chat_get_users(const PurpleConvChat *chat)
+{
+    return chat->in_room;
+}
+
+const char *purple_conv_chat_cb_get_name(PurpleConvChatBuddy *cb)
+{
+    return cb->name;
+}
+
 void purple_conv_chat_clear_users(PurpleConvChat *chat)
 {
+    g_list_free_full(chat->in_room, freeChatUser);
+    chat->in_room = NULL;
     EVENT(ChatClearUsersEvent, chat->conv->name);
 }
 
@@ -1410,6 +1559,12 @@ PurpleAccountOption *purple_account_option_bool_new(const char *text,
     return NULL;
 }
 
+PurpleAccountOption *purple_account_option_int_new(const char *text,
+	const char *pref_name, int default_value)
+{
+    return NULL;
+}
+
 PurpleAccountOption *purple_account_option_list_new(const char *text,
 	const char *pref_name, GList *list)
 {
@@ -1464,6 +1619,18 @@ void purple_account_set_bool(PurpleAccount *account, const char *name,
     purple_account_set_string(account, name, value ? "true" : "");
 }
 
+int purple_account_get_int(const PurpleAccount *account, const char *name,
+						 int default_value)
+{
+    std::string defaultStr = std::to_string(default_value);
+    return atoi(purple_account_get_string(account, name, defaultStr.c_str()));
+}
+
+void purple_account_set_int(PurpleAccount *account, const char *name, int value)
+{
+    purple_account_set_string(account, name, std::to_string(value).c_str());
+}
+
 void purple_account_remove_setting(PurpleAccount *account, const char *setting)
 {
     auto it = std::find_if(g_accounts.begin(), g_accounts.end(),
@@ -1507,6 +1674,16 @@ GHashTable *purple_core_get_ui_info()
     return uiInfo;
 }
 
+void setMockOutput(gboolean enabled)
+{
+    g_mockOutput = enabled;
+}
+
+gboolean isMockOutputEnabled()
+{
+    return g_mockOutput;
+}
+
 void setUiName(const char *name)
 {
     if (!uiInfo)
@@ -1536,7 +1713,24 @@ gboolean purple_conversation_has_focus(PurpleConversation *conv)
 gulong purple_signal_connect(void *instance, const char *signal,
 	void *handle, PurpleCallback func, void *data)
 {
+    if (instance == &g_blistHandle)
+        g_blistSignalHandlers.push_back(SignalHandler{signal, handle, func, data});
     return 0;
 }
 
+void purple_signal_disconnect(void *instance, const char *signal,
+	void *handle, PurpleCallback func)
+{
+    if (instance == &g_blistHandle)
+        g_blistSignalHandlers.erase(std::remove_if(g_blistSignalHandlers.begin(), g_blistSignalHandlers.end(),
+            [signal, handle, func](const SignalHandler &handler) {
+                return (handler.signal == signal) && (handler.handle == handle) && (handler.func == func);
+            }), g_blistSignalHandlers.end());
+}
+
+void *purple_blist_get_handle(void)
+{
+    return &g_blistHandle;
+}
+
 };
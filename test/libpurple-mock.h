@@ -13,6 +13,12 @@ void clearFakeFiles();
 int  getLastImgstoreId();
 guint8 *arrayDup(gpointer data, size_t size);
 void setUiName(const char *name);
+// Makes purple_xfer_start open destination file of received transfers, like libpurple does when
+// UI doesn't do its own writing. Off by default.
+void setXferDestFile(gboolean enabled);
+// Printing of debug messages, libpurple events and tdlib traffic, on by default
+void setMockOutput(gboolean enabled);
+gboolean isMockOutputEnabled();
 
 };
 
@@ -0,0 +1,397 @@
+#include "load-generator.h"
+#include "benchmark-client.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+
+static const int32_t groupId      = 700;
+static const int64_t groupChatId  = -7000;
+static const int32_t firstUserId  = 1000;
+static const int32_t photoSize    = 1000;
+// How far back replies and file progress updates reach
+static const int64_t replyWindow  = 1000;
+static const int64_t mediaWindow  = 20;
+
+static const char *const seqMarker = "[seq:";
+
+void LatencyStats::add(gint64 microseconds)
+{
+    m_samples.push_back(microseconds);
+    m_sorted = false;
+}
+
+double LatencyStats::percentile(double p)
+{
+    if (m_samples.empty())
+        return 0;
+    if (!m_sorted) {
+        std::sort(m_samples.begin(), m_samples.end());
+        m_sorted = true;
+    }
+    size_t index = std::ceil(p / 100 * m_samples.size());
+    index = std::min(std::max<size_t>(index, 1), m_samples.size()) - 1;
+    return m_samples[index] / 1000.0;
+}
+
+double LatencyStats::max()
+{
+    return percentile(100);
+}
+
+static int32_t userCount(LoadScenario scenario)
+{
+    switch (scenario) {
+    case LoadScenario::ManyChats: return 500;
+    case LoadScenario::Replies: return 200;
+    case LoadScenario::Media: return 50;
+    }
+    return 1;
+}
+
+static std::string withMarker(const std::string &text, int64_t messageId)
+{
+    return text + " " + seqMarker + std::to_string(messageId) + "]";
+}
+
+// Message id from the last marker, since replies quote the original message
+static int64_t findMarker(const std::string &text)
+{
+    size_t pos = text.rfind(seqMarker);
+    if (pos == std::string::npos)
+        return 0;
+    return std::strtoll(text.c_str() + pos + strlen(seqMarker), NULL, 10);
+}
+
+static object_ptr<file> makeDownloadedFile(int32_t fileId)
+{
+    return make_object<file>(
+        fileId, photoSize, photoSize,
+        make_object<localFile>(TEST_SOURCE_DIR "/test.webp", true, true, false, true, 0, photoSize, photoSize),
+        make_object<remoteFile>("beh", "bleh", false, true, photoSize)
+    );
+}
+
+class LoadRun {
+public:
+    LoadRun(const LoadConfig &config);
+    LoadResult run();
+
+private:
+    const LoadConfig  m_config;
+    const int32_t     m_userCount;
+    BenchmarkClient   m_client;
+    std::mt19937      m_random;
+    LoadResult        m_result;
+
+    std::mutex        m_pendingMutex;
+    // Enqueue times of messages by id, and of latest status change by user
+    std::unordered_map<int64_t, gint64> m_pendingMessages;
+    std::unordered_map<int32_t, gint64> m_pendingStatuses;
+    std::atomic<bool> m_producerDone{false};
+    int64_t           m_lastMessageId = 0;
+    std::vector<bool> m_userOnline;
+
+    void login();
+    void produce();
+    void postUpdate(object_ptr<Object> update);
+    void postMessage(object_ptr<message> message);
+    void postStatus(int32_t userId);
+    void generateUpdate();
+    void onEvent(const PurpleEvent &event);
+    void messageShown(int64_t messageId);
+    bool allMessagesShown();
+    object_ptr<Object> respond(const Function &request);
+
+    int32_t randomUser() { return firstUserId + m_random() % m_userCount; }
+    unsigned randomPercent() { return m_random() % 100; }
+};
+
+LoadRun::LoadRun(const LoadConfig &config)
+: m_config(config),
+  m_userCount(userCount(config.scenario)),
+  m_random(config.seed),
+  m_userOnline(m_userCount, false)
+{
+    m_client.setResponder([this](const Function &request) { return respond(request); });
+}
+
+void LoadRun::login()
+{
+    std::vector<object_ptr<Object>> updates;
+    std::vector<int32_t> contacts;
+    for (int32_t i = 0; i < m_userCount; i++)
+        updates.push_back(makeBenchmarkUser(firstUserId + i));
+
+    if (m_config.scenario == LoadScenario::Replies) {
+        updates.push_back(make_object<updateSupergroup>(make_object<supergroup>(
+            groupId, "", 0, make_object<chatMemberStatusMember>(), m_userCount,
+            false, false, false, false, false, false, "", false
+        )));
+        updates.push_back(make_object<updateNewChat>(makeChat(
+            groupChatId, make_object<chatTypeSupergroup>(groupId, false), "Group", nullptr, 0, 0, 0
+        )));
+        updates.push_back(makeUpdateChatListMain(groupChatId));
+    } else {
+        for (int32_t i = 0; i < m_userCount; i++) {
+            updates.push_back(makeBenchmarkPrivateChat(firstUserId + i));
+            updates.push_back(makeUpdateChatListMain(firstUserId + i));
+            contacts.push_back(firstUserId + i);
+        }
+    }
+
+    m_client.login(std::move(updates), std::move(contacts));
+}
+
+object_ptr<Object> LoadRun::respond(const Function &request)
+{
+    switch (request.get_id()) {
+    case getMessage::ID: {
+        const getMessage &getMsg = static_cast<const getMessage &>(request);
+        return makeBenchmarkTextMessage(getMsg.message_id_, firstUserId, getMsg.chat_id_,
+                                        "Message " + std::to_string(getMsg.message_id_));
+    }
+    case downloadFile::ID:
+        return makeDownloadedFile(static_cast<const downloadFile &>(request).file_id_);
+    default:
+        return nullptr;
+    }
+}
+
+void LoadRun::postUpdate(object_ptr<Object> update)
+{
+    m_client.tgl.post({0, std::move(update)});
+    m_result.updatesSent++;
+}
+
+void LoadRun::postMessage(object_ptr<message> message)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_pendingMutex);
+        m_pendingMessages[message->id_] = g_get_monotonic_time();
+    }
+    m_result.messagesSent++;
+    postUpdate(make_object<updateNewMessage>(std::move(message)));
+}
+
+void LoadRun::postStatus(int32_t userId)
+{
+    // Always a change, so that every status update should eventually show up
+    bool online = !m_userOnline[userId - firstUserId];
+    m_userOnline[userId - firstUserId] = online;
+    object_ptr<UserStatus> status;
+    if (online)
+        status = make_object<userStatusOnline>(0);
+    else
+        status = make_object<userStatusOffline>(0);
+
+    {
+        std::unique_lock<std::mutex> lock(m_pendingMutex);
+        m_pendingStatuses[userId] = g_get_monotonic_time();
+    }
+    postUpdate(make_object<updateUserStatus>(userId, std::move(status)));
+}
+
+void LoadRun::generateUpdate()
+{
+    unsigned percent = randomPercent();
+    int32_t  userId  = randomUser();
+
+    switch (m_config.scenario) {
+    case LoadScenario::ManyChats:
+        if (percent < 70) {
+            int64_t id = ++m_lastMessageId;
+            postMessage(makeBenchmarkTextMessage(id, userId, userId, withMarker("Message", id)));
+        } else if (percent < 85)
+            postStatus(userId);
+        else if (percent < 95)
+            postUpdate(makeUpdateChatListMain(userId));
+        else
+            postUpdate(makeBenchmarkUser(userId));
+        break;
+
+    case LoadScenario::Replies:
+        if (percent < 85) {
+            int64_t id = ++m_lastMessageId;
+            auto message = makeBenchmarkTextMessage(id, userId, groupChatId, withMarker("Message", id));
+            if ((percent < 60) && (id > 1)) {
+                int64_t window  = std::min(replyWindow, id - 1);
+                int64_t replyId = id - 1 - m_random() % window;
+                message->reply_to_ = make_object<messageReplyToMessage>(groupChatId, replyId);
+            }
+            postMessage(std::move(message));
+        } else
+            postStatus(userId);
+        break;
+
+    case LoadScenario::Media:
+        if (percent < 40) {
+            int64_t id = ++m_lastMessageId;
+            postMessage(makeMessage(
+                id, userId, userId, false, 1600000000 + id,
+                make_object<messagePhoto>(
+                    makePhotoRemote(id, photoSize, 100, 100),
+                    make_object<formattedText>(withMarker("Photo", id), std::vector<object_ptr<textEntity>>()),
+                    false
+                )
+            ));
+        } else if (percent < 60) {
+            int64_t id = ++m_lastMessageId;
+            postMessage(makeBenchmarkTextMessage(id, userId, userId, withMarker("Message", id)));
+        } else if ((percent < 90) && (m_lastMessageId > 0)) {
+            // Download progress of a recent photo
+            int32_t fileId     = m_lastMessageId - m_random() % std::min(mediaWindow, m_lastMessageId);
+            int32_t downloaded = m_random() % photoSize;
+            postUpdate(make_object<updateFile>(make_object<file>(
+                fileId, photoSize, photoSize,
+                make_object<localFile>("", true, true, true, false, 0, downloaded, downloaded),
+                make_object<remoteFile>("beh", "bleh", false, true, photoSize)
+            )));
+        } else
+            postStatus(userId);
+        break;
+    }
+}
+
+void LoadRun::produce()
+{
+    const gint64   start = g_get_monotonic_time();
+    const uint64_t total = uint64_t(m_config.rate) * m_config.duration;
+
+    for (uint64_t i = 0; i < total; i++) {
+        gint64 due = start + gint64(i * 1000000 / m_config.rate);
+        gint64 now = g_get_monotonic_time();
+        if (due > now)
+            g_usleep(due - now);
+        generateUpdate();
+    }
+
+    gint64 elapsed = std::max<gint64>(g_get_monotonic_time() - start, 1);
+    m_result.achievedRate = double(m_result.updatesSent) * 1000000 / elapsed;
+    m_producerDone = true;
+}
+
+void LoadRun::messageShown(int64_t messageId)
+{
+    gint64 now = g_get_monotonic_time();
+    std::unique_lock<std::mutex> lock(m_pendingMutex);
+    auto it = m_pendingMessages.find(messageId);
+    if (it != m_pendingMessages.end()) {
+        m_result.messageLatency.add(now - it->second);
+        m_result.messagesShown++;
+        m_pendingMessages.erase(it);
+    }
+}
+
+void LoadRun::onEvent(const PurpleEvent &event)
+{
+    switch (event.type) {
+    case PurpleEventType::ServGotIm:
+        messageShown(findMarker(static_cast<const ServGotImEvent &>(event).message));
+        break;
+    case PurpleEventType::ServGotChat:
+        messageShown(findMarker(static_cast<const ServGotChatEvent &>(event).message));
+        break;
+    case PurpleEventType::ConversationWrite:
+        messageShown(findMarker(static_cast<const ConversationWriteEvent &>(event).message));
+        break;
+    case PurpleEventType::UserStatus: {
+        // Buddy names are "id<user id>"
+        const std::string &name   = static_cast<const UserStatusEvent &>(event).username;
+        int32_t            userId = (name.size() > 2) ? atoi(name.c_str() + 2) : 0;
+        gint64             now    = g_get_monotonic_time();
+        std::unique_lock<std::mutex> lock(m_pendingMutex);
+        auto it = m_pendingStatuses.find(userId);
+        if (it != m_pendingStatuses.end()) {
+            m_result.statusLatency.add(now - it->second);
+            m_pendingStatuses.erase(it);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+bool LoadRun::allMessagesShown()
+{
+    std::unique_lock<std::mutex> lock(m_pendingMutex);
+    return m_pendingMessages.empty();
+}
+
+struct LatenessProbe {
+    static constexpr guint interval = 10; // ms
+    LatencyStats *stats;
+    gint64        expected;
+
+    static gboolean callback(gpointer data)
+    {
+        LatenessProbe *probe = static_cast<LatenessProbe *>(data);
+        gint64 now = g_get_monotonic_time();
+        probe->stats->add(std::max<gint64>(now - probe->expected, 0));
+        probe->expected = now + interval * 1000;
+        return G_SOURCE_CONTINUE;
+    }
+};
+
+LoadResult LoadRun::run()
+{
+    login();
+    g_purpleEvents.setEventHook([this](const PurpleEvent &event) { onEvent(event); });
+
+    LatenessProbe probe{&m_result.mainLoopLateness, g_get_monotonic_time() + LatenessProbe::interval * 1000};
+    guint probeId = g_timeout_add(LatenessProbe::interval, LatenessProbe::callback, &probe);
+
+    std::thread producer(&LoadRun::produce, this);
+
+    // Timers of the plugin, such as status update coalescing, only run when asked to by
+    // TestTransceiver, so run them at about the rate they would fire on their own
+    const gint64 timerInterval = 1000000;
+    const gint64 drainTime     = 10000000;
+    gint64       nextTimers    = g_get_monotonic_time() + timerInterval;
+    gint64       drainDeadline = 0;
+
+    while (true) {
+        g_main_context_iteration(NULL, TRUE);
+        m_client.respond();
+
+        gint64 now = g_get_monotonic_time();
+        if (now >= nextTimers) {
+            m_client.tgl.runTimeouts();
+            m_client.respond();
+            nextTimers = now + timerInterval;
+        }
+
+        if (m_producerDone) {
+            if (drainDeadline == 0) {
+                drainDeadline = now + drainTime;
+                // Let pending status changes through the timer at least once
+                nextTimers = std::min(nextTimers, now + timerInterval);
+            }
+            if (now >= drainDeadline)
+                break;
+            if (allMessagesShown() && (now > drainDeadline - drainTime + 3 * timerInterval / 2))
+                break;
+        }
+    }
+
+    producer.join();
+    g_source_remove(probeId);
+    while (g_main_context_iteration(NULL, FALSE))
+        m_client.respond();
+    m_client.respond();
+    g_purpleEvents.setEventHook(nullptr);
+    m_client.discardEvents();
+
+    return std::move(m_result);
+}
+
+LoadResult runLoad(const LoadConfig &config)
+{
+    LoadRun run(config);
+    return run.run();
+}
@@ -0,0 +1,49 @@
+#ifndef _LOAD_GENERATOR_H
+#define _LOAD_GENERATOR_H
+
+#include <glib.h>
+#include <cstdint>
+#include <vector>
+
+enum class LoadScenario {
+    ManyChats, // Messages spread over hundreds of private chats, with status and chat list churn
+    Replies,   // Busy group chat where most messages reply to earlier ones
+    Media      // Photos in private chats, with file progress updates
+};
+
+struct LoadConfig {
+    LoadScenario scenario = LoadScenario::ManyChats;
+    unsigned     rate     = 1000; // Updates per second
+    unsigned     duration = 10;   // Seconds
+    unsigned     seed     = 1;
+};
+
+class LatencyStats {
+public:
+    void   add(gint64 microseconds);
+    size_t count() const { return m_samples.size(); }
+    // In milliseconds
+    double percentile(double p);
+    double max();
+private:
+    std::vector<gint64> m_samples;
+    bool                m_sorted = true;
+};
+
+struct LoadResult {
+    uint64_t     updatesSent   = 0;
+    double       achievedRate  = 0;
+    uint64_t     messagesSent  = 0;
+    uint64_t     messagesShown = 0;
+    // From queueing an update in TdTransceiver until the message or status change reaches libpurple
+    LatencyStats messageLatency;
+    LatencyStats statusLatency;
+    // How late a periodic glib timer fires, which is what the user sees as unresponsive UI
+    LatencyStats mainLoopLateness;
+};
+
+// Logs in with synthetic data, then feeds updates from a separate thread at the target rate, like
+// tdlib poll thread does, while running glib main loop in the calling thread
+LoadResult runLoad(const LoadConfig &config);
+
+#endif
@@ -0,0 +1,114 @@
+#include "load-generator.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Feeds a synthetic flood of updates through the plugin and reports how long it takes for them to
+// reach libpurple, and how much glib main loop is held up meanwhile
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [--scenario many-chats|replies|media] [--rate N] [--duration SECONDS]\n"
+            "          [--seed N] [--sweep] [--lag-threshold MS]\n"
+            "\n"
+            "  --rate           Updates per second (default 1000)\n"
+            "  --sweep          Double the rate, starting from --rate, until 99th percentile of\n"
+            "                   message latency exceeds --lag-threshold (default 100 ms)\n",
+            program);
+}
+
+static bool parseScenario(const char *name, LoadScenario &scenario)
+{
+    if (!strcmp(name, "many-chats"))
+        scenario = LoadScenario::ManyChats;
+    else if (!strcmp(name, "replies"))
+        scenario = LoadScenario::Replies;
+    else if (!strcmp(name, "media"))
+        scenario = LoadScenario::Media;
+    else
+        return false;
+    return true;
+}
+
+static void printLatency(const char *name, LatencyStats &stats)
+{
+    printf("  %-10s n=%-8zu p50=%8.2f ms  p90=%8.2f ms  p99=%8.2f ms  max=%8.2f ms\n", name,
+           stats.count(), stats.percentile(50), stats.percentile(90), stats.percentile(99), stats.max());
+}
+
+static void printResult(const LoadConfig &config, LoadResult &result)
+{
+    printf("Target rate %u updates/s, achieved %.0f updates/s, %llu updates\n", config.rate,
+           result.achievedRate, (unsigned long long)result.updatesSent);
+    printf("  Messages shown: %llu of %llu\n", (unsigned long long)result.messagesShown,
+           (unsigned long long)result.messagesSent);
+    printLatency("messages", result.messageLatency);
+    printLatency("statuses", result.statusLatency);
+    printLatency("main loop", result.mainLoopLateness);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    LoadConfig config;
+    bool       sweep        = false;
+    double     lagThreshold = 100;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg   = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if (!strcmp(arg, "--sweep"))
+            sweep = true;
+        else if (value && !strcmp(arg, "--scenario")) {
+            if (!parseScenario(value, config.scenario)) {
+                usage(argv[0]);
+                return 1;
+            }
+            i++;
+        } else if (value && !strcmp(arg, "--rate")) {
+            config.rate = std::max(atoi(value), 1);
+            i++;
+        } else if (value && !strcmp(arg, "--duration")) {
+            config.duration = std::max(atoi(value), 1);
+            i++;
+        } else if (value && !strcmp(arg, "--seed")) {
+            config.seed = atoi(value);
+            i++;
+        } else if (value && !strcmp(arg, "--lag-threshold")) {
+            lagThreshold = atof(value);
+            i++;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!sweep) {
+        LoadResult result = runLoad(config);
+        printResult(config, result);
+        return 0;
+    }
+
+    // Highest rate at which all messages got through in time
+    unsigned sustainedRate = 0;
+    while (true) {
+        LoadResult result = runLoad(config);
+        printResult(config, result);
+        if ((result.messagesShown < result.messagesSent) ||
+            (result.messageLatency.percentile(99) > lagThreshold))
+            break;
+        sustainedRate = config.rate;
+        config.rate *= 2;
+    }
+
+    if (sustainedRate)
+        printf("Sustained rate: %u updates/s with 99th percentile message latency under %.0f ms\n",
+               sustainedRate, lagThreshold);
+    else
+        printf("Message latency exceeds %.0f ms already at %u updates/s\n", lagThreshold, config.rate);
+
+    return 0;
+}
@@ -133,7 +133,7 @@ TEST_F(MessageSplitTest, SplitCaption_Utf8)
 
     uint8_t data1[] = {1, 2, 3, 4, 5};
     const int id1 = purple_imgstore_add_with_id(arrayDup(data1, sizeof(data1)), sizeof(data1), "filename1");
-    std::string messageText = fmt::format("<img id=\"{}\">😃😃😃", id1);
+    std::string messageText = fmt::format("<img id=\"{}\">😃😃😃😃😃😃", id1);
     ASSERT_EQ(0, pluginInfo().send_im(connection, purpleUserName(0).c_str(), messageText.c_str(), PURPLE_MESSAGE_SEND));
 
     tgl.verifyRequests({
@@ -145,8 +145,8 @@ TEST_F(MessageSplitTest, SplitCaption_Utf8)
             make_object<inputMessagePhoto>(
                 make_object<inputFileLocal>(),
                 nullptr, std::vector<std::int32_t>(), 0, 0,
-                // 8 bytes (limit is 9)
-                make_object<formattedText>("😃😃", std::vector<object_ptr<textEntity>>()),
+                // Limit is in UTF-16 code units: 10 of them, though it's 20 bytes
+                make_object<formattedText>("😃😃😃😃😃", std::vector<object_ptr<textEntity>>()),
                 0
             )
         ),
@@ -171,10 +171,11 @@ TEST_F(MessageSplitTest, SplitText_Utf8)
         make_object<optionValueInteger>(10)
     ));
 
+    // Emoji take two UTF-16 code units, so the 11th one doesn't fit
     ASSERT_EQ(0, pluginInfo().send_im(
         connection,
         purpleUserName(0).c_str(),
-        "😃😃😃😃😃",
+        "😃😃😃😃😃😃😃😃😃😃😃",
         PURPLE_MESSAGE_SEND
     ));
 
@@ -185,7 +186,7 @@ TEST_F(MessageSplitTest, SplitText_Utf8)
             nullptr,
             nullptr,
             make_object<inputMessageText>(
-                make_object<formattedText>("😃😃", std::vector<object_ptr<textEntity>>()),
+                make_object<formattedText>("😃😃😃😃😃", std::vector<object_ptr<textEntity>>()),
                 false, false
             )
         ),
@@ -195,7 +196,7 @@ TEST_F(MessageSplitTest, SplitText_Utf8)
             nullptr,
             nullptr,
             make_object<inputMessageText>(
-                make_object<formattedText>("😃😃", std::vector<object_ptr<textEntity>>()),
+                make_object<formattedText>("😃😃😃😃😃", std::vector<object_ptr<textEntity>>()),
                 false, false
             )
         ),
@@ -210,4 +211,79 @@ TEST_F(MessageSplitTest, SplitText_Utf8)
             )
         )
     });
+
+    // Two bytes per character in UTF-8, but one UTF-16 code unit
+    ASSERT_EQ(0, pluginInfo().send_im(
+        connection,
+        purpleUserName(0).c_str(),
+        "абвгдежзийклмн",
+        PURPLE_MESSAGE_SEND
+    ));
+
+    tgl.verifyRequests({
+        make_object<sendMessage>(
+            chatIds[0],
+            0,
+            nullptr,
+            nullptr,
+            make_object<inputMessageText>(
+                make_object<formattedText>("абвгдежзий", std::vector<object_ptr<textEntity>>()),
+                false, false
+            )
+        ),
+        make_object<sendMessage>(
+            chatIds[0],
+            0,
+            nullptr,
+            nullptr,
+            make_object<inputMessageText>(
+                make_object<formattedText>("клмн", std::vector<object_ptr<textEntity>>()),
+                false, false
+            )
+        )
+    });
+}
+
+TEST_F(MessageSplitTest, SplitText_Formatting)
+{
+    loginWithOneContact();
+    tgl.update(make_object<updateOption>(
+        "message_text_length_max",
+        make_object<optionValueInteger>(10)
+    ));
+
+    // Bold text crosses the split point, limit and entity offsets are in UTF-16 code units
+    ASSERT_EQ(0, pluginInfo().send_im(
+        connection,
+        purpleUserName(0).c_str(),
+        "😃1<b>2345😃67</b>8",
+        PURPLE_MESSAGE_SEND
+    ));
+
+    std::vector<object_ptr<textEntity>> entities1;
+    entities1.push_back(make_object<textEntity>(3, 7, make_object<textEntityTypeBold>()));
+    std::vector<object_ptr<textEntity>> entities2;
+    entities2.push_back(make_object<textEntity>(0, 1, make_object<textEntityTypeBold>()));
+    tgl.verifyRequests({
+        make_object<sendMessage>(
+            chatIds[0],
+            0,
+            nullptr,
+            nullptr,
+            make_object<inputMessageText>(
+                make_object<formattedText>("😃12345😃6", std::move(entities1)),
+                false, false
+            )
+        ),
+        make_object<sendMessage>(
+            chatIds[0],
+            0,
+            nullptr,
+            nullptr,
+            make_object<inputMessageText>(
+                make_object<formattedText>("78", std::move(entities2)),
+                false, false
+            )
+        )
+    });
 }
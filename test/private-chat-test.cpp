@@ -672,29 +672,26 @@ TEST_F(PrivateChatTest, SendImage)
                 false, false
             )
         ),
-        make_object<sendMessage>(
+        make_object<sendMessageAlbum>(
             chatIds[0],
             0,
             nullptr,
-            nullptr,
-            make_object<inputMessagePhoto>(
-                make_object<inputFileLocal>(),
-                nullptr, std::vector<std::int32_t>(), 0, 0,
-                make_object<formattedText>("caption1", std::vector<object_ptr<textEntity>>()),
-                0
-            )
-        ),
-        make_object<sendMessage>(
-            chatIds[0],
-            0,
-            nullptr,
-            nullptr,
-            make_object<inputMessagePhoto>(
-                make_object<inputFileLocal>(),
-                nullptr, std::vector<std::int32_t>(), 0, 0,
-                make_object<formattedText>("caption2", std::vector<object_ptr<textEntity>>()),
-                0
-            )
+            [&]() {
+                std::vector<object_ptr<InputMessageContent>> contents;
+                contents.push_back(make_object<inputMessagePhoto>(
+                    make_object<inputFileLocal>(),
+                    nullptr, std::vector<std::int32_t>(), 0, 0,
+                    make_object<formattedText>("caption1", std::vector<object_ptr<textEntity>>()),
+                    0
+                ));
+                contents.push_back(make_object<inputMessagePhoto>(
+                    make_object<inputFileLocal>(),
+                    nullptr, std::vector<std::int32_t>(), 0, 0,
+                    make_object<formattedText>("caption2", std::vector<object_ptr<textEntity>>()),
+                    0
+                ));
+                return contents;
+            }()
         )
     });
 
@@ -708,7 +705,8 @@ TEST_F(PrivateChatTest, SendImage)
     );
     tgl.reply(std::move(msg));
 
-    msg = makeMessage(
+    std::vector<object_ptr<message>> album;
+    album.push_back(makeMessage(
         msgIdOld[1],
         userIds[0],
         chatIds[0],
@@ -719,11 +717,10 @@ TEST_F(PrivateChatTest, SendImage)
             make_object<formattedText>("caption1", std::vector<object_ptr<textEntity>>()),
             false
         )
-    );
-    msg->sending_state_ = make_object<messageSendingStatePending>();
-    tgl.reply(std::move(msg));
+    ));
+    album.back()->sending_state_ = make_object<messageSendingStatePending>();
 
-    msg = makeMessage(
+    album.push_back(makeMessage(
         msgIdOld[2],
         userIds[0],
         chatIds[0],
@@ -734,9 +731,9 @@ TEST_F(PrivateChatTest, SendImage)
             make_object<formattedText>("caption2", std::vector<object_ptr<textEntity>>()),
             false
         )
-    );
-    msg->sending_state_ = make_object<messageSendingStatePending>();
-    tgl.reply(std::move(msg));
+    ));
+    album.back()->sending_state_ = make_object<messageSendingStatePending>();
+    tgl.reply(make_object<messages>(album.size(), std::move(album)));
 
     checkFile(tgl.getInputPhotoPath(0).c_str(), data1, sizeof(data1));
     tgl.update(make_object<updateMessageSendSucceeded>(
@@ -783,6 +780,221 @@ TEST_F(PrivateChatTest, SendImage)
     );
 }
 
+TEST_F(PrivateChatTest, SendSameImageTwice)
+{
+    loginWithOneContact();
+
+    const int64_t msgIdOld[2] = {10, 11};
+    const int64_t msgIdNew[2] = {20, 21};
+    const int32_t fileId      = 101;
+    uint8_t data[] = {1, 2, 3, 4, 5, 6};
+
+    const int id1 = purple_imgstore_add_with_id(arrayDup(data, sizeof(data)), sizeof(data), "filename1");
+    const int id2 = purple_imgstore_add_with_id(arrayDup(data, sizeof(data)), sizeof(data), "filename2");
+
+    for (int id: {id1, id2}) {
+        const std::string messageText = fmt::format("<img id=\"{}\">", id);
+        ASSERT_EQ(0, pluginInfo().send_im(connection, purpleUserName(0).c_str(), messageText.c_str(), PURPLE_MESSAGE_SEND));
+        tgl.verifyRequest(sendMessage(
+            chatIds[0],
+            0,
+            nullptr,
+            nullptr,
+            make_object<inputMessagePhoto>(
+                make_object<inputFileLocal>(),
+                nullptr, std::vector<std::int32_t>(), 0, 0,
+                make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+                0
+            )
+        ));
+    }
+    // Same content - same file
+    ASSERT_EQ(tgl.getInputPhotoPath(0), tgl.getInputPhotoPath(1));
+    checkFile(tgl.getInputPhotoPath(0).c_str(), data, sizeof(data));
+
+    for (int i = 0; i < 2; i++) {
+        object_ptr<message> msg = makeMessage(
+            msgIdOld[i],
+            userIds[0],
+            chatIds[0],
+            true,
+            1,
+            make_object<messagePhoto>(
+                makePhotoUploading(fileId, sizeof(data), 0, "/path", 0, 0),
+                make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+                false
+            )
+        );
+        msg->sending_state_ = make_object<messageSendingStatePending>();
+        tgl.reply(std::move(msg));
+    }
+
+    tgl.update(make_object<updateMessageSendSucceeded>(
+        makeMessage(
+            msgIdNew[0],
+            userIds[0],
+            chatIds[0],
+            true,
+            1,
+            make_object<messagePhoto>(
+                makePhotoLocal(fileId, sizeof(data), "/path", 0, 0),
+                make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+                false
+            )
+        ),
+        msgIdOld[0]
+    ));
+    // Still used by the other message
+    checkFile(tgl.getInputPhotoPath(0).c_str(), data, sizeof(data));
+
+    tgl.update(make_object<updateMessageSendSucceeded>(
+        makeMessage(
+            msgIdNew[1],
+            userIds[0],
+            chatIds[0],
+            true,
+            1,
+            make_object<messagePhoto>(
+                makePhotoLocal(fileId, sizeof(data), "/path", 0, 0),
+                make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+                false
+            )
+        ),
+        msgIdOld[1]
+    ));
+    ASSERT_FALSE(g_file_test(tgl.getInputPhotoPath(0).c_str(), G_FILE_TEST_EXISTS));
+}
+
+TEST_F(PrivateChatTest, SendImage_SentBefore)
+{
+    loginWithOneContact();
+
+    const int64_t msgIdOld[2] = {10, 11};
+    const int64_t msgIdNew[2] = {20, 21};
+    const int32_t fileId      = 101;
+    uint8_t data[] = {1, 2, 3, 4, 5, 6, 7};
+
+    const int id = purple_imgstore_add_with_id(arrayDup(data, sizeof(data)), sizeof(data), "filename1");
+    const std::string messageText = fmt::format("<img id=\"{}\">", id);
+
+    ASSERT_EQ(0, pluginInfo().send_im(connection, purpleUserName(0).c_str(), messageText.c_str(), PURPLE_MESSAGE_SEND));
+    tgl.verifyRequest(sendMessage(
+        chatIds[0],
+        0,
+        nullptr,
+        nullptr,
+        make_object<inputMessagePhoto>(
+            make_object<inputFileLocal>(),
+            nullptr, std::vector<std::int32_t>(), 0, 0,
+            make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+            0
+        )
+    ));
+
+    object_ptr<message> msg = makeMessage(
+        msgIdOld[0],
+        userIds[0],
+        chatIds[0],
+        true,
+        1,
+        make_object<messagePhoto>(
+            makePhotoUploading(fileId, sizeof(data), 0, "/path", 0, 0),
+            make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+            false
+        )
+    );
+    msg->sending_state_ = make_object<messageSendingStatePending>();
+    tgl.reply(std::move(msg));
+
+    tgl.update(make_object<updateMessageSendSucceeded>(
+        makeMessage(
+            msgIdNew[0],
+            userIds[0],
+            chatIds[0],
+            true,
+            1,
+            make_object<messagePhoto>(
+                makePhotoLocal(fileId, sizeof(data), "/path", 0, 0),
+                make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+                false
+            )
+        ),
+        msgIdOld[0]
+    ));
+    ASSERT_FALSE(g_file_test(tgl.getInputPhotoPath(0).c_str(), G_FILE_TEST_EXISTS));
+
+    // Same image again is sent by remote id, without writing and uploading it
+    ASSERT_EQ(0, pluginInfo().send_im(connection, purpleUserName(0).c_str(), messageText.c_str(), PURPLE_MESSAGE_SEND));
+    tgl.verifyRequest(sendMessage(
+        chatIds[0],
+        0,
+        nullptr,
+        nullptr,
+        make_object<inputMessagePhoto>(
+            make_object<inputFileRemote>("beh"),
+            nullptr, std::vector<std::int32_t>(), 0, 0,
+            make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+            0
+        )
+    ));
+    ASSERT_FALSE(g_file_test(tgl.getInputPhotoPath(0).c_str(), G_FILE_TEST_EXISTS));
+
+    // Server no longer knowing the file makes the next one upload again
+    tgl.reply(make_object<error>(400, "FILE_REFERENCE_EXPIRED"));
+    prpl.verifyEvents(
+        NewConversationEvent(PURPLE_CONV_TYPE_IM, account, purpleUserName(0)),
+        ConversationWriteEvent(purpleUserName(0), purpleUserName(0),
+                               "Failed to send message: code 400 (FILE_REFERENCE_EXPIRED)",
+                               PURPLE_MESSAGE_SYSTEM, 0)
+    );
+
+    ASSERT_EQ(0, pluginInfo().send_im(connection, purpleUserName(0).c_str(), messageText.c_str(), PURPLE_MESSAGE_SEND));
+    tgl.verifyRequest(sendMessage(
+        chatIds[0],
+        0,
+        nullptr,
+        nullptr,
+        make_object<inputMessagePhoto>(
+            make_object<inputFileLocal>(),
+            nullptr, std::vector<std::int32_t>(), 0, 0,
+            make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+            0
+        )
+    ));
+    checkFile(tgl.getInputPhotoPath(1).c_str(), data, sizeof(data));
+
+    msg = makeMessage(
+        msgIdOld[1],
+        userIds[0],
+        chatIds[0],
+        true,
+        1,
+        make_object<messagePhoto>(
+            makePhotoUploading(fileId, sizeof(data), 0, "/path", 0, 0),
+            make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+            false
+        )
+    );
+    msg->sending_state_ = make_object<messageSendingStatePending>();
+    tgl.reply(std::move(msg));
+    tgl.update(make_object<updateMessageSendSucceeded>(
+        makeMessage(
+            msgIdNew[1],
+            userIds[0],
+            chatIds[0],
+            true,
+            1,
+            make_object<messagePhoto>(
+                makePhotoLocal(fileId, sizeof(data), "/path", 0, 0),
+                make_object<formattedText>("", std::vector<object_ptr<textEntity>>()),
+                false
+            )
+        ),
+        msgIdOld[1]
+    ));
+    ASSERT_FALSE(g_file_test(tgl.getInputPhotoPath(1).c_str(), G_FILE_TEST_EXISTS));
+}
+
 TEST_F(PrivateChatTest, ReplyToOldMessage)
 {
     const int32_t date     = 10002;
@@ -944,6 +1156,68 @@ TEST_F(PrivateChatTest, MessageSendResponseError)
     );
 }
 
+TEST_F(PrivateChatTest, MessageSendResponseFloodWait)
+{
+    loginWithOneContact();
+
+    ASSERT_EQ(0, pluginInfo().send_im(connection, purpleUserName(0).c_str(), "message1", PURPLE_MESSAGE_SEND));
+    tgl.verifyRequest(sendMessage(
+        chatIds[0],
+        0,
+        nullptr,
+        nullptr,
+        make_object<inputMessageText>(
+            make_object<formattedText>("message1", std::vector<object_ptr<textEntity>>()),
+            false, false
+        )
+    ));
+
+    // Sent again once flood wait is over rather than reported as failed
+    tgl.reply(make_object<error>(429, "Too Many Requests: retry after 3"));
+    prpl.verifyEvents(
+        NewConversationEvent(PURPLE_CONV_TYPE_IM, account, purpleUserName(0)),
+        ConversationWriteEvent(
+            purpleUserName(0), purpleUserName(0),
+            "Sending messages too fast, waiting for 3 seconds",
+            PURPLE_MESSAGE_SYSTEM, 0
+        )
+    );
+
+    // Held back until flood wait is over
+    ASSERT_EQ(0, pluginInfo().send_im(connection, purpleUserName(0).c_str(), "message2", PURPLE_MESSAGE_SEND));
+    tgl.verifyNoRequests();
+
+    runTimeouts();
+    std::vector<uint64_t> requestIds = tgl.verifyRequests({
+        make_object<sendMessage>(
+            chatIds[0],
+            0,
+            nullptr,
+            nullptr,
+            make_object<inputMessageText>(
+                make_object<formattedText>("message1", std::vector<object_ptr<textEntity>>()),
+                false, false
+            )
+        ),
+        make_object<sendMessage>(
+            chatIds[0],
+            0,
+            nullptr,
+            nullptr,
+            make_object<inputMessageText>(
+                make_object<formattedText>("message2", std::vector<object_ptr<textEntity>>()),
+                false, false
+            )
+        )
+    });
+    tgl.reply(requestIds[1], make_object<error>(100, "error"));
+    prpl.verifyEvents(ConversationWriteEvent(
+        purpleUserName(0), purpleUserName(0),
+        "Failed to send message: code 100 (error)",
+        PURPLE_MESSAGE_SYSTEM, 0
+    ));
+}
+
 TEST_F(PrivateChatTest, SendMessage_SpecialCharactersAndHtml)
 {
     loginWithOneContact();
@@ -960,13 +1234,41 @@ TEST_F(PrivateChatTest, SendMessage_SpecialCharactersAndHtml)
         nullptr,
         nullptr,
         make_object<inputMessageText>(
-            // Our mock purple_unescape_html handles these two characters
             make_object<formattedText>("1<2 3>2", std::vector<object_ptr<textEntity>>()),
             false, false
         )
     ));
 }
 
+TEST_F(PrivateChatTest, SendMessage_Formatting)
+{
+    loginWithOneContact();
+
+    ASSERT_EQ(0, pluginInfo().send_im(
+        connection,
+        purpleUserName(0).c_str(),
+        "😃<b>bold <i>both</i></b><br>&#x1F603;<a href=\"https://example.com/?a=1&amp;b=2\">link</a> "
+        "<a href=\"https://example.com\">https://example.com</a>",
+        PURPLE_MESSAGE_SEND
+    ));
+
+    std::vector<object_ptr<textEntity>> entities;
+    // Offsets are in UTF-16 code units, emoji takes two
+    entities.push_back(make_object<textEntity>(2, 9, make_object<textEntityTypeBold>()));
+    entities.push_back(make_object<textEntity>(7, 4, make_object<textEntityTypeItalic>()));
+    entities.push_back(make_object<textEntity>(14, 4, make_object<textEntityTypeTextUrl>("https://example.com/?a=1&b=2")));
+    tgl.verifyRequest(sendMessage(
+        chatIds[0],
+        0,
+        nullptr,
+        nullptr,
+        make_object<inputMessageText>(
+            make_object<formattedText>("😃bold both\n😃link https://example.com", std::move(entities)),
+            false, false
+        )
+    ));
+}
+
 TEST_F(PrivateChatTest, ReceiveMessage_SpecialCharacters)
 {
     constexpr int64_t messageId = 10000;
@@ -984,7 +1286,42 @@ TEST_F(PrivateChatTest, ReceiveMessage_SpecialCharacters)
     prpl.verifyEvents(ServGotImEvent(
         connection,
         purpleUserName(0),
-        "1&lt;2 3&gt;2", // mock purple_markup_escape_text handles these two
+        "1&lt;2 3&gt;2",
+        PURPLE_MESSAGE_RECV,
+        date
+    ));
+    tgl.verifyRequest(viewMessages(chatIds[0], {messageId}, true));
+}
+
+TEST_F(PrivateChatTest, ReceiveMessage_Formatting)
+{
+    constexpr int64_t messageId = 10000;
+    constexpr int32_t date      = 123456;
+
+    loginWithOneContact();
+    std::vector<object_ptr<textEntity>> entities;
+    // Offsets are in UTF-16 code units, emoji takes two
+    entities.push_back(make_object<textEntity>(2, 9, make_object<textEntityTypeBold>()));
+    entities.push_back(make_object<textEntity>(7, 6, make_object<textEntityTypeItalic>()));
+    entities.push_back(make_object<textEntity>(14, 5, make_object<textEntityTypeMention>()));
+    entities.push_back(make_object<textEntity>(20, 4, make_object<textEntityTypeTextUrl>("https://a.b/?c&d")));
+    tgl.update(make_object<updateNewMessage>(makeMessage(
+        messageId,
+        userIds[0],
+        chatIds[0],
+        false,
+        date,
+        make_object<messageText>(
+            make_object<formattedText>("😃bold both & @user link \"<>\" 'quoted'", std::move(entities)),
+            nullptr
+        )
+    )));
+    prpl.verifyEvents(ServGotImEvent(
+        connection,
+        purpleUserName(0),
+        // Italic overlaps bold, so it is split in two
+        "😃<b>bold <i>both</i></b><i> &amp;</i> <a href=\"https://t.me/user\">@user</a> "
+        "<a href=\"https://a.b/?c&amp;d\">link</a> &quot;&lt;&gt;&quot; &apos;quoted&apos;",
         PURPLE_MESSAGE_RECV,
         date
     ));
@@ -1161,3 +1498,20 @@ TEST_F(PrivateChatTest, DisablingReadReceipts)
     setUiName("pidgin");
     testReadReceipt(true);
 }
+
+TEST_F(PrivateChatTest, UserStatusUpdatesCoalesced)
+{
+    loginWithOneContact();
+
+    tgl.update(make_object<updateUserStatus>(userIds[0], make_object<userStatusOnline>(0)));
+    tgl.update(make_object<updateUserStatus>(userIds[0], make_object<userStatusOffline>(0)));
+    tgl.update(make_object<updateUserStatus>(userIds[0], make_object<userStatusOnline>(0)));
+    prpl.verifyNoEvents();
+
+    // Only the latest status is applied
+    runTimeouts();
+    prpl.verifyEvents(UserStatusEvent(account, purpleUserName(0), PURPLE_STATUS_AVAILABLE));
+
+    runTimeouts();
+    prpl.verifyNoEvents();
+}
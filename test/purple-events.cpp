@@ -6,8 +6,12 @@ PurpleEventReceiver g_purpleEvents;
 
 void PurpleEventReceiver::addEvent(std::unique_ptr<PurpleEvent> event)
 {
-    std::cout << "Libpurple event: " << event->toString() << "\n";
-    m_events.push(std::move(event));
+    if (isMockOutputEnabled())
+        std::cout << "Libpurple event: " << event->toString() << "\n";
+    if (m_eventHook)
+        m_eventHook(*event);
+    else
+        m_events.push(std::move(event));
 }
 
 #define COMPARE(param) ASSERT_EQ(expected.param, actual.param)
@@ -211,6 +215,26 @@ static void compare(const ChatClearUsersEvent &actual, const ChatClearUsersEvent
     COMPARE(chatName);
 }
 
+static void compare(const ChatRemoveUserEvent &actual, const ChatRemoveUserEvent &expected)
+{
+    COMPARE(chatName);
+    COMPARE(user);
+}
+
+static void compare(const ChatRenameUserEvent &actual, const ChatRenameUserEvent &expected)
+{
+    COMPARE(chatName);
+    COMPARE(oldName);
+    COMPARE(newName);
+}
+
+static void compare(const ChatUserSetFlagsEvent &actual, const ChatUserSetFlagsEvent &expected)
+{
+    COMPARE(chatName);
+    COMPARE(user);
+    COMPARE(flags);
+}
+
 static void compare(const ChatSetTopicEvent &actual, const ChatSetTopicEvent &expected)
 {
     COMPARE(chatName);
@@ -345,6 +369,9 @@ static void compareEvents(const PurpleEvent &actual, const PurpleEvent &expected
         C(PresentConversation)
         C(ChatAddUser)
         C(ChatClearUsers)
+        C(ChatRemoveUser)
+        C(ChatRenameUser)
+        C(ChatUserSetFlags)
         C(ChatSetTopic)
         C(XferAccepted)
         C(XferStart)
@@ -492,6 +519,9 @@ std::string PurpleEvent::toString() const
     C(PresentConversation)
     C(ChatAddUser)
     C(ChatClearUsers)
+    C(ChatRemoveUser)
+    C(ChatRenameUser)
+    C(ChatUserSetFlags)
     C(ChatSetTopic)
     C(XferAccepted)
     C(XferStart)
@@ -8,6 +8,7 @@
 #include <queue>
 #include <iostream>
 #include <map>
+#include <functional>
 
 struct PurpleEvent;
 
@@ -30,6 +31,8 @@ public:
     void verifyEvents2(std::initializer_list<std::unique_ptr<PurpleEvent>> events);
     void verifyNoEvents();
     void discardEvents();
+    // Passes events to the hook instead of queueing them, for load tests
+    void setEventHook(std::function<void(const PurpleEvent &)> hook) { m_eventHook = std::move(hook); }
 
     void inputEnter(const gchar *value);
     void inputCancel();
@@ -54,6 +57,7 @@ private:
     }
 
     std::queue<std::unique_ptr<PurpleEvent>> m_events;
+    std::function<void(const PurpleEvent &)> m_eventHook;
     void      *inputUserData = NULL;
     GCallback  inputOkCb     = NULL;
     GCallback  inputCancelCb = NULL;
@@ -97,6 +101,9 @@ enum class PurpleEventType: uint8_t {
     PresentConversation,
     ChatAddUser,
     ChatClearUsers,
+    ChatRemoveUser,
+    ChatRenameUser,
+    ChatUserSetFlags,
     ChatSetTopic,
     XferAccepted,
     XferStart,
@@ -264,6 +271,11 @@ struct NotifyMessageEvent: PurpleEvent {
     std::string          title;
     std::string          primary;
     std::string          secondary;
+
+    NotifyMessageEvent(void *handle, PurpleNotifyMsgType type, const std::string &title,
+                       const std::string &primary, const std::string &secondary)
+    : PurpleEvent(PurpleEventType::NotifyMessage), handle(handle), type(type), title(title),
+    primary(primary), secondary(secondary) {}
 };
 
 struct UserStatusEvent: PurpleEvent {
@@ -434,6 +446,32 @@ struct ChatClearUsersEvent: PurpleEvent {
     : PurpleEvent(PurpleEventType::ChatClearUsers), chatName(chatName) {}
 };
 
+struct ChatRemoveUserEvent: PurpleEvent {
+    std::string chatName;
+    std::string user;
+
+    ChatRemoveUserEvent(const std::string &chatName, const std::string &user)
+    : PurpleEvent(PurpleEventType::ChatRemoveUser), chatName(chatName), user(user) {}
+};
+
+struct ChatRenameUserEvent: PurpleEvent {
+    std::string chatName;
+    std::string oldName;
+    std::string newName;
+
+    ChatRenameUserEvent(const std::string &chatName, const std::string &oldName, const std::string &newName)
+    : PurpleEvent(PurpleEventType::ChatRenameUser), chatName(chatName), oldName(oldName), newName(newName) {}
+};
+
+struct ChatUserSetFlagsEvent: PurpleEvent {
+    std::string              chatName;
+    std::string              user;
+    PurpleConvChatBuddyFlags flags;
+
+    ChatUserSetFlagsEvent(const std::string &chatName, const std::string &user, PurpleConvChatBuddyFlags flags)
+    : PurpleEvent(PurpleEventType::ChatUserSetFlags), chatName(chatName), user(user), flags(flags) {}
+};
+
 struct ChatSetTopicEvent: PurpleEvent {
     std::string chatName;
     std::string newTopic;
@@ -123,7 +123,6 @@ TEST_F(SupergroupTest, AddSupergroupChatAtLogin_WithMemberList_OpenChatAfterFull
     prpl.verifyEvents(
         ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
         ChatSetTopicEvent(groupChatPurpleName, "Description", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
         ChatAddUserEvent(
             groupChatPurpleName,
             // This user is not in our contact list so first/last name is used
@@ -277,7 +276,6 @@ TEST_F(SupergroupTest, ExistingSupergroupReceiveMessageAtLogin_WithMemberList_Op
         },
         {
             std::make_unique<ChatSetTopicEvent>(groupChatPurpleName, "Description", ""),
-            std::make_unique<ChatClearUsersEvent>(groupChatPurpleName),
             std::make_unique<ChatAddUserEvent>(
                 groupChatPurpleName,
                 // This user is not in our contact list so first/last name is used
@@ -370,7 +368,6 @@ TEST_F(SupergroupTest, LeaveSupergroup)
         ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatPurpleName),
         ConvSetTitleEvent(groupChatPurpleName, groupChatTitle),
         ChatSetTopicEvent(groupChatPurpleName, "", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
         ConversationWriteEvent(groupChatPurpleName, NotificationWho,
                                selfFirstName + " " + selfLastName +
                                ": Unsupported message type messageChatDeleteMember",
@@ -399,7 +396,6 @@ TEST_F(SupergroupTest, GetInviteLink)
     prpl.verifyEvents(
         ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
         ChatSetTopicEvent(groupChatPurpleName, "", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
         ConversationWriteEvent(
             groupChatPurpleName, NotificationWho,
             "Cannot generate invite link: code 100 (error)",
@@ -628,11 +624,284 @@ TEST_F(SupergroupTest, ReceiveChannelPost)
     prpl.verifyEvents(
         ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
         ChatSetTopicEvent(groupChatPurpleName, "", ""),
-        ChatClearUsersEvent(groupChatPurpleName),
         ServGotChatEvent(connection, purpleChatId, "Channel post",
                          "Hello", PURPLE_MESSAGE_RECV, date)
     );
 
 }
 
+TEST_F(SupergroupTest, MemberListPages)
+{
+    constexpr int purpleChatId = 1;
+    purple_account_set_int(account, "member-list-limit", 201);
+
+    auto firstPage = make_object<chatMembers>();
+    firstPage->total_count_ = 500;
+    firstPage->members_.push_back(makeChatMember(
+        userIds[0], userIds[1], 0, make_object<chatMemberStatusMember>(), nullptr
+    ));
+    firstPage->members_.push_back(makeChatMember(
+        userIds[1], userIds[1], 0, make_object<chatMemberStatusCreator>("", true), nullptr
+    ));
+    // Unknown users, not shown in the conversation
+    for (int i = 2; i < 200; i++)
+        firstPage->members_.push_back(makeChatMember(
+            1000 + i, userIds[1], 0, make_object<chatMemberStatusMember>(), nullptr
+        ));
+
+    auto secondPage = make_object<chatMembers>();
+    secondPage->total_count_ = 500;
+    secondPage->members_.push_back(makeChatMember(
+        selfId, userIds[1], 0, make_object<chatMemberStatusMember>(), nullptr
+    ));
+
+    login(
+        {
+            standardUpdateUser(0),
+            standardUpdateUser(1),
+            make_object<updateSupergroup>(make_object<supergroup>(
+                groupId, "", 0, make_object<chatMemberStatusMember>(), 500,
+                false, false, false, false, false, false, "", false
+            )),
+            make_object<updateNewChat>(makeChat(
+                groupChatId, make_object<chatTypeSupergroup>(groupId, false), groupChatTitle,
+                nullptr, 0, 0, 0
+            )),
+            makeUpdateChatListMain(groupChatId)
+        },
+        make_object<users>(),
+        make_object<chats>(std::vector<int64_t>(1, groupChatId)),
+        {
+            std::make_unique<AddChatEvent>(
+                groupChatPurpleName, groupChatTitle, account, nullptr, nullptr
+            ),
+        },
+        {
+            make_object<getSupergroupFullInfo>(groupId),
+            make_object<getSupergroupMembers>(
+                groupId,
+                make_object<supergroupMembersFilterRecent>(),
+                0,
+                200
+            ),
+            make_object<supergroupFullInfo>(),
+            std::move(firstPage),
+            // Limit of 201 members leaves just one for second page
+            make_object<getSupergroupMembers>(
+                groupId,
+                make_object<supergroupMembersFilterRecent>(),
+                200,
+                1
+            ),
+            std::move(secondPage),
+            make_object<getSupergroupMembers>(
+                groupId,
+                make_object<supergroupMembersFilterAdministrators>(),
+                0, 200
+            ),
+            make_object<chatMembers>()
+        }
+    );
+
+    GHashTable *components = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+    g_hash_table_insert(components, (char *)"id", g_strdup((groupChatPurpleName).c_str()));
+    pluginInfo().join_chat(connection, components);
+    g_hash_table_destroy(components);
+
+    prpl.verifyEvents(
+        ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
+        ChatSetTopicEvent(groupChatPurpleName, "", ""),
+        ChatAddUserEvent(groupChatPurpleName, userFirstNames[0] + " " + userLastNames[0],
+                         "", PURPLE_CBFLAGS_NONE, false),
+        ChatAddUserEvent(groupChatPurpleName, userFirstNames[1] + " " + userLastNames[1],
+                         "", PURPLE_CBFLAGS_FOUNDER, false),
+        ChatAddUserEvent(groupChatPurpleName, "+" + selfPhoneNumber, "", PURPLE_CBFLAGS_NONE, false)
+    );
+}
+
+TEST_F(SupergroupTest, MemberListRefreshOnMemberCountChange)
+{
+    constexpr int purpleChatId = 1;
+
+    auto members = make_object<chatMembers>();
+    members->members_.push_back(makeChatMember(
+        userIds[1], userIds[1], 0, make_object<chatMemberStatusCreator>("", true), nullptr
+    ));
+    loginWithSupergroup(nullptr, std::move(members));
+
+    GHashTable *components = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+    g_hash_table_insert(components, (char *)"id", g_strdup((groupChatPurpleName).c_str()));
+    pluginInfo().join_chat(connection, components);
+    g_hash_table_destroy(components);
+
+    prpl.verifyEvents(
+        ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
+        ChatSetTopicEvent(groupChatPurpleName, "", ""),
+        ChatAddUserEvent(groupChatPurpleName, userFirstNames[1] + " " + userLastNames[1],
+                         "", PURPLE_CBFLAGS_FOUNDER, false)
+    );
+
+    auto fullInfo = make_object<supergroupFullInfo>();
+    fullInfo->member_count_ = 2;
+    tgl.update(make_object<updateSupergroupFullInfo>(groupId, std::move(fullInfo)));
+    tgl.verifyRequest(getSupergroupMembers(
+        groupId,
+        make_object<supergroupMembersFilterRecent>(),
+        0, 200
+    ));
+    prpl.verifyEvents(ChatSetTopicEvent(groupChatPurpleName, "", ""));
+
+    members = make_object<chatMembers>();
+    members->total_count_ = 2;
+    members->members_.push_back(makeChatMember(
+        userIds[0], userIds[1], 0, make_object<chatMemberStatusMember>(), nullptr
+    ));
+    members->members_.push_back(makeChatMember(
+        userIds[1], userIds[1], 0, make_object<chatMemberStatusCreator>("", true), nullptr
+    ));
+    tgl.reply(std::move(members));
+
+    // Only the new member is added, and no administrator list is requested
+    prpl.verifyEvents(
+        ChatAddUserEvent(groupChatPurpleName, userFirstNames[0] + " " + userLastNames[0],
+                         "", PURPLE_CBFLAGS_NONE, false)
+    );
+    tgl.verifyNoRequests();
+
+    fullInfo = make_object<supergroupFullInfo>();
+    fullInfo->member_count_ = 1;
+    tgl.update(make_object<updateSupergroupFullInfo>(groupId, std::move(fullInfo)));
+    tgl.verifyRequest(getSupergroupMembers(
+        groupId,
+        make_object<supergroupMembersFilterRecent>(),
+        0, 200
+    ));
+    prpl.verifyEvents(ChatSetTopicEvent(groupChatPurpleName, "", ""));
+
+    members = make_object<chatMembers>();
+    members->total_count_ = 1;
+    members->members_.push_back(makeChatMember(
+        userIds[1], userIds[1], 0, make_object<chatMemberStatusCreator>("", true), nullptr
+    ));
+    tgl.reply(std::move(members));
+
+    // The page holds the whole group, so whoever is missing from it has left
+    prpl.verifyEvents(
+        ChatRemoveUserEvent(groupChatPurpleName, userFirstNames[0] + " " + userLastNames[0])
+    );
+    tgl.verifyNoRequests();
+}
+
+TEST_F(SupergroupTest, MemberListLimit_KeepsAdministrators)
+{
+    constexpr int purpleChatId = 1;
+    purple_account_set_int(account, "member-list-limit", 1);
+
+    auto members = make_object<chatMembers>();
+    members->total_count_ = 3;
+    members->members_.push_back(makeChatMember(
+        userIds[0], userIds[1], 0, make_object<chatMemberStatusMember>(), nullptr
+    ));
+    auto admins = make_object<chatMembers>();
+    admins->total_count_ = 1;
+    admins->members_.push_back(makeChatMember(
+        userIds[1], userIds[1], 0, make_object<chatMemberStatusCreator>("", true), nullptr
+    ));
+
+    login(
+        {
+            standardUpdateUser(0),
+            standardUpdateUser(1),
+            make_object<updateSupergroup>(make_object<supergroup>(
+                groupId, "", 0, make_object<chatMemberStatusMember>(), 3,
+                false, false, false, false, false, false, "", false
+            )),
+            make_object<updateNewChat>(makeChat(
+                groupChatId, make_object<chatTypeSupergroup>(groupId, false), groupChatTitle,
+                nullptr, 0, 0, 0
+            )),
+            makeUpdateChatListMain(groupChatId)
+        },
+        make_object<users>(),
+        make_object<chats>(std::vector<int64_t>(1, groupChatId)),
+        {
+            std::make_unique<AddChatEvent>(
+                groupChatPurpleName, groupChatTitle, account, nullptr, nullptr
+            ),
+        },
+        {
+            make_object<getSupergroupFullInfo>(groupId),
+            make_object<getSupergroupMembers>(
+                groupId,
+                make_object<supergroupMembersFilterRecent>(),
+                0,
+                1
+            ),
+            make_object<supergroupFullInfo>(),
+            std::move(members),
+            make_object<getSupergroupMembers>(
+                groupId,
+                make_object<supergroupMembersFilterAdministrators>(),
+                0, 200
+            ),
+            std::move(admins)
+        }
+    );
+
+    GHashTable *components = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+    g_hash_table_insert(components, (char *)"id", g_strdup((groupChatPurpleName).c_str()));
+    pluginInfo().join_chat(connection, components);
+    g_hash_table_destroy(components);
+
+    prpl.verifyEvents(
+        ServGotJoinedChatEvent(connection, purpleChatId, groupChatPurpleName, groupChatTitle),
+        ChatSetTopicEvent(groupChatPurpleName, "", ""),
+        ChatAddUserEvent(groupChatPurpleName, userFirstNames[0] + " " + userLastNames[0],
+                         "", PURPLE_CBFLAGS_NONE, false),
+        ChatAddUserEvent(groupChatPurpleName, userFirstNames[1] + " " + userLastNames[1],
+                         "", PURPLE_CBFLAGS_FOUNDER, false)
+    );
+
+    auto fullInfo = make_object<supergroupFullInfo>();
+    fullInfo->member_count_ = 4;
+    tgl.update(make_object<updateSupergroupFullInfo>(groupId, std::move(fullInfo)));
+    tgl.verifyRequest(getSupergroupMembers(
+        groupId,
+        make_object<supergroupMembersFilterRecent>(),
+        0, 1
+    ));
+    prpl.verifyEvents(ChatSetTopicEvent(groupChatPurpleName, "", ""));
+
+    members = make_object<chatMembers>();
+    members->total_count_ = 4;
+    members->members_.push_back(makeChatMember(
+        selfId, userIds[1], 0, make_object<chatMemberStatusMember>(), nullptr
+    ));
+    tgl.reply(std::move(members));
+
+    // Newest member pushes the previous one out of the limit, but the creator stays
+    prpl.verifyEvents(
+        ChatRemoveUserEvent(groupChatPurpleName, userFirstNames[0] + " " + userLastNames[0]),
+        ChatAddUserEvent(groupChatPurpleName, "+" + selfPhoneNumber, "", PURPLE_CBFLAGS_NONE, false)
+    );
+    tgl.verifyNoRequests();
+}
+
+TEST_F(SupergroupTest, ChatRemovedFromBuddyListByUser)
+{
+    loginWithSupergroup();
+
+    PurpleChat *chat = purple_blist_find_chat(account, groupChatPurpleName.c_str());
+    ASSERT_NE(nullptr, chat);
+    purple_blist_remove_chat(chat);
+    prpl.verifyEvents(RemoveChatEvent(groupChatPurpleName, ""));
+
+    // Chat is added again, rather than being found under its old pointer
+    tgl.update(make_object<updateSupergroup>(make_object<supergroup>(
+        groupId, "", 0, make_object<chatMemberStatusMember>(), 2,
+        false, false, false, false, false, false, "", false
+    )));
+    prpl.verifyEvents(AddChatEvent(groupChatPurpleName, groupChatTitle, account, nullptr, nullptr));
+}
+
 Test non-user member
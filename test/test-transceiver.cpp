@@ -1,4 +1,5 @@
 #include "test-transceiver.h"
+#include "libpurple-mock.h"
 #include "printout.h"
 #include "buildopt.h"
 #include <gtest/gtest.h>
@@ -10,7 +11,8 @@ void TestTransceiver::send(td::Client::Request &&request)
 {
     ASSERT_EQ(expectedRequestId, request.id);
     expectedRequestId++;
-    std::cout << "Received: " << requestToString(*request.function) << std::endl;
+    if (isMockOutputEnabled())
+        std::cout << "Received: " << requestToString(*request.function) << std::endl;
     m_requests.push(std::move(request));
 }
 
@@ -54,6 +56,12 @@ void TestTransceiver::verifyRequests(const std::vector<const td::td_api::Functio
     verifyNoRequests();
 }
 
+void TestTransceiver::reserveId(uint64_t id)
+{
+    ASSERT_EQ(expectedRequestId, id);
+    expectedRequestId++;
+}
+
 guint TestTransceiver::addTimeout(guint interval, GSourceFunc function, gpointer data)
 {
     m_timers.emplace_back();
@@ -73,11 +81,22 @@ void TestTransceiver::cancelTimer(guint id)
 
 void TestTransceiver::runTimeouts()
 {
-    std::cout << "Waiting for all timeouts\n";
+    if (isMockOutputEnabled())
+        std::cout << "Waiting for all timeouts\n";
+    // Callbacks may add and cancel timers. Ones added here are left for the next call.
+    std::vector<guint> timerIds;
     for (const TimerInfo &timer: m_timers)
+        timerIds.push_back(timer.id);
+
+    for (guint id: timerIds) {
+        auto it = std::find_if(m_timers.begin(), m_timers.end(),
+                               [id](const TimerInfo &timer) { return (timer.id == id); });
+        if (it == m_timers.end())
+            continue;
+        TimerInfo timer = *it;
+        m_timers.erase(it);
         while (timer.function(timer.data)) ;
-
-    m_timers.clear();
+    }
 }
 
 #define COMPARE(param) ASSERT_EQ(expected.param, actual.param)
@@ -151,8 +170,16 @@ static void compare(const object_ptr<formattedText> &actual, const object_ptr<fo
     if (!actual) return;
 
     ASSERT_EQ(expected->text_, actual->text_);
-    ASSERT_TRUE(actual->entities_.empty()) << "not supported";
-    ASSERT_TRUE(expected->entities_.empty()) << "not supported";
+    ASSERT_EQ(expected->entities_.size(), actual->entities_.size());
+    for (unsigned i = 0; i < actual->entities_.size(); i++) {
+        ASSERT_EQ(expected->entities_[i]->offset_, actual->entities_[i]->offset_);
+        ASSERT_EQ(expected->entities_[i]->length_, actual->entities_[i]->length_);
+        ASSERT_NE(nullptr, actual->entities_[i]->type_);
+        ASSERT_EQ(expected->entities_[i]->type_->get_id(), actual->entities_[i]->type_->get_id());
+        if (actual->entities_[i]->type_->get_id() == textEntityTypeTextUrl::ID)
+            ASSERT_EQ(static_cast<const textEntityTypeTextUrl &>(*expected->entities_[i]->type_).url_,
+                      static_cast<const textEntityTypeTextUrl &>(*actual->entities_[i]->type_).url_);
+    }
 }
 
 static void compare(const inputMessageText &actual,
@@ -178,6 +205,10 @@ static void compare(const object_ptr<InputFile> &actual, const object_ptr<InputF
             ASSERT_EQ(static_cast<const inputFileId &>(*expected).id_,
                       static_cast<const inputFileId &>(*actual).id_);
             break;
+        case td::td_api::inputFileRemote::ID:
+            ASSERT_EQ(static_cast<const inputFileRemote &>(*expected).id_,
+                      static_cast<const inputFileRemote &>(*actual).id_);
+            break;
         default:
             ASSERT_TRUE(false) << "not supported";
     }
@@ -210,6 +241,8 @@ static void compare(const inputMessagePhoto &actual, const inputMessagePhoto &ex
         COMPARE(photo_->get_id());
         if (actual.photo_->get_id() == inputFileLocal::ID)
             m_inputPhotoPaths.push_back(static_cast<const inputFileLocal &>(*actual.photo_).path_);
+        else
+            compare(actual.photo_, expected.photo_);
     }
 }
 
@@ -248,6 +281,26 @@ static void compare(const sendMessage &actual, const sendMessage &expected,
     compare(actual.input_message_content_, expected.input_message_content_, m_inputPhotoPaths);
 }
 
+static void compare(const sendMessageAlbum &actual, const sendMessageAlbum &expected,
+                    std::vector<std::string> &m_inputPhotoPaths)
+{
+    COMPARE(chat_id_);
+    COMPARE(reply_to_message_id_);
+
+    compare(actual.options_, expected.options_);
+    COMPARE(input_message_contents_.size());
+    for (unsigned i = 0; i < actual.input_message_contents_.size(); i++)
+        compare(actual.input_message_contents_[i], expected.input_message_contents_[i], m_inputPhotoPaths);
+}
+
+static void compare(const resendMessages &actual, const resendMessages &expected)
+{
+    COMPARE(chat_id_);
+    COMPARE(message_ids_.size());
+    for (unsigned i = 0; i < actual.message_ids_.size(); i++)
+        COMPARE(message_ids_[i]);
+}
+
 static void compare(const getBasicGroupFullInfo &actual, const getBasicGroupFullInfo &expected)
 {
     COMPARE(basic_group_id_);
@@ -479,6 +532,19 @@ static void compare(const getChatHistory &actual, const getChatHistory &expected
     COMPARE(only_local_);
 }
 
+static void compare(const optimizeStorage &actual, const optimizeStorage &expected)
+{
+    COMPARE(size_);
+    COMPARE(ttl_);
+    COMPARE(count_);
+    COMPARE(immunity_delay_);
+    COMPARE(file_types_.size());
+    COMPARE(chat_ids_);
+    COMPARE(exclude_chat_ids_);
+    COMPARE(return_deleted_file_statistics_);
+    COMPARE(chat_limit_);
+}
+
 static void compareRequests(const Function &actual, const Function &expected,
                             std::vector<std::string> &m_inputPhotoPaths)
 {
@@ -502,6 +568,11 @@ static void compareRequests(const Function &actual, const Function &expected,
             compare(static_cast<const sendMessage &>(actual), static_cast<const sendMessage &>(expected),
                     m_inputPhotoPaths);
             break;
+        case sendMessageAlbum::ID:
+            compare(static_cast<const sendMessageAlbum &>(actual), static_cast<const sendMessageAlbum &>(expected),
+                    m_inputPhotoPaths);
+            break;
+        C(resendMessages)
         C(getBasicGroupFullInfo)
         C(joinChatByInviteLink)
         C(importContacts)
@@ -532,6 +603,7 @@ static void compareRequests(const Function &actual, const Function &expected,
         C(joinChat)
         C(createNewSecretChat)
         C(getChatHistory)
+        C(optimizeStorage)
         default: ASSERT_TRUE(false) << "Unsupported request " << requestToString(actual);
     }
 }
@@ -544,6 +616,14 @@ void TestTransceiver::verifyRequestImpl(const Function &request)
     compareRequests(*m_requests.front().function, request, m_inputPhotoPaths);
 }
 
+std::vector<td::Client::Request> TestTransceiver::takeRequests()
+{
+    std::vector<td::Client::Request> requests;
+    for (; !m_requests.empty(); m_requests.pop())
+        requests.push_back(std::move(m_requests.front()));
+    return requests;
+}
+
 void TestTransceiver::verifyNoRequests()
 {
     ASSERT_TRUE(m_requests.empty()) << "Unexpected request: " << requestToString(*m_requests.front().function);
@@ -551,7 +631,8 @@ void TestTransceiver::verifyNoRequests()
 
 void TestTransceiver::update(object_ptr<Object> object)
 {
-    std::cout << "Sending update: " << responseToString(*object) << "\n";
+    if (isMockOutputEnabled())
+        std::cout << "Sending update: " << responseToString(*object) << "\n";
     receive({0, std::move(object)});
 }
 
@@ -564,7 +645,8 @@ void TestTransceiver::reply(object_ptr<Object> object)
 
 void TestTransceiver::reply(uint64_t requestId, td::td_api::object_ptr<td::td_api::Object> object)
 {
-    std::cout << "Replying to request " << requestId << ": " << responseToString(*object) << "\n";
+    if (isMockOutputEnabled())
+        std::cout << "Replying to request " << requestId << ": " << responseToString(*object) << "\n";
     receive({requestId, std::move(object)});
 }
 
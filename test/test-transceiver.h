@@ -10,6 +10,7 @@ public:
     void  send(td::Client::Request &&request) override;
     guint addTimeout(guint interval, GSourceFunc function, gpointer data) override;
     void  cancelTimer(guint id) override;
+    void  reserveId(uint64_t id) override;
     void  runTimeouts();
 
     // Check that given requests, and no others, have been received, and clear the queue
@@ -17,6 +18,8 @@ public:
     std::vector<uint64_t> verifyRequests(std::initializer_list<td::td_api::object_ptr<td::td_api::Function>> requests);
     void verifyRequests(const std::vector<const td::td_api::Function *> requests);
     void verifyNoRequests();
+    // Takes all received requests without checking them, for driving the client in benchmarks
+    std::vector<td::Client::Request> takeRequests();
 
     void update(td::td_api::object_ptr<td::td_api::Object> object);
 
@@ -0,0 +1,289 @@
+#include "fixture.h"
+#include "trace.h"
+#include "purple-info.h"
+#include <glib/gstdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+class TraceTest: public CommTest {};
+
+namespace {
+
+// Just enough JSON to check what Trace::save writes
+struct JsonValue {
+    enum class Type {
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object
+    };
+    Type                                           type   = Type::Null;
+    double                                         number = 0;
+    std::string                                    string;
+    std::vector<JsonValue>                         array;
+    std::vector<std::pair<std::string, JsonValue>> object;
+
+    const JsonValue *get(const char *key) const
+    {
+        for (const auto &member: object)
+            if (member.first == key)
+                return &member.second;
+        return nullptr;
+    }
+};
+
+class JsonParser {
+public:
+    JsonParser(const std::string &text) : m_text(text) {}
+
+    // Returns false unless the whole text is one well-formed value
+    bool parse(JsonValue &value)
+    {
+        if (!parseValue(value))
+            return false;
+        skipSpace();
+        return (m_pos == m_text.size());
+    }
+private:
+    const std::string &m_text;
+    size_t             m_pos = 0;
+
+    void skipSpace()
+    {
+        while ((m_pos < m_text.size()) && isspace((unsigned char)m_text[m_pos]))
+            m_pos++;
+    }
+
+    bool consume(char c)
+    {
+        skipSpace();
+        if ((m_pos < m_text.size()) && (m_text[m_pos] == c)) {
+            m_pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool consumeLiteral(const char *literal)
+    {
+        if (m_text.compare(m_pos, strlen(literal), literal) != 0)
+            return false;
+        m_pos += strlen(literal);
+        return true;
+    }
+
+    bool parseValue(JsonValue &value)
+    {
+        skipSpace();
+        if (m_pos >= m_text.size())
+            return false;
+
+        char c = m_text[m_pos];
+        if (c == '{')
+            return parseObject(value);
+        if (c == '[')
+            return parseArray(value);
+        if (c == '"') {
+            value.type = JsonValue::Type::String;
+            return parseString(value.string);
+        }
+        if ((c == '-') || isdigit((unsigned char)c))
+            return parseNumber(value);
+        if (consumeLiteral("true") || consumeLiteral("false")) {
+            value.type = JsonValue::Type::Bool;
+            return true;
+        }
+        return consumeLiteral("null");
+    }
+
+    bool parseString(std::string &result)
+    {
+        m_pos++;
+        while (m_pos < m_text.size()) {
+            char c = m_text[m_pos++];
+            if (c == '"')
+                return true;
+            if ((unsigned char)c < 0x20)
+                return false;
+            if (c == '\\') {
+                if ((m_pos >= m_text.size()) || !strchr("\"\\/bfnrt", m_text[m_pos]))
+                    return false;
+                c = m_text[m_pos++];
+            }
+            result += c;
+        }
+        return false;
+    }
+
+    bool parseNumber(JsonValue &value)
+    {
+        const char *start = m_text.c_str() + m_pos;
+        char       *end   = nullptr;
+        value.type   = JsonValue::Type::Number;
+        value.number = strtod(start, &end);
+        if (end == start)
+            return false;
+        m_pos += end - start;
+        return true;
+    }
+
+    bool parseArray(JsonValue &value)
+    {
+        value.type = JsonValue::Type::Array;
+        m_pos++;
+        if (consume(']'))
+            return true;
+        do {
+            value.array.emplace_back();
+            if (!parseValue(value.array.back()))
+                return false;
+        } while (consume(','));
+        return consume(']');
+    }
+
+    bool parseObject(JsonValue &value)
+    {
+        value.type = JsonValue::Type::Object;
+        m_pos++;
+        if (consume('}'))
+            return true;
+        do {
+            skipSpace();
+            value.object.emplace_back();
+            if ((m_pos >= m_text.size()) || (m_text[m_pos] != '"') ||
+                !parseString(value.object.back().first) || !consume(':') ||
+                !parseValue(value.object.back().second))
+            {
+                return false;
+            }
+        } while (consume(','));
+        return consume('}');
+    }
+};
+
+}
+
+static void saveTrace(JsonValue &trace)
+{
+    gchar      *path = g_build_filename(g_get_tmp_dir(), "tdlib-purple-test-trace.json", NULL);
+    std::string errorMessage;
+    bool        saved = Trace::save(path, errorMessage);
+    EXPECT_TRUE(saved) << errorMessage;
+
+    gchar *contents = NULL;
+    gsize  length   = 0;
+    if (saved && g_file_get_contents(path, &contents, &length, NULL)) {
+        std::string text(contents, length);
+        EXPECT_TRUE(JsonParser(text).parse(trace)) << text;
+    }
+
+    g_free(contents);
+    g_unlink(path);
+    g_free(path);
+}
+
+static std::string getString(const JsonValue &object, const char *key)
+{
+    const JsonValue *value = object.get(key);
+    EXPECT_TRUE(value && (value->type == JsonValue::Type::String)) << key;
+    return (value && (value->type == JsonValue::Type::String)) ? value->string : "";
+}
+
+static double getNumber(const JsonValue &object, const char *key)
+{
+    const JsonValue *value = object.get(key);
+    EXPECT_TRUE(value && (value->type == JsonValue::Type::Number)) << key;
+    return (value && (value->type == JsonValue::Type::Number)) ? value->number : -1;
+}
+
+// Spans after the thread name metadata event
+static std::vector<const JsonValue *> getSpans(const JsonValue &trace)
+{
+    std::vector<const JsonValue *> spans;
+    EXPECT_EQ("ms", getString(trace, "displayTimeUnit"));
+    const JsonValue *events = trace.get("traceEvents");
+    EXPECT_TRUE(events && (events->type == JsonValue::Type::Array));
+    if (!events || events->array.empty())
+        return spans;
+
+    const JsonValue &metadata = events->array[0];
+    EXPECT_EQ("thread_name", getString(metadata, "name"));
+    EXPECT_EQ("M", getString(metadata, "ph"));
+    for (size_t i = 1; i < events->array.size(); i++) {
+        const JsonValue &span = events->array[i];
+        EXPECT_EQ("X", getString(span, "ph"));
+        EXPECT_LE(0, getNumber(span, "ts"));
+        EXPECT_LE(0, getNumber(span, "dur"));
+        // Everything here runs on main thread
+        EXPECT_EQ(getNumber(metadata, "tid"), getNumber(span, "tid"));
+        spans.push_back(&span);
+    }
+    return spans;
+}
+
+TEST_F(TraceTest, SaveRecordedSpans)
+{
+    {
+        TRACE_SPAN("beforeStart");
+    }
+
+    Trace::retain();
+    Trace::addSpan("first", 1000, 1500, nullptr, 0);
+    {
+        TRACE_SPAN("second", "count", 1);
+    }
+    {
+        TRACE_SPAN("third");
+    }
+    Trace::release();
+
+    // Stopping keeps the timeline for saving, but nothing more is recorded
+    {
+        TRACE_SPAN("afterStop");
+    }
+
+    JsonValue trace;
+    saveTrace(trace);
+    std::vector<const JsonValue *> spans = getSpans(trace);
+    ASSERT_EQ(3u, spans.size());
+
+    ASSERT_EQ("first", getString(*spans[0], "name"));
+    ASSERT_EQ(1000, getNumber(*spans[0], "ts"));
+    ASSERT_EQ(500, getNumber(*spans[0], "dur"));
+    ASSERT_EQ(nullptr, spans[0]->get("args"));
+
+    ASSERT_EQ("second", getString(*spans[1], "name"));
+    ASSERT_LE(getNumber(*spans[1], "ts"), getNumber(*spans[2], "ts"));
+    const JsonValue *args = spans[1]->get("args");
+    ASSERT_NE(nullptr, args);
+    ASSERT_EQ(1, getNumber(*args, "count"));
+
+    ASSERT_EQ("third", getString(*spans[2], "name"));
+    ASSERT_EQ(nullptr, spans[2]->get("args"));
+
+    // Starting again discards previous timeline
+    Trace::retain();
+    Trace::release();
+    trace = JsonValue();
+    saveTrace(trace);
+    ASSERT_TRUE(getSpans(trace).empty());
+}
+
+TEST_F(TraceTest, RecordTimeline)
+{
+    purple_account_set_bool(account, AccountOptions::RecordTimeline, TRUE);
+    loginWithOneContact();
+    pluginInfo().close(connection);
+    ASSERT_FALSE(Trace::enabled());
+
+    JsonValue trace;
+    saveTrace(trace);
+    std::vector<const JsonValue *> spans = getSpans(trace);
+    ASSERT_NE(spans.end(), std::find_if(spans.begin(), spans.end(), [](const JsonValue *span) {
+        return (span->get("name") && (span->get("name")->string == "updateAuthorizationState"));
+    }));
+}
@@ -0,0 +1,117 @@
+#include "trace.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> Trace::s_enabled{false};
+
+namespace {
+
+struct TraceEvent {
+    const char *name;
+    const char *argName;
+    int64_t     arg;
+    gint64      start;
+    gint64      duration;
+    unsigned    thread;
+};
+
+enum {
+    // Roughly 3 MB
+    MAX_EVENTS = 65536
+};
+
+}
+
+// Spans come from worker threads too, but rarely enough that a mutex is fine
+static std::mutex              g_traceMutex;
+static std::vector<TraceEvent> g_events;
+static uint64_t                g_eventCount   = 0;
+static int                     g_recorders    = 0;
+static unsigned                g_mainThread   = 0;
+static std::atomic<unsigned>   g_lastThreadId{0};
+
+static unsigned getThreadId()
+{
+    static thread_local unsigned id = ++g_lastThreadId;
+    return id;
+}
+
+void Trace::retain()
+{
+    std::lock_guard<std::mutex> lock(g_traceMutex);
+    if (g_recorders++ == 0) {
+        g_events.resize(MAX_EVENTS);
+        g_eventCount = 0;
+        // Always called from glib main thread
+        g_mainThread = getThreadId();
+        s_enabled = true;
+    }
+}
+
+void Trace::release()
+{
+    std::lock_guard<std::mutex> lock(g_traceMutex);
+    if (--g_recorders == 0)
+        s_enabled = false;
+}
+
+void Trace::addSpan(const char *name, gint64 start, gint64 end, const char *argName, int64_t arg)
+{
+    unsigned                    thread = getThreadId();
+    std::lock_guard<std::mutex> lock(g_traceMutex);
+    if (g_events.empty())
+        return;
+
+    TraceEvent &event = g_events[g_eventCount++ % MAX_EVENTS];
+    event.name     = name;
+    event.argName  = argName;
+    event.arg      = arg;
+    event.start    = start;
+    event.duration = end - start;
+    event.thread   = thread;
+}
+
+bool Trace::save(const char *path, std::string &errorMessage)
+{
+    std::vector<TraceEvent> events;
+    unsigned                mainThread;
+    {
+        std::lock_guard<std::mutex> lock(g_traceMutex);
+        uint64_t start = (g_eventCount > MAX_EVENTS) ? g_eventCount - MAX_EVENTS : 0;
+        events.reserve(g_eventCount - start);
+        for (uint64_t i = start; i < g_eventCount; i++)
+            events.push_back(g_events[i % MAX_EVENTS]);
+        mainThread = g_mainThread;
+    }
+
+    // Names are string literals from our own code, so nothing needs escaping
+    std::string contents = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    char        line[256];
+    snprintf(line, sizeof(line),
+             "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"main loop\"}}",
+             mainThread);
+    contents += line;
+
+    for (const TraceEvent &event: events) {
+        snprintf(line, sizeof(line),
+                 ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%" G_GINT64_FORMAT
+                 ",\"dur\":%" G_GINT64_FORMAT, event.name, event.thread, event.start, event.duration);
+        contents += line;
+        if (event.argName) {
+            snprintf(line, sizeof(line), ",\"args\":{\"%s\":%" PRId64 "}", event.argName, event.arg);
+            contents += line;
+        }
+        contents += '}';
+    }
+    contents += "\n]}\n";
+
+    GError *error = NULL;
+    if (!g_file_set_contents(path, contents.c_str(), contents.size(), &error)) {
+        errorMessage = error->message;
+        g_error_free(error);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <glib.h>
+#include <atomic>
+#include <string>
+
+// Timeline of what the plugin spends its time on, saved in Chrome trace event format (opens in
+// ui.perfetto.dev or chrome://tracing). Spans are only recorded while at least one account or the
+// timeline command has asked for it, into a fixed-size buffer that keeps the most recent ones.
+class Trace {
+public:
+    static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    // Starting when nobody was recording discards previous timeline; stopping keeps it for saving
+    static void retain();
+    static void release();
+
+    // Times are from g_get_monotonic_time. Names must be string literals.
+    static void addSpan(const char *name, gint64 start, gint64 end, const char *argName, int64_t arg);
+    static bool save(const char *path, std::string &errorMessage);
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+class TraceSpan {
+public:
+    TraceSpan(const char *name, const char *argName = nullptr, int64_t arg = 0)
+    :   m_name(name),
+        m_argName(argName),
+        m_arg(arg),
+        m_recording(Trace::enabled()),
+        m_start(m_recording ? g_get_monotonic_time() : 0)
+    {
+    }
+
+    ~TraceSpan()
+    {
+        if (m_recording)
+            Trace::addSpan(m_name, m_start, g_get_monotonic_time(), m_argName, m_arg);
+    }
+
+    // For values only known at the end, like number of items processed
+    void setArg(const char *argName, int64_t arg)
+    {
+        m_argName = argName;
+        m_arg     = arg;
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+private:
+    const char *m_name;
+    const char *m_argName;
+    int64_t     m_arg;
+    bool        m_recording;
+    gint64      m_start;
+};
+
+#define TRACE_SPAN_NAME2(line) traceSpan##line
+#define TRACE_SPAN_NAME(line)  TRACE_SPAN_NAME2(line)
+// Span from here until the end of enclosing block
+#define TRACE_SPAN(...) TraceSpan TRACE_SPAN_NAME(__LINE__)(__VA_ARGS__)
+
+#endif
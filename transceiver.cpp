@@ -1,6 +1,9 @@
 #include "transceiver.h"
 #include "config.h"
+#include "debug-log.h"
 #include "purple-info.h"
+#include "trace.h"
+#include "translate.h"
 #include <algorithm>
 #include <assert.h>
 
@@ -55,7 +58,7 @@ TdTransceiverImpl::TdTransceiverImpl(PurpleTdClient *owner, TdTransceiver::Updat
 
 TdTransceiverImpl::~TdTransceiverImpl()
 {
-    purple_debug_misc(config::pluginId, "Destroyed TdTransceiverImpl\n");
+    DEBUG_MISC("Destroyed TdTransceiverImpl\n");
 }
 
 void TdTransceiverImpl::cancelTimer(uint64_t requestId)
@@ -120,7 +123,7 @@ TdTransceiver::~TdTransceiver()
     // Since poll thread is no longer running, there is no need to lock the mutex before decrementing
     // shared pointer reference count
     m_impl.reset();
-    purple_debug_misc(config::pluginId, "Destroyed TdTransceiver\n");
+    DEBUG_MISC("Destroyed TdTransceiver\n");
 }
 
 void *TdTransceiver::queueResponse(td::Client::Response &&response)
@@ -143,23 +146,30 @@ void TdTransceiver::pollThreadLoop()
                     break;
                 }
             }
-            // Passing shared pointer through glib event queue using pointer to pointer seems funky,
-            // but it works
-            void *implRef;
-            {
-                std::unique_lock<std::mutex> lock(m_impl->m_rxMutex);
-                implRef = queueResponse(std::move(response));
-            }
-            g_idle_add(TdTransceiverImpl::rxCallback, implRef);
+            postResponse(std::move(response));
         }
     }
 }
 
+void TdTransceiver::postResponse(td::Client::Response &&response)
+{
+    // Passing shared pointer through glib event queue using pointer to pointer seems funky,
+    // but it works
+    void *implRef;
+    {
+        std::unique_lock<std::mutex> lock(m_impl->m_rxMutex);
+        implRef = queueResponse(std::move(response));
+    }
+    g_idle_add(TdTransceiverImpl::rxCallback, implRef);
+}
+
 int TdTransceiverImpl::rxCallback(gpointer user_data)
 {
     std::shared_ptr<TdTransceiverImpl> *ppSelf =
         static_cast<std::shared_ptr<TdTransceiverImpl> *>(user_data);
     std::shared_ptr<TdTransceiverImpl> &self = *ppSelf;
+    TraceSpan batchSpan("rxCallback");
+    int64_t responseCount = 0;
 
     while (1) {
         td::Client::Response response;
@@ -170,6 +180,7 @@ int TdTransceiverImpl::rxCallback(gpointer user_data)
             response = std::move(self->m_rxQueue.front());
             self->m_rxQueue.erase(self->m_rxQueue.begin());
         }
+        responseCount++;
 
         self->cancelTimer(response.id);
 
@@ -177,9 +188,8 @@ int TdTransceiverImpl::rxCallback(gpointer user_data)
             ; // impossible
         else if (!self->m_owner)
             // m_owner will be NULL if this callback is invoked after TdTransceiver destructor
-            purple_debug_misc(config::pluginId,
-                              "Ignoring response (object id %d) as transceiver is already destroyed\n",
-                              (int)response.object->get_id());
+            DEBUG_MISC("Ignoring response (object id %d) as transceiver is already destroyed\n",
+                       (int)response.object->get_id());
         else if (response.id == 0)
             ((self->m_owner)->*(self->m_updateCb))(*response.object);
         else {
@@ -189,12 +199,15 @@ int TdTransceiverImpl::rxCallback(gpointer user_data)
                 callback = it->second;
                 self->m_responseHandlers.erase(it);
             } else
-                purple_debug_misc(config::pluginId, "Ignoring response to request %" G_GUINT64_FORMAT "\n",
-                                  response.id);
-            if (callback)
+                DEBUG_MISC("Ignoring response to request %" G_GUINT64_FORMAT "\n",
+                           response.id);
+            if (callback) {
+                TRACE_SPAN("response", "requestId", response.id);
                 callback(response.id, std::move(response.object));
+            }
         }
     }
+    batchSpan.setArg("responses", responseCount);
 
     std::unique_lock<std::mutex> lock(self->m_rxMutex, std::defer_lock);
     // owner=NULL means TdTransceiver has been destroyed, so the poll thread is no longer running
@@ -211,7 +224,7 @@ int TdTransceiverImpl::rxCallback(gpointer user_data)
 uint64_t TdTransceiver::sendQuery(td::td_api::object_ptr<td::td_api::Function> f, ResponseCb2 handler)
 {
     uint64_t queryId = ++m_impl->m_lastQueryId;
-    purple_debug_misc(config::pluginId, "Sending query id %lu\n", (unsigned long)queryId);
+    DEBUG_TRACE("Sending query id %lu\n", (unsigned long)queryId);
     if (handler)
         m_impl->m_responseHandlers.emplace(queryId, std::move(handler));
     if (m_testBackend)
@@ -271,6 +284,19 @@ void TdTransceiver::setQueryTimer(uint64_t queryId, ResponseCb handler, unsigned
                   }, timeoutSeconds, cancelNormalResponse);
 }
 
+uint64_t TdTransceiver::reserveQueryId()
+{
+    uint64_t queryId = ++m_impl->m_lastQueryId;
+    if (m_testBackend)
+        m_testBackend->reserveId(queryId);
+    return queryId;
+}
+
+void TdTransceiver::cancelQueryTimer(uint64_t queryId)
+{
+    m_impl->cancelTimer(queryId);
+}
+
 gboolean TdTransceiver::timerCallback(gpointer userdata)
 {
     TimerCallbackData *data        = static_cast<TimerCallbackData *>(userdata);
@@ -285,7 +311,42 @@ gboolean TdTransceiver::timerCallback(gpointer userdata)
     return FALSE; // one-time callback
 }
 
+void TdTransceiver::getMemoryUsage(MemoryReport &report) const
+{
+    // Received objects are not counted, as they don't stay in the queue for long
+    MemoryUsage rxQueue;
+    {
+        std::unique_lock<std::mutex> lock(m_impl->m_rxMutex);
+        rxQueue.add(m_impl->m_rxQueue.capacity() * sizeof(td::Client::Response), m_impl->m_rxQueue.size());
+    }
+    // TRANSLATOR: Memory report item, followed by count and size of data received from Telegram library and not processed yet
+    report.push_back({_("Received objects waiting for main loop"), rxQueue});
+
+    MemoryUsage handlers;
+    for (const auto &item: m_impl->m_responseHandlers)
+        handlers.add(MAP_NODE_OVERHEAD + sizeof(item));
+    // TRANSLATOR: Memory report item, followed by count and size of callbacks waiting for answers from Telegram library
+    report.push_back({_("Response handlers"), handlers});
+
+    MemoryUsage timers;
+    for (const TimerInfo &timer: m_impl->m_timers)
+        timers.add(sizeof(timer) + sizeof(*timer.data));
+    // TRANSLATOR: Memory report item, followed by count and size of scheduled actions
+    report.push_back({_("Timers"), timers});
+}
+
 void ITransceiverBackend::receive(td::Client::Response response)
 {
-    TdTransceiverImpl::rxCallback(m_owner->queueResponse(std::move(response)));
+    // Other threads may be posting at the same time
+    void *implRef;
+    {
+        std::unique_lock<std::mutex> lock(m_owner->m_impl->m_rxMutex);
+        implRef = m_owner->queueResponse(std::move(response));
+    }
+    TdTransceiverImpl::rxCallback(implRef);
+}
+
+void ITransceiverBackend::post(td::Client::Response response)
+{
+    m_owner->postResponse(std::move(response));
 }
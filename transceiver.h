@@ -1,6 +1,7 @@
 #ifndef _TRANSCEIVER_H
 #define _TRANSCEIVER_H
 
+#include "memory-usage.h"
 #include <td/telegram/Client.h>
 #include <td/telegram/td_api.hpp>
 #include <thread>
@@ -22,7 +23,12 @@ public:
     virtual void  send(td::Client::Request &&request) = 0;
     virtual guint addTimeout(guint interval, GSourceFunc function, gpointer data) = 0;
     virtual void  cancelTimer(guint id) = 0;
+    // Query id taken by reserveQueryId, which no request will be sent with
+    virtual void  reserveId(uint64_t id) = 0;
     void          receive(td::Client::Response response);
+    // Unlike receive, goes through glib main loop like responses from tdlib do. Can be called
+    // from any thread.
+    void          post(td::Client::Response response);
 private:
     TdTransceiver *m_owner = nullptr;
 };
@@ -50,9 +56,15 @@ public:
                            bool cancelNormalResponse);
     void     setQueryTimer(uint64_t queryId, ResponseCb2 handler, unsigned timeoutSeconds,
                            bool cancelNormalResponse);
+    // Allocates an id that no query will be sent with, so that setQueryTimer can be used to track
+    // something other than a single query
+    uint64_t reserveQueryId();
+    void     cancelQueryTimer(uint64_t queryId);
+    void     getMemoryUsage(MemoryReport &report) const;
 private:
     void  pollThreadLoop();
     void *queueResponse(td::Client::Response &&response);
+    void  postResponse(td::Client::Response &&response);
     static gboolean timerCallback(gpointer userdata);
 
     std::shared_ptr<TdTransceiverImpl>  m_impl;